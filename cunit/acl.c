@@ -0,0 +1,98 @@
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "acl.h"
+#include "auth.h"
+
+#define ACL	"anyone\tlr\tfred\tlrswipkxtecda\t-fred\tx\tbarney\tlrs\t"
+
+static void test_compile_null(void)
+{
+    struct cyrus_acl *cacl;
+
+    /* NULL and empty ACLs grant nothing */
+    cacl = cyrus_acl_compile(NULL);
+    CU_ASSERT_PTR_NOT_NULL(cacl);
+    CU_ASSERT_EQUAL(cyrus_acl_rights(NULL, cacl), 0);
+    cyrus_acl_free(&cacl);
+    CU_ASSERT_PTR_NULL(cacl);
+
+    cacl = cyrus_acl_compile("");
+    CU_ASSERT_EQUAL(cyrus_acl_rights(NULL, cacl), 0);
+    cyrus_acl_free(&cacl);
+
+    /* _free(NULL) is harmless */
+    cyrus_acl_free(&cacl);
+}
+
+static void test_rights(void)
+{
+    struct auth_state *fred = auth_newstate("fred");
+    struct auth_state *barney = auth_newstate("barney");
+    struct auth_state *wilma = auth_newstate("wilma");
+    struct cyrus_acl *cacl = cyrus_acl_compile(ACL);
+    int expected;
+
+    CU_ASSERT_PTR_NOT_NULL_FATAL(fred);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(barney);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(wilma);
+
+    /* negative rights take away from the positive ones */
+    expected = cyrus_acl_strtomask("lrswipkxtecda") &
+	       ~cyrus_acl_strtomask("x");
+    CU_ASSERT_EQUAL(cyrus_acl_rights(fred, cacl), expected);
+    CU_ASSERT_EQUAL(cyrus_acl_rights(barney, cacl),
+		    cyrus_acl_strtomask("lrs"));
+    CU_ASSERT_EQUAL(cyrus_acl_rights(wilma, cacl),
+		    cyrus_acl_strtomask("lr"));
+
+    /* asking again gives the same answers from the memo */
+    CU_ASSERT_EQUAL(cyrus_acl_rights(fred, cacl), expected);
+    CU_ASSERT_EQUAL(cyrus_acl_rights(wilma, cacl),
+		    cyrus_acl_strtomask("lr"));
+
+    /* and they agree with parsing the string every time */
+    CU_ASSERT_EQUAL(cyrus_acl_myrights(fred, ACL), expected);
+    CU_ASSERT_EQUAL(cyrus_acl_myrights(barney, ACL),
+		    cyrus_acl_strtomask("lrs"));
+
+    cyrus_acl_free(&cacl);
+    auth_freestate(fred);
+    auth_freestate(barney);
+    auth_freestate(wilma);
+}
+
+static void test_freestate(void)
+{
+    struct auth_state *state;
+    struct cyrus_acl *cacl = cyrus_acl_compile(ACL);
+    int i;
+
+    /* a new state, perhaps at the same address as a freed one,
+     * mustn't be given the old one's answers */
+    for (i = 0; i < 10; i++) {
+	state = auth_newstate((i % 2) ? "fred" : "wilma");
+	CU_ASSERT_EQUAL(cyrus_acl_rights(state, cacl),
+			cyrus_acl_myrights(state, ACL));
+	CU_ASSERT_EQUAL(cyrus_acl_rights(state, cacl) & ACL_ADMIN,
+			(i % 2) ? ACL_ADMIN : 0);
+	auth_freestate(state);
+    }
+
+    cyrus_acl_free(&cacl);
+}
+
+static void test_trailing_garbage(void)
+{
+    struct auth_state *fred = auth_newstate("fred");
+    struct cyrus_acl *cacl;
+
+    /* an identifier without a trailing tab is ignored, as before */
+    cacl = cyrus_acl_compile("anyone\tlr\tfred\tlrs");
+    CU_ASSERT_EQUAL(cyrus_acl_rights(fred, cacl),
+		    cyrus_acl_strtomask("lr"));
+    CU_ASSERT_EQUAL(cyrus_acl_myrights(fred, "anyone\tlr\tfred\tlrs"),
+		    cyrus_acl_strtomask("lr"));
+    cyrus_acl_free(&cacl);
+
+    auth_freestate(fred);
+}
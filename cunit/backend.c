@@ -10,6 +10,7 @@
 #include <sasl/saslutil.h>
 #include <sasl/saslplug.h>
 #include "xmalloc.h"
+#include "xstrlcpy.h"
 #include "mutex.h"
 #include "prot.h"
 #include "backend.h"
@@ -20,6 +21,7 @@ struct server_config {
     int sasl_digestmd5;
     int starttls;
     int deflate;
+    int proxyauth;
     int caps_one_per_line;
 };
 
@@ -44,6 +46,7 @@ struct server_state {
     int is_connected;
     int is_authenticated;
     int is_tls;
+    char proxyauth_user[64];	    /* who we're acting for, if switched */
     sasl_conn_t *saslconn;	    /* the sasl connection context */
 #ifdef HAVE_SSL
     SSL *tls_conn;
@@ -57,6 +60,7 @@ struct server_state {
 #define SASLSERVICE	"vorpal"
 #define USERID		"fbloggs"
 #define PASSWORD	"shibboleth"
+#define CAPA_PROXYAUTH	(1<<MAX_CAPA)
 extern int verbose;
 
 static sasl_callback_t *callbacks;
@@ -67,6 +71,7 @@ static const struct server_config default_server_config = {
     .sasl_digestmd5 = 0,
     .starttls = 0,
     .deflate = 0,
+    .proxyauth = 0,
     .caps_one_per_line = 1
 };
 static const struct capa_t default_capa[] = {
@@ -126,6 +131,12 @@ static struct protocol_t test_prot =
 	.cmd = "XXLOGOUT",
 	.unsol = NULL,
 	.ok = "OK"
+    },
+    .proxyauth_cmd = {
+	.cmd = "XXPROXYAUTH",
+	.unsol = NULL,
+	.ok = "OK",
+	.capa = CAPA_PROXYAUTH
     }
 };
 
@@ -421,6 +432,70 @@ static void test_starttls(void)
 }
 #endif
 
+/*
+ * Test switching the user a connection is acting for.
+ */
+static void test_proxyauth(void)
+{
+    static const struct capa_t extra_capa[] = {
+	{ "CCPROXYAUTH", CAPA_PROXYAUTH },
+	{ NULL, 0 }
+    };
+    struct protocol_t prot;
+    struct backend *be;
+    const char *auth_status = NULL;
+    int r;
+    int n;
+
+    default_conditions();
+    n = sizeof(default_capa)/sizeof(default_capa[0]) - 1;
+    /* a copy of the protocol which knows the capability, leaving the
+     * other tests' alone */
+    prot = test_prot;
+    memcpy(&prot.capa_cmd.capa[n], extra_capa, sizeof(extra_capa));
+
+    /* the server doesn't offer it, so we don't ask */
+    be = backend_connect(NULL, HOST, &prot,
+			 USERID, callbacks, &auth_status);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(be);
+    CU_ASSERT_EQUAL(!!CAPA(be, CAPA_PROXYAUTH), 0);
+
+    r = backend_proxyauth(be, "jdoe");
+    CU_ASSERT_EQUAL(r, -1);
+    CU_ASSERT_STRING_EQUAL(server_state->proxyauth_user, "");
+
+    backend_disconnect(be);
+    free(be);
+
+    /* the server offers it */
+    server_state->config.proxyauth = 1;
+
+    be = backend_connect(NULL, HOST, &prot,
+			 USERID, callbacks, &auth_status);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(be);
+    CU_ASSERT_EQUAL(!!CAPA(be, CAPA_PROXYAUTH), 1);
+
+    r = backend_proxyauth(be, "jdoe");
+    CU_ASSERT_EQUAL(r, 0);
+    CU_ASSERT_STRING_EQUAL(server_state->proxyauth_user, "jdoe");
+
+    /* and again, for someone else, on the same connection */
+    r = backend_proxyauth(be, "asmith");
+    CU_ASSERT_EQUAL(r, 0);
+    CU_ASSERT_STRING_EQUAL(server_state->proxyauth_user, "asmith");
+
+    /* refused, but the connection is still good */
+    r = backend_proxyauth(be, "nobody");
+    CU_ASSERT_NOT_EQUAL(r, 0);
+    CU_ASSERT_STRING_EQUAL(server_state->proxyauth_user, "asmith");
+
+    r = backend_ping(be);
+    CU_ASSERT_EQUAL(r, 0);
+
+    backend_disconnect(be);
+    free(be);
+}
+
 /* TODO: test UNIX socket comms too */
 /* TODO: test IPv6 socket comms too */
 /* TODO: test connect() timeout */
@@ -578,6 +653,7 @@ static int server_accept(struct server_state *state)
     }
 
     state->is_authenticated = 0;
+    state->proxyauth_user[0] = '\0';
     state->is_connected = 1;
     state->is_tls = 0;
     state->tls_conn = NULL;
@@ -746,6 +822,15 @@ static void server_emit_caps(struct server_state *state)
 	words[n++] = NULL;
     }
 
+    /*
+     * The ccPROXYAUTH cap reports the ability to switch the user an
+     * authenticated connection acts for.
+     */
+    if (state->config.proxyauth) {
+	words[n++] = "ccPROXYAUTH";
+	words[n++] = NULL;
+    }
+
     /*
      * Various test capabilities; the test code in the client knows what
      * to expect for these.
@@ -954,6 +1039,26 @@ static void cmd_starttls(struct server_state *state)
 #endif
 }
 
+/*
+ * Switch the user an authenticated connection acts for.  Everyone
+ * but "nobody" is allowed.
+ */
+static void cmd_proxyauth(struct server_state *state, const char *user)
+{
+    if (!state->config.proxyauth || !state->is_authenticated || !user) {
+	server_printf(state, "BAD command\r\n");
+    }
+    else if (!strcmp(user, "nobody")) {
+	server_printf(state, "NO not allowed\r\n");
+    }
+    else {
+	strlcpy(state->proxyauth_user, user,
+		sizeof(state->proxyauth_user));
+	server_printf(state, "OK\r\n");
+    }
+    server_flush(state);
+}
+
 /*
  * Server main command loop for a single connection.  Blocks waiting for
  * commands from the client, and handles each command.  Returns when the
@@ -993,6 +1098,9 @@ static void server_cmdloop(struct server_state *state)
 	    cmd_authenticate(state, mech, initial_in);
 	} else if (!strcasecmp(command, "XXSTARTTLS")) {
 	    cmd_starttls(state);
+	} else if (!strcasecmp(command, "XXPROXYAUTH")) {
+	    char *user = strtok(NULL, sep);
+	    cmd_proxyauth(state, user);
 	} else {
 	    server_printf(state, "BAD command\r\n");
 	    server_flush(state);
@@ -0,0 +1,145 @@
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "bitvector.h"
+
+static void test_fini_null(void)
+{
+    /* _fini(NULL) is harmless */
+    bv_fini(NULL);
+}
+
+static void test_basic(void)
+{
+    bitvector_t bv = BITVECTOR_INITIALIZER;
+
+    CU_ASSERT_EQUAL(bv.length, 0);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 0), 0);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 1000), 0);
+    CU_ASSERT_EQUAL(bv_count(&bv), 0);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 0), -1);
+
+    /* setting past the end grows the vector */
+    bv_set(&bv, 3);
+    CU_ASSERT_EQUAL(bv.length, 4);
+    CU_ASSERT_EQUAL(bv.alloc % BV_QUANTUM, 0);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 3), 1);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 2), 0);
+
+    bv_set(&bv, 300);
+    CU_ASSERT_EQUAL(bv.length, 301);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 300), 1);
+    CU_ASSERT_EQUAL(bv_count(&bv), 2);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 0), 3);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 3), 3);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 4), 300);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 301), -1);
+
+    bv_clear(&bv, 3);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 3), 0);
+    CU_ASSERT_EQUAL(bv_count(&bv), 1);
+
+    bv_fini(&bv);
+    CU_ASSERT_EQUAL(bv.length, 0);
+    CU_ASSERT_EQUAL(bv.alloc, 0);
+    CU_ASSERT_PTR_NULL(bv.bits);
+}
+
+static void test_setall(void)
+{
+    bitvector_t bv = BITVECTOR_INITIALIZER;
+
+    /* bits past the length must stay clear */
+    bv_setsize(&bv, 77);
+    bv_setall(&bv);
+    CU_ASSERT_EQUAL(bv_count(&bv), 77);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 76), 1);
+    CU_ASSERT_EQUAL(bv_isset(&bv, 77), 0);
+    CU_ASSERT_EQUAL(bv_next_set(&bv, 77), -1);
+
+    /* shrinking drops the bits off the end */
+    bv_setsize(&bv, 10);
+    CU_ASSERT_EQUAL(bv_count(&bv), 10);
+    bv_setsize(&bv, 77);
+    CU_ASSERT_EQUAL(bv_count(&bv), 10);
+
+    bv_clearall(&bv);
+    CU_ASSERT_EQUAL(bv_count(&bv), 0);
+    CU_ASSERT_EQUAL(bv.length, 77);
+
+    bv_fini(&bv);
+}
+
+static void test_combinators(void)
+{
+    bitvector_t a = BITVECTOR_INITIALIZER;
+    bitvector_t b = BITVECTOR_INITIALIZER;
+    bitvector_t c = BITVECTOR_INITIALIZER;
+    unsigned int i;
+
+    /* multiples of 2 and of 3, long enough to need several blocks */
+    bv_setsize(&a, 1000);
+    bv_setsize(&b, 1000);
+    for (i = 0 ; i < 1000 ; i++) {
+	if (i % 2 == 0) bv_set(&a, i);
+	if (i % 3 == 0) bv_set(&b, i);
+    }
+
+    bv_setsize(&c, 1000);
+    bv_oreq(&c, &a);
+    bv_andeq(&c, &b);
+    for (i = 0 ; i < 1000 ; i++)
+	CU_ASSERT_EQUAL(bv_isset(&c, i), (i % 6 == 0));
+    CU_ASSERT_EQUAL(bv_count(&c), 167);
+
+    bv_clearall(&c);
+    bv_oreq(&c, &a);
+    bv_oreq(&c, &b);
+    for (i = 0 ; i < 1000 ; i++)
+	CU_ASSERT_EQUAL(bv_isset(&c, i), (i % 2 == 0 || i % 3 == 0));
+
+    bv_clearall(&c);
+    bv_oreq(&c, &a);
+    bv_andnoteq(&c, &b);
+    for (i = 0 ; i < 1000 ; i++)
+	CU_ASSERT_EQUAL(bv_isset(&c, i), (i % 2 == 0 && i % 3 != 0));
+
+    bv_fini(&a);
+    bv_fini(&b);
+    bv_fini(&c);
+}
+
+static void test_mismatched(void)
+{
+    bitvector_t a = BITVECTOR_INITIALIZER;
+    bitvector_t b = BITVECTOR_INITIALIZER;
+
+    bv_setsize(&a, 500);
+    bv_setall(&a);
+    bv_setsize(&b, 100);
+    bv_setall(&b);
+
+    /* AND with a shorter vector clears everything past its end */
+    bv_andeq(&a, &b);
+    CU_ASSERT_EQUAL(a.length, 500);
+    CU_ASSERT_EQUAL(bv_count(&a), 100);
+    CU_ASSERT_EQUAL(bv_isset(&a, 99), 1);
+    CU_ASSERT_EQUAL(bv_isset(&a, 100), 0);
+
+    /* OR with a longer vector grows */
+    bv_clearall(&b);
+    bv_set(&b, 700);
+    bv_oreq(&a, &b);
+    CU_ASSERT_EQUAL(a.length, 701);
+    CU_ASSERT_EQUAL(bv_count(&a), 101);
+    CU_ASSERT_EQUAL(bv_next_set(&a, 100), 700);
+
+    /* ANDNOT with a shorter vector leaves the rest alone */
+    bv_setsize(&b, 50);
+    bv_setall(&b);
+    bv_andnoteq(&a, &b);
+    CU_ASSERT_EQUAL(bv_count(&a), 51);
+    CU_ASSERT_EQUAL(bv_next_set(&a, 0), 50);
+
+    bv_fini(&a);
+    bv_fini(&b);
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "cunit/cunit.h"
 #include "xmalloc.h"
 #include "charset.h"
@@ -170,6 +171,94 @@ static void test_search_mimeheader(void)
     free(s);
 }
 
+static void test_searchfile(void)
+{
+    int cs;
+    char *buf;
+    char *s;
+    comp_pat *pat;
+    size_t i;
+    static const char FILLER[] = "lorem ipsum   dolor\r\n";
+    static const char TARGET[] = "Gr=C3=BC=C3=9Fe Welt";
+    static const char SEARCH[] = "gr\303\274\303\237e welt";
+    int flags = CHARSET_SKIPDIACRIT | CHARSET_MERGESPACE; /* default */
+    size_t len = 10000;
+
+    cs = charset_lookupname("utf-8");
+    CU_ASSERT(cs >= 0);
+
+    /* long mostly-ASCII input, with the match straddling the
+     * boundary between two blocks of input */
+    buf = xmalloc(len);
+    for (i = 0; i < len; i++)
+	buf[i] = FILLER[i % (sizeof(FILLER)-1)];
+    memcpy(buf + 4096 - 5, TARGET, sizeof(TARGET)-1);
+
+    s = charset_convert(SEARCH, cs, flags);
+    pat = charset_compilepat(s);
+    CU_ASSERT(charset_searchfile(s, pat, buf, len, cs, ENCODING_QP, flags));
+    /* without decoding, the escapes don't match */
+    CU_ASSERT(!charset_searchfile(s, pat, buf, len, cs, ENCODING_NONE, flags));
+    charset_freepat(pat);
+    free(s);
+
+    /* whitespace runs are merged */
+    s = charset_convert("ipsum dolor lorem", cs, flags);
+    pat = charset_compilepat(s);
+    CU_ASSERT(charset_searchfile(s, pat, buf, len, cs, ENCODING_NONE, flags));
+    charset_freepat(pat);
+    free(s);
+
+    s = charset_convert("dolor ipsum", cs, flags);
+    pat = charset_compilepat(s);
+    CU_ASSERT(!charset_searchfile(s, pat, buf, len, cs, ENCODING_NONE, flags));
+    charset_freepat(pat);
+    free(s);
+
+    free(buf);
+}
+
+static void test_searchfile_multi(void)
+{
+    int cs;
+    int i;
+    char *pats[4];
+    unsigned char found[4];
+    comp_multipat *pat;
+    static const char BODY[] = "She sells sea shells by the sea shore";
+    static const char HEADER[] = "=?iso-8859-1?q?Gr=FC=DFe?=";
+    static const char *WORDS[4] = { "shells", "he", "", "gr\303\274\303\237e" };
+    int flags = CHARSET_SKIPDIACRIT | CHARSET_MERGESPACE; /* default */
+
+    cs = charset_lookupname("utf-8");
+    CU_ASSERT(cs >= 0);
+
+    for (i = 0; i < 4; i++)
+	pats[i] = charset_convert(WORDS[i], cs, flags);
+    pat = charset_compilemultipat((const char **)pats, 4);
+
+    /* overlapping patterns are all found, the empty one trivially */
+    memset(found, 0, sizeof(found));
+    CU_ASSERT(!charset_searchfile_multi(pat, found, BODY, sizeof(BODY)-1,
+					cs, ENCODING_NONE, flags));
+    CU_ASSERT_EQUAL(found[0], 1);
+    CU_ASSERT_EQUAL(found[1], 1);
+    CU_ASSERT_EQUAL(found[2], 1);
+    CU_ASSERT_EQUAL(found[3], 0);
+
+    /* the rest turns up in a header, and then all have been found */
+    CU_ASSERT(charset_search_mimeheader_multi(pat, found, HEADER, flags));
+    CU_ASSERT_EQUAL(found[3], 1);
+
+    /* nothing to do once everything is found */
+    CU_ASSERT(charset_searchfile_multi(pat, found, "", 0,
+				       cs, ENCODING_NONE, flags));
+
+    charset_freemultipat(pat);
+    for (i = 0; i < 4; i++)
+	free(pats[i]);
+}
+
 static void test_rfc5051(void)
 {
     /* Example: codepoint U+01C4 (LATIN CAPITAL LETTER DZ WITH CARON)
@@ -1,5 +1,9 @@
 #include "config.h"
+#include <signal.h>
+#include <sys/wait.h>
 #include "cunit/cunit.h"
+#include "bsearch.h"
+#include "cyr_lock.h"
 #include "xmalloc.h"
 #include "global.h"
 #include "retry.h"
@@ -1312,6 +1316,427 @@ static void test_many(void)
 #undef MAXN
 }
 
+/* what test_groupcommit() leaves in record 'n', or NULL for none */
+static const char *groupcommit_data(unsigned int n, unsigned int maxn)
+{
+    switch (n % 4) {
+    case 0: return nth_data(n);		/* deleted, then added back */
+    case 1: return nth_data(n);		/* replaced twice */
+    case 2: return NULL;		/* deleted */
+    default: return nth_data(maxn - n);	/* replaced once */
+    }
+}
+
+static void test_groupcommit(void)
+{
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    hash_table exphash = HASH_TABLE_INITIALIZER;
+#define MAXN	4095
+#define NWRITERS 3
+    pid_t pids[NWRITERS];
+    int sync[2];
+    unsigned int n;
+    int i, status;
+    int r;
+
+    construct_hash_table(&exphash, (MAXN+1)*4, 0);
+
+    r = cyrusdb_open(backend, filename,
+		     CYRUSDB_CREATE|CYRUSDB_GROUPCOMMIT, &db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    CU_ASSERT_PTR_NOT_NULL(db);
+
+    /* lots of small commits, each one starting a new transaction
+     * straight after the last one let go of the lock, and enough
+     * of them to force a checkpoint or two along the way */
+    for (n = 0 ; n <= MAXN ; n++) {
+	const char *key = nth_key(n);
+	const char *data = nth_data(n);
+	CANSTORE(key, strlen(key), data, strlen(data));
+	CANCOMMIT();
+	CANFETCH_NOTXN(key, strlen(key), data, strlen(data));
+    }
+
+    /* replace the odd ones and delete every fourth, again one
+     * commit at a time */
+    for (n = 0 ; n <= MAXN ; n++) {
+	const char *key = nth_key(n);
+	if (n % 2) {
+	    const char *data = nth_data(MAXN - n);
+	    CANSTORE(key, strlen(key), data, strlen(data));
+	}
+	else if (n % 4 == 0) {
+	    r = cyrusdb_delete(db, key, strlen(key), &txn, 1);
+	    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	}
+	else {
+	    continue;
+	}
+	CANCOMMIT();
+    }
+
+    r = cyrusdb_close(db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    db = NULL;
+
+    /* then several processes committing at once, each with its own
+     * share of the records, so that commits queue up behind the one
+     * waiting for the disk.  Only skiplist and twoskip do anything
+     * different for CYRUSDB_GROUPCOMMIT, and can share a file between
+     * processes without more setup */
+    if (!strcmp(backend, "skiplist") || !strcmp(backend, "twoskip")) {
+	r = pipe(sync);
+	CU_ASSERT_EQUAL_FATAL(r, 0);
+
+	for (i = 0 ; i < NWRITERS ; i++) {
+	    pids[i] = fork();
+	    CU_ASSERT_FATAL(pids[i] >= 0);
+	    if (!pids[i]) {
+		struct db *wdb = NULL;
+		struct txn *wtxn = NULL;
+		char c;
+
+		close(sync[1]);
+		if (cyrusdb_open(backend, filename, CYRUSDB_GROUPCOMMIT, &wdb))
+		    _exit(1);
+		/* start together */
+		if (read(sync[0], &c, 1) != 0)
+		    _exit(1);
+
+		for (n = i ; n <= MAXN ; n += NWRITERS) {
+		    const char *key = nth_key(n);
+		    const char *data = groupcommit_data(n, MAXN);
+		    if (n % 4 == 3)
+			continue;
+		    if (data)
+			r = cyrusdb_store(wdb, key, strlen(key),
+					  data, strlen(data), &wtxn);
+		    else
+			r = cyrusdb_delete(wdb, key, strlen(key), &wtxn, 0);
+		    if (r || cyrusdb_commit(wdb, wtxn))
+			_exit(1);
+		    wtxn = NULL;
+		}
+		_exit(cyrusdb_close(wdb) ? 1 : 0);
+	    }
+	}
+	close(sync[0]);
+	close(sync[1]);
+
+	for (i = 0 ; i < NWRITERS ; i++) {
+	    r = waitpid(pids[i], &status, 0);
+	    CU_ASSERT_EQUAL(r, pids[i]);
+	    CU_ASSERT(WIFEXITED(status));
+	    CU_ASSERT_EQUAL(WEXITSTATUS(status), 0);
+	}
+    }
+    else {
+	/* one after the other will have to do */
+	r = cyrusdb_open(backend, filename, CYRUSDB_GROUPCOMMIT, &db);
+	CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	for (n = 0 ; n <= MAXN ; n++) {
+	    const char *key = nth_key(n);
+	    const char *data = groupcommit_data(n, MAXN);
+	    if (n % 4 == 3)
+		continue;
+	    if (data) {
+		CANSTORE(key, strlen(key), data, strlen(data));
+	    }
+	    else {
+		r = cyrusdb_delete(db, key, strlen(key), &txn, 0);
+		CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	    }
+	    CANCOMMIT();
+	}
+	r = cyrusdb_close(db);
+	CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	db = NULL;
+    }
+
+    /* everything is there when opened the ordinary way */
+    r = cyrusdb_open(backend, filename, 0, &db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+
+    for (n = 0 ; n <= MAXN ; n++) {
+	const char *key = nth_key(n);
+	const char *data = groupcommit_data(n, MAXN);
+	if (data) {
+	    CANFETCH(key, strlen(key), data, strlen(data));
+	    hash_insert(key, xstrdup(data), &exphash);
+	}
+	else {
+	    CANNOTFETCH(key, strlen(key), CYRUSDB_NOTFOUND);
+	}
+    }
+    CU_ASSERT_EQUAL(hash_count(&exphash), (MAXN+1)/4*3);
+
+    /* and nothing else */
+    r = cyrusdb_foreach(db, NULL, 0, NULL, finder, &exphash, &txn);
+    FOREACH_POSTCONDITION();
+
+    CANCOMMIT();
+
+    r = cyrusdb_close(db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+
+    free_hash_table(&exphash, free);
+#undef NWRITERS
+#undef MAXN
+}
+
+static void test_lockfree_read(void)
+{
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    struct binary_result *results = NULL;
+    struct deleteit deldata;
+    static const char KEY1[] = "carib";
+    static const char DATA1[] = "delays maj bullish packard ronald";
+    static const char KEY2[] = "cubist";
+    static const char DATA2[] = "bobby tswana cu albumin created";
+    static const char KEY3[] = "eulogy";
+    static const char DATA3[] = "aleut stoic muscovy adonis moe docent";
+    static const char DATA4[] = "docent moe adonis";
+    int sync[2];
+    pid_t pid;
+    time_t start;
+    char c;
+    int r;
+
+    /* only twoskip reads without locking */
+    if (strcmp(backend, "twoskip"))
+	return;
+
+    libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS, 1);
+
+    r = cyrusdb_open(backend, filename, CYRUSDB_CREATE, &db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    CU_ASSERT_PTR_NOT_NULL(db);
+
+    CANSTORE(KEY1, strlen(KEY1), DATA1, strlen(DATA1));
+    CANSTORE(KEY2, strlen(KEY2), DATA2, strlen(DATA2));
+    CANSTORE(KEY3, strlen(KEY3), DATA3, strlen(DATA3));
+    CANCOMMIT();
+
+    /* have another process sit on the write lock */
+    r = pipe(sync);
+    CU_ASSERT_EQUAL(r, 0);
+    pid = fork();
+    CU_ASSERT(pid >= 0);
+    if (!pid) {
+	int fd = open(filename, O_RDWR);
+	if (fd < 0 || lock_blocking(fd) < 0)
+	    _exit(1);
+	c = 'x';
+	retry_write(sync[1], &c, 1);
+	sleep(60);
+	_exit(0);
+    }
+    r = read(sync[0], &c, 1);
+    CU_ASSERT_EQUAL(r, 1);
+
+    /* reads don't wait for it */
+    start = time(NULL);
+
+    CANFETCH_NOTXN(KEY1, strlen(KEY1), DATA1, strlen(DATA1));
+    CANFETCH_NOTXN(KEY3, strlen(KEY3), DATA3, strlen(DATA3));
+
+    r = cyrusdb_foreach(db, NULL, 0, NULL, foreacher, &results, NULL);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    GOTRESULT(KEY1, strlen(KEY1), DATA1, strlen(DATA1));
+    GOTRESULT(KEY2, strlen(KEY2), DATA2, strlen(DATA2));
+    GOTRESULT(KEY3, strlen(KEY3), DATA3, strlen(DATA3));
+    CU_ASSERT_PTR_NULL(results);
+
+    CU_ASSERT(time(NULL) - start < 10);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(sync[0]);
+    close(sync[1]);
+
+    /* a commit between lock free reads is seen by the next one */
+    CANSTORE(KEY3, strlen(KEY3), DATA4, strlen(DATA4));
+    CANCOMMIT();
+    CANFETCH_NOTXN(KEY3, strlen(KEY3), DATA4, strlen(DATA4));
+
+    /* and so are commits made from inside a lock free foreach */
+    deldata.db = db;
+    deldata.results = &results;
+    r = cyrusdb_foreach(db, NULL, 0, NULL, deleter, &deldata, NULL);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    GOTRESULT(KEY1, strlen(KEY1), DATA1, strlen(DATA1));
+    GOTRESULT(KEY2, strlen(KEY2), DATA2, strlen(DATA2));
+    GOTRESULT(KEY3, strlen(KEY3), DATA4, strlen(DATA4));
+    CU_ASSERT_PTR_NULL(results);
+
+    r = cyrusdb_foreach(db, NULL, 0, NULL, foreacher, &results, NULL);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    CU_ASSERT_PTR_NULL(results);
+
+    r = cyrusdb_close(db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+
+    libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS, 0);
+}
+
+struct churnseen {
+    unsigned long first;
+    unsigned long last;
+    int nfirst;
+    int nlast;
+    int bad;
+    struct buf prevkey;
+};
+
+static unsigned long parse_counter(const char *data, size_t datalen)
+{
+    char buf[32];
+
+    if (datalen >= sizeof(buf)) return 0;
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+
+    return strtoul(buf, NULL, 10);
+}
+
+static int churner(void *rock,
+		   const char *key, size_t keylen,
+		   const char *data, size_t datalen)
+{
+    struct churnseen *seen = (struct churnseen *)rock;
+
+    /* each key once, in order */
+    if (seen->prevkey.len &&
+	bsearch_ncompare_raw(seen->prevkey.s, seen->prevkey.len,
+			     key, keylen) >= 0)
+	seen->bad++;
+    buf_setmap(&seen->prevkey, key, keylen);
+
+    if (keylen == 5 && !memcmp(key, "aaaaa", 5)) {
+	seen->first = parse_counter(data, datalen);
+	seen->nfirst++;
+    }
+    else if (keylen == 5 && !memcmp(key, "zzzzz", 5)) {
+	seen->last = parse_counter(data, datalen);
+	seen->nlast++;
+    }
+    else if (datalen <= keylen || memcmp(data, key, keylen) ||
+	     data[keylen] != '=') {
+	/* every other value names its own key */
+	seen->bad++;
+    }
+
+    return 0;
+}
+
+static void test_lockfree_concurrent(void)
+{
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    struct churnseen seen;
+    unsigned long prev = 0;
+    const char *data;
+    size_t datalen;
+    int nreads = 0;
+    int status = 0;
+    pid_t pid;
+    int r;
+#define MAXN	2000
+
+    /* only twoskip reads without locking */
+    if (strcmp(backend, "twoskip"))
+	return;
+
+    libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS, 1);
+
+    r = cyrusdb_open(backend, filename, CYRUSDB_CREATE, &db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    CANSTORE("aaaaa", 5, "0", 1);
+    CANSTORE("zzzzz", 5, "0", 1);
+    CANCOMMIT();
+    r = cyrusdb_close(db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    db = NULL;
+
+    /* another process commits a counter at both ends of the database,
+     * each time along with some churn in the middle, often enough to
+     * checkpoint a few times */
+    pid = fork();
+    CU_ASSERT_FATAL(pid >= 0);
+    if (!pid) {
+	struct db *wdb = NULL;
+	struct txn *wtxn = NULL;
+	struct buf val = BUF_INITIALIZER;
+	char buf[32];
+	unsigned int n;
+
+	if (cyrusdb_open(backend, filename, 0, &wdb))
+	    _exit(1);
+	for (n = 1 ; n <= MAXN ; n++) {
+	    const char *key = nth_key(n % 97);
+	    snprintf(buf, sizeof(buf), "%u", n);
+	    buf_reset(&val);
+	    buf_printf(&val, "%s=%s", key, nth_data(n));
+	    if (cyrusdb_store(wdb, "aaaaa", 5, buf, strlen(buf), &wtxn) ||
+		(n % 5 ?
+		 cyrusdb_store(wdb, key, strlen(key), val.s, val.len, &wtxn) :
+		 cyrusdb_delete(wdb, key, strlen(key), &wtxn, 1)) ||
+		cyrusdb_store(wdb, "zzzzz", 5, buf, strlen(buf), &wtxn) ||
+		cyrusdb_commit(wdb, wtxn))
+		_exit(1);
+	    wtxn = NULL;
+	}
+	_exit(cyrusdb_close(wdb) ? 1 : 0);
+    }
+
+    r = cyrusdb_open(backend, filename, 0, &db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+
+    /* every record read, lock free or not, is one that was committed,
+     * and no read sees an older commit than one before it */
+    memset(&seen, 0, sizeof(seen));
+    while ((r = waitpid(pid, &status, WNOHANG)) == 0) {
+	seen.nfirst = seen.nlast = 0;
+	buf_reset(&seen.prevkey);
+	r = cyrusdb_foreach(db, NULL, 0, NULL, churner, &seen, NULL);
+	CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	CU_ASSERT_EQUAL(seen.bad, 0);
+	CU_ASSERT_EQUAL(seen.nfirst, 1);
+	CU_ASSERT_EQUAL(seen.nlast, 1);
+	CU_ASSERT(seen.first >= prev);
+	CU_ASSERT(seen.last >= seen.first);
+	prev = seen.last;
+
+	r = cyrusdb_fetch(db, "aaaaa", 5, &data, &datalen, NULL);
+	CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+	CU_ASSERT(parse_counter(data, datalen) >= prev);
+	prev = parse_counter(data, datalen);
+
+	nreads++;
+    }
+    CU_ASSERT_EQUAL(r, pid);
+    CU_ASSERT(WIFEXITED(status));
+    CU_ASSERT_EQUAL(WEXITSTATUS(status), 0);
+    CU_ASSERT(nreads > 0);
+
+    /* and once it's done, reads see its last commit */
+    seen.nfirst = seen.nlast = 0;
+    buf_reset(&seen.prevkey);
+    r = cyrusdb_foreach(db, NULL, 0, NULL, churner, &seen, NULL);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+    CU_ASSERT_EQUAL(seen.bad, 0);
+    CU_ASSERT_EQUAL(seen.first, MAXN);
+    CU_ASSERT_EQUAL(seen.last, MAXN);
+    buf_free(&seen.prevkey);
+
+    r = cyrusdb_close(db);
+    CU_ASSERT_EQUAL(r, CYRUSDB_OK);
+
+    libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS, 0);
+#undef MAXN
+}
+
 static char *basedir;
 
 static int set_up(void)
@@ -291,3 +291,90 @@ static void test_freeing_nonempty(void)
     free_hash_table(&ht, lincoln);
     CU_ASSERT_EQUAL(N, freed_count);
 }
+
+/* test that everything is still there while the table
+ * is part way through moving into a bigger one */
+static void test_growing(void)
+{
+    hash_table ht;
+    void *d;
+    unsigned int count;
+    unsigned int i, j;
+
+    /* a tiny table, which has to grow many times */
+    construct_hash_table(&ht, 1, 1);
+
+    for (i = 0 ; i < N ; i++) {
+	d = hash_insert(key(i), value(i), &ht);
+	CU_ASSERT_PTR_EQUAL(value(i), d);
+
+	/* delete every third key as we go */
+	if (i % 3 == 2) {
+	    d = hash_del(key(i-1), &ht);
+	    CU_ASSERT_PTR_EQUAL(value(i-1), d);
+	}
+
+	/* everything we expect is still there, every so often */
+	if (i % 97 == 0) {
+	    for (j = 0 ; j <= i ; j++) {
+		d = hash_lookup(key(j), &ht);
+		if (j % 3 == 1 && j < i) {
+		    CU_ASSERT_PTR_NULL(d);
+		}
+		else {
+		    CU_ASSERT_PTR_EQUAL(value(j), d);
+		}
+	    }
+	}
+    }
+
+    count = 0;
+    hash_enumerate(&ht, count_cb, &count);
+    CU_ASSERT_EQUAL(N - N/3, count);
+
+    freed_count = 0;
+    free_hash_table(&ht, lincoln);
+    CU_ASSERT_EQUAL(N - N/3, freed_count);
+}
+
+static void del_cb(const char *key,
+		   void *data __attribute__((unused)),
+		   void *rock)
+{
+    hash_table *ht = (hash_table *)rock;
+    hash_del(key, ht);
+}
+
+/* cyrusdb_quotalegacy deletes each key from inside hash_enumerate() */
+static void test_del_enumerate(void)
+{
+    hash_table ht;
+    void *d;
+    unsigned int count;
+    unsigned int i;
+
+    construct_hash_table(&ht, 16, 0);
+
+    for (i = 0 ; i < N ; i++) {
+	d = hash_insert(key(i), value(i), &ht);
+	CU_ASSERT_PTR_EQUAL(value(i), d);
+    }
+
+    hash_enumerate(&ht, del_cb, &ht);
+
+    count = 0;
+    hash_enumerate(&ht, count_cb, &count);
+    CU_ASSERT_EQUAL(0, count);
+
+    /* and the deleted buckets get used again */
+    for (i = 0 ; i < N ; i++) {
+	d = hash_insert(key(i), value(i), &ht);
+	CU_ASSERT_PTR_EQUAL(value(i), d);
+    }
+    for (i = 0 ; i < N ; i++) {
+	d = hash_lookup(key(i), &ht);
+	CU_ASSERT_PTR_EQUAL(value(i), d);
+    }
+
+    free_hash_table(&ht, NULL);
+}
@@ -0,0 +1,453 @@
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "retry.h"
+#include "global.h"
+#include "libcyr_cfg.h"
+#include "mailbox.h"
+#include "mboxlist.h"
+#include "message.h"
+#include "index.h"
+#include "prot.h"
+#include "imap_err.h"
+
+#define DBDIR		"test-dbdir"
+#define MBOXNAME	"user.smurf"
+#define PARTITION	"default"
+#define USERID		"smurf"
+#define ACL		"smurf\tlrswipkxtecda\t"
+
+static struct auth_state *auth_state;
+
+static void config_read_string(const char *s)
+{
+    char *fname = xstrdup("/tmp/cyrus-cunit-configXXXXXX");
+    int fd = mkstemp(fname);
+    retry_write(fd, s, strlen(s));
+    config_reset();
+    config_read(fname);
+    unlink(fname);
+    free(fname);
+    close(fd);
+}
+
+/* a message of 80 bytes, plus 10 for each of 'nlines' more */
+static void add_message_dated(time_t internaldate, int nlines)
+{
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    const char *fname;
+    FILE *f;
+    int i, r;
+
+    r = mailbox_open_iwl(MBOXNAME, &mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    memset(&record, 0, sizeof(record));
+    record.uid = mailbox->i.last_uid + 1;
+    record.internaldate = internaldate;
+    fname = mailbox_message_fname(mailbox, record.uid);
+    f = fopen(fname, "w");
+    CU_ASSERT_PTR_NOT_NULL_FATAL(f);
+    fputs("From: smurfette@example.com\r\n"
+	  "To: smurf@example.com\r\n"
+	  "Subject: hello\r\n"
+	  "\r\n", f);
+    for (i = 0; i <= nlines; i++)
+	fputs("la la la\r\n", f);
+    fclose(f);
+
+    r = message_parse(fname, &record);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = mailbox_append_index_record(mailbox, &record);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = mailbox_commit(mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    mailbox_close(&mailbox);
+}
+
+static void add_message(void)
+{
+    add_message_dated(0, 0);
+}
+
+static void set_flags(uint32_t uid, uint32_t flags)
+{
+    struct mailbox *mailbox = NULL;
+    struct index_record record;
+    uint32_t recno;
+    int r;
+
+    r = mailbox_open_iwl(MBOXNAME, &mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    for (recno = 1; recno <= mailbox->i.num_records; recno++) {
+	r = mailbox_read_index_record(mailbox, recno, &record);
+	CU_ASSERT_EQUAL_FATAL(r, 0);
+	if (record.uid != uid) continue;
+
+	record.system_flags |= flags;
+	r = mailbox_rewrite_index_record(mailbox, &record);
+	CU_ASSERT_EQUAL_FATAL(r, 0);
+	break;
+    }
+    CU_ASSERT(recno <= mailbox->i.num_records);
+
+    r = mailbox_commit(mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    mailbox_close(&mailbox);
+}
+
+static struct index_state *open_index(struct protstream *out)
+{
+    struct index_state *state = NULL;
+    struct index_init init;
+    int r;
+
+    memset(&init, 0, sizeof(init));
+    init.userid = USERID;
+    init.authstate = auth_state;
+    init.out = out;
+
+    r = index_open(MBOXNAME, &init, &state);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+
+    return state;
+}
+
+/* what index_check() tells the client, at a NOOP */
+static char *check(struct index_state *state)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct protstream *out;
+    char tmp[4096];
+    FILE *f = tmpfile();
+    int n;
+
+    out = prot_new(fileno(f), 1);
+    state->out = out;
+    index_check(state, 1, 0);
+    prot_flush(out);
+    state->out = NULL;
+
+    rewind(f);
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+	buf_appendmap(&buf, tmp, n);
+
+    prot_free(out);
+    fclose(f);
+
+    return buf_release(&buf);
+}
+
+/* a session which has been through SELECT */
+static struct index_state *select_index(void)
+{
+    struct index_state *state = open_index(NULL);
+
+    /* the untagged responses to the SELECT */
+    free(check(state));
+
+    return state;
+}
+
+/* what UID SEARCH tells the client */
+static char *search(struct index_state *state, struct searchargs *searchargs)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct protstream *out;
+    char tmp[4096];
+    FILE *f = tmpfile();
+    int n;
+
+    out = prot_new(fileno(f), 1);
+    state->out = out;
+    index_search(state, searchargs, 1);
+    prot_flush(out);
+    state->out = NULL;
+
+    rewind(f);
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+	buf_appendmap(&buf, tmp, n);
+
+    prot_free(out);
+    fclose(f);
+
+    return buf_release(&buf);
+}
+
+/* check a search gives 'expect' from the column snapshot, and from
+ * evaluating each message without it */
+static void search_both(struct index_state *state,
+			struct searchargs *searchargs, const char *expect)
+{
+    char *s;
+
+    s = search(state, searchargs);
+    CU_ASSERT_STRING_EQUAL(s, expect);
+    free(s);
+
+    imapopts[IMAPOPT_SEARCH_COLUMNS].val.b = 0;
+    s = search(state, searchargs);
+    CU_ASSERT_STRING_EQUAL(s, expect);
+    free(s);
+    imapopts[IMAPOPT_SEARCH_COLUMNS].val.b = 1;
+}
+
+static void test_search_columns(void)
+{
+    struct index_state *state;
+    struct searchargs flagged, unanswered, dated, larger, smaller;
+    struct searchargs notflagged, orsmall, orflagged;
+    struct searchsub notsub, orsub;
+    char *s;
+
+    /* uid:  1      2         3      4
+     * date: 1000   2000      3000   4000
+     * size: small  large     small  large
+     * flags:       \Flagged         \Flagged \Answered */
+    add_message_dated(1000, 0);
+    add_message_dated(2000, 20);
+    add_message_dated(3000, 0);
+    add_message_dated(4000, 20);
+    set_flags(2, FLAG_FLAGGED);
+    set_flags(4, FLAG_FLAGGED|FLAG_ANSWERED);
+
+    memset(&flagged, 0, sizeof(flagged));
+    flagged.system_flags_set = FLAG_FLAGGED;
+    memset(&unanswered, 0, sizeof(unanswered));
+    unanswered.system_flags_unset = FLAG_ANSWERED;
+    memset(&dated, 0, sizeof(dated));
+    dated.after = 1500;
+    dated.before = 3500;
+    memset(&larger, 0, sizeof(larger));
+    larger.larger = 150;
+    memset(&smaller, 0, sizeof(smaller));
+    smaller.smaller = 150;
+
+    /* NOT FLAGGED */
+    memset(&notflagged, 0, sizeof(notflagged));
+    memset(&notsub, 0, sizeof(notsub));
+    notsub.sub1 = &flagged;
+    notflagged.sublist = &notsub;
+
+    /* OR SMALLER 150 FLAGGED, and UNANSWERED */
+    orsmall = smaller;
+    orflagged = unanswered;
+    memset(&orsub, 0, sizeof(orsub));
+    orsub.sub1 = &orsmall;
+    orsub.sub2 = &flagged;
+    orflagged.sublist = &orsub;
+
+    state = select_index();
+
+    search_both(state, &flagged, "* SEARCH 2 4\r\n");
+    search_both(state, &unanswered, "* SEARCH 1 2 3\r\n");
+    search_both(state, &dated, "* SEARCH 2 3\r\n");
+    search_both(state, &larger, "* SEARCH 2 4\r\n");
+    search_both(state, &smaller, "* SEARCH 1 3\r\n");
+    search_both(state, &notflagged, "* SEARCH 1 3\r\n");
+    search_both(state, &orflagged, "* SEARCH 1 2 3\r\n");
+
+    /* an expunge has to reach the snapshot */
+    set_flags(2, FLAG_EXPUNGED);
+    s = check(state);
+    free(s);
+
+    search_both(state, &flagged, "* SEARCH 4\r\n");
+    search_both(state, &unanswered, "* SEARCH 1 3\r\n");
+    search_both(state, &dated, "* SEARCH 3\r\n");
+    search_both(state, &larger, "* SEARCH 4\r\n");
+    search_both(state, &notflagged, "* SEARCH 1 3\r\n");
+    search_both(state, &orflagged, "* SEARCH 1 3\r\n");
+
+    /* and so does an append, and a flag change on it */
+    add_message_dated(2500, 20);
+    set_flags(5, FLAG_FLAGGED);
+    s = check(state);
+    free(s);
+
+    search_both(state, &flagged, "* SEARCH 4 5\r\n");
+    search_both(state, &unanswered, "* SEARCH 1 3 5\r\n");
+    search_both(state, &dated, "* SEARCH 3 5\r\n");
+    search_both(state, &larger, "* SEARCH 4 5\r\n");
+    search_both(state, &smaller, "* SEARCH 1 3\r\n");
+    search_both(state, &notflagged, "* SEARCH 1 3\r\n");
+    search_both(state, &orflagged, "* SEARCH 1 3 5\r\n");
+
+    index_close(&state);
+}
+
+static void test_getview(void)
+{
+    struct index_state *state;
+    struct index_view view;
+    char *s;
+
+    add_message();
+    add_message();
+    add_message();
+    set_flags(2, FLAG_EXPUNGED);
+
+    state = select_index();
+    index_getview(state, &view);
+
+    CU_ASSERT_EQUAL(view.uidvalidity, state->mailbox->i.uidvalidity);
+    CU_ASSERT_EQUAL(view.highestmodseq, state->mailbox->i.highestmodseq);
+    s = seqset_cstring(view.uids);
+    CU_ASSERT_STRING_EQUAL(s, "1,3");
+    free(s);
+
+    seqset_free(view.uids);
+    seqset_free(view.recent);
+    index_close(&state);
+}
+
+static void test_setview(void)
+{
+    struct index_state *state;
+    struct index_view view;
+    char *s;
+
+    add_message();
+    add_message();
+    add_message();
+
+    /* the first session sees three messages, and goes away */
+    state = select_index();
+    index_getview(state, &view);
+    index_close(&state);
+
+    /* meanwhile one goes, one changes and one arrives */
+    set_flags(2, FLAG_EXPUNGED);
+    set_flags(3, FLAG_FLAGGED);
+    add_message();
+
+    /* a fresh session thinks the client is up to date */
+    state = select_index();
+    s = check(state);
+    CU_ASSERT_STRING_EQUAL(s, "");
+    free(s);
+    index_close(&state);
+
+    /* but one picking up the view tells it everything */
+    state = open_index(NULL);
+    CU_ASSERT_EQUAL(index_setview(state, &view), 0);
+    s = check(state);
+    CU_ASSERT_PTR_NOT_NULL(strstr(s, "* 2 EXPUNGE\r\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(s, "* 3 EXISTS\r\n"));
+    CU_ASSERT_PTR_NOT_NULL(strstr(s, "* 2 FETCH (FLAGS ("));
+    CU_ASSERT_PTR_NOT_NULL(strstr(s, "\\Flagged"));
+    CU_ASSERT_PTR_NULL(strstr(s, "* 1 FETCH"));
+    CU_ASSERT_PTR_NULL(strstr(s, "* 3 FETCH"));
+    free(s);
+
+    /* after which it's up to date */
+    s = check(state);
+    CU_ASSERT_STRING_EQUAL(s, "");
+    free(s);
+    index_close(&state);
+
+    /* a view of some other mailbox of the same name is no use */
+    view.uidvalidity++;
+    state = open_index(NULL);
+    CU_ASSERT_EQUAL(index_setview(state, &view), IMAP_MAILBOX_NONEXISTENT);
+    index_close(&state);
+
+    seqset_free(view.uids);
+    seqset_free(view.recent);
+}
+
+static int set_up(void)
+{
+    int r;
+    struct mboxlist_entry mbentry;
+    struct mailbox *mailbox;
+    const char * const *d;
+    static const char * const dirs[] = {
+	DBDIR,
+	DBDIR"/db",
+	DBDIR"/conf",
+	DBDIR"/data",
+	DBDIR"/data/user",
+	DBDIR"/data/user/smurf",
+	NULL
+    };
+
+    r = system("rm -rf " DBDIR);
+    if (r)
+	return r;
+
+    for (d = dirs ; *d ; d++) {
+	r = mkdir(*d, 0777);
+	if (r < 0) {
+	    int e = errno;
+	    perror(*d);
+	    return e;
+	}
+    }
+
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, DBDIR);
+    config_read_string(
+	"configdirectory: "DBDIR"/conf\n"
+	"defaultpartition: "PARTITION"\n"
+	"partition-"PARTITION": "DBDIR"/data\n"
+    );
+
+    cyrusdb_init();
+    config_mboxlist_db = "skiplist";
+    config_quota_db = "skiplist";
+
+    auth_state = auth_newstate(USERID);
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    memset(&mbentry, 0, sizeof(mbentry));
+    mbentry.name = MBOXNAME;
+    mbentry.mbtype = 0;
+    mbentry.partition = PARTITION;
+    mbentry.acl = ACL;
+    r = mboxlist_update(&mbentry, /*localonly*/1);
+    if (r)
+	return r;
+
+    r = mailbox_create(MBOXNAME, PARTITION, ACL,
+		       /*uniqueid*/NULL, /*specialuse*/NULL,
+		       /*options*/0, /*uidvalidity*/0,
+		       &mailbox);
+    if (r)
+	return r;
+    mailbox_close(&mailbox);
+
+    return 0;
+}
+
+static int tear_down(void)
+{
+    int r;
+
+    mboxlist_close();
+    mboxlist_done();
+
+    quotadb_close();
+    quotadb_done();
+
+    auth_freestate(auth_state);
+
+    cyrusdb_done();
+    config_mboxlist_db = NULL;
+    config_quota_db = NULL;
+
+    r = system("rm -rf " DBDIR);
+    /* I'm ignoring you */
+
+    return 0;
+}
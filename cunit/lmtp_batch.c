@@ -0,0 +1,415 @@
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "retry.h"
+#include "global.h"
+#include "libcyr_cfg.h"
+#include "append.h"
+#include "duplicate.h"
+#include "mailbox.h"
+#include "map.h"
+#include "mboxlist.h"
+#include "message.h"
+#include "lmtp_batch.h"
+#include "imap_err.h"
+
+#define DBDIR		"test-dbdir"
+#define INBOX		"user.smurf"
+#define FOLDER		"user.smurf.lists"
+#define PARTITION	"default"
+#define USERID		"smurf"
+#define ACL		"smurf\tlrswipkxtecda\t"
+#define DATE		"Mon, 10 Oct 2011 10:10:10 +1100"
+
+static struct auth_state *auth_state;
+static struct stagemsg *stage;
+static struct message_content content;
+static struct batch_msg msg;
+static strarray_t delivered = STRARRAY_INITIALIZER;
+
+static void config_read_string(const char *s)
+{
+    char *fname = xstrdup("/tmp/cyrus-cunit-configXXXXXX");
+    int fd = mkstemp(fname);
+    retry_write(fd, s, strlen(s));
+    config_reset();
+    config_read(fname);
+    unlink(fname);
+    free(fname);
+    close(fd);
+}
+
+static void delivered_cb(const char *mailboxname, const char *user,
+			 const char *notifyheader __attribute__((unused)),
+			 void *rock __attribute__((unused)))
+{
+    strarray_appendm(&delivered, strconcat(mailboxname, ":",
+					   user ? user : "", (char *)NULL));
+}
+
+/* what delivered_cb() saw, space separated */
+static char *get_delivered(void)
+{
+    char *s = strarray_join(&delivered, " ");
+    strarray_truncate(&delivered, 0);
+    return s ? s : xstrdup("");
+}
+
+static int deliver(int rcpt, const char *mailboxname,
+		   struct auth_state *authstate, int acloverride,
+		   const strarray_t *flags, const char *id, const char *user)
+{
+    quota_t qdiffs[QUOTA_NUMRESOURCES] = QUOTA_DIFFS_INITIALIZER;
+
+    return lmtp_batch_append(&msg, rcpt, mailboxname, /*authuser*/NULL,
+			     authstate, acloverride, qdiffs, flags,
+			     id, DATE, user, /*notifyheader*/NULL);
+}
+
+static unsigned count(const char *mailboxname)
+{
+    struct mailbox *mailbox = NULL;
+    unsigned n;
+    int r;
+
+    r = mailbox_open_irl(mailboxname, &mailbox);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    n = mailbox->i.exists;
+    mailbox_close(&mailbox);
+
+    return n;
+}
+
+static int marked(const char *id, const char *mailboxname)
+{
+    duplicate_key_t dkey = DUPLICATE_INITIALIZER;
+
+    dkey.id = id;
+    dkey.to = mailboxname;
+    dkey.date = DATE;
+
+    return duplicate_check(&dkey) != 0;
+}
+
+#define CU_ASSERT_STRING_EQUAL_FREE(actual, expected) \
+    do { \
+	char *_s = (actual); \
+	CU_ASSERT_STRING_EQUAL(_s, (expected)); \
+	free(_s); \
+    } while (0)
+
+static void test_batch(void)
+{
+    int r;
+
+    lmtp_batch_start(4, delivered_cb, NULL);
+
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    r = deliver(1, INBOX, auth_state, 1, NULL, "<c@d>", "barney");
+    CU_ASSERT_EQUAL(r, 0);
+    /* no id, never a duplicate */
+    r = deliver(2, INBOX, auth_state, 1, NULL, NULL, NULL);
+    CU_ASSERT_EQUAL(r, 0);
+    /* nothing is committed until delivery moves on */
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(), "");
+
+    r = deliver(3, FOLDER, auth_state, 1, NULL, "<a@b>", "wilma");
+    CU_ASSERT_EQUAL(r, 0);
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(),
+				INBOX":fred "INBOX":barney "INBOX":");
+
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(), FOLDER":wilma");
+
+    CU_ASSERT_EQUAL(lmtp_batch_status(0), 0);
+    CU_ASSERT_EQUAL(lmtp_batch_status(1), 0);
+    CU_ASSERT_EQUAL(lmtp_batch_status(2), 0);
+    CU_ASSERT_EQUAL(lmtp_batch_status(3), 0);
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(INBOX), 3);
+    CU_ASSERT_EQUAL(count(FOLDER), 1);
+    CU_ASSERT(marked("<a@b>", INBOX));
+    CU_ASSERT(marked("<c@d>", INBOX));
+    CU_ASSERT(marked("<a@b>", FOLDER));
+    CU_ASSERT(!marked("<c@d>", FOLDER));
+}
+
+static void test_duplicate_pending(void)
+{
+    int r;
+
+    lmtp_batch_start(3, delivered_cb, NULL);
+
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    /* the same message again is suppressed... */
+    r = deliver(1, INBOX, auth_state, 1, NULL, "<a@b>", "barney");
+    CU_ASSERT_EQUAL(r, 0);
+    /* ...but another one isn't */
+    r = deliver(2, INBOX, auth_state, 1, NULL, "<c@d>", "wilma");
+    CU_ASSERT_EQUAL(r, 0);
+
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(),
+				INBOX":fred "INBOX":wilma");
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(INBOX), 2);
+
+    /* without duplicate suppression, everyone gets one */
+    msg.dupelim = 0;
+    lmtp_batch_start(2, delivered_cb, NULL);
+
+    r = deliver(0, FOLDER, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    r = deliver(1, FOLDER, auth_state, 1, NULL, "<a@b>", "barney");
+    CU_ASSERT_EQUAL(r, 0);
+
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(),
+				FOLDER":fred "FOLDER":barney");
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(FOLDER), 2);
+    CU_ASSERT(!marked("<a@b>", FOLDER));
+}
+
+static void test_duplicate_delivered(void)
+{
+    int r;
+
+    lmtp_batch_start(1, delivered_cb, NULL);
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(), INBOX":fred");
+    lmtp_batch_end();
+
+    /* the same message in a later transaction is a duplicate, and
+       leaves nothing pending */
+    lmtp_batch_start(2, delivered_cb, NULL);
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    r = deliver(1, INBOX, auth_state, 1, NULL, "<c@d>", "barney");
+    CU_ASSERT_EQUAL(r, 0);
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(), INBOX":barney");
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(INBOX), 2);
+}
+
+static void test_append_failure(void)
+{
+    strarray_t flags = STRARRAY_INITIALIZER;
+    char flag[32];
+    int i;
+    int r;
+
+    /* more flags than a mailbox can have */
+    for (i = 0; i <= MAX_USER_FLAGS; i++) {
+	snprintf(flag, sizeof(flag), "flag%d", i);
+	strarray_append(&flags, flag);
+    }
+
+    lmtp_batch_start(3, delivered_cb, NULL);
+
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    /* this one fails, and takes the session with it... */
+    r = deliver(1, INBOX, auth_state, 1, &flags, "<c@d>", "barney");
+    CU_ASSERT_EQUAL(r, IMAP_USERFLAG_EXHAUSTED);
+    /* ...but the one before is put back, and later ones carry on */
+    r = deliver(2, INBOX, auth_state, 1, NULL, "<e@f>", "wilma");
+    CU_ASSERT_EQUAL(r, 0);
+
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(),
+				INBOX":fred "INBOX":wilma");
+
+    /* and only the one that failed was told so */
+    CU_ASSERT_EQUAL(lmtp_batch_status(0), 0);
+    CU_ASSERT_EQUAL(lmtp_batch_status(1), 0);
+    CU_ASSERT_EQUAL(lmtp_batch_status(2), 0);
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(INBOX), 2);
+    CU_ASSERT(marked("<a@b>", INBOX));
+    CU_ASSERT(!marked("<c@d>", INBOX));
+    CU_ASSERT(marked("<e@f>", INBOX));
+
+    strarray_fini(&flags);
+}
+
+static void test_acl_failure(void)
+{
+    struct auth_state *nobody = auth_newstate("nobody");
+    int r;
+
+    lmtp_batch_start(3, delivered_cb, NULL);
+
+    r = deliver(0, INBOX, auth_state, 1, NULL, "<a@b>", "fred");
+    CU_ASSERT_EQUAL(r, 0);
+    /* joining the session still needs the right to post */
+    r = deliver(1, INBOX, nobody, 0, NULL, "<c@d>", "barney");
+    CU_ASSERT_EQUAL(r, IMAP_MAILBOX_NONEXISTENT);
+    r = deliver(2, INBOX, auth_state, 0, NULL, "<e@f>", "wilma");
+    CU_ASSERT_EQUAL(r, 0);
+
+    lmtp_batch_commit();
+    CU_ASSERT_STRING_EQUAL_FREE(get_delivered(),
+				INBOX":fred "INBOX":wilma");
+    lmtp_batch_end();
+
+    CU_ASSERT_EQUAL(count(INBOX), 2);
+
+    auth_freestate(nobody);
+}
+
+static int create_mailbox(const char *name)
+{
+    struct mboxlist_entry mbentry;
+    struct mailbox *mailbox = NULL;
+    int r;
+
+    memset(&mbentry, 0, sizeof(mbentry));
+    mbentry.name = (char *)name;
+    mbentry.mbtype = 0;
+    mbentry.partition = PARTITION;
+    mbentry.acl = ACL;
+    r = mboxlist_update(&mbentry, /*localonly*/1);
+    if (r)
+	return r;
+
+    r = mailbox_create(name, PARTITION, ACL,
+		       /*uniqueid*/NULL, /*specialuse*/NULL,
+		       /*options*/0, /*uidvalidity*/0,
+		       &mailbox);
+    if (r)
+	return r;
+    mailbox_close(&mailbox);
+
+    return 0;
+}
+
+static int set_up(void)
+{
+    static const char message[] =
+	"From: smurfette@example.com\r\n"
+	"To: smurf@example.com\r\n"
+	"Subject: hello\r\n"
+	"Message-ID: <a@b>\r\n"
+	"\r\n"
+	"la la la\r\n";
+    int r;
+    FILE *f;
+    const char * const *d;
+    static const char * const dirs[] = {
+	DBDIR,
+	DBDIR"/db",
+	DBDIR"/conf",
+	DBDIR"/data",
+	DBDIR"/data/user",
+	DBDIR"/data/user/smurf",
+	DBDIR"/data/user/smurf/lists",
+	NULL
+    };
+
+    r = system("rm -rf " DBDIR);
+    if (r)
+	return r;
+
+    for (d = dirs ; *d ; d++) {
+	r = mkdir(*d, 0777);
+	if (r < 0) {
+	    int e = errno;
+	    perror(*d);
+	    return e;
+	}
+    }
+
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, DBDIR);
+    config_read_string(
+	"configdirectory: "DBDIR"/conf\n"
+	"defaultpartition: "PARTITION"\n"
+	"partition-"PARTITION": "DBDIR"/data\n"
+    );
+
+    cyrusdb_init();
+    config_mboxlist_db = "skiplist";
+    config_quota_db = "skiplist";
+    config_duplicate_db = "skiplist";
+
+    auth_state = auth_newstate(USERID);
+
+    quotadb_init(0);
+    quotadb_open(NULL);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    duplicate_init(NULL);
+
+    r = create_mailbox(INBOX);
+    if (r)
+	return r;
+    r = create_mailbox(FOLDER);
+    if (r)
+	return r;
+
+    /* the message, staged the way lmtpd does it */
+    f = append_newstage(INBOX, time(NULL), 0, &stage);
+    if (!f)
+	return IMAP_IOERROR;
+    fputs(message, f);
+    fflush(f);
+
+    memset(&content, 0, sizeof(content));
+    msg.f = f;
+    msg.content = &content;
+    msg.stage = stage;
+    msg.nolink = 0;
+    msg.dupelim = 1;
+
+    return 0;
+}
+
+static int tear_down(void)
+{
+    int r;
+
+    if (content.base) map_free(&content.base, &content.len);
+    if (content.body) {
+	message_free_body(content.body);
+	free(content.body);
+    }
+    fclose(msg.f);
+    append_removestage(stage);
+    stage = NULL;
+    strarray_fini(&delivered);
+
+    duplicate_done();
+
+    mboxlist_close();
+    mboxlist_done();
+
+    quotadb_close();
+    quotadb_done();
+
+    auth_freestate(auth_state);
+
+    cyrusdb_done();
+    config_mboxlist_db = NULL;
+    config_quota_db = NULL;
+    config_duplicate_db = NULL;
+
+    r = system("rm -rf " DBDIR);
+    /* I'm ignoring you */
+
+    return 0;
+}
@@ -0,0 +1,332 @@
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <errno.h>
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "retry.h"
+#include "global.h"
+#include "libcyr_cfg.h"
+#include "mboxlist.h"
+#include "imap_err.h"
+
+#define DBDIR		"test-dbdir"
+#define RACLFNAME	DBDIR"/conf"FNAME_REVERSEACLSDB
+#define PARTITION	"default"
+#define USERID		"fred"
+
+static struct namespace namespace;
+
+static void config_read_string(const char *s)
+{
+    char *fname = xstrdup("/tmp/cyrus-cunit-configXXXXXX");
+    int fd = mkstemp(fname);
+    retry_write(fd, s, strlen(s));
+    config_reset();
+    config_read(fname);
+    unlink(fname);
+    free(fname);
+    close(fd);
+}
+
+static void read_config(int reverseacls)
+{
+    libcyrus_config_setstring(CYRUSOPT_CONFIG_DIR, DBDIR);
+    config_read_string(reverseacls ?
+	"configdirectory: "DBDIR"/conf\n"
+	"defaultpartition: "PARTITION"\n"
+	"partition-"PARTITION": "DBDIR"/data\n"
+	"reverseacls: yes\n" :
+	"configdirectory: "DBDIR"/conf\n"
+	"defaultpartition: "PARTITION"\n"
+	"partition-"PARTITION": "DBDIR"/data\n"
+    );
+    config_mboxlist_db = "skiplist";
+    config_reverseacls_db = "skiplist";
+}
+
+static int setacl(const char *name, const char *acl)
+{
+    struct mboxlist_entry mbentry;
+
+    memset(&mbentry, 0, sizeof(mbentry));
+    mbentry.name = (char *)name;
+    mbentry.mbtype = 0;
+    mbentry.partition = PARTITION;
+    mbentry.acl = (char *)acl;
+
+    return mboxlist_update(&mbentry, /*localonly*/1);
+}
+
+static void create_mailboxes(void)
+{
+    int r;
+
+    r = setacl("shared.anyone", "anyone\tlr\t");
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = setacl("shared.fred", USERID"\tlrs\tbarney\tlr\t");
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = setacl("shared.barney", "barney\tlrswipkxtecda\t");
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    /* reading isn't enough, fred has to be able to see it */
+    r = setacl("shared.nolookup", USERID"\tr\t");
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = setacl("shared.negative", USERID"\tlr\t-"USERID"\tl\t");
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+}
+
+static int list_cb(char *name, int matchlen,
+		   int maycreate __attribute__((unused)), void *rock)
+{
+    strarray_t *names = (strarray_t *)rock;
+
+    strarray_appendm(names, xstrndup(name, matchlen));
+    return 0;
+}
+
+/* what 'userid' gets from LIST "" *, space separated */
+static char *list(int isadmin, const char *userid)
+{
+    strarray_t names = STRARRAY_INITIALIZER;
+    struct auth_state *auth_state = auth_newstate(userid);
+    char *res;
+    int r;
+
+    r = mboxlist_findall(&namespace, "*", isadmin, userid, auth_state,
+			 list_cb, &names);
+    CU_ASSERT_EQUAL(r, 0);
+    auth_freestate(auth_state);
+
+    strarray_sort(&names);
+    res = strarray_join(&names, " ");
+    strarray_fini(&names);
+
+    return res;
+}
+
+static int keys_cb(void *rock,
+		   const char *key, size_t keylen,
+		   const char *data __attribute__((unused)),
+		   size_t datalen __attribute__((unused)))
+{
+    struct buf *buf = (struct buf *)rock;
+    const char *p;
+
+    if (buf->len) buf_putc(buf, ' ');
+    for (p = key; p < key + keylen; p++)
+	buf_putc(buf, *p ? *p : '/');
+
+    return 0;
+}
+
+/* the reverse acls for 'identifier', as identifier/mailbox pairs */
+static char *racl_keys(const char *identifier)
+{
+    struct db *db = NULL;
+    struct buf buf = BUF_INITIALIZER;
+    int r;
+
+    r = cyrusdb_open(config_reverseacls_db, RACLFNAME, 0, &db);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    r = cyrusdb_foreach(db, identifier, strlen(identifier) + 1, NULL,
+			keys_cb, &buf, NULL);
+    CU_ASSERT_EQUAL(r, 0);
+    cyrusdb_close(db);
+
+    return buf_release(&buf);
+}
+
+/* add or remove one reverse acl behind mboxlist's back */
+static void racl_poke(const char *identifier, const char *name, int add)
+{
+    struct db *db = NULL;
+    struct buf key = BUF_INITIALIZER;
+    int r;
+
+    buf_appendcstr(&key, identifier);
+    buf_putc(&key, '\0');
+    buf_appendcstr(&key, name);
+
+    r = cyrusdb_open(config_reverseacls_db, RACLFNAME, 0, &db);
+    CU_ASSERT_EQUAL_FATAL(r, 0);
+    if (add)
+	r = cyrusdb_store(db, key.s, key.len, "", 0, NULL);
+    else
+	r = cyrusdb_delete(db, key.s, key.len, NULL, 0);
+    CU_ASSERT_EQUAL(r, 0);
+    cyrusdb_close(db);
+
+    buf_free(&key);
+}
+
+#define CU_ASSERT_STRING_EQUAL_FREE(actual, expected) \
+    do { \
+	char *_s = (actual); \
+	CU_ASSERT_STRING_EQUAL(_s, (expected)); \
+	free(_s); \
+    } while (0)
+
+static void test_racl_add(void)
+{
+    create_mailboxes();
+
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys(USERID),
+				USERID"/shared.fred "
+				USERID"/shared.negative");
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney barney/shared.fred");
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("anyone"),
+				"anyone/shared.anyone");
+
+    /* negative rights are still applied when LIST checks the entry */
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID),
+				"shared.anyone shared.fred");
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, "barney"),
+				"shared.anyone shared.barney shared.fred");
+}
+
+static void test_racl_remove(void)
+{
+    int r;
+
+    create_mailboxes();
+
+    /* fred loses lookup, barney keeps it */
+    r = setacl("shared.fred", USERID"\trs\tbarney\tlr\t");
+    CU_ASSERT_EQUAL(r, 0);
+
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys(USERID),
+				USERID"/shared.negative");
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney barney/shared.fred");
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID), "shared.anyone");
+
+    /* and gets it back */
+    r = setacl("shared.fred", USERID"\tlrs\t");
+    CU_ASSERT_EQUAL(r, 0);
+
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys(USERID),
+				USERID"/shared.fred "
+				USERID"/shared.negative");
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney");
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID),
+				"shared.anyone shared.fred");
+
+    /* deleting the mailbox forgets it for everyone */
+    r = mboxlist_deletemailbox("shared.fred", /*isadmin*/1, NULL, NULL,
+			       /*checkacl*/0, /*localonly*/1, /*force*/1);
+    CU_ASSERT_EQUAL(r, 0);
+
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys(USERID),
+				USERID"/shared.negative");
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID), "shared.anyone");
+}
+
+static void test_racl_build(void)
+{
+    /* make the mailboxes with nobody keeping the reverse acls */
+    mboxlist_close();
+    read_config(0);
+    mboxlist_open(NULL);
+    create_mailboxes();
+    mboxlist_close();
+
+    CU_ASSERT_EQUAL(access(RACLFNAME, F_OK), -1);
+
+    /* turning it on builds it */
+    read_config(1);
+    mboxlist_open(NULL);
+
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys(USERID),
+				USERID"/shared.fred "
+				USERID"/shared.negative");
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney barney/shared.fred");
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID),
+				"shared.anyone shared.fred");
+
+    /* opening it again leaves it alone */
+    racl_poke("barney", "shared.fred", 0);
+    mboxlist_close();
+    mboxlist_open(NULL);
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney");
+
+    /* but rebuilding it doesn't */
+    CU_ASSERT_EQUAL(mboxlist_racl_rebuild(), 0);
+    CU_ASSERT_STRING_EQUAL_FREE(racl_keys("barney"),
+				"barney/shared.barney barney/shared.fred");
+}
+
+static void test_racl_list_filter(void)
+{
+    create_mailboxes();
+
+    /* a non-admin LIST only looks at what the reverse acls name */
+    racl_poke(USERID, "shared.fred", 0);
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID), "shared.anyone");
+
+    /* and still checks those against the real acl */
+    racl_poke(USERID, "shared.barney", 1);
+    racl_poke(USERID, "shared.nolookup", 1);
+    CU_ASSERT_STRING_EQUAL_FREE(list(0, USERID), "shared.anyone");
+
+    /* admins don't use them at all */
+    CU_ASSERT_STRING_EQUAL_FREE(list(1, USERID),
+				"shared.anyone shared.barney shared.fred "
+				"shared.negative shared.nolookup");
+}
+
+static int set_up(void)
+{
+    int r;
+    const char * const *d;
+    static const char * const dirs[] = {
+	DBDIR,
+	DBDIR"/db",
+	DBDIR"/conf",
+	DBDIR"/data",
+	NULL
+    };
+
+    r = system("rm -rf " DBDIR);
+    if (r)
+	return r;
+
+    for (d = dirs ; *d ; d++) {
+	r = mkdir(*d, 0777);
+	if (r < 0) {
+	    int e = errno;
+	    perror(*d);
+	    return e;
+	}
+    }
+
+    read_config(1);
+    cyrusdb_init();
+
+    mboxname_init_namespace(&namespace, /*isadmin*/0);
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    return 0;
+}
+
+static int tear_down(void)
+{
+    int r;
+
+    mboxlist_close();
+    mboxlist_done();
+
+    cyrusdb_done();
+    config_mboxlist_db = NULL;
+    config_reverseacls_db = NULL;
+
+    r = system("rm -rf " DBDIR);
+    /* I'm ignoring you */
+
+    return 0;
+}
@@ -123,6 +123,34 @@ static void test_contains(void)
     CU_ASSERT_EQUAL(mboxname_is_prefix(FOO, FOONONE), 0);
 }
 
+static void test_shard(void)
+{
+    static const char FRED[] = "bloggs.com!user.fred";
+    static const char FRED_SENT[] = "bloggs.com!user.fred.Sent";
+    static const char FRED_DELETED[] =
+	"bloggs.com!DELETED.user.fred.Sent.4E9A5C3B";
+    static const char FREDNET[] = "bloggs.net!user.fred";
+    static const char JANE[] = "bloggs.com!user.jane";
+    static const char SHARED[] = "bloggs.com!shared";
+    static const char SHARED_FOO[] = "bloggs.com!shared.foo";
+    static const char SHARED_DELETED[] = "bloggs.com!DELETED.shared.4E9A5C3B";
+    int fred = mboxname_shard(FRED, 1000);
+
+    CU_ASSERT(fred >= 0 && fred < 1000);
+    CU_ASSERT_EQUAL(mboxname_shard(FRED_SENT, 1000), fred);
+    /* a deleted mailbox stays with its user */
+    CU_ASSERT_EQUAL(mboxname_shard(FRED_DELETED, 1000), fred);
+    CU_ASSERT_NOT_EQUAL(mboxname_shard(FREDNET, 1000), fred);
+    CU_ASSERT_NOT_EQUAL(mboxname_shard(JANE, 1000), fred);
+
+    CU_ASSERT_EQUAL(mboxname_shard(SHARED_FOO, 1000),
+		    mboxname_shard(SHARED, 1000));
+    CU_ASSERT_EQUAL(mboxname_shard(SHARED_DELETED, 1000),
+		    mboxname_shard(SHARED, 1000));
+
+    CU_ASSERT_EQUAL(mboxname_shard(FRED, 1), 0);
+}
+
 static void test_parts_same_userid(void)
 {
     static const char FRED_DRAFTS[] = "user.fred.Drafts";
@@ -240,3 +240,72 @@ static void test_printmap(void)
     prot_free(p);
     EPILOG;
 }
+
+static void test_sendfile(void)
+{
+    PROLOG;
+    struct protstream *p;
+    int len;
+    struct buf b = BUF_INITIALIZER;
+    struct buf exp = BUF_INITIALIZER;
+    char *src_fname = xstrdup("/tmp/cyrus-protXXXXXX");
+    int src_fd = mkstemp(src_fname);
+    char *str;
+    int i, r;
+
+    /* plenty of lines, some of which start with a dot */
+    for (i = 0 ; i < 5000 ; i++) {
+	if (i % 7 == 0)
+	    buf_printf(&b, ".line %d\r\n", i);
+	else
+	    buf_printf(&b, "line %d of the message\r\n", i);
+    }
+    r = write(src_fd, b.s, b.len);
+    CU_ASSERT_EQUAL_FATAL(r, (int)b.len);
+    str = xmalloc(2 * b.len + 1);
+
+    p = prot_new(_fd, 1);
+    CU_ASSERT_PTR_NOT_NULL_FATAL(p);
+
+    /* straight from the file, after some buffered output */
+    BEGIN;
+    prot_printf(p, "{%u}\r\n", (unsigned)b.len - 10);
+    prot_sendfile(p, src_fd, NULL, 10, b.len - 10);
+    prot_flush(p);
+    END(str, len);
+    buf_printf(&exp, "{%u}\r\n", (unsigned)b.len - 10);
+    buf_appendmap(&exp, b.s + 10, b.len - 10);
+    CU_ASSERT_EQUAL(len, (int)exp.len);
+    CU_ASSERT(!memcmp(str, exp.s, exp.len));
+
+    /* short ones are copied from the map */
+    BEGIN;
+    prot_sendfile(p, src_fd, b.s, 6, 20);
+    prot_flush(p);
+    END(str, len);
+    CU_ASSERT_EQUAL(len, 20);
+    CU_ASSERT(!memcmp(str, b.s + 6, 20));
+
+    /* dot-stuffed */
+    BEGIN;
+    prot_sendfile_dotstuffed(p, src_fd, b.s, 0, b.len);
+    prot_flush(p);
+    END(str, len);
+    buf_reset(&exp);
+    for (i = 0 ; i < (int)b.len ; i++) {
+	if (b.s[i] == '.' && (!i || b.s[i-1] == '\n'))
+	    buf_putc(&exp, '.');
+	buf_putc(&exp, b.s[i]);
+    }
+    CU_ASSERT_EQUAL(len, (int)exp.len);
+    CU_ASSERT(!memcmp(str, exp.s, exp.len));
+
+    prot_free(p);
+    free(str);
+    buf_free(&exp);
+    buf_free(&b);
+    unlink(src_fname);
+    free(src_fname);
+    close(src_fd);
+    EPILOG;
+}
@@ -0,0 +1,287 @@
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "cunit/cunit.h"
+#include "xmalloc.h"
+#include "util.h"
+#include "shmcache.h"
+
+static char fname[PATH_MAX];
+
+static int set_up(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+
+    snprintf(fname, sizeof(fname), "%s/cunit-shmcache-test.%d",
+	     tmpdir ? tmpdir : "/tmp", (int) getpid());
+    unlink(fname);
+
+    return 0;
+}
+
+static int tear_down(void)
+{
+    unlink(fname);
+
+    return 0;
+}
+
+static void test_basic(void)
+{
+    struct shmcache *cache = NULL;
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    int r;
+
+    r = shmcache_open(fname, 100, 64, &cache);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_PTR_NOT_NULL(cache);
+
+    r = shmcache_fetch(cache, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+    CU_ASSERT_EQUAL(data.len, 0);
+
+    r = shmcache_store(cache, "foo", 3, "bar", 3, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_store(cache, "fo", 2, "baz!", 4, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    r = shmcache_fetch(cache, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 3);
+    CU_ASSERT(!memcmp(data.s, "bar", 3));
+
+    /* replacing keeps the one entry */
+    r = shmcache_store(cache, "foo", 3, "quux", 4, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_fetch(cache, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 4);
+    CU_ASSERT(!memcmp(data.s, "quux", 4));
+
+    /* expired entries aren't returned */
+    r = shmcache_fetch(cache, "foo", 3, &data, now + 61);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+
+    r = shmcache_delete(cache, "foo", 3);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_delete(cache, "foo", 3);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+    r = shmcache_fetch(cache, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+
+    r = shmcache_fetch(cache, "fo", 2, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 4);
+
+    /* too big to keep */
+    r = shmcache_store(cache, "big", 3,
+		       "0123456789012345678901234567890123456789"
+		       "0123456789012345678901234567890123456789", 80, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_TOOBIG);
+
+    buf_free(&data);
+    shmcache_close(cache);
+}
+
+static void test_reopen(void)
+{
+    struct shmcache *cache = NULL, *cache2 = NULL;
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    int r;
+
+    r = shmcache_open(fname, 100, 64, &cache);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_store(cache, "foo", 3, "bar", 3, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    /* a second user, who'd like another size, gets the same table */
+    r = shmcache_open(fname, 5000, 16, &cache2);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_fetch(cache2, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 3);
+
+    r = shmcache_store(cache2, "long", 4,
+		       "0123456789012345678901234567890123456789", 40, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_fetch(cache, "long", 4, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 40);
+
+    buf_free(&data);
+    shmcache_close(cache2);
+    shmcache_close(cache);
+}
+
+static void test_evict(void)
+{
+    struct shmcache *cache = NULL;
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    char key[16];
+    int i, r, found;
+
+    /* a single bucket */
+    r = shmcache_open(fname, 8, 16, &cache);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    for (i = 0; i < 8; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	r = shmcache_store(cache, key, strlen(key), key, strlen(key),
+			   now + 60);
+	CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    }
+
+    /* everything but key3 is used later than it */
+    for (i = 0; i < 8; i++) {
+	if (i == 3) continue;
+	snprintf(key, sizeof(key), "key%d", i);
+	r = shmcache_fetch(cache, key, strlen(key), &data, now + 1);
+	CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    }
+
+    r = shmcache_store(cache, "new", 3, "new", 3, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    r = shmcache_fetch(cache, "key3", 4, &data, now + 1);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+    for (found = 0, i = 0; i < 8; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	if (!shmcache_fetch(cache, key, strlen(key), &data, now + 1)) found++;
+    }
+    CU_ASSERT_EQUAL(found, 7);
+
+    /* an expired entry goes before any live one, even one used longer ago */
+    r = shmcache_store(cache, "stale", 5, "stale", 5, now - 1);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    for (i = 0; i < 8; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	shmcache_fetch(cache, key, strlen(key), &data, now - 100);
+    }
+    r = shmcache_store(cache, "fresh", 5, "fresh", 5, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    for (found = 0, i = 0; i < 8; i++) {
+	snprintf(key, sizeof(key), "key%d", i);
+	if (!shmcache_fetch(cache, key, strlen(key), &data, now)) found++;
+    }
+    CU_ASSERT_EQUAL(found, 7);
+    r = shmcache_fetch(cache, "fresh", 5, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    buf_free(&data);
+    shmcache_close(cache);
+}
+
+static void test_processes(void)
+{
+    struct shmcache *cache = NULL;
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    char val[64];
+    int i, r, status, torn = 0;
+    size_t j;
+    pid_t pid;
+
+    r = shmcache_open(fname, 8, 64, &cache);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    pid = fork();
+    CU_ASSERT(pid >= 0);
+    if (!pid) {
+	/* rewrite the one key, always with a value of one repeated
+	 * character, as fast as we can */
+	for (i = 0; i < 20000; i++) {
+	    memset(val, 'a' + i % 26, sizeof(val));
+	    shmcache_store(cache, "k", 1, val, 1 + i % sizeof(val), now + 60);
+	}
+	_exit(0);
+    }
+
+    /* meanwhile, nothing we read may be half of one and half another */
+    for (i = 0; i < 20000; i++) {
+	if (shmcache_fetch(cache, "k", 1, &data, now)) continue;
+	for (j = 1; j < data.len; j++)
+	    if (data.s[j] != data.s[0]) break;
+	if (j < data.len) torn++;
+    }
+    waitpid(pid, &status, 0);
+    CU_ASSERT_EQUAL(status, 0);
+    CU_ASSERT_EQUAL(torn, 0);
+
+    /* the child's last write is there for us */
+    r = shmcache_fetch(cache, "k", 1, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    CU_ASSERT_EQUAL(data.len, 1 + 19999 % 64);
+
+    buf_free(&data);
+    shmcache_close(cache);
+}
+
+static void test_replace_mapped(void)
+{
+    struct shmcache *cache = NULL, *cache2 = NULL;
+    struct buf data = BUF_INITIALIZER;
+    time_t now = time(NULL);
+    struct stat sbuf;
+    int i, r, status, pipefd[2];
+    char c;
+    pid_t pid;
+
+    r = shmcache_open(fname, 100, 64, &cache);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_store(cache, "foo", 3, "bar", 3, now + 60);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+
+    r = pipe(pipefd);
+    CU_ASSERT_EQUAL(r, 0);
+
+    pid = fork();
+    CU_ASSERT(pid >= 0);
+    if (!pid) {
+	/* keep using our mapping after the file has been replaced */
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) _exit(1);
+	for (i = 0; i < 1000; i++) {
+	    if (shmcache_fetch(cache, "foo", 3, &data, now)) _exit(2);
+	    if (shmcache_store(cache, "baz", 3, "quux", 4, now + 60)) _exit(3);
+	}
+	_exit(0);
+    }
+    close(pipefd[0]);
+
+    /* damage it, as if it were written by a different version */
+    r = stat(fname, &sbuf);
+    CU_ASSERT_EQUAL(r, 0);
+    r = truncate(fname, sbuf.st_size + 4096);
+    CU_ASSERT_EQUAL(r, 0);
+
+    /* the next user starts afresh, with the size it asked for */
+    r = shmcache_open(fname, 8, 16, &cache2);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_fetch(cache2, "foo", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+    r = stat(fname, &sbuf);
+    CU_ASSERT_EQUAL(r, 0);
+    CU_ASSERT(sbuf.st_size < 4096);
+
+    /* and the child, still with the old file mapped, doesn't notice */
+    r = write(pipefd[1], "x", 1);
+    CU_ASSERT_EQUAL(r, 1);
+    close(pipefd[1]);
+    waitpid(pid, &status, 0);
+    CU_ASSERT(WIFEXITED(status));
+    CU_ASSERT_EQUAL(WEXITSTATUS(status), 0);
+
+    /* nor do we, through our old handle */
+    r = shmcache_fetch(cache, "baz", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_OK);
+    r = shmcache_fetch(cache2, "baz", 3, &data, now);
+    CU_ASSERT_EQUAL(r, SHMCACHE_NOTFOUND);
+
+    buf_free(&data);
+    shmcache_close(cache2);
+    shmcache_close(cache);
+}
@@ -7,6 +7,8 @@
  */
 #include "cunit/cunit.h"
 #include <malloc.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include "sieve_interface.h"
 #include "bytecode.h"
 #include "prot.h"
@@ -512,6 +514,29 @@ static int tear_down(void)
     return 0;
 }
 
+/* Here we pretend to be the sieve compiler, and generate
+ * a file of compiled bytecode from the script string */
+static void compile_script(sieve_test_context_t *ctx,
+			   const char *script, int fd)
+{
+    int r;
+    FILE *fp;
+    sieve_script_t *scr = NULL;
+    bytecode_info_t *bytecode = NULL;
+
+    fp = fmemopen((void *)script, strlen(script), "r");
+    r = sieve_script_parse(ctx->interp, fp, ctx, &scr);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    fclose(fp);
+
+    r = sieve_generate_bytecode(&bytecode, scr);
+    CU_ASSERT(r > 0);
+    r = sieve_emit_bytecode(fd, bytecode);
+    CU_ASSERT(r > 0);
+    sieve_free_bytecode(&bytecode);
+    sieve_script_free(&scr);
+}
+
 static void context_setup(sieve_test_context_t *ctx,
 			  const char *script)
 {
@@ -523,11 +548,7 @@ static void context_setup(sieve_test_context_t *ctx,
 	&autorespond,		/* autorespond() */
 	&send_response		/* send_response() */
     };
-    int len = strlen(script);
     int fd;
-    FILE *fp;
-    sieve_script_t *scr = NULL;
-    bytecode_info_t *bytecode = NULL;
     char tempfile[32];
 
     memset(ctx, 0, sizeof(*ctx));
@@ -570,22 +591,11 @@ static void context_setup(sieve_test_context_t *ctx,
     r = sieve_register_execute_error(ctx->interp, mysieve_execute_error);
     CU_ASSERT_EQUAL(r, SIEVE_OK);
 
-    /* Here we pretend to be the sieve compiler, and generate
-     * a file of compiled bytecode from the script string */
-    fp = fmemopen((void *)script, len, "r");
-    r = sieve_script_parse(ctx->interp, fp, ctx, &scr);
-    CU_ASSERT_EQUAL(r, SIEVE_OK);
-    fclose(fp);
-
-    r = sieve_generate_bytecode(&bytecode, scr);
-    CU_ASSERT(r > 0);
     strcpy(tempfile, "/tmp/sievetest-BC-XXXXXX");
     fd = mkstemp(tempfile);
     CU_ASSERT(fd >= 0);
-    r = sieve_emit_bytecode(fd, bytecode);
-    CU_ASSERT(r > 0);
-    sieve_free_bytecode(&bytecode);
-    sieve_script_free(&scr);
+    compile_script(ctx, script, fd);
+    close(fd);
 
     /* Now load the compiled bytecode */
     r = sieve_script_load(tempfile, &ctx->exe);
@@ -960,6 +970,164 @@ static void test_address_localpart(void)
     context_cleanup(&ctx);
 }
 
+static void test_regex_cache(void)
+{
+    static const char SCRIPT_REGEX[] =
+    "require \"regex\";\n"
+    "if header :regex \"subject\" \"^(urgent|asap):\"\n"
+    "{redirect \"me@blah.com\";}\n"
+    ;
+    static const char SCRIPT_DISCARD[] =
+    "discard;\n"
+    ;
+
+    static const char MSG_TRUE[] =
+    "Date: Mon, 25 Jan 2003 08:51:06 -0500\r\n"
+    "From: zme@true.com\r\n"
+    "To: you\r\n"
+    "Subject: asap: regex test\r\n"
+    "\r\n"
+    "blah\n"
+    ;
+    static const char MSG_FALSE[] =
+    "Date: Mon, 25 Jan 2003 08:51:06 -0500\r\n"
+    "From: zme@false.com\r\n"
+    "To: you\r\n"
+    "Subject: re: asap: regex test\r\n"
+    "\r\n"
+    "blah\n"
+    ;
+    sieve_test_context_t ctx;
+    char tempfile[32];
+    char newfile[64];
+    int fd;
+    int r;
+
+    context_setup(&ctx, SCRIPT_REGEX);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+
+    /* the regex is compiled on first use and reused after that */
+    run_message(&ctx, MSG_TRUE);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+    CU_ASSERT_EQUAL(ctx.stats.redirects, 1);
+    CU_ASSERT_EQUAL(ctx.stats.keeps, 0);
+
+    run_message(&ctx, MSG_FALSE);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+    CU_ASSERT_EQUAL(ctx.stats.redirects, 1);
+    CU_ASSERT_EQUAL(ctx.stats.keeps, 1);
+
+    run_message(&ctx, MSG_TRUE);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+    CU_ASSERT_EQUAL(ctx.stats.redirects, 2);
+    CU_ASSERT_EQUAL(ctx.stats.keeps, 1);
+
+    /* a script loaded again from the same file comes from the cache */
+    strcpy(tempfile, "/tmp/sievetest-BC-XXXXXX");
+    fd = mkstemp(tempfile);
+    CU_ASSERT(fd >= 0);
+    compile_script(&ctx, SCRIPT_DISCARD, fd);
+    close(fd);
+
+    r = sieve_script_unload(&ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    r = sieve_script_load(tempfile, &ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    run_message(&ctx, MSG_TRUE);
+    CU_ASSERT_EQUAL(ctx.stats.discards, 1);
+
+    r = sieve_script_unload(&ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    r = sieve_script_load(tempfile, &ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    run_message(&ctx, MSG_TRUE);
+    CU_ASSERT_EQUAL(ctx.stats.discards, 2);
+    CU_ASSERT_EQUAL(ctx.stats.redirects, 2);
+
+    /* replacing the file the way timsieved does forces a reload */
+    snprintf(newfile, sizeof(newfile), "%s.NEW", tempfile);
+    fd = open(newfile, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    CU_ASSERT(fd >= 0);
+    compile_script(&ctx, SCRIPT_REGEX, fd);
+    close(fd);
+    r = rename(newfile, tempfile);
+    CU_ASSERT_EQUAL(r, 0);
+
+    r = sieve_script_unload(&ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    r = sieve_script_load(tempfile, &ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    run_message(&ctx, MSG_TRUE);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+    CU_ASSERT_EQUAL(ctx.stats.discards, 2);
+    CU_ASSERT_EQUAL(ctx.stats.redirects, 3);
+
+    unlink(tempfile);
+    context_cleanup(&ctx);
+}
+
+static void test_run_failure(void)
+{
+    static const char SCRIPT[] =
+    "discard;\n"
+    ;
+    static const char MSG[] =
+    "Date: Mon, 25 Jan 2003 08:51:06 -0500\r\n"
+    "From: zme@true.com\r\n"
+    "To: you\r\n"
+    "Subject: failure test\r\n"
+    "\r\n"
+    "blah\n"
+    ;
+    sieve_test_context_t ctx;
+    sieve_test_message_t *msg;
+    char tempfile[32];
+    int version = htonl(BYTECODE_VERSION + 1);
+    int fd;
+    int r;
+
+    context_setup(&ctx, SCRIPT);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 0);
+
+    /* bytecode which fails as soon as it runs */
+    strcpy(tempfile, "/tmp/sievetest-BC-XXXXXX");
+    fd = mkstemp(tempfile);
+    CU_ASSERT(fd >= 0);
+    compile_script(&ctx, SCRIPT, fd);
+    r = pwrite(fd, &version, sizeof(version), BYTECODE_MAGIC_LEN);
+    CU_ASSERT_EQUAL(r, sizeof(version));
+    close(fd);
+
+    r = sieve_script_unload(&ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    r = sieve_script_load(tempfile, &ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+
+    msg = message_new(MSG, strlen(MSG));
+    r = sieve_execute_bytecode(ctx.exe, ctx.interp, &ctx, msg);
+    CU_ASSERT_EQUAL(r, SIEVE_RUN_ERROR);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 1);
+    CU_ASSERT_EQUAL(ctx.stats.discards, 0);
+
+    /* the second run, from the cached bytecode, fails the same way */
+    r = sieve_script_unload(&ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+    r = sieve_script_load(tempfile, &ctx.exe);
+    CU_ASSERT_EQUAL(r, SIEVE_OK);
+
+    r = sieve_execute_bytecode(ctx.exe, ctx.interp, &ctx, msg);
+    CU_ASSERT_EQUAL(r, SIEVE_RUN_ERROR);
+    CU_ASSERT_EQUAL(ctx.stats.errors, 2);
+    CU_ASSERT_EQUAL(ctx.run_errors->count, 2);
+    CU_ASSERT_STRING_EQUAL(ctx.run_errors->data[1],
+			   ctx.run_errors->data[0]);
+    CU_ASSERT(strcmp(ctx.run_errors->data[1], "Recursive Include"));
+
+    message_free(msg);
+    unlink(tempfile);
+    context_cleanup(&ctx);
+}
+
 // TODO: test
 // if size :over 10K { redirect "me@blah.com"; }
 // TODO: test
@@ -128,3 +128,147 @@ static void test_coding_I(void)
     TESTCASE(0x4afebabebdefaced);
 #undef TESTCASE
 }
+
+#define NDOCS	1000
+
+/* document 0 is empty, like squatter's validity document; after that
+ * document i contains "xyzw" if i is a multiple of 3, "yzwq" if i is
+ * a multiple of 5, and "abcd" always */
+static void index_docs(SquatIndex *index)
+{
+    char text[64];
+    char name[32];
+    int i;
+    int r;
+
+    r = squat_index_open_document(index, "empty");
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    r = squat_index_close_document(index);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+
+    for (i = 1 ; i < NDOCS ; i++) {
+	snprintf(name, sizeof(name), "d%d", i);
+	snprintf(text, sizeof(text), "abcd %s %s",
+		 (i % 3 == 0 ? "xyzw" : "----"),
+		 (i % 5 == 0 ? "yzwq" : "____"));
+	r = squat_index_open_document_key(index, name, (SquatInt64)i * 10);
+	CU_ASSERT_EQUAL(r, SQUAT_OK);
+	r = squat_index_append_document(index, text, strlen(text));
+	CU_ASSERT_EQUAL(r, SQUAT_OK);
+	r = squat_index_close_document(index);
+	CU_ASSERT_EQUAL(r, SQUAT_OK);
+    }
+}
+
+struct hits {
+    int n;
+    SquatInt64 keys[NDOCS];
+};
+
+static int hit_key(void *closure, SquatInt64 key)
+{
+    struct hits *h = (struct hits *)closure;
+    h->keys[h->n++] = key;
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+static int hit_name(void *closure, const char *name)
+{
+    struct hits *h = (struct hits *)closure;
+    h->keys[h->n++] = atoi(name+1) * 10;
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+static int choose_all(void *closure __attribute__((unused)),
+		      const SquatListDoc *doc __attribute__((unused)))
+{
+    return 1;
+}
+
+/* check that a search finds exactly the documents whose number
+ * is a multiple of 'mod' */
+static void check_search(SquatSearchIndex *sindex, const char *s, int mod)
+{
+    struct hits h;
+    int r;
+    int i;
+
+    memset(&h, 0, sizeof(h));
+    r = squat_search_execute_keys(sindex, s, strlen(s), hit_key, &h);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    CU_ASSERT_EQUAL(h.n, (NDOCS - 1) / mod);
+    for (i = 0 ; i < h.n ; i++)
+	CU_ASSERT_EQUAL(h.keys[i], (SquatInt64)(i + 1) * mod * 10);
+
+    memset(&h, 0, sizeof(h));
+    r = squat_search_execute(sindex, s, strlen(s), hit_name, &h);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    CU_ASSERT_EQUAL(h.n, (NDOCS - 1) / mod);
+    for (i = 0 ; i < h.n ; i++)
+	CU_ASSERT_EQUAL(h.keys[i], (SquatInt64)(i + 1) * mod * 10);
+}
+
+static void test_build_search(void)
+{
+    static const char tmpl[] = "/tmp/squat-test.XXXXXX";
+    char fname[sizeof(tmpl)];
+    char fname2[sizeof(tmpl)];
+    SquatOptions options;
+    SquatIndex *index;
+    SquatSearchIndex *sindex;
+    struct hits h;
+    int fd, fd2;
+    int r;
+
+    strcpy(fname, tmpl);
+    fd = mkstemp(fname);
+    CU_ASSERT(fd >= 0);
+    unlink(fname);
+
+    memset(&options, 0, sizeof(options));
+    options.option_mask = SQUAT_OPTION_TMP_PATH;
+    options.tmp_path = "/tmp";
+    index = squat_index_init(fd, &options);
+    CU_ASSERT_PTR_NOT_NULL(index);
+    index_docs(index);
+    r = squat_index_finish(index);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+
+    lseek(fd, 0, SEEK_SET);
+    sindex = squat_search_open(fd);
+    CU_ASSERT_PTR_NOT_NULL(sindex);
+
+    check_search(sindex, "abcd", 1);
+    check_search(sindex, "xyzw", 3);
+    check_search(sindex, "yzwq", 5);
+    /* needs both "xyzw" and "yzwq" */
+    check_search(sindex, "xyzwq", 15);
+
+    memset(&h, 0, sizeof(h));
+    r = squat_search_execute_keys(sindex, "nope", 4, hit_key, &h);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    CU_ASSERT_EQUAL(h.n, 0);
+
+    /* an incremental rebuild keeps the document keys */
+    strcpy(fname2, tmpl);
+    fd2 = mkstemp(fname2);
+    CU_ASSERT(fd2 >= 0);
+    unlink(fname2);
+
+    index = squat_index_init(fd2, &options);
+    CU_ASSERT_PTR_NOT_NULL(index);
+    r = squat_index_add_existing(index, sindex, choose_all, NULL);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    r = squat_index_finish(index);
+    CU_ASSERT_EQUAL(r, SQUAT_OK);
+    squat_search_close(sindex);
+    close(fd);
+
+    lseek(fd2, 0, SEEK_SET);
+    sindex = squat_search_open(fd2);
+    CU_ASSERT_PTR_NOT_NULL(sindex);
+    check_search(sindex, "xyzw", 3);
+    check_search(sindex, "xyzwq", 15);
+    squat_search_close(sindex);
+    close(fd2);
+}
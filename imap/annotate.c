@@ -1536,7 +1536,7 @@ static void annotation_get_server(annotate_state_t *state,
      * normal - we only check for ACL_LOOKUP and we don't refuse
      * access if the mailbox is not local */
     if (!state->mbentry->acl ||
-        !(cyrus_acl_myrights(state->auth_state, state->mbentry->acl) & ACL_LOOKUP))
+        !(mboxlist_entry_myrights(state->mbentry, state->auth_state) & ACL_LOOKUP))
 	goto out;
 
     if (state->mbentry->server)
@@ -1560,7 +1560,7 @@ static void annotation_get_partition(annotate_state_t *state,
 
     /* Check ACL */
     if (!state->mbentry->acl ||
-        !(cyrus_acl_myrights(state->auth_state, state->mbentry->acl) & ACL_LOOKUP))
+        !(mboxlist_entry_myrights(state->mbentry, state->auth_state) & ACL_LOOKUP))
 	goto out;
 
     if (!state->mbentry->server)
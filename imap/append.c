@@ -73,11 +73,13 @@
 #include "seen.h"
 #include "retry.h"
 #include "quota.h"
+#include "statuscache.h"
 #include "util.h"
 
 #include "annotate.h"
 #include "message_guid.h"
 #include "strarray.h"
+#include "sync_log.h"
 
 struct stagemsg {
     char fname[1024];
@@ -256,6 +258,9 @@ int append_commit(struct appendstate *as,
     /* TODO: what could we do in the case of an error? */
     annotatemore_commit();
 
+    /* queue the mailbox for the rolling squatter */
+    if (as->nummsg) sync_log_squat(as->mailbox->name);
+
     if (mailboxptr) {
 	*mailboxptr = as->mailbox;
     }
@@ -920,8 +925,10 @@ int append_fromstage(struct appendstate *as, struct body **body,
     r = mailbox_copyfile(stagefile, fname, nolink);
     destfile = fopen(fname, "r");
     if (!r && destfile) {
-	/* ok, we've successfully created the file */
-	if (!*body || (as->nummsg - 1))
+	/* ok, we've successfully created the file.  A body passed in
+	   describes this message, even when it isn't the first one
+	   in the session (lmtpd appends one message per recipient) */
+	if (!*body)
 	    r = message_parse_file(destfile, NULL, NULL, body);
 	if (!r) r = message_create_record(&record, *body);
     }
@@ -1305,6 +1312,9 @@ static int append_addseen(struct mailbox *mailbox,
     r = seen_write(seendb, mailbox->uniqueid, &sd);
     seen_freedata(&sd);
 
+    /* the cached unseen count won't know these ones are seen */
+    if (!r) statuscache_invalidate_user(mailbox->name, userid);
+
  done:
     seen_close(&seendb);
     return r;
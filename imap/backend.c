@@ -939,6 +939,34 @@ int backend_ping(struct backend *s)
     }
 }
 
+int backend_proxyauth(struct backend *s, const char *userid)
+{
+    struct proxyauth_cmd_t *cmd = &s->prot->proxyauth_cmd;
+    char buf[1024];
+
+    if (!cmd->cmd || !CAPA(s, cmd->capa)) return -1;
+    if (s->sock == -1) return -1; /* Disconnected Socket */
+
+    prot_printf(s->out, "%s ", cmd->cmd);
+    prot_printastring(s->out, userid);
+    prot_printf(s->out, "\r\n");
+    prot_flush(s->out);
+
+    for (;;) {
+	if (!prot_fgets(buf, sizeof(buf), s->in)) {
+	    /* connection closed? */
+	    return -1;
+	} else if (cmd->unsol &&
+		   !strncmp(cmd->unsol, buf, strlen(cmd->unsol))) {
+	    /* unsolicited response */
+	    continue;
+	} else {
+	    /* success/fail response */
+	    return strncmp(cmd->ok, buf, strlen(cmd->ok));
+	}
+    }
+}
+
 void backend_disconnect(struct backend *s)
 {
     char buf[1024];
@@ -74,6 +74,7 @@ struct backend {
     struct protstream *clientin; /* input stream from client to proxy */
     struct backend **current, **inbox; /* pointers to current/inbox be ptrs */
     struct prot_waitevent *timeout; /* event for idle timeout */
+    time_t pooled;		/* when put in the connection pool */
 
     sasl_conn_t *saslconn;
 #ifdef HAVE_SSL
@@ -96,6 +97,8 @@ struct backend *backend_connect(struct backend *cache, const char *server,
 				struct protocol_t *prot, const char *userid,
 				sasl_callback_t *cb, const char **auth_status);
 int backend_ping(struct backend *s);
+/* switch the user a connection made as ourselves is acting for */
+int backend_proxyauth(struct backend *s, const char *userid);
 void backend_disconnect(struct backend *s);
 char *backend_get_cap_params(const struct backend *, unsigned long capa);
 
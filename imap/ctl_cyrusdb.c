@@ -104,6 +104,7 @@ struct cyrusdb {
     { FNAME_TLSSESSIONS,	&config_tlscache_db,	NULL,	0 },
     { FNAME_PTSDB,		&config_ptscache_db,	NULL,	0 },
     { FNAME_STATUSCACHEDB,	&config_statuscache_db,	NULL,	0 },
+    { FNAME_REVERSEACLSDB,	&config_reverseacls_db,	NULL,	0 },
     { NULL,			NULL,			NULL,	0 }
 };
 
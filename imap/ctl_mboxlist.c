@@ -1084,6 +1084,7 @@ int main(int argc, char *argv[])
 	annotatemore_open();
 
 	do_dump(op, partition, dopurge);
+	if (op == M_POPULATE) mboxlist_racl_rebuild();
 
 	annotatemore_close();
 	annotatemore_done();
@@ -1106,6 +1107,7 @@ int main(int argc, char *argv[])
 	annotatemore_open();
 
 	do_undump();
+	mboxlist_racl_rebuild();
 
 	annotatemore_close();
 	annotatemore_done();
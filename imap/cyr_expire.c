@@ -56,15 +56,34 @@
 #include <syslog.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_DIRENT_H
+# include <dirent.h>
+#else
+# define dirent direct
+# if HAVE_SYS_NDIR_H
+#  include <sys/ndir.h>
+# endif
+# if HAVE_SYS_DIR_H
+#  include <sys/dir.h>
+# endif
+# if HAVE_NDIR_H
+#  include <ndir.h>
+# endif
+#endif
 
 #include <sasl/sasl.h>
 
 #include "annotate.h"
+#include "bsearch.h"
 #include "cyrusdb.h"
 #include "duplicate.h"
 #include "exitcodes.h"
 #include "global.h"
 #include "hash.h"
+#include "imap_err.h"
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "util.h"
@@ -78,13 +97,31 @@ const int config_need_data = 0;
 static int sigquit = 0;
 static int verbose = 0;
 
+/* the workers, so we can pass a SIGQUIT on to them */
+static pid_t *worker_pids = NULL;
+static int worker_count = 0;
+
+/* checkpoints go in <configdirectory>/expire/<worker>of<workers> */
+#define FNAME_EXPIRE_CHECKPOINT "/expire/"
+#define CHECKPOINT_INTERVAL 30
+
 void usage(void)
 {
     fprintf(stderr,
-	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>] [-p prefix] [-a] [-v]\n");
+	    "cyr_expire [-C <altconfig>] -E <days> [-X <expunge-days>] [-p prefix] [-a] [-v]\n"
+	    "           [-j <workers>] [-r] [-B <bytes/sec>] [-R <records/sec>]\n");
     exit(-1);
 }
 
+/* how much I/O expiry may cause, and how much it has */
+struct expire_budget {
+    unsigned long bytes;		/* unlinked per second, 0 = no limit */
+    unsigned long records;		/* repacked per second, 0 = no limit */
+    struct timeval start;
+    unsigned long long bytes_used;
+    unsigned long long records_used;
+};
+
 struct expire_rock {
     struct hash_table table;
     time_t expire_mark;
@@ -93,7 +130,19 @@ struct expire_rock {
     unsigned long messages_seen;
     unsigned long messages_expired;
     unsigned long messages_expunged;
+    unsigned long long bytes_unlinked;
+    unsigned long long records_repacked;
     int skip_annotate;
+
+    /* we only do the mailboxes whose user hashes to 'worker' */
+    int worker;
+    int nworkers;
+    char *checkpoint;			/* filename */
+    char *resume_after;			/* mailbox we'd got to last time */
+    char *last_done;
+    time_t checkpoint_time;
+    struct expire_budget budget;
+    quota_t expired_bytes;
 };
 
 struct delete_rock {
@@ -160,12 +209,153 @@ static unsigned expire_cb(struct mailbox *mailbox __attribute__((unused)),
     /* otherwise, we're expiring messages by sent date */
     if (record->gmtime < erock->expire_mark) {
 	erock->messages_expired++;
+	erock->expired_bytes += record->size;
 	return 1;
     }
 
     return 0;
 }
 
+/* the order mboxlist_findall() gives us mailboxes in */
+static int expire_mboxcmp(const char *a, const char *b)
+{
+    if (config_getswitch(IMAPOPT_IMPROVED_MBOXLIST_SORT))
+	return bsearch_compare_mbox(a, b);
+    return strcmp(a, b);
+}
+
+/*
+ * Checkpoints are text:
+ *   the last mailbox we finished (may be empty)
+ *   the counters, and whether the worker finished
+ *   "<expire mark> <mailbox>" for each expire annotation we found,
+ *   which duplicate_prune() wants afterwards
+ */
+static void checkpoint_cb(const char *name, void *data, void *rock)
+{
+    fprintf((FILE *) rock, "%ld %s\n", (long) *((time_t *) data), name);
+}
+
+static int checkpoint_write(struct expire_rock *erock, int done)
+{
+    char *tmp = strconcat(erock->checkpoint, ".NEW", (char *)NULL);
+    FILE *f;
+    int r = 0;
+
+    f = fopen(tmp, "w");
+    if (!f) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", tmp);
+	free(tmp);
+	return IMAP_IOERROR;
+    }
+
+    fprintf(f, "%s\n", erock->last_done ? erock->last_done : "");
+    fprintf(f, "%lu %lu %lu %lu %llu %llu %d\n",
+	    erock->mailboxes_seen, erock->messages_seen,
+	    erock->messages_expired, erock->messages_expunged,
+	    erock->bytes_unlinked, erock->records_repacked, done);
+    hash_enumerate(&erock->table, checkpoint_cb, f);
+
+    if (fflush(f) || fsync(fileno(f)) || ferror(f)) r = IMAP_IOERROR;
+    if (fclose(f)) r = IMAP_IOERROR;
+    if (!r && rename(tmp, erock->checkpoint) < 0) r = IMAP_IOERROR;
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", erock->checkpoint);
+	unlink(tmp);
+    }
+    free(tmp);
+
+    erock->checkpoint_time = time(0);
+
+    return r;
+}
+
+/*
+ * Add a checkpoint's counters and expire table to 'erock'.  Returns
+ * 0 and sets *donep and *lastp if there was a checkpoint to read.
+ */
+static int checkpoint_read(const char *fname, struct expire_rock *erock,
+			   int *donep, char **lastp)
+{
+    FILE *f;
+    char buf[MAX_MAILBOX_BUFFER + 32];
+    unsigned long mailboxes, seen, expired, expunged;
+    unsigned long long bytes, records;
+    int done;
+    char *p, *name;
+
+    f = fopen(fname, "r");
+    if (!f) return IMAP_NOTFOUND;
+
+    if (!fgets(buf, sizeof(buf), f)) goto bad;
+    if ((p = strchr(buf, '\n'))) *p = '\0';
+    *lastp = buf[0] ? xstrdup(buf) : NULL;
+
+    if (!fgets(buf, sizeof(buf), f) ||
+	sscanf(buf, "%lu %lu %lu %lu %llu %llu %d", &mailboxes, &seen,
+	       &expired, &expunged, &bytes, &records, &done) != 7) {
+	free(*lastp);
+	*lastp = NULL;
+	goto bad;
+    }
+
+    erock->mailboxes_seen += mailboxes;
+    erock->messages_seen += seen;
+    erock->messages_expired += expired;
+    erock->messages_expunged += expunged;
+    erock->bytes_unlinked += bytes;
+    erock->records_repacked += records;
+    *donep = done;
+
+    while (fgets(buf, sizeof(buf), f)) {
+	time_t mark = strtol(buf, &name, 10);
+	time_t *data, *old;
+
+	if (*name++ != ' ') continue;
+	if ((p = strchr(name, '\n'))) *p = '\0';
+
+	/* resuming, we may have seen this one before */
+	data = xmemdup(&mark, sizeof(mark));
+	old = hash_insert(name, data, &erock->table);
+	if (old != data) free(old);
+    }
+
+    fclose(f);
+    return 0;
+
+ bad:
+    syslog(LOG_ERR, "%s: bad checkpoint, ignoring", fname);
+    fclose(f);
+    return IMAP_IOERROR;
+}
+
+/*
+ * Sleep as long as it takes to bring us back inside our budget.
+ */
+static void expire_throttle(struct expire_budget *budget)
+{
+    struct timeval now;
+    double wanted = 0.0, elapsed;
+
+    if (!budget->bytes && !budget->records)
+	return;
+
+    if (budget->bytes)
+	wanted = (double) budget->bytes_used / budget->bytes;
+    if (budget->records &&
+	(double) budget->records_used / budget->records > wanted)
+	wanted = (double) budget->records_used / budget->records;
+
+    while (!sigquit) {
+	gettimeofday(&now, NULL);
+	elapsed = timesub(&budget->start, &now);
+	if (elapsed >= wanted) break;
+	/* no more than a second at a time, so we notice a SIGQUIT */
+	usleep(wanted - elapsed > 1.0 ? 1000000 :
+	       (useconds_t) ((wanted - elapsed) * 1000000));
+    }
+}
+
 
 /*
  * mboxlist_findall() callback function to:
@@ -183,11 +373,20 @@ static int expire(char *name, int matchlen __attribute__((unused)),
     int r;
     struct mailbox *mailbox = NULL;
     unsigned numexpunged = 0;
+    quota_t numbytes = 0;
+    unsigned long numrepacked = 0;
     int expire_seconds = 0;
 
     if (sigquit) {
 	return 1;
     }
+
+    /* another worker's, or one we did before we were interrupted */
+    if (mboxname_shard(name, erock->nworkers) != erock->worker)
+	return 0;
+    if (erock->resume_after && expire_mboxcmp(name, erock->resume_after) <= 0)
+	return 0;
+
     /* Skip remote mailboxes */
     r = mboxlist_lookup(name, &mbentry, NULL);
     if (r) {
@@ -254,17 +453,39 @@ static int expire(char *name, int matchlen __attribute__((unused)),
 
     erock->messages_seen += mailbox->i.num_records;
 
-    r = mailbox_expunge_cleanup(mailbox, erock->expunge_mark, &numexpunged);
+    r = mailbox_expunge_cleanup(mailbox, erock->expunge_mark, &numexpunged,
+				&numbytes);
 
     erock->messages_expunged += numexpunged;
     erock->mailboxes_seen++;
 
+    /* expired messages are unlinked straight away unless expunges
+     * are delayed, and closing repacks the index if we changed it */
+    if (config_getenum(IMAPOPT_EXPUNGE_MODE) != IMAP_ENUM_EXPUNGE_MODE_DELAYED)
+	numbytes += erock->expired_bytes;
+    erock->expired_bytes = 0;
+    if (mailbox->i.options & OPT_MAILBOX_NEEDS_REPACK)
+	numrepacked = mailbox->i.num_records;
+
     mailbox_close(&mailbox);
 
     if (r) {
 	syslog(LOG_WARNING, "failure expiring %s: %s", name, error_message(r));
     }
 
+    erock->bytes_unlinked += numbytes;
+    erock->records_repacked += numrepacked;
+    erock->budget.bytes_used += numbytes;
+    erock->budget.records_used += numrepacked;
+
+    free(erock->last_done);
+    erock->last_done = xstrdup(name);
+    if (erock->checkpoint &&
+	time(0) - erock->checkpoint_time >= CHECKPOINT_INTERVAL)
+	checkpoint_write(erock, 0);
+
+    expire_throttle(&erock->budget);
+
     /* Even if we had a problem with one mailbox, continue with the others */
     return 0;
 }
@@ -312,10 +533,213 @@ static int delete(char *name,
 }
 static void sighandler (int sig __attribute((unused)))
 {
+    int i;
+
     sigquit = 1;
+
+    for (i = 0; i < worker_count; i++)
+	if (worker_pids[i] > 0) kill(worker_pids[i], SIGQUIT);
+
     return;
 }
 
+static char *checkpoint_fname(int worker, int nworkers)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%dof%d", worker + 1, nworkers);
+    return strconcat(config_dir, FNAME_EXPIRE_CHECKPOINT, buf, (char *)NULL);
+}
+
+/*
+ * Remove the checkpoints left by runs with a different number of
+ * workers, which nothing will ever resume from, or every checkpoint
+ * if 'nworkers' is 0.
+ */
+static void checkpoint_clean(int nworkers)
+{
+    char *dname = strconcat(config_dir, FNAME_EXPIRE_CHECKPOINT, (char *)NULL);
+    struct dirent *dirent;
+    DIR *dirp;
+
+    dirp = opendir(dname);
+    if (!dirp) {
+	free(dname);
+	return;
+    }
+
+    while ((dirent = readdir(dirp))) {
+	int worker, n;
+	char *fname;
+
+	if (sscanf(dirent->d_name, "%dof%d", &worker, &n) != 2) continue;
+	/* including the .NEW files of runs like ours, which another
+	 * worker may be writing right now */
+	if (n == nworkers) continue;
+
+	fname = strconcat(dname, dirent->d_name, (char *)NULL);
+	if (verbose) fprintf(stderr, "removing old checkpoint %s\n", fname);
+	unlink(fname);
+	free(fname);
+    }
+
+    closedir(dirp);
+    free(dname);
+}
+
+static void expire_dbs_open(void)
+{
+    annotatemore_init(NULL, NULL);
+    annotatemore_open();
+
+    mboxlist_init(0);
+    mboxlist_open(NULL);
+
+    /* open the quota db, we'll need it for expunge */
+    quotadb_init(0);
+    quotadb_open(NULL);
+}
+
+static void expire_dbs_close(void)
+{
+    quotadb_close();
+    quotadb_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+}
+
+/*
+ * Expire and expunge this worker's share of the mailboxes, picking
+ * up where its last run left off if 'resume'.  Returns non-zero if
+ * we were interrupted.
+ */
+static int expire_worker(struct expire_rock *erock, const char *find_prefix,
+			 int resume)
+{
+    int done = 0;
+    int r;
+
+    erock->checkpoint = checkpoint_fname(erock->worker, erock->nworkers);
+    if (cyrus_mkdir(erock->checkpoint, 0755) == -1) {
+	free(erock->checkpoint);
+	erock->checkpoint = NULL;
+    }
+    else if (!erock->worker) {
+	/* one worker is enough to tidy up */
+	checkpoint_clean(erock->nworkers);
+    }
+
+    if (erock->checkpoint && resume &&
+	!checkpoint_read(erock->checkpoint, erock, &done,
+			 &erock->resume_after)) {
+	if (done) return 0;
+	if (verbose) {
+	    fprintf(stderr, "worker %d resuming after %s\n", erock->worker + 1,
+		    erock->resume_after ? erock->resume_after : "(start)");
+	}
+    }
+    else if (erock->checkpoint) {
+	/* so nobody takes a previous run's for ours */
+	checkpoint_write(erock, 0);
+    }
+
+    gettimeofday(&erock->budget.start, NULL);
+
+    mboxlist_findall(NULL, find_prefix, 1, 0, 0, expire, erock);
+
+    if (erock->checkpoint) {
+	/* the workers of -j hand their counters back in it; a single
+	 * run can do without, and just resumes from further back */
+	r = checkpoint_write(erock, !sigquit);
+	if (r && erock->nworkers > 1) return r;
+    }
+
+    return sigquit;
+}
+
+/*
+ * Run 'nworkers' copies of expire_worker() side by side.  Returns
+ * non-zero if any of them didn't finish.
+ */
+static int expire_workers(struct expire_rock *erock, const char *find_prefix,
+			  int resume, const char *alt_config)
+{
+    int incomplete = 0;
+    int i, status;
+    pid_t pid;
+
+    worker_pids = xzmalloc(erock->nworkers * sizeof(pid_t));
+
+    for (i = 0; i < erock->nworkers && !sigquit; i++) {
+	pid = fork();
+	if (pid < 0) {
+	    fprintf(stderr, "cyr_expire: can't fork worker %d: %s\n",
+		    i + 1, strerror(errno));
+	    incomplete = 1;
+	    break;
+	}
+	if (!pid) {
+	    int r;
+
+	    worker_count = 0;
+	    erock->worker = i;
+
+	    cyrus_init(alt_config, "cyr_expire", 0);
+	    global_sasl_init(1, 0, NULL);
+	    expire_dbs_open();
+
+	    r = expire_worker(erock, find_prefix, resume);
+
+	    expire_dbs_close();
+	    sasl_done();
+	    cyrus_done();
+	    exit(r ? EC_TEMPFAIL : 0);
+	}
+	worker_pids[i] = pid;
+	worker_count = i + 1;
+    }
+    if (i < erock->nworkers) incomplete = 1;
+
+    for (i = 0; i < worker_count; i++) {
+	while (waitpid(worker_pids[i], &status, 0) < 0) {
+	    if (errno != EINTR) break;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) incomplete = 1;
+	worker_pids[i] = 0;
+    }
+
+    free(worker_pids);
+    worker_pids = NULL;
+    worker_count = 0;
+
+    return incomplete;
+}
+
+/*
+ * Gather up what the workers found out from their checkpoints.
+ * Returns non-zero if any of them didn't finish.
+ */
+static int expire_gather(struct expire_rock *erock)
+{
+    int incomplete = 0;
+    int i;
+
+    for (i = 0; i < erock->nworkers; i++) {
+	char *fname = checkpoint_fname(i, erock->nworkers);
+	char *last = NULL;
+	int done = 0;
+
+	if (checkpoint_read(fname, erock, &done, &last) || !done)
+	    incomplete = 1;
+	free(last);
+	free(fname);
+    }
+
+    return incomplete;
+}
+
 int main(int argc, char *argv[])
 {
     extern char *optarg;
@@ -324,11 +748,15 @@ int main(int argc, char *argv[])
     int expunge_seconds = -1;
     int delete_seconds = -1;
     int expire_seconds = 0;
+    int nworkers = 1;
+    int resume = 0;
+    int incomplete = 0;
     char *alt_config = NULL;
     const char *find_prefix = "*";
     struct expire_rock erock;
     struct delete_rock drock;
     struct sigaction action;
+    int i;
 
     if ((geteuid()) == 0 && (become_cyrus() != 0)) {
 	fatal("must run as the Cyrus user", EC_USAGE);
@@ -340,7 +768,7 @@ int main(int argc, char *argv[])
     memset(&drock, 0, sizeof(drock));
     strarray_init(&drock.to_delete);
 
-    while ((opt = getopt(argc, argv, "C:D:E:X:p:vax")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:D:E:X:p:vaxj:rB:R:")) != EOF) {
 	switch (opt) {
 	case 'C': /* alt config file */
 	    alt_config = optarg;
@@ -378,6 +806,23 @@ int main(int argc, char *argv[])
 	    erock.skip_annotate = 1;
 	    break;
 
+	case 'j':
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1) usage();
+	    break;
+
+	case 'r':
+	    resume = 1;
+	    break;
+
+	case 'B':
+	    erock.budget.bytes = strtoul(optarg, NULL, 10);
+	    break;
+
+	case 'R':
+	    erock.budget.records = strtoul(optarg, NULL, 10);
+	    break;
+
 	default:
 	    usage();
 	    break;
@@ -386,6 +831,17 @@ int main(int argc, char *argv[])
 
     if (!expire_seconds) usage();
 
+    /* the budget is for the whole run, so each worker gets a share */
+    erock.nworkers = nworkers;
+    if (erock.budget.bytes) {
+	erock.budget.bytes /= nworkers;
+	if (!erock.budget.bytes) erock.budget.bytes = 1;
+    }
+    if (erock.budget.records) {
+	erock.budget.records /= nworkers;
+	if (!erock.budget.records) erock.budget.records = 1;
+    }
+
     sigemptyset(&action.sa_mask);
     action.sa_flags = 0;
     action.sa_handler = sighandler;
@@ -393,25 +849,6 @@ int main(int argc, char *argv[])
         fatal("unable to install signal handler for %d: %m", SIGQUIT);
     }
 
-    cyrus_init(alt_config, "cyr_expire", 0);
-    global_sasl_init(1, 0, NULL);
-
-    annotatemore_init(NULL, NULL);
-    annotatemore_open();
-
-    mboxlist_init(0);
-    mboxlist_open(NULL);
-
-    /* open the quota db, we'll need it for expunge */
-    quotadb_init(0);
-    quotadb_open(NULL);
-
-    if (duplicate_init(NULL) != 0) {
-	fprintf(stderr, 
-		"cyr_expire: unable to init duplicate delivery database\n");
-	exit(1);
-    }
-
     if (do_expunge) {
 	/* xxx better way to determine a size for this table? */
 
@@ -431,7 +868,28 @@ int main(int argc, char *argv[])
 	    }
 	}
 
-	mboxlist_findall(NULL, find_prefix, 1, 0, 0, expire, &erock);
+	/* the workers each open their own databases, so fork them
+	 * before we open ours */
+	if (nworkers > 1)
+	    incomplete = expire_workers(&erock, find_prefix, resume, alt_config);
+    }
+
+    cyrus_init(alt_config, "cyr_expire", 0);
+    global_sasl_init(1, 0, NULL);
+
+    expire_dbs_open();
+
+    if (duplicate_init(NULL) != 0) {
+	fprintf(stderr, 
+		"cyr_expire: unable to init duplicate delivery database\n");
+	exit(1);
+    }
+
+    if (do_expunge) {
+	if (nworkers == 1)
+	    incomplete = expire_worker(&erock, find_prefix, resume);
+	else if (expire_gather(&erock))
+	    incomplete = 1;
 
 	syslog(LOG_NOTICE, "Expired %lu and expunged %lu out of %lu "
 			    "messages from %lu mailboxes",
@@ -439,6 +897,12 @@ int main(int argc, char *argv[])
 			   erock.messages_expunged,
 			   erock.messages_seen,
 			   erock.mailboxes_seen);
+	syslog(LOG_NOTICE, "Unlinked %llu bytes and repacked %llu records "
+			    "with %d workers%s",
+			   erock.bytes_unlinked,
+			   erock.records_repacked,
+			   nworkers,
+			   incomplete ? ", incomplete" : "");
 	if (verbose) {
 	    fprintf(stderr, "\nExpired %lu and expunged %lu out of %lu "
 			    "messages from %lu mailboxes\n",
@@ -448,14 +912,19 @@ int main(int argc, char *argv[])
 			   erock.mailboxes_seen);
 	}
     }
-    if (sigquit) {
+    if (sigquit || incomplete) {
+	/* duplicate_prune() needs all the expire annotations, so leave
+	 * it, and the checkpoints, to a run with -r */
+	if (verbose) {
+	    fprintf(stderr, "Interrupted, use -r to resume\n");
+	}
+	r = EC_TEMPFAIL;
 	goto finish;
     }
 
     if ((delete_seconds >= 0) && mboxlist_delayed_delete_isenabled() &&
 	config_getstring(IMAPOPT_DELETEDPREFIX)) {
 	int count = 0;
-	int i;
 
 	if (verbose) {
 	    fprintf(stderr,
@@ -496,16 +965,17 @@ int main(int argc, char *argv[])
     /* purge deliver.db entries of expired messages */
     r = duplicate_prune(expire_seconds, &erock.table);
 
+    /* the run is complete, so nothing to resume */
+    if (do_expunge) checkpoint_clean(0);
+
 finish:
     free_hash_table(&erock.table, free);
     strarray_fini(&drock.to_delete);
+    free(erock.checkpoint);
+    free(erock.resume_after);
+    free(erock.last_done);
 
-    quotadb_close();
-    quotadb_done();
-    mboxlist_close();
-    mboxlist_done();
-    annotatemore_close();
-    annotatemore_done();
+    expire_dbs_close();
     duplicate_done();
     sasl_done();
     cyrus_done();
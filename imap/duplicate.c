@@ -91,6 +91,7 @@ static int duplicate_dbopen = 0;
 int duplicate_init(const char *fname)
 {
     int r = 0;
+    int dbflags;
     char *tofree = NULL;
 
     if (!fname)
@@ -102,7 +103,11 @@ int duplicate_init(const char *fname)
 	fname = tofree;
     }
 
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
+    dbflags = CYRUSDB_CREATE;
+    if (config_getswitch(IMAPOPT_DUPLICATE_DB_GROUPCOMMIT))
+	dbflags |= CYRUSDB_GROUPCOMMIT;
+
+    r = cyrusdb_open(DB, fname, dbflags, &dupdb);
     if (r != 0) {
 	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
 	       cyrusdb_strerror(r));
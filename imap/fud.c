@@ -377,7 +377,7 @@ int handle_request(const char *who, const char *name,
 
     if (mbentry->mbtype & MBTYPE_REMOTE) {
 	/* Check the ACL */
-	if(cyrus_acl_myrights(mystate, mbentry->acl) & ACL_USER0) {
+	if(mboxlist_entry_myrights(mbentry, mystate) & ACL_USER0) {
 	    /* We want to proxy this one */
 	    auth_freestate(mystate);
 	    r = do_proxy_request(who, name, mbentry->server, sfrom, sfromsiz);
@@ -105,6 +105,7 @@ const char *config_duplicate_db;
 const char *config_tlscache_db;
 const char *config_ptscache_db;
 const char *config_statuscache_db;
+const char *config_reverseacls_db;
 const char *config_userdeny_db;
 int charset_flags;
 
@@ -226,6 +227,7 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 	config_tlscache_db = config_getstring(IMAPOPT_TLSCACHE_DB);
 	config_ptscache_db = config_getstring(IMAPOPT_PTSCACHE_DB);
 	config_statuscache_db = config_getstring(IMAPOPT_STATUSCACHE_DB);
+	config_reverseacls_db = config_getstring(IMAPOPT_REVERSEACLS_DB);
 	config_userdeny_db = config_getstring(IMAPOPT_USERDENY_DB);
 
 	/* configure libcyrus as needed */
@@ -274,6 +276,8 @@ int cyrus_init(const char *alt_config, const char *ident, unsigned flags)
 				  config_getswitch(IMAPOPT_SQL_USESSL));
 	libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
 				  config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+	libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS,
+				  config_getswitch(IMAPOPT_TWOSKIP_LOCKFREE_READS));
 
 	/* Not until all configuration parameters are set! */
 	libcyrus_init();
@@ -559,7 +563,7 @@ static int acl_ok(const char *user, struct auth_state *authstate)
 	r = 0;  /* Failed so assume no proxy access */
     }
     else {
-	r = (cyrus_acl_myrights(authstate, mbentry->acl) & ACL_ADMIN) != 0;
+	r = (mboxlist_entry_myrights(mbentry, authstate) & ACL_ADMIN) != 0;
     }
     mboxlist_entry_free(&mbentry);
     return r;
@@ -179,6 +179,7 @@ extern const char *config_duplicate_db;
 extern const char *config_tlscache_db;
 extern const char *config_ptscache_db;
 extern const char *config_statuscache_db;
+extern const char *config_reverseacls_db;
 extern const char *config_userdeny_db;
 extern int charset_flags;
 
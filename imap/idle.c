@@ -55,10 +55,14 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 
 #include "idle.h"
 #include "idled.h"
 #include "global.h"
+#include "util.h"
+#include "xstrlcpy.h"
+#include "xstrlcat.h"
 
 const char *idle_method_desc = "no";
 
@@ -74,39 +78,66 @@ static int notify_sock = -1;
 static struct sockaddr_un idle_remote;
 static int idle_remote_len = 0;
 
+/* our subscription connection to idled */
+static int bus_sock = -1;
+static struct buf bus_in = BUF_INITIALIZER;
+
+/* mailbox state from the last notification */
+static int last_havestate = 0;
+static modseq_t last_highestmodseq = 0;
+static unsigned long last_exists = 0;
+
+static void idle_fill_msg(idle_data_t *idledata, int msg, const char *mboxname)
+{
+    idledata->msg = msg;
+    idledata->pid = getpid();
+    idledata->highestmodseq = 0;
+    idledata->exists = 0;
+    strncpy(idledata->mboxname, mboxname ? mboxname : ".",
+	    sizeof(idledata->mboxname));
+    idledata->mboxname[sizeof(idledata->mboxname)-1] = '\0';
+}
 
 /*
  * Send a message to idled
  */
-static int idle_send_msg(int msg, const char *mboxname)
+static int idle_send(idle_data_t *idledata)
 {
-    idle_data_t idledata;
-
-    /* fill the structure */
-    idledata.msg = msg;
-    idledata.pid = getpid();
-    strncpy(idledata.mboxname, mboxname ? mboxname : ".", sizeof(idledata.mboxname));
-
     /* send */
-    if (sendto(notify_sock, (void *) &idledata,
-	       IDLEDATA_BASE_SIZE+strlen(idledata.mboxname)+1, /* 1 for NULL */
+    if (sendto(notify_sock, (void *) idledata,
+	       IDLEDATA_BASE_SIZE+strlen(idledata->mboxname)+1, /* 1 for NULL */
 	       0, (struct sockaddr *) &idle_remote, idle_remote_len) == -1) {
-      syslog(LOG_ERR, "error sending to idled: %x", msg);
+      syslog(LOG_ERR, "error sending to idled: %lx", idledata->msg);
       return 0;
     }
 
     return 1;
 }
 
+static int idle_send_msg(int msg, const char *mboxname)
+{
+    idle_data_t idledata;
+
+    idle_fill_msg(&idledata, msg, mboxname);
+
+    return idle_send(&idledata);
+}
+
 /*
  * Notify idled of a mailbox change
  */
-void idle_notify(const char *mboxname)
+static void idle_notify(struct mailbox *mailbox)
 {
+    idle_data_t idledata;
+
     /* We should try to determine if we need to send this
      * (ie, is an imapd is IDLE on 'mailbox'?).
      */
-    idle_send_msg(IDLE_NOTIFY, mboxname);
+    idle_fill_msg(&idledata, IDLE_NOTIFY, mailbox->name);
+    idledata.highestmodseq = mailbox->i.highestmodseq;
+    idledata.exists = mailbox->i.exists;
+
+    idle_send(&idledata);
 }
 
 /*
@@ -187,12 +218,6 @@ static void idle_handler(int sig)
     if (!idle_started) return;
 
     switch (sig) {
-    case SIGUSR1:
-	idle_update(IDLE_MAILBOX);
-	break;
-    case SIGUSR2:
-	idle_update(IDLE_ALERT);
-	break;
     case SIGALRM:
 	idle_update(IDLE_MAILBOX|IDLE_ALERT);
 	alarm(idle_period);
@@ -208,18 +233,14 @@ int idle_init(idle_updateproc_t *proc)
 
     /* We don't want recursive calls to idle_update() */
     sigemptyset(&action.sa_mask);
-    sigaddset(&action.sa_mask, SIGUSR1);
-    sigaddset(&action.sa_mask, SIGUSR2);
     action.sa_flags = 0;
 #ifdef SA_RESTART
     action.sa_flags |= SA_RESTART;
 #endif
     action.sa_handler = idle_handler;
 
-    /* Setup the signal handlers */
-    if ((sigaction(SIGUSR1, &action, NULL) < 0) ||
-	(sigaction(SIGUSR2, &action, NULL) < 0) ||
-	(sigaction(SIGALRM, &action, NULL) < 0)) {
+    /* Setup the signal handler for polling */
+    if (sigaction(SIGALRM, &action, NULL) < 0) {
 	syslog(LOG_ERR, "sigaction: %m");
 
 	/* Cancel receiving signals */
@@ -230,12 +251,251 @@ int idle_init(idle_updateproc_t *proc)
     return 1;
 }
 
+static void bus_close(void)
+{
+    if (bus_sock != -1) close(bus_sock);
+    bus_sock = -1;
+    buf_reset(&bus_in);
+}
+
+/*
+ * Connect to idled's subscription socket, if we aren't already
+ */
+static int bus_connect(void)
+{
+    struct sockaddr_un remote;
+    const char *bus_name;
+    int s, len, fdflags;
+
+    if (bus_sock != -1) return 1;
+    if (notify_sock == -1) return 0;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return 0;
+
+    remote.sun_family = AF_UNIX;
+    bus_name = config_getstring(IMAPOPT_IDLEBUSSOCKET);
+    if (bus_name) {
+	strlcpy(remote.sun_path, bus_name, sizeof(remote.sun_path));
+    }
+    else {
+	strlcpy(remote.sun_path, config_dir, sizeof(remote.sun_path));
+	strlcat(remote.sun_path, FNAME_IDLE_BUS_SOCK, sizeof(remote.sun_path));
+    }
+    len = sizeof(remote.sun_family) + strlen(remote.sun_path) + 1;
+
+    if (connect(s, (struct sockaddr *) &remote, len) == -1) {
+	syslog(LOG_ERR, "connecting to idled at %s: %m", remote.sun_path);
+	close(s);
+	return 0;
+    }
+
+    /* put us in non-blocking mode */
+    fdflags = fcntl(s, F_GETFL, 0);
+    if (fdflags != -1) fdflags = fcntl(s, F_SETFL, O_NONBLOCK | fdflags);
+    if (fdflags == -1) { close(s); return 0; }
+
+    bus_sock = s;
+
+    return 1;
+}
+
+/*
+ * Send a subscription change to idled
+ */
+static int bus_send_msg(int msg, const char *mboxname)
+{
+    idle_data_t idledata;
+    int len;
+
+    if (!bus_connect()) return 0;
+
+    idle_fill_msg(&idledata, msg, mboxname);
+    len = IDLEDATA_BASE_SIZE + strlen(idledata.mboxname) + 1;
+
+    /* a short write would leave idled out of step with us, so just
+       give up on the connection and poll instead */
+    if (write(bus_sock, (void *) &idledata, len) != len) {
+	syslog(LOG_ERR, "error sending to idled: %x", msg);
+	bus_close();
+	return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Hand the client on 'fd' over to idled, along with the 'session'
+ * it needs to give the client back to an imapd
+ */
+int idle_park(int fd, const char *mboxname, const struct buf *session)
+{
+    idle_data_t idledata;
+    struct buf msg = BUF_INITIALIZER;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int fdflags, n;
+    unsigned sent = 0;
+
+    /* idled has to be able to hand the session on in one piece */
+    if (session->len >= IDLE_MAXSESSION) return 0;
+
+    if (!bus_connect() || !idle_peer_trusted(bus_sock)) return 0;
+
+    idle_fill_msg(&idledata, IDLE_PARK, mboxname);
+    buf_appendmap(&msg, (const char *) &idledata,
+		  IDLEDATA_BASE_SIZE + strlen(idledata.mboxname) + 1);
+    buf_append(&msg, session);
+    buf_putc(&msg, '\0');
+
+    /* the message has to go whole, so wait for room */
+    fdflags = fcntl(bus_sock, F_GETFL, 0);
+    if (fdflags == -1 ||
+	fcntl(bus_sock, F_SETFL, fdflags & ~O_NONBLOCK) == -1) {
+	buf_free(&msg);
+	return 0;
+    }
+
+    /* the client's socket rides along with the first part */
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg.s;
+    iov.iov_len = msg.len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+	n = sendmsg(bus_sock, &mh, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0) {
+	for (sent = n; sent < msg.len; sent += n) {
+	    n = write(bus_sock, msg.s + sent, msg.len - sent);
+	    if (n == -1 && errno == EINTR) n = 0;
+	    else if (n <= 0) break;
+	}
+    }
+
+    buf_free(&msg);
+
+    if (n <= 0) {
+	syslog(LOG_ERR, "error parking session with idled: %m");
+	bus_close();
+	return 0;
+    }
+
+    fcntl(bus_sock, F_SETFL, fdflags);
+
+    return 1;
+}
+
+/*
+ * Is the process on the other end of the unix socket 'fd' one of
+ * ours?  Sessions are only handed between Cyrus processes.
+ */
+int idle_peer_trusted(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+	return 0;
+
+    return cred.uid == geteuid();
+#else
+    (void) fd;
+    return 0;
+#endif
+}
+
+int idle_get_sock(void)
+{
+    return idle_started ? bus_sock : -1;
+}
+
+void idle_receive(void)
+{
+    char buf[4096];
+    const char *p, *end, *nul;
+    idle_flags_t flags = 0;
+    int n;
+
+    if (bus_sock == -1) return;
+
+    for (;;) {
+	n = read(bus_sock, buf, sizeof(buf));
+	if (n > 0) {
+	    buf_appendmap(&bus_in, buf, n);
+	    continue;
+	}
+	if (n == -1 && errno == EINTR) continue;
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+	/* idled went away: check everything, and poll from now on */
+	syslog(LOG_WARNING, "lost connection to idled, polling instead");
+	bus_close();
+	last_havestate = 0;
+	flags |= IDLE_MAILBOX|IDLE_ALERT;
+	if (idle_started) alarm(idle_period);
+	break;
+    }
+
+    p = bus_in.s;
+    end = bus_in.s + bus_in.len;
+    while (end - p > IDLEDATA_BASE_SIZE &&
+	   (nul = memchr(p + IDLEDATA_BASE_SIZE, '\0',
+			 end - p - IDLEDATA_BASE_SIZE))) {
+	idle_data_t idledata;
+
+	/* messages are packed back to back, so copy out the header */
+	memcpy(&idledata, p, IDLEDATA_BASE_SIZE);
+
+	switch (idledata.msg) {
+	case IDLE_NOTIFY:
+	    last_havestate = 1;
+	    last_highestmodseq = idledata.highestmodseq;
+	    last_exists = idledata.exists;
+	    flags |= IDLE_MAILBOX;
+	    break;
+	case IDLE_CHECKALERT:
+	    flags |= IDLE_ALERT;
+	    break;
+	}
+	p = nul + 1;
+    }
+    if (bus_in.len) {
+	memmove(bus_in.s, p, end - p);
+	buf_truncate(&bus_in, end - p);
+    }
+
+    if (flags && idle_started && idle_update) idle_update(flags);
+}
+
+int idle_last_state(modseq_t *highestmodseq, unsigned long *exists)
+{
+    if (!last_havestate) return 0;
+
+    *highestmodseq = last_highestmodseq;
+    *exists = last_exists;
+
+    return 1;
+}
+
 void idle_start(const char *mboxname)
 {
     idle_started = 1;
+    last_havestate = 0;
 
     /* Tell idled that we're idling */
-    if (notify_sock == -1 || !idle_send_msg(IDLE_INIT, mboxname)) {
+    if (!bus_send_msg(IDLE_INIT, mboxname)) {
 	/* otherwise, we'll poll with SIGALRM */
 	alarm(idle_period);
     }
@@ -243,17 +503,17 @@ void idle_start(const char *mboxname)
 
 void idle_done(const char *mboxname)
 {
-    /* Tell idled that we're done idling */
-    if (notify_sock != -1) idle_send_msg(IDLE_DONE, mboxname);
+    /* Tell idled that we're done idling.  The connection stays open
+       for the next IDLE command. */
+    if (bus_sock != -1) bus_send_msg(IDLE_DONE, mboxname);
 
     /* Cancel alarm */
     alarm(0);
 
-    /* Remove the signal handlers */
-    signal(SIGUSR1, SIG_IGN);
-    signal(SIGUSR2, SIG_IGN);
+    /* Remove the signal handler */
     signal(SIGALRM, SIG_IGN);
 
     idle_update = NULL;
     idle_started = 0;
+    last_havestate = 0;
 }
@@ -45,6 +45,7 @@
 #define IDLE_H
 
 #include "mailbox.h"
+#include "util.h"
 
 extern const char *idle_method_desc;
 
@@ -68,6 +69,26 @@ int idle_init(idle_updateproc_t *proc);
 /* Start IDLEing on 'mailbox'. */
 void idle_start(const char *mboxname);
 
+/* Descriptor to wait on for notifications from idled while IDLE,
+ * or -1 if we're polling for updates with SIGALRM instead. */
+int idle_get_sock(void);
+
+/* Read the notifications waiting on idle_get_sock(), and report them
+ * to the client through the update proc. */
+void idle_receive(void);
+
+/* Mailbox state carried by the last notification from idled.
+ * Returns 0 if there was none. */
+int idle_last_state(modseq_t *highestmodseq, unsigned long *exists);
+
+/* Hand the client on 'fd' to idled to wait on, with the 'session' it
+ * passes to the imapd which picks the client up again.
+ * Returns 0 if idled couldn't take it. */
+int idle_park(int fd, const char *mboxname, const struct buf *session);
+
+/* Is the peer on the unix socket 'fd' running as the Cyrus user? */
+int idle_peer_trusted(int fd);
+
 /* Cleanup when IDLE is completed. */
 void idle_done(const char *mboxname);
 
@@ -52,20 +52,32 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include "idled.h"
+#include "idle.h"
 #include "global.h"
+#include "dlist.h"
 #include "mboxlist.h"
+#include "retry.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
 #include "hash.h"
+#include "strarray.h"
+#include "util.h"
 #include "exitcodes.h"
 
 /* global state */
@@ -76,18 +88,69 @@ extern char *optarg;
 
 static int verbose = 0;
 static int debugmode = 0;
-static time_t idle_timeout;
 static int sigquit = 0;
+static int coalesce;		/* msecs to hold back notifications */
 
-struct ientry {
-    pid_t pid;
-    time_t itime;
-    struct ientry *next;
+/* drop a subscriber which lets this much go unread */
+#define IDLE_MAXQUEUE (1024*1024)
+
+/* client sockets an imapd may have in flight to us */
+#define IDLE_MAXPASSED 16
+
+/*
+ * An imapd connected to the bus, or a client one of them has parked
+ * with us.  Parked clients are never read or written by us beyond a
+ * BYE: when they speak, or their mailbox changes, they go back to an
+ * imapd along with their session.
+ */
+struct iconn {
+    int fd;
+    int dead;			/* closed at the end of this loop */
+    int wantwrite;		/* waiting for the socket to drain */
+    struct buf in;		/* partial message */
+    struct buf out;		/* notifications not yet written */
+    strarray_t mboxes;		/* mailboxes subscribed to */
+    int trusted;		/* peer is a Cyrus process */
+    int passed[IDLE_MAXPASSED];	/* client sockets yet to be parked */
+    int npassed;
+
+    /* parked clients only */
+    char *session;		/* to hand back to imapd */
+    time_t deadline;		/* autologout */
+    modseq_t modseq;		/* what the client has seen of its mailbox */
+    int resumewait;		/* imapd service busy, try again */
+
+    struct iconn *next;
+};
+
+/* a subscription to a mailbox */
+struct isub {
+    struct iconn *conn;
+    struct isub *next;
 };
+
+/* a mailbox somebody is IDLE on */
+struct imbox {
+    char *name;
+    struct isub *subs;
+
+    /* latest state, held back for the coalescing window */
+    int pending;
+    struct timeval due;
+    modseq_t highestmodseq;
+    unsigned long exists;
+    struct imbox *next_pending;
+};
+
 static struct hash_table itable;
-static struct ientry *ifreelist;
-static int itable_inc = 100;
-void idle_done(char *mboxname, pid_t pid);
+static struct iconn *conns = NULL;
+static struct imbox *pending_head = NULL, *pending_tail = NULL;
+
+static int notify_sock = -1;
+static int bus_sock = -1;
+static struct sockaddr_un resume_addr;
+static int resume_addrlen;
+static unsigned nparked = 0;
 
 void fatal(const char *msg, int err)
 {
@@ -112,115 +175,609 @@ static int mbox_count_cb(void *rockp,
     return 0;
 }
 
-/* return a new 'ientry', either from the freelist or by malloc'ing it */
-static struct ientry *get_ientry(void)
+/*
+ * Event handling.  epoll where we have it, so that waiting costs the
+ * same with 100 or 100000 subscribers; poll() otherwise.
+ */
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+
+static void ev_init(void)
+{
+    epoll_fd = epoll_create(1024);
+    if (epoll_fd == -1) fatal("epoll_create failed", EC_OSERR);
+}
+
+static void ev_set(int fd, void *data, int wantread, int wantwrite, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (wantread ? EPOLLIN : 0) | (wantwrite ? EPOLLOUT : 0);
+    ev.data.ptr = data;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+	syslog(LOG_ERR, "epoll_ctl(%d): %m", fd);
+}
+
+#define ev_add(fd, data)	ev_set((fd), (data), 1, 0, EPOLL_CTL_ADD)
+#define ev_mod(fd, data, r, w)	ev_set((fd), (data), (r), (w), EPOLL_CTL_MOD)
+#define ev_del(fd)		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, (fd), NULL)
+#else
+static void ev_init(void) { }
+#define ev_add(fd, data)
+#define ev_mod(fd, data, r, w)
+#define ev_del(fd)
+#endif
+
+/* milliseconds from now until 'tv', never negative */
+static int ms_until(const struct timeval *tv)
+{
+    struct timeval now;
+    long ms;
+
+    gettimeofday(&now, NULL);
+    ms = (tv->tv_sec - now.tv_sec) * 1000 +
+	(tv->tv_usec - now.tv_usec) / 1000;
+
+    return ms < 0 ? 0 : (int) ms;
+}
+
+/*
+ * Subscribers
+ */
+static struct iconn *conn_new(int fd)
+{
+    struct iconn *c = xzmalloc(sizeof(struct iconn));
+
+    c->fd = fd;
+    c->next = conns;
+    conns = c;
+    ev_add(fd, c);
+
+    return c;
+}
+
+/* write out as much of the queue as the socket will take */
+static void conn_flush(struct iconn *c)
+{
+    int n;
+
+    while (!c->dead && c->out.len) {
+	n = write(c->fd, c->out.s, c->out.len);
+	if (n > 0) {
+	    memmove(c->out.s, c->out.s + n, c->out.len - n);
+	    buf_truncate(&c->out, c->out.len - n);
+	}
+	else if (n == -1 && errno == EINTR) {
+	    continue;
+	}
+	else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    break;
+	}
+	else {
+	    c->dead = 1;
+	}
+    }
+
+    if (c->out.len > IDLE_MAXQUEUE) {
+	syslog(LOG_WARNING, "dropping IDLE subscriber on fd %d: "
+	       "%u bytes of notifications unread", c->fd, c->out.len);
+	c->dead = 1;
+    }
+
+    if (!c->dead && c->wantwrite != (c->out.len != 0)) {
+	c->wantwrite = (c->out.len != 0);
+	ev_mod(c->fd, c, !c->resumewait, c->wantwrite);
+    }
+}
+
+static void resume(struct iconn *c);
+
+static void conn_send(struct iconn *c, unsigned long msg,
+		      const char *mboxname,
+		      modseq_t highestmodseq, unsigned long exists)
+{
+    idle_data_t idledata;
+
+    if (c->dead) return;
+
+    /* the imapd we hand a parked client to does its own checking,
+       but only wake it for something it hasn't seen */
+    if (c->session) {
+	if (msg != IDLE_NOTIFY || !highestmodseq || highestmodseq > c->modseq)
+	    resume(c);
+	return;
+    }
+
+    memset(&idledata, 0, IDLEDATA_BASE_SIZE);
+    idledata.msg = msg;
+    idledata.pid = getpid();
+    idledata.highestmodseq = highestmodseq;
+    idledata.exists = exists;
+    strlcpy(idledata.mboxname, mboxname, sizeof(idledata.mboxname));
+
+    buf_appendmap(&c->out, (const char *) &idledata,
+		  IDLEDATA_BASE_SIZE + strlen(idledata.mboxname) + 1);
+    conn_flush(c);
+}
+
+static void subscribe(struct iconn *c, const char *mboxname)
+{
+    struct imbox *mb;
+    struct isub *sub;
+
+    if (strarray_find(&c->mboxes, mboxname, 0) >= 0) return;
+
+    mb = (struct imbox *) hash_lookup(mboxname, &itable);
+    if (!mb) {
+	mb = xzmalloc(sizeof(struct imbox));
+	mb->name = xstrdup(mboxname);
+	hash_insert(mboxname, mb, &itable);
+    }
+
+    sub = xmalloc(sizeof(struct isub));
+    sub->conn = c;
+    sub->next = mb->subs;
+    mb->subs = sub;
+
+    strarray_append(&c->mboxes, mboxname);
+}
+
+static void imbox_free_unused(struct imbox *mb)
+{
+    if (mb->subs || mb->pending) return;
+
+    hash_del(mb->name, &itable);
+    free(mb->name);
+    free(mb);
+}
+
+static void unsubscribe(struct iconn *c, const char *mboxname)
+{
+    struct imbox *mb;
+    struct isub **prevp, *sub;
+
+    mb = (struct imbox *) hash_lookup(mboxname, &itable);
+    if (!mb) return;
+
+    for (prevp = &mb->subs; (sub = *prevp); prevp = &sub->next) {
+	if (sub->conn == c) {
+	    *prevp = sub->next;
+	    free(sub);
+	    break;
+	}
+    }
+    strarray_remove_all(&c->mboxes, mboxname);
+
+    imbox_free_unused(mb);
+}
+
+static void conn_free(struct iconn *c)
 {
-    struct ientry *t;
+    while (c->mboxes.count)
+	unsubscribe(c, c->mboxes.data[c->mboxes.count-1]);
+    strarray_fini(&c->mboxes);
+
+    while (c->npassed)
+	close(c->passed[--c->npassed]);
+
+    if (c->session) {
+	free(c->session);
+	nparked--;
+    }
+
+    ev_del(c->fd);
+    close(c->fd);
+    buf_free(&c->in);
+    buf_free(&c->out);
+    free(c);
+}
 
-    if (!ifreelist) {
-	/* create child_table_inc more and add them to the freelist */
-	struct ientry *n;
-	int i;
+/* close the connections which failed during this round of events */
+static void reap_conns(void)
+{
+    struct iconn **prevp = &conns, *c;
 
-	n = xmalloc(itable_inc * sizeof(struct ientry));
-	ifreelist = n;
-	for (i = 0; i < itable_inc - 1; i++) {
-	    n[i].next = n + (i + 1);
+    while ((c = *prevp)) {
+	if (c->dead) {
+	    *prevp = c->next;
+	    conn_free(c);
 	}
-	/* i == child_table_inc - 1, last item in block */
-	n[i].next = NULL;
+	else prevp = &c->next;
     }
+}
+
+/*
+ * Parked clients
+ */
 
-    t = ifreelist;
-    ifreelist = ifreelist->next;
+/* a last word to a parked client we're giving up on */
+static void parked_bye(struct iconn *c, const char *msg)
+{
+    char buf[1024];
+    int n;
 
-    return t;
+    n = snprintf(buf, sizeof(buf), "* BYE %s\r\n", msg);
+    if (n > 0 && n < (int) sizeof(buf))
+	(void) send(c->fd, buf, n, MSG_DONTWAIT);
+    c->dead = 1;
 }
 
-/* remove pid from list of those idling on mboxname */
-void idle_done(char *mboxname, pid_t pid)
+/* take over the client imapd 'c' just passed us */
+static void park(struct iconn *c, const char *mboxname, const char *session)
 {
-    struct ientry *t, *p = NULL;
+    struct iconn *pc;
+    struct dlist *dl = NULL;
+    const char *tag = NULL;
+    bit64 deadline = 0, modseq = 0;
+    int fd, i;
+
+    if (!c->npassed) {
+	syslog(LOG_ERR, "IDLE_PARK without a client socket");
+	c->dead = 1;
+	return;
+    }
+    fd = c->passed[0];
+    for (i = 1; i < c->npassed; i++) c->passed[i-1] = c->passed[i];
+    c->npassed--;
+
+    /* the session says who the client is logged in as */
+    if (!c->trusted) {
+	syslog(LOG_ERR, "IDLE_PARK from an untrusted peer");
+	close(fd);
+	return;
+    }
 
-    t = (struct ientry *) hash_lookup(mboxname, &itable);
-    while (t && t->pid != pid) {
-	p = t;
-	t = t->next;
+    dlist_parsemap(&dl, 1, session, strlen(session));
+    if (!dl || !dlist_getnum64(dl, "DEADLINE", &deadline)) {
+	syslog(LOG_ERR, "IDLE_PARK with an invalid session");
+	dlist_free(&dl);
+	close(fd);
+	return;
     }
-    if (t) {
-	if (!p) {
-	    /* first pid in the linked list */
+    dlist_getatom(dl, "IDLETAG", &tag);
+    dlist_getnum64(dl, "HIGHESTMODSEQ", &modseq);
 
-	    p = t->next; /* remove node */
+    /* we never change the flags on the client socket: the imapd
+       which gets it back expects it as it was */
+    pc = conn_new(fd);
+    pc->session = xstrdup(session);
+    pc->deadline = deadline;
+    pc->modseq = modseq;
+    if (tag) subscribe(pc, mboxname);
+    nparked++;
 
-	    /* we just removed the data that the hash entry
-	       was pointing to, so insert the new data */
-	    hash_insert(mboxname, p, &itable);
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "parked client fd %d on '%s'%s (%u parked)",
+	       fd, mboxname, tag ? " idling" : "", nparked);
+
+    dlist_free(&dl);
+}
+
+/*
+ * The imapd service is busy: check_parked() retries once a second.
+ * Stop listening to the client meanwhile, or whatever it has sent
+ * would wake us, and get us retrying, as fast as we can loop.
+ */
+static void resume_later(struct iconn *c)
+{
+    if (c->resumewait) return;
+    c->resumewait = 1;
+    ev_mod(c->fd, c, 0, c->wantwrite);
+}
+
+/* hand a parked client back to an imapd, along with its session */
+static void resume(struct iconn *c)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    size_t len = strlen(c->session) + 1;
+    int s, fdflags, n;
+
+    if (c->dead) return;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+	syslog(LOG_ERR, "socket: %m");
+	resume_later(c);
+	return;
+    }
+    fdflags = fcntl(s, F_GETFL, 0);
+    if (fdflags != -1) fcntl(s, F_SETFL, fdflags | O_NONBLOCK);
+
+    if (connect(s, (struct sockaddr *) &resume_addr, resume_addrlen) == -1) {
+	if (errno == EAGAIN) {
+	    /* backlog is full: leave it until the next round */
+	    resume_later(c);
 	}
 	else {
-	    /* not the first pid in the linked list */
+	    syslog(LOG_ERR, "resuming parked client: connect(%s): %m",
+		   resume_addr.sun_path);
+	    parked_bye(c, "Server unavailable");
+	}
+	close(s);
+	return;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = c->session;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
 
-	    p->next = t->next; /* remove node */
+    n = sendmsg(s, &mh, MSG_DONTWAIT);
+    if (n == -1) {
+	if (errno == EAGAIN || errno == EINTR) {
+	    /* nothing went: leave it until the next round */
+	    resume_later(c);
 	}
-	t->next = ifreelist; /* add to freelist */
-	ifreelist = t;
+	else {
+	    syslog(LOG_ERR, "resuming parked client: sendmsg: %m");
+	    parked_bye(c, "Server unavailable");
+	}
+	close(s);
+	return;
     }
+
+    /* the imapd has the client's socket now, so the rest has to
+       follow; the socket buffer is normally big enough for all of it,
+       so this rarely waits, and never for long */
+    if (n < (int) len) {
+	struct timeval tv = { 5, 0 };
+
+	if (fdflags != -1) fcntl(s, F_SETFL, fdflags);
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (retry_write(s, c->session + n, len - n) == -1) {
+	    syslog(LOG_ERR, "resuming parked client: write: %m");
+	    parked_bye(c, "Server unavailable");
+	    close(s);
+	    return;
+	}
+    }
+    close(s);
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "resumed client fd %d", c->fd);
+
+    /* the imapd has its own copy of the client now */
+    c->dead = 1;
 }
 
-void process_msg(idle_data_t *idledata)
+/* a parked client has something to say, or has gone away */
+static void parked_read(struct iconn *c)
 {
-    struct ientry *t, *n;
+    char ch;
+    int n;
+
+    /* only a hangup gets here while we wait: check_parked() retries */
+    n = recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
 
+    if (n <= 0) c->dead = 1;
+    else if (!c->resumewait) resume(c);
+}
+
+/* once a second: autologout, and retries for a busy imapd service */
+static void check_parked(time_t now)
+{
+    struct iconn *c;
+
+    if (!nparked) return;
+
+    for (c = conns; c; c = c->next) {
+	if (!c->session || c->dead) continue;
+
+	if (c->resumewait) resume(c);
+	else if (now >= c->deadline) parked_bye(c, "idle for too long");
+    }
+}
+
+static void process_sub(struct iconn *c, idle_data_t *idledata,
+			const char *session)
+{
     switch (idledata->msg) {
     case IDLE_INIT:
 	if (verbose || debugmode)
 	    syslog(LOG_DEBUG, "imapd[%ld]: IDLE_INIT '%s'\n",
 		   idledata->pid, idledata->mboxname);
-
-	/* add pid to list of those idling on mboxname */
-	t = (struct ientry *) hash_lookup(idledata->mboxname, &itable);
-	n = get_ientry();
-	n->pid = idledata->pid;
-	n->itime = time(NULL);
-	n->next = t;
-	hash_insert(idledata->mboxname, n, &itable);
+	subscribe(c, idledata->mboxname);
 	break;
-	
-    case IDLE_NOTIFY:
-	if (verbose || debugmode)
-	    syslog(LOG_DEBUG, "IDLE_NOTIFY '%s'\n", idledata->mboxname);
-
-	/* send a message to all pids idling on mboxname */
-	t = (struct ientry *) hash_lookup(idledata->mboxname, &itable);
-	while (t) {
-	    if ((t->itime + idle_timeout) < time(NULL)) {
-		/* This process has been idling for longer than the timeout
-		 * period, so it probably died.  Remove it from the list.
-		 */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    TIMEOUT %d\n", t->pid);
-
-		n = t;
-		t = t->next;
-		idle_done(idledata->mboxname, n->pid);
-	    }
-	    else { /* signal process to update */
-		if (verbose || debugmode)
-		    syslog(LOG_DEBUG, "    SIGUSR1 %d\n", t->pid);
 
-		kill(t->pid, SIGUSR1);
-		t = t->next;
-	    }
-	}
-	break;
-	
     case IDLE_DONE:
 	if (verbose || debugmode)
 	    syslog(LOG_DEBUG, "imapd[%ld]: IDLE_DONE '%s'\n",
 		   idledata->pid, idledata->mboxname);
+	unsubscribe(c, idledata->mboxname);
+	break;
 
-	/* remove pid from list of those idling on mboxname */
-	idle_done(idledata->mboxname, idledata->pid);
+    case IDLE_NOOP:
+	break;
+
+    case IDLE_PARK:
+	park(c, idledata->mboxname, session);
+	break;
+
+    default:
+	syslog(LOG_ERR, "unrecognized message: %lx", idledata->msg);
+	break;
+    }
+}
+
+/* read whatever the subscriber sent, and act on the complete messages */
+static void conn_read(struct iconn *c)
+{
+    char buf[4096];
+    char cbuf[CMSG_SPACE(IDLE_MAXPASSED * sizeof(int))];
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    const char *p, *end, *nul;
+    int n;
+
+    if (c->dead) return;
+
+    if (c->session) {
+	parked_read(c);
+	return;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    n = recvmsg(c->fd, &mh, 0);
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n <= 0) {
+	c->dead = 1;
+	return;
+    }
+
+    /* client sockets for IDLE_PARK, in the order of the messages */
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	int *fds = (int *) CMSG_DATA(cmsg);
+	int i, nfds;
+
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	    continue;
+
+	nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	for (i = 0; i < nfds; i++) {
+	    int fd;
+
+	    memcpy(&fd, fds + i, sizeof(int));
+	    if (c->npassed < IDLE_MAXPASSED) c->passed[c->npassed++] = fd;
+	    else {
+		syslog(LOG_ERR, "too many client sockets in flight");
+		close(fd);
+		c->dead = 1;
+	    }
+	}
+    }
+    if (mh.msg_flags & MSG_CTRUNC) {
+	syslog(LOG_ERR, "client sockets lost in flight");
+	c->dead = 1;
+    }
+    if (c->dead) return;
+
+    buf_appendmap(&c->in, buf, n);
+
+    p = c->in.s;
+    end = c->in.s + c->in.len;
+    while (end - p > IDLEDATA_BASE_SIZE &&
+	   (nul = memchr(p + IDLEDATA_BASE_SIZE, '\0',
+			 end - p - IDLEDATA_BASE_SIZE))) {
+	idle_data_t idledata;
+	size_t len = nul + 1 - p;
+	const char *session = NULL;
+
+	if (len > sizeof(idledata)) {
+	    syslog(LOG_ERR, "Invalid message received, size=%d\n", (int) len);
+	    c->dead = 1;
+	    return;
+	}
+	memcpy(&idledata, p, len);
+
+	if (idledata.msg == IDLE_PARK) {
+	    /* the session follows the mailbox name */
+	    const char *tail = memchr(nul + 1, '\0', end - nul - 1);
+
+	    if (!tail) break;
+	    session = nul + 1;
+	    len = tail + 1 - p;
+	}
+
+	process_sub(c, &idledata, session);
+	p += len;
+    }
+
+    if (end - p >= (int) sizeof(idle_data_t) + IDLE_MAXSESSION) {
+	syslog(LOG_ERR, "Invalid message received, too long\n");
+	c->dead = 1;
+	return;
+    }
+
+    /* keep any partial message for next time */
+    memmove(c->in.s, p, end - p);
+    buf_truncate(&c->in, end - p);
+}
+
+/*
+ * Notifications
+ */
+static void send_notify(struct imbox *mb)
+{
+    struct isub *sub;
+
+    if (verbose || debugmode)
+	syslog(LOG_DEBUG, "IDLE_NOTIFY '%s' " MODSEQ_FMT " %lu\n",
+	       mb->name, mb->highestmodseq, mb->exists);
+
+    for (sub = mb->subs; sub; sub = sub->next) {
+	conn_send(sub->conn, IDLE_NOTIFY, mb->name,
+		  mb->highestmodseq, mb->exists);
+    }
+}
+
+/* send the notifications whose coalescing window has passed */
+static void send_due(void)
+{
+    struct imbox *mb;
+
+    while ((mb = pending_head) && !ms_until(&mb->due)) {
+	pending_head = mb->next_pending;
+	if (!pending_head) pending_tail = NULL;
+
+	mb->pending = 0;
+	mb->next_pending = NULL;
+	send_notify(mb);
+	imbox_free_unused(mb);
+    }
+}
+
+void process_msg(idle_data_t *idledata)
+{
+    struct imbox *mb;
+
+    switch (idledata->msg) {
+    case IDLE_NOTIFY:
+	/* nobody is IDLE on most mailboxes that change */
+	mb = (struct imbox *) hash_lookup(idledata->mboxname, &itable);
+	if (!mb) break;
+
+	if (idledata->highestmodseq >= mb->highestmodseq) {
+	    mb->highestmodseq = idledata->highestmodseq;
+	    mb->exists = idledata->exists;
+	}
+
+	if (!coalesce) {
+	    send_notify(mb);
+	}
+	else if (!mb->pending) {
+	    /* hold it back, so that the changes which follow
+	       within the window go out as one notification */
+	    mb->pending = 1;
+	    gettimeofday(&mb->due, NULL);
+	    mb->due.tv_usec += coalesce * 1000;
+	    mb->due.tv_sec += mb->due.tv_usec / 1000000;
+	    mb->due.tv_usec %= 1000000;
+
+	    if (pending_tail) pending_tail->next_pending = mb;
+	    else pending_head = mb;
+	    pending_tail = mb;
+	}
 	break;
 
     case IDLE_NOOP:
@@ -232,20 +789,106 @@ void process_msg(idle_data_t *idledata)
     }
 }
 
-void idle_alert(const char *key __attribute__((unused)),
-		void *data,
-		void *rock __attribute__((unused)))
+static void notify_read(void)
+{
+    idle_data_t idledata;
+    int n;
+
+    for (;;) {
+	n = recv(notify_sock, (void*) &idledata, sizeof(idle_data_t), 0);
+	if (n <= 0) break;
+
+	if (n <= IDLEDATA_BASE_SIZE ||
+	    idledata.mboxname[n - 1 - IDLEDATA_BASE_SIZE] != '\0')
+	    syslog(LOG_ERR, "Invalid message received, size=%d\n", n);
+	else 
+	    process_msg(&idledata);
+    }
+}
+
+static void bus_accept(void)
 {
-    struct ientry *t = (struct ientry *) data;
+    int fd;
 
-    while (t) {
-	/* signal process to check ALERTs */
+    while ((fd = accept(bus_sock, NULL, NULL)) != -1) {
+	int fdflags = fcntl(fd, F_GETFL, 0);
+	if (fdflags == -1 || fcntl(fd, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+	    close(fd);
+	    continue;
+	}
+	conn_new(fd)->trusted = idle_peer_trusted(fd);
+    }
+}
+
+/* tell every subscriber to check for shutdown and ALERTs */
+static void idle_alert(void)
+{
+    struct iconn *c;
+
+    for (c = conns; c; c = c->next) {
 	if (verbose || debugmode)
-	    syslog(LOG_DEBUG, "    SIGUSR2 %d\n", t->pid);
-	kill(t->pid, SIGUSR2);
+	    syslog(LOG_DEBUG, "    IDLE_CHECKALERT fd %d\n", c->fd);
+	conn_send(c, IDLE_CHECKALERT, ".", 0, 0);
+    }
+}
 
-	t = t->next;
+/* wait up to 'timeout' msecs, and handle what comes in */
+static void wait_events(int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[256];
+    int i, n;
+
+    n = epoll_wait(epoll_fd, events, 256, timeout);
+    if (n == -1 && errno != EINTR) {
+	syslog(LOG_ERR, "epoll_wait(): %m");
+	fatal("epoll_wait error", -1);
     }
+
+    for (i = 0; i < n; i++) {
+	struct iconn *c = (struct iconn *) events[i].data.ptr;
+
+	if (c == (struct iconn *) &notify_sock) notify_read();
+	else if (c == (struct iconn *) &bus_sock) bus_accept();
+	else {
+	    if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) conn_read(c);
+	    if (events[i].events & EPOLLOUT) conn_flush(c);
+	}
+    }
+#else
+    struct pollfd *fds;
+    struct iconn *c;
+    int i, n, nfds = 2;
+
+    for (c = conns; c; c = c->next) nfds++;
+    fds = xzmalloc(nfds * sizeof(struct pollfd));
+    fds[0].fd = notify_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = bus_sock;
+    fds[1].events = POLLIN;
+    for (c = conns, i = 2; c; c = c->next, i++) {
+	fds[i].fd = c->fd;
+	fds[i].events = (c->resumewait ? 0 : POLLIN) | (c->out.len ? POLLOUT : 0);
+    }
+
+    n = poll(fds, nfds, timeout);
+    if (n == -1 && errno != EINTR) {
+	syslog(LOG_ERR, "poll(): %m");
+	fatal("poll error", -1);
+    }
+
+    if (n > 0) {
+	/* new connections go on the front of the list, after the ones
+	   we polled, so walk the list before accepting */
+	for (c = conns, i = 2; c && i < nfds; c = c->next, i++) {
+	    if (fds[i].revents & (POLLIN|POLLERR|POLLHUP)) conn_read(c);
+	    if (fds[i].revents & POLLOUT) conn_flush(c);
+	}
+	if (fds[0].revents & POLLIN) notify_read();
+	if (fds[1].revents & POLLIN) bus_accept();
+    }
+    free(fds);
+#endif
 }
 
 static void sighandler (int sig __attribute__((unused))) 
@@ -254,26 +897,75 @@ static void sighandler (int sig __attribute__((unused)))
     return;
 }
 
+/* create and bind a unix socket named by 'opt' (or 'fname' in configdir),
+   with permissions 'mode' */
+static int idle_socket(int type, enum imapopt opt, const char *fname,
+		       mode_t mode)
+{
+    struct sockaddr_un local;
+    const char *sockname;
+    mode_t oldumask;
+    int s, len, fdflags;
+
+    if ((s = socket(AF_UNIX, type, 0)) == -1) {
+	perror("socket");
+	cyrus_done();
+	exit(1);
+    }
+
+    /* bind it to a local file */
+    local.sun_family = AF_UNIX;
+    sockname = config_getstring(opt);
+    if (sockname) {	
+	strlcpy(local.sun_path, sockname, sizeof(local.sun_path));
+    }
+    else {
+	strlcpy(local.sun_path, config_dir, sizeof(local.sun_path));
+	strlcat(local.sun_path, fname, sizeof(local.sun_path));
+    }
+    unlink(local.sun_path);
+    len = sizeof(local.sun_family) + strlen(local.sun_path) + 1;
+
+    /* so it never has more than 'mode', not even until the chmod() */
+    oldumask = umask(~mode & 0777); /* for Linux */
+
+    if (bind(s, (struct sockaddr *)&local, len) == -1) {
+	perror("bind");
+	cyrus_done();
+	exit(1);
+    }
+    umask(oldumask); /* for Linux */
+    chmod(local.sun_path, mode); /* for DUX */
+
+    if (type == SOCK_STREAM && listen(s, SOMAXCONN) == -1) {
+	perror("listen");
+	cyrus_done();
+	exit(1);
+    }
+
+    /* everything we read is drained until it would block */
+    fdflags = fcntl(s, F_GETFL, 0);
+    if (fdflags == -1 || fcntl(s, F_SETFL, fdflags | O_NONBLOCK) == -1) {
+	perror("fcntl");
+	cyrus_done();
+	exit(1);
+    }
+
+    return s;
+}
+
 int main(int argc, char **argv)
 {
     char shutdownfilename[1024];
     char *p = NULL;
+    const char *resume_name;
     int opt;
     int nmbox = 0;
-    int s, len;
-    struct sockaddr_un local;
-    idle_data_t idledata;
-    struct sockaddr_un from;
-    socklen_t fromlen;
-    mode_t oldumask;
-    fd_set read_set, rset;
-    int nfds;
-    struct timeval timeout;
     pid_t pid;
     int fd;
     char *alt_config = NULL;
-    const char *idle_sock;
     struct sigaction action;
+    time_t lastcheck = 0;
 
     p = getenv("CYRUS_VERBOSE");
     if (p) verbose = atoi(p) + 1;
@@ -315,10 +1007,8 @@ int main(int argc, char **argv)
     snprintf(shutdownfilename, sizeof(shutdownfilename), "%s/msg/shutdown",
 	     config_dir);
 
-    /* Set inactivity timer (convert from minutes to seconds) */
-    idle_timeout = config_getint(IMAPOPT_TIMEOUT);
-    if (idle_timeout < 30) idle_timeout = 30;
-    idle_timeout *= 60;
+    coalesce = config_getint(IMAPOPT_IDLECOALESCE);
+    if (coalesce < 0) coalesce = 0;
 
     /* count the number of mailboxes */
     mboxlist_init(0);
@@ -335,96 +1025,73 @@ int main(int argc, char **argv)
     if (sigaction(SIGQUIT, &action, NULL) < 0) {
         fatal("unable to install signal handler for %d: %m", SIGQUIT);
     }
+    signal(SIGPIPE, SIG_IGN);
 
     /* create idle table -- +1 to avoid a zero value */
-    construct_hash_table(&itable, nmbox + 1, 1);
-    ifreelist = NULL;
+    construct_hash_table(&itable, nmbox + 1, 0);
 
-    /* create socket we are going to use for listening */
-    if ((s = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
-	perror("socket");
-	cyrus_done();
-	exit(1);
-    }
+    /* notifications of changes come in on the datagram socket,
+       subscribers connect to the stream socket.  What comes out of
+       the stream socket says which mailboxes are changing, so only
+       Cyrus processes, which share our user and group, get to it */
+    notify_sock = idle_socket(SOCK_DGRAM, IMAPOPT_IDLESOCKET,
+			      FNAME_IDLE_SOCK, 0777);
+    bus_sock = idle_socket(SOCK_STREAM, IMAPOPT_IDLEBUSSOCKET,
+			   FNAME_IDLE_BUS_SOCK, 0770);
 
-    /* bind it to a local file */
-    local.sun_family = AF_UNIX;
-    idle_sock = config_getstring(IMAPOPT_IDLESOCKET);
-    if (idle_sock) {	
-	strlcpy(local.sun_path, idle_sock, sizeof(local.sun_path));
+    /* where parked clients go back to */
+    resume_addr.sun_family = AF_UNIX;
+    resume_name = config_getstring(IMAPOPT_IDLERESUMESOCKET);
+    if (resume_name) {
+	strlcpy(resume_addr.sun_path, resume_name,
+		sizeof(resume_addr.sun_path));
     }
     else {
-	strlcpy(local.sun_path, config_dir, sizeof(local.sun_path));
-	strlcat(local.sun_path, FNAME_IDLE_SOCK, sizeof(local.sun_path));
+	strlcpy(resume_addr.sun_path, config_dir,
+		sizeof(resume_addr.sun_path));
+	strlcat(resume_addr.sun_path, FNAME_IDLE_RESUME_SOCK,
+		sizeof(resume_addr.sun_path));
     }
-    unlink(local.sun_path);
-    len = sizeof(local.sun_family) + strlen(local.sun_path) + 1;
-
-    oldumask = umask((mode_t) 0); /* for Linux */
-
-    if (bind(s, (struct sockaddr *)&local, len) == -1) {
-	perror("bind");
-	cyrus_done();
-	exit(1);
-    }
-    umask(oldumask); /* for Linux */
-    chmod(local.sun_path, 0777); /* for DUX */
+    resume_addrlen = sizeof(resume_addr.sun_family) +
+	strlen(resume_addr.sun_path) + 1;
 
-    /* get ready for select() */
-    FD_ZERO(&read_set);
-    FD_SET(s, &read_set);
-    nfds = s + 1;
+    ev_init();
+    ev_add(notify_sock, &notify_sock);
+    ev_add(bus_sock, &bus_sock);
 
     for (;;) {
-	int n;
+	int timeout = 1000;
+	time_t now = time(NULL);
 
-	/* check for shutdown file */
-	if ((fd = open(shutdownfilename, O_RDONLY, 0)) != -1) {
-	    /* signal all processes to shutdown */
-	    if (verbose || debugmode)
-		syslog(LOG_DEBUG, "IDLE_ALERT\n");
+	/* check for shutdown file, once a second */
+	if (now != lastcheck) {
+	    lastcheck = now;
+	    if ((fd = open(shutdownfilename, O_RDONLY, 0)) != -1) {
+		/* signal all processes to shutdown */
+		if (verbose || debugmode)
+		    syslog(LOG_DEBUG, "IDLE_ALERT\n");
 
-	    hash_enumerate(&itable, idle_alert, NULL);
-	    break;
+		close(fd);
+		idle_alert();
+		break;
+	    }
+
+	    check_parked(now);
 	}
 	if (sigquit) {
-	    hash_enumerate(&itable, idle_alert, NULL);
+	    idle_alert();
 	    break;
 	}
 
-	/* timeout for select is 1 second */
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
-
-	/* check for the next input */
-	rset = read_set;
-	n = select(nfds, &rset, NULL, NULL, &timeout);
-	if (n < 0 && errno == EAGAIN) continue;
-	if (n < 0 && errno == EINTR) continue;
-	if (n == -1) {
-	    /* uh oh */
-	    syslog(LOG_ERR, "select(): %m");
-	    close(s);
-	    fatal("select error",-1);
-	}
-
-	/* read on unix socket */
-	if (FD_ISSET(s, &rset)) {
-	    fromlen = sizeof(from);
-	    n = recvfrom(s, (void*) &idledata, sizeof(idle_data_t), 0,
-			 (struct sockaddr *) &from, &fromlen);
-
-	    if (n > 0) {
-		if (n <= IDLEDATA_BASE_SIZE ||
-		    idledata.mboxname[n - 1 - IDLEDATA_BASE_SIZE] != '\0')
-		    syslog(LOG_ERR, "Invalid message received, size=%d\n", n);
-		else 
-		    process_msg(&idledata);
-	    }
-	} else {
-	    /* log some sort of error */	    
+	/* wake up in time for the next held back notification */
+	if (pending_head) {
+	    int due = ms_until(&pending_head->due);
+	    if (due < timeout) timeout = due;
 	}
 
+	wait_events(timeout);
+	send_due();
+	reap_conns();
     }
 
     cyrus_done();
@@ -438,4 +1105,3 @@ void printstring(const char *s __attribute__((unused)))
     fatal("printstring() executed, but its not used for POP3!",
           EC_SOFTWARE);
 }
-
@@ -47,24 +47,56 @@
 
 #include "mailbox.h"
 
-/* socket to communicate with the idled */
+/* socket to send mailbox change notifications to idled */
 #define FNAME_IDLE_SOCK "/socket/idle"
 
+/* stream socket on which IDLE clients subscribe to mailboxes */
+#define FNAME_IDLE_BUS_SOCK "/socket/idlebus"
+
+/* imapd service to which idled hands parked clients back */
+#define FNAME_IDLE_RESUME_SOCK "/socket/imapresume"
+
+/*
+ * Notifications arrive at idled as datagrams.  Subscribers hold a
+ * stream connection, on which messages are sent back to back: each
+ * one is IDLEDATA_BASE_SIZE bytes followed by the NUL terminated
+ * mailbox name.
+ */
 typedef struct idle_data_s {
     unsigned long msg;
     unsigned long pid;
 
+    /* mailbox state at the time of the change (IDLE_NOTIFY) */
+    modseq_t highestmodseq;
+    unsigned long exists;
+
     /* 1 for null. leave at end of structure for alignment */
     char mboxname[MAX_MAILBOX_BUFFER];
 } idle_data_t;
 
-#define IDLEDATA_BASE_SIZE	(2 * (int) sizeof(unsigned long))
+#define IDLEDATA_BASE_SIZE	(3 * (int) sizeof(unsigned long) + \
+				 (int) sizeof(modseq_t))
 
 typedef enum {
-    IDLE_INIT,
-    IDLE_DONE,
-    IDLE_NOTIFY,
-    IDLE_NOOP
+    IDLE_INIT,		/* subscribe to a mailbox */
+    IDLE_DONE,		/* unsubscribe from a mailbox */
+    IDLE_NOTIFY,	/* a mailbox changed */
+    IDLE_NOOP,
+    IDLE_CHECKALERT,	/* check for shutdown and ALERTs */
+    IDLE_PARK		/* wait on a client for imapd; see below */
 } idle_msg_t;
 
+/*
+ * IDLE_PARK carries the client's socket (SCM_RIGHTS), and the mailbox
+ * name is followed by the NUL terminated session for the imapd which
+ * picks the client up again, a dlist with at least:
+ *
+ *   DEADLINE	time of autologout
+ *   IDLETAG	tag of the IDLE command, if the client is idling
+ *
+ * and, if a mailbox is selected, its HIGHESTMODSEQ as the client has
+ * seen it: notifications which don't go beyond that are ignored.
+ */
+#define IDLE_MAXSESSION (64*1024)
+
 #endif
@@ -94,13 +94,15 @@ struct protocol_t imap_protocol =
       { "RIGHTS=kxte", CAPA_ACLRIGHTS },
       { "LIST-EXTENDED", CAPA_LISTEXTENDED },
       { "SASL-IR", CAPA_SASL_IR },
+      { "X-PROXYAUTH", CAPA_PROXYAUTH },
       { NULL, 0 } } },
   { "S01 STARTTLS", "S01 OK", "S01 NO", 0 },
   { "A01 AUTHENTICATE", 0, 0, "A01 OK", "A01 NO", "+ ", "*",
     NULL, AUTO_CAPA_AUTH_OK },
   { "Z01 COMPRESS DEFLATE", "* ", "Z01 OK" },
   { "N01 NOOP", "* ", "N01 OK" },
-  { "Q01 LOGOUT", "* ", "Q01 " }
+  { "Q01 LOGOUT", "* ", "Q01 " },
+  { "P01 PROXYAUTH", "* ", "P01 OK", CAPA_PROXYAUTH }
 };
 
 void proxy_gentag(char *tag, size_t len)
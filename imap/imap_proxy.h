@@ -64,7 +64,8 @@ enum {
     CAPA_MULTIAPPEND	= (1 << 5),
     CAPA_ACLRIGHTS	= (1 << 6),
     CAPA_LISTEXTENDED	= (1 << 7),
-    CAPA_SASL_IR	= (1 << 8)
+    CAPA_SASL_IR	= (1 << 8),
+    CAPA_PROXYAUTH	= (1 << 9)
 };
 
 extern struct protocol_t imap_protocol;
@@ -168,6 +168,8 @@ static char *imapd_magicplus = NULL;
 struct auth_state *imapd_authstate = 0;
 static int imapd_userisadmin = 0;
 static int imapd_userisproxyadmin = 0;
+static int imapd_proxyauth_ok = 0; /* logged in as one of proxyservers */
+static char *imapd_proxyauth_id = NULL; /* ... and which one */
 unsigned imapd_client_capa = 0;
 static sasl_conn_t *imapd_saslconn; /* the sasl connection context */
 static int imapd_starttls_done = 0; /* have we done a successful starttls? */
@@ -215,6 +217,15 @@ static const int max_monthdays[] = {
 /* track if we're idling */
 static int idling = 0;
 
+/* handing quiet clients to idled, and picking them up again */
+static int imapd_parkdelay = 0;	/* seconds before parking */
+static int imapd_parked = 0;	/* idled has the client now */
+static int imapd_resume = 0;	/* we're the service for parked clients */
+static int imapd_resumed = 0;	/* this session was parked */
+static time_t park_retry = 0;	/* idled refused: not before this */
+static int park_backoff = 0;	/* and the wait after the next refusal */
+static char *resume_idletag = NULL;
+
 static const struct mbox_name_attribute {
     int flag;
     const char *id;
@@ -338,6 +349,10 @@ enum {
 
 
 static void motd_file(void);
+static int imapd_canpark(void);
+static int imapd_park(const char *idletag);
+static int imapd_resume_accept(struct dlist **sessionp);
+static void imapd_resume_session(struct dlist *session);
 void shut_down(int code);
 void fatal(const char *s, int code);
 
@@ -345,6 +360,7 @@ void cmdloop(void);
 void cmd_login(char *tag, char *user);
 void cmd_authenticate(char *tag, char *authtype, char *resp);
 void cmd_noop(char *tag, char *cmd);
+void cmd_proxyauth(char *tag, char *user);
 void capa_response(int flags);
 void cmd_capability(char *tag);
 void cmd_append(char *tag, char *name, const char *cur_name);
@@ -386,7 +402,7 @@ void cmd_id(char* tag);
 extern void id_getcmdline(int argc, char **argv);
 extern void id_response(struct protstream *pout);
 
-void cmd_idle(char* tag);
+void cmd_idle(char* tag, int resumed);
 void idle_update(idle_flags_t flags);
 
 void cmd_starttls(char *tag, int imaps);
@@ -641,7 +657,7 @@ int mlookup(const char *tag, const char *ext_name,
     else if (mbentry->mbtype & MBTYPE_MOVING) {
 	/* do we have rights on the mailbox? */
 	if (!imapd_userisadmin &&
-	   (!mbentry->acl || !(cyrus_acl_myrights(imapd_authstate, mbentry->acl) & ACL_LOOKUP))) {
+	   (!mbentry->acl || !(mboxlist_entry_myrights(mbentry, imapd_authstate) & ACL_LOOKUP))) {
 	    r = IMAP_MAILBOX_NONEXISTENT;
 	} else if (tag && ext_name && mbentry->server) {
 	    imapd_refer(tag, mbentry->server, ext_name);
@@ -669,14 +685,16 @@ static void imapd_reset(void)
     
     proc_cleanup();
 
-    /* close backend connections */
+    /* close backend connections, or keep them for the next session */
     i = 0;
     while (backend_cached && backend_cached[i]) {
-	proxy_downserver(backend_cached[i]);
-	if (backend_cached[i]->last_result.s) {
-	    free(backend_cached[i]->last_result.s);
+	if (!proxy_pool_put(backend_cached[i])) {
+	    proxy_downserver(backend_cached[i]);
+	    if (backend_cached[i]->last_result.s) {
+		free(backend_cached[i]->last_result.s);
+	    }
+	    free(backend_cached[i]);
 	}
-	free(backend_cached[i]);
 	i++;
     }
     if (backend_cached) free(backend_cached);
@@ -689,9 +707,11 @@ static void imapd_reset(void)
     if (imapd_index) index_close(&imapd_index);
 
     if (imapd_in) {
-	/* Flush the incoming buffer */
-	prot_NONBLOCK(imapd_in);
-	prot_fill(imapd_in);
+	/* Flush the incoming buffer, unless it's idled's to read now */
+	if (!imapd_parked) {
+	    prot_NONBLOCK(imapd_in);
+	    prot_fill(imapd_in);
+	}
 	bytes_in = prot_bytes_in(imapd_in);
 	prot_free(imapd_in);
     }
@@ -720,7 +740,20 @@ static void imapd_reset(void)
     }
 #endif
 
-    cyrus_reset_stdio();
+    if (imapd_parked) {
+	/* idled has the client now: let go of it without a shutdown(),
+	   which would be seen by idled's copy too */
+	int devnull = open("/dev/null", O_RDWR, 0);
+
+	if (devnull == -1) {
+	    fatal("open() on /dev/null failed", EC_TEMPFAIL);
+	}
+	dup2(devnull, 0);
+	dup2(devnull, 1);
+	dup2(devnull, 2);
+	if (devnull > 2) close(devnull);
+    }
+    else cyrus_reset_stdio();
 
     imapd_clienthost = "[local]";
     if (imapd_logfd != -1) {
@@ -745,6 +778,9 @@ static void imapd_reset(void)
     }
     imapd_userisadmin = 0;
     imapd_userisproxyadmin = 0;
+    imapd_proxyauth_ok = 0;
+    free(imapd_proxyauth_id);
+    imapd_proxyauth_id = NULL;
     imapd_client_capa = 0;
     if (imapd_saslconn) {
 	sasl_dispose(&imapd_saslconn);
@@ -755,6 +791,10 @@ static void imapd_reset(void)
     imapd_tls_comp = NULL;
     imapd_starttls_done = 0;
     plaintextloginalert = NULL;
+    imapd_parked = 0;
+    imapd_resumed = 0;
+    park_retry = 0;
+    park_backoff = 0;
 
     if(saslprops.iplocalport) {
 	free(saslprops.iplocalport);
@@ -817,7 +857,7 @@ int service_init(int argc, char **argv, char **envp)
     snmp_connect(); /* ignore return code */
     snmp_set_str(SERVER_NAME_VERSION,cyrus_version());
 
-    while ((opt = getopt(argc, argv, "sp:N")) != EOF) {
+    while ((opt = getopt(argc, argv, "sp:NR")) != EOF) {
 	switch (opt) {
 	case 's': /* imaps (do starttls right away) */
 	    imaps = 1;
@@ -834,6 +874,9 @@ int service_init(int argc, char **argv, char **envp)
 		   * you know what you're doing! */
 	    nosaslpasswdcheck = 1;
 	    break;
+	case 'R': /* take clients back from idled */
+	    imapd_resume = 1;
+	    break;
 	default:
 	    break;
 	}
@@ -850,6 +893,9 @@ int service_init(int argc, char **argv, char **envp)
 	statuscache_open(NULL);
     }
 
+    imapd_parkdelay = config_getint(IMAPOPT_IMAPIDLEPARK);
+    if (imapd_parkdelay < 0) imapd_parkdelay = 0;
+
     /* Create a protgroup for input from the client and selected backend */
     protin = protgroup_new(2);
 
@@ -869,6 +915,7 @@ int service_main(int argc __attribute__((unused)),
 {
     sasl_security_properties_t *secprops = NULL;
     const char *localip, *remoteip;
+    struct dlist *resumed = NULL;
 
     struct io_count *io_count_start;
     struct io_count *io_count_stop;
@@ -888,6 +935,9 @@ int service_main(int argc __attribute__((unused)),
     id_getcmdline(argc, argv);
 #endif
 
+    /* a client coming back from idled replaces the connection */
+    if (imapd_resume && imapd_resume_accept(&resumed)) return 0;
+
     sync_log_init();
 
     imapd_in = prot_new(0, 0);
@@ -930,6 +980,11 @@ int service_main(int argc __attribute__((unused)),
        TLS negotiation immediately */
     if (imaps == 1) cmd_starttls(NULL, 1);
 
+    if (resumed) {
+	imapd_resume_session(resumed);
+	dlist_free(&resumed);
+    }
+
     snmp_increment(TOTAL_CONNECTIONS, 1);
     snmp_increment(ACTIVE_CONNECTIONS, 1);
 
@@ -1018,6 +1073,7 @@ void shut_down(int code)
 	i++;
     }
     if (backend_cached) free(backend_cached);
+    proxy_pool_done();
 
     if (idling)
 	idle_done(imapd_index ? imapd_index->mailbox->name : NULL);
@@ -1144,17 +1200,22 @@ void cmdloop(void)
     const char * commandmintimer;
     double commandmintimerd = 0.0;
 
-    prot_printf(imapd_out, "* OK [CAPABILITY ");
-    capa_response(CAPA_PREAUTH);
-    prot_printf(imapd_out, "]");
-    if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
-    if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
-	prot_printf(imapd_out, " Cyrus IMAP%s %s",
-		    config_mupdate_server ? " Murder" : "", cyrus_version());
-    }
-    prot_printf(imapd_out, " server ready\r\n");
+    /* a client back from idled has had all this already */
+    if (!imapd_resumed) {
+	prot_printf(imapd_out, "* OK [CAPABILITY ");
+	capa_response(CAPA_PREAUTH);
+	prot_printf(imapd_out, "]");
+	if (config_serverinfo)
+	    prot_printf(imapd_out, " %s", config_servername);
+	if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
+	    prot_printf(imapd_out, " Cyrus IMAP%s %s",
+			config_mupdate_server ? " Murder" : "",
+			cyrus_version());
+	}
+	prot_printf(imapd_out, " server ready\r\n");
 
-    motd_file();
+	motd_file();
+    }
 
     /* Get command timer logging paramater. This string
      * is a time in seconds. Any command that takes >=
@@ -1165,7 +1226,19 @@ void cmdloop(void)
       commandmintimerd = atof(commandmintimer);
     }
 
+    if (resume_idletag) {
+	/* parked in the middle of IDLE: carry on with it */
+	char *idletag = resume_idletag;
+
+	resume_idletag = NULL;
+	cmd_idle(idletag, 1);
+	free(idletag);
+    }
+
     for (;;) {
+	/* idled has the client now */
+	if (imapd_parked) return;
+
 	/* Flush any buffered output */
 	prot_flush(imapd_out);
 	if (backend_current) prot_flush(backend_current->out);
@@ -1182,9 +1255,17 @@ void cmdloop(void)
 
 	signals_poll();
 
-	if (!proxy_check_input(protin, imapd_in, imapd_out,
-			       backend_current ? backend_current->in : NULL,
-			       NULL, 0)) {
+	if (imapd_canpark()) {
+	    /* leave a quiet client to idled */
+	    if (!proxy_check_input(protin, imapd_in, imapd_out,
+				   NULL, NULL, imapd_parkdelay)) {
+		if (imapd_canpark() && imapd_park(NULL)) return;
+		continue;
+	    }
+	}
+	else if (!proxy_check_input(protin, imapd_in, imapd_out,
+				    backend_current ? backend_current->in : NULL,
+				    NULL, 0)) {
 	    /* No input from client */
 	    continue;
 	}
@@ -1518,7 +1599,7 @@ void cmdloop(void)
 	    else if (!strcmp(cmd.s, "Idle") && idle_enabled()) {
 		if (c == '\r') c = prot_getc(imapd_in);
 		if (c != '\n') goto extraargs;
-		cmd_idle(tag.s);
+		cmd_idle(tag.s, 0);
 
 		snmp_increment(IDLE_COUNT, 1);
 	    }
@@ -1687,6 +1768,19 @@ void cmdloop(void)
 	    else goto badcmd;
 	    break;
 
+	case 'P':
+	    if (!imapd_userid) goto nologin;
+	    else if (!strcmp(cmd.s, "Proxyauth")) {
+		if (c != ' ') goto missingargs;
+		c = getastring(imapd_in, imapd_out, &arg1);
+		if (c == EOF) goto missingargs;
+		if (c == '\r') c = prot_getc(imapd_in);
+		if (c != '\n') goto extraargs;
+		cmd_proxyauth(tag.s, arg1.s);
+	    }
+	    else goto badcmd;
+	    break;
+
 	case 'R':
 	    if (!strcmp(cmd.s, "Rename")) {
 		havepartition = 0;
@@ -2199,6 +2293,12 @@ static void authentication_success(void)
     
     /* authstate already created by mysasl_proxy_policy() */
     imapd_userisadmin = global_authisa(imapd_authstate, IMAPOPT_ADMINS);
+    if (!imapd_proxyauth_ok) {
+	imapd_proxyauth_ok = global_authisa(imapd_authstate,
+					    IMAPOPT_PROXYSERVERS);
+	if (imapd_proxyauth_ok)
+	    imapd_proxyauth_id = xstrdup(imapd_userid);
+    }
 
     /* Create telemetry log */
     imapd_logfd = telemetry_log(imapd_userid, imapd_in, imapd_out, 0);
@@ -2250,6 +2350,250 @@ static int checklimits(const char *tag)
     return 0;
 }
 
+/*
+ * Can the client wait with idled, while it's quiet, instead of us?
+ * Not if any of the connection's state lives outside this process
+ * and the session we can hand on.
+ */
+static int imapd_canpark(void)
+{
+    if (!imapd_parkdelay || !imapd_userid ||
+	imapd_userisproxyadmin || imapd_proxyauth_ok)
+	return 0;
+
+    /* TLS, COMPRESS and SASL layers can't be handed on */
+    if (imapd_starttls_done || imapd_compress_done || saslprops.ssf)
+	return 0;
+
+    /* nor can connections to backends */
+    if (backend_current || (backend_cached && backend_cached[0]))
+	return 0;
+
+    /* and we'd lose anything already read */
+    if (imapd_in->cnt) return 0;
+
+    /* idled turned us down last time */
+    if (park_retry && time(NULL) < park_retry) return 0;
+
+    return idle_enabled() == 1;
+}
+
+/*
+ * Hand the client to idled, with what an imapd needs to pick the
+ * session up again.  'idletag' is the tag of the IDLE command in
+ * progress, if any.
+ */
+static int imapd_park(const char *idletag)
+{
+    struct dlist *dl;
+    struct buf session = BUF_INITIALIZER;
+    int r;
+
+    /* about to be logged out anyway */
+    if (imapd_in->timeout_mark <= time(NULL)) return 0;
+
+    prot_flush(imapd_out);
+
+    dl = dlist_newkvlist(NULL, "SESSION");
+    dlist_setatom(dl, "SESSIONID", session_id());
+    dlist_setatom(dl, "USERID", proxy_userid);
+    if (imapd_magicplus)
+	dlist_setatom(dl, "MAGICPLUS", imapd_magicplus);
+    dlist_setnum32(dl, "CLIENTCAPA", imapd_client_capa);
+    dlist_setnum64(dl, "DEADLINE", imapd_in->timeout_mark);
+    if (idletag)
+	dlist_setatom(dl, "IDLETAG", idletag);
+
+    if (imapd_index) {
+	struct index_view view;
+	char *uids, *recent;
+
+	index_getview(imapd_index, &view);
+	uids = seqset_cstring(view.uids);
+	recent = seqset_cstring(view.recent);
+
+	dlist_setatom(dl, "MBOXNAME", imapd_index->mailbox->name);
+	dlist_setnum32(dl, "EXAMINE", imapd_index->examining);
+	dlist_setnum32(dl, "UIDVALIDITY", view.uidvalidity);
+	dlist_setnum64(dl, "HIGHESTMODSEQ", view.highestmodseq);
+	dlist_setatom(dl, "UIDS", uids ? uids : "");
+	dlist_setatom(dl, "RECENT", recent ? recent : "");
+
+	free(uids);
+	free(recent);
+	seqset_free(view.uids);
+	seqset_free(view.recent);
+    }
+
+    dlist_printbuf(dl, 1, &session);
+    dlist_free(&dl);
+
+    /* "." can't be a mailbox, so nothing will be notified on it */
+    r = idle_park(imapd_in->fd,
+		  imapd_index ? imapd_index->mailbox->name : ".", &session);
+    buf_free(&session);
+    if (!r) {
+	/* try again later, less and less often, and only say so once */
+	if (!park_backoff) {
+	    syslog(LOG_NOTICE, "park: idled won't take session <%s>",
+		   session_id());
+	    park_backoff = imapd_parkdelay;
+	}
+	else if (park_backoff < 3600) park_backoff *= 2;
+	park_retry = time(NULL) + park_backoff;
+	return 0;
+    }
+
+    syslog(LOG_DEBUG, "park: user %s session <%s> handed to idled",
+	   imapd_userid, session_id());
+
+    imapd_parked = 1;
+
+    return 1;
+}
+
+/*
+ * Take a parked client back from idled: the session arrives on the
+ * connection we accepted, with the client's socket alongside, and
+ * the client then replaces that connection on stdin/stdout.
+ */
+static int imapd_resume_accept(struct dlist **sessionp)
+{
+    struct buf session = BUF_INITIALIZER;
+    char buf[4096];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int n, fd = -1;
+
+    if (!idle_peer_trusted(0)) {
+	syslog(LOG_ERR, "resume: connection isn't from idled");
+	return IMAP_PERMISSION_DENIED;
+    }
+
+    for (;;) {
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	n = recvmsg(0, &mh, 0);
+	if (n == -1 && errno == EINTR) continue;
+	if (n <= 0) break;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	    if (cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS && fd == -1) {
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	    }
+	}
+	buf_appendmap(&session, buf, n);
+    }
+
+    /* the session is NUL terminated */
+    if (fd != -1 && session.len && !session.s[session.len-1])
+	dlist_parsemap(sessionp, 1, session.s, session.len - 1);
+    buf_free(&session);
+
+    if (!*sessionp) {
+	syslog(LOG_ERR, "resume: invalid session from idled");
+	if (fd != -1) close(fd);
+	return IMAP_PROTOCOL_ERROR;
+    }
+
+    if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0) {
+	syslog(LOG_ERR, "resume: can't duplicate client socket: %m");
+	fatal("can't duplicate client socket", EC_OSERR);
+    }
+    if (fd > 2) close(fd);
+
+    return 0;
+}
+
+/*
+ * Log the user in and reopen their mailbox as the parked session
+ * left them, so that the next check tells the client what changed.
+ */
+static void imapd_resume_session(struct dlist *session)
+{
+    const char *userid = NULL, *val = NULL, *mboxname = NULL;
+    uint32_t capa = 0;
+    bit64 deadline = 0;
+
+    if (!dlist_getatom(session, "USERID", &userid))
+	fatal("resumed session has no user", EC_SOFTWARE);
+
+    imapd_userid = xstrdup(userid);
+    imapd_authstate = auth_newstate(imapd_userid);
+    if (dlist_getatom(session, "MAGICPLUS", &val))
+	imapd_magicplus = xstrdup(val);
+    authentication_success();
+
+    dlist_getnum32(session, "CLIENTCAPA", &capa);
+    imapd_client_capa = capa;
+
+    if (dlist_getatom(session, "MBOXNAME", &mboxname)) {
+	struct index_init init;
+	struct index_view view;
+	uint32_t num = 0;
+	bit64 modseq = 0;
+	int r;
+
+	memset(&init, 0, sizeof(struct index_init));
+	init.qresync = imapd_client_capa & CAPA_QRESYNC;
+	init.userid = imapd_userid;
+	init.authstate = imapd_authstate;
+	init.out = imapd_out;
+	dlist_getnum32(session, "EXAMINE", &num);
+	init.examine_mode = num;
+
+	dlist_getnum32(session, "UIDVALIDITY", &num);
+	view.uidvalidity = num;
+	dlist_getnum64(session, "HIGHESTMODSEQ", &modseq);
+	view.highestmodseq = modseq;
+	val = "";
+	dlist_getatom(session, "UIDS", &val);
+	view.uids = seqset_parse(val, NULL, 0);
+	val = "";
+	dlist_getatom(session, "RECENT", &val);
+	view.recent = seqset_parse(val, NULL, 0);
+
+	r = index_open(mboxname, &init, &imapd_index);
+	if (!r && !(imapd_index->myrights & ACL_READ))
+	    r = IMAP_MAILBOX_NONEXISTENT;
+	if (!r) r = index_setview(imapd_index, &view);
+
+	seqset_free(view.uids);
+	seqset_free(view.recent);
+
+	if (r) {
+	    syslog(LOG_WARNING, "resume: user %s can't reopen %s: %s",
+		   imapd_userid, mboxname, error_message(r));
+	    fatal("Mailbox has been (re)moved", EC_IOERR);
+	}
+
+	proc_register("imapd", imapd_clienthost, imapd_userid, mboxname);
+    }
+
+    if (dlist_getatom(session, "IDLETAG", &val))
+	resume_idletag = xstrdup(val);
+
+    /* the autologout timer carries on from where it was */
+    if (dlist_getnum64(session, "DEADLINE", &deadline))
+	imapd_in->timeout_mark = deadline;
+
+    val = "";
+    dlist_getatom(session, "SESSIONID", &val);
+    syslog(LOG_DEBUG, "resume: user %s session <%s> picked up as <%s>",
+	   imapd_userid, val, session_id());
+
+    imapd_resumed = 1;
+}
+
 /*
  * Perform a LOGIN command
  */
@@ -2565,6 +2909,92 @@ void cmd_authenticate(char *tag, char *authtype, char *resp)
     authentication_success();
 }
 
+/*
+ * Perform a PROXYAUTH command: a frontend which logged in as itself
+ * goes on to act for 'user', as if it had authenticated on their
+ * behalf.  It can do so again later, for someone else, on the same
+ * connection (see pool_get() in proxy.c).
+ */
+void cmd_proxyauth(char *tag, char *user)
+{
+    const char *canon_user;
+    struct proxy_context ctx;
+    struct auth_state *authstate = NULL;
+    int userisadmin = 0, userisproxyadmin = 0;
+    int r;
+
+    if (!imapd_proxyauth_ok || !imapd_proxyauth_id) {
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_PERMISSION_DENIED));
+	return;
+    }
+
+    canon_user = canonify_userid(user, NULL, NULL);
+    if (!canon_user || is_userid_anonymous(canon_user) ||
+	!strcmp(canon_user, "anyone")) {
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_INVALID_USER));
+	return;
+    }
+
+    /* same loginrealms and userdeny rules as a SASL proxy login */
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.proxy_servers = 1;
+    ctx.authstate = &authstate;
+    ctx.userisadmin = &userisadmin;
+    ctx.userisproxyadmin = &userisproxyadmin;
+    r = imapd_proxy_policy(imapd_saslconn, &ctx,
+			   canon_user, strlen(canon_user),
+			   imapd_proxyauth_id, strlen(imapd_proxyauth_id),
+			   NULL, 0, NULL);
+    if (r != SASL_OK) {
+	syslog(LOG_NOTICE, "badlogin: %s %s %s [%s]",
+	       imapd_clienthost, "PROXYAUTH", canon_user,
+	       sasl_errdetail(imapd_saslconn));
+	prot_printf(imapd_out, "%s NO %s\r\n", tag,
+		    error_message(IMAP_PERMISSION_DENIED));
+	return;
+    }
+
+    /* put down everything of the previous user's */
+    if (imapd_index) index_close(&imapd_index);
+    if (imapd_logfd != -1) {
+	close(imapd_logfd);
+	imapd_logfd = -1;
+    }
+    free(imapd_magicplus);
+    imapd_magicplus = NULL;
+    free(proxy_userid);
+    proxy_userid = NULL;
+    auth_freestate(imapd_authstate);
+    imapd_client_capa = 0;
+
+    free(imapd_userid);
+    imapd_userid = xstrdup(canon_user);
+    imapd_authstate = authstate;
+    imapd_userisadmin = userisadmin;
+    imapd_userisproxyadmin = userisproxyadmin;
+
+    syslog(LOG_NOTICE, "login: %s %s %s%s %s", imapd_clienthost,
+	   imapd_userid, "PROXYAUTH", imapd_starttls_done ? "+TLS" : "",
+	   "User logged in");
+
+    if (checklimits(tag)) {
+	/* nobody is logged in now, so nobody may switch again either */
+	imapd_userisadmin = 0;
+	imapd_userisproxyadmin = 0;
+	imapd_proxyauth_ok = 0;
+	free(imapd_proxyauth_id);
+	imapd_proxyauth_id = NULL;
+	return;
+    }
+
+    prot_printf(imapd_out, "%s OK %s\r\n", tag,
+		error_message(IMAP_OK_COMPLETED));
+
+    authentication_success();
+}
+
 /*
  * Perform a NOOP command
  */
@@ -2753,9 +3183,10 @@ void cmd_id(char *tag)
 }
 
 /*
- * Perform an IDLE command
+ * Perform an IDLE command.  'resumed' if we're picking it up from
+ * idled, where the client was parked part way through.
  */
-void cmd_idle(char *tag)
+void cmd_idle(char *tag, int resumed)
 {
     int c = EOF;
     static struct buf arg;
@@ -2770,18 +3201,47 @@ void cmd_idle(char *tag)
 	}
 
 	/* Tell client we are idling and waiting for end of command */
-	prot_printf(imapd_out, "+ idling\r\n");
+	if (!resumed) prot_printf(imapd_out, "+ idling\r\n");
 	prot_flush(imapd_out);
 
 	/* Start doing mailbox updates */
 	if (imapd_index) index_check(imapd_index, 1, 0);
+	prot_flush(imapd_out);
 	idle_start(imapd_index ? imapd_index->mailbox->name : NULL);
 	/* use this flag so if getc causes a shutdown due to
 	 * connection abort we tell idled about it */
 	idling = 1;
 
+	/* Wait for the client or idled, whichever speaks first.
+	 * Without an idled connection, updates arrive via SIGALRM
+	 * while we block in getword() below. */
+	if (idle_get_sock() != -1) {
+	    struct protgroup *clientin = protgroup_new(1);
+	    struct protgroup *ready = NULL;
+	    struct timeval park;
+	    int fd, notified, canpark;
+
+	    protgroup_insert(clientin, imapd_in);
+	    while ((fd = idle_get_sock()) != -1) {
+		notified = 0;
+		canpark = imapd_canpark();
+		park.tv_sec = imapd_parkdelay;
+		park.tv_usec = 0;
+		if (prot_select(clientin, fd, &ready, &notified,
+				canpark ? &park : NULL) < 0)
+		    continue;
+		if (ready) {
+		    protgroup_free(ready);
+		    break;
+		}
+		if (notified) idle_receive();
+		else if (canpark && imapd_park(tag)) break;
+	    }
+	    protgroup_free(clientin);
+	}
+
 	/* Get continuation data */
-	c = getword(imapd_in, &arg);
+	if (!imapd_parked) c = getword(imapd_in, &arg);
 
 	/* Stop updates and do any necessary cleanup */
 	idling = 0;
@@ -2861,6 +3321,9 @@ void cmd_idle(char *tag)
 	}
     }
 
+    /* idled will bring the client back to finish the command */
+    if (imapd_parked) return;
+
     imapd_check(NULL, 1);
 
     if (c != EOF) {
@@ -2880,6 +3343,17 @@ void cmd_idle(char *tag)
 /* Send unsolicited untagged responses to the client */
 void idle_update(idle_flags_t flags)
 {
+    modseq_t highestmodseq;
+    unsigned long exists;
+
+    /* idled tells us the state it saw; skip the reread if we're
+       already there (e.g. our own change, or a duplicate) */
+    if ((flags & IDLE_MAILBOX) && imapd_index &&
+	idle_last_state(&highestmodseq, &exists) &&
+	highestmodseq == imapd_index->highestmodseq &&
+	exists == imapd_index->exists)
+	flags &= ~IDLE_MAILBOX;
+
     if ((flags & IDLE_MAILBOX) && imapd_index)
 	index_check(imapd_index, 1, 0);
 
@@ -2958,6 +3432,13 @@ void capa_response(int flags)
     for (i = 0 ; i < QUOTA_NUMRESOURCES ; i++)
 	prot_printf(imapd_out, " X-QUOTA=%s", quota_names[i]);
 
+    /* frontends logged in as themselves may act for each user in turn */
+    if (imapd_authstate &&
+	(imapd_proxyauth_ok ||
+	 global_authisa(imapd_authstate, IMAPOPT_PROXYSERVERS))) {
+	prot_printf(imapd_out, " X-PROXYAUTH");
+    }
+
     if (idle_enabled()) {
 	prot_printf(imapd_out, " IDLE");
     }
@@ -5057,7 +5538,7 @@ void cmd_copy(char *tag, char *sequence, char *name, int usinguid, int ismove)
 	r = mlookup(NULL, NULL, mailboxname, &mbentry);
     }
 
-    if (!r) myrights = cyrus_acl_myrights(imapd_authstate, mbentry->acl);
+    if (!r) myrights = mboxlist_entry_myrights(mbentry, imapd_authstate);
 
     if (!r && backend_current) {
 	/* remote mailbox -> local or remote mailbox */
@@ -6428,7 +6909,7 @@ void cmd_getacl(const char *tag, const char *name)
     if (r == IMAP_MAILBOX_MOVED) return;
 
     if (!r) {
-	access = cyrus_acl_myrights(imapd_authstate, mbentry->acl);
+	access = mboxlist_entry_myrights(mbentry, imapd_authstate);
 
 	if (!(access & ACL_ADMIN) &&
 	    !imapd_userisadmin &&
@@ -6497,7 +6978,7 @@ void cmd_listrights(char *tag, char *name, char *identifier)
     if (r == IMAP_MAILBOX_MOVED) return;
 
     if (!r) {
-	rights = cyrus_acl_myrights(imapd_authstate, mbentry->acl);
+	rights = mboxlist_entry_myrights(mbentry, imapd_authstate);
 
 	if (!rights && !imapd_userisadmin &&
 	    !mboxname_userownsmailbox(imapd_userid, mailboxname)) {
@@ -6588,7 +7069,7 @@ void cmd_myrights(const char *tag, const char *name)
     if (r == IMAP_MAILBOX_MOVED) return;
 
     if (!r) {
-	rights = cyrus_acl_myrights(imapd_authstate, mbentry->acl);
+	rights = mboxlist_entry_myrights(mbentry, imapd_authstate);
 
 	/* Add in implicit rights */
 	if (imapd_userisadmin) {
@@ -7379,7 +7860,7 @@ void cmd_status(char *tag, char *name)
 
     /* check permissions */
     if (!r) {
-	int myrights = cyrus_acl_myrights(imapd_authstate, mbentry->acl);
+	int myrights = mboxlist_entry_myrights(mbentry, imapd_authstate);
 
 	if (!(myrights & ACL_READ)) {
 	    r = (imapd_userisadmin || (myrights & ACL_LOOKUP)) ?
@@ -10533,6 +11014,7 @@ void freesearchargs(struct searchargs *s)
     freestrlist(s->text);
     freestrlist(s->header_name);
     freestrlist(s->header);
+    charset_freemultipat(s->bodytext_pat);
 
     while ((sa = s->annotations)) {
 	s->annotations = sa->next;
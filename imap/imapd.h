@@ -234,6 +234,9 @@ struct searchargs {
 
     bit32 cache_atleast;
 
+    /* body and text strings compiled together, built on first use */
+    comp_multipat *bodytext_pat;
+
     /* For ESEARCH */
     const char *tag;
     int returnopts;
@@ -87,6 +87,8 @@
 
 /* Forward declarations */
 static void index_refresh(struct index_state *state);
+static void index_columns_free(struct index_columns **colsptr);
+static void index_columns_update(struct index_state *state, uint32_t msgno);
 static void index_tellexists(struct index_state *state);
 static int index_lock(struct index_state *state);
 static void index_unlock(struct index_state *state);
@@ -96,12 +98,12 @@ static void index_checkflags(struct index_state *state, int dirty);
 
 int index_writeseen(struct index_state *state);
 void index_fetchmsg(struct index_state *state,
-		    const char *msg_base, unsigned long msg_size,
+		    const char *msg_base, unsigned long msg_size, int msg_fd,
 		    unsigned offset, unsigned size,
 		    unsigned start_octet, unsigned octet_count);
 static int index_fetchsection(struct index_state *state, const char *resp,
 			      const char *msg_base, unsigned long msg_size,
-			      char *section,
+			      int msg_fd, char *section,
 			      const char *cachestr, unsigned size,
 			      unsigned start_octet, unsigned octet_count);
 static void index_fetchfsection(struct index_state *state,
@@ -126,9 +128,9 @@ static void index_fetchflags(struct index_state *state, uint32_t msgno);
 static int index_search_evaluate(struct index_state *state,
 				 struct searchargs *searchargs,
 				 uint32_t msgno, struct mapfile *msgfile);
-static int index_searchmsg(char *substr, comp_pat *pat,
+static int index_searchmsg(struct searchargs *searchargs,
 			   struct mapfile *msgfile,
-			   int skipheader, const char *cachestr);
+			   const char *cachestr);
 static int index_searchheader(char *name, char *substr, comp_pat *pat,
 			      struct mapfile *msgfile,
 			      int size);
@@ -201,6 +203,7 @@ void index_close(struct index_state **stateptr)
 
     free(state->userid);
     free(state->map);
+    index_columns_free(&state->columns);
     for (i = 0; i < MAX_USER_FLAGS; i++)
 	free(state->flagname[i]);
     mailbox_close(&state->mailbox);
@@ -309,6 +312,8 @@ int index_expunge(struct index_state *state, char *sequence,
 	r = mailbox_rewrite_index_record(state->mailbox, &im->record);
 
 	if (r) break;
+
+	index_columns_update(state, msgno);
     }
 
     seqset_free(seq);
@@ -464,6 +469,85 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
     return seenlist;
 }
 
+/*
+ * Column snapshot maintenance.  The columns mirror state->map and
+ * are only allocated once a search has asked for them; after that
+ * every place that changes an index_map entry must call
+ * index_columns_update() for it.
+ */
+static void index_columns_grow(struct index_columns *cols, unsigned alloc)
+{
+    if (alloc <= cols->alloc) return;
+
+    cols->uid = xrealloc(cols->uid, alloc * sizeof(uint32_t));
+    cols->system_flags = xrealloc(cols->system_flags, alloc * sizeof(bit32));
+    cols->user_flags = xrealloc(cols->user_flags,
+				alloc * (MAX_USER_FLAGS/32) * sizeof(bit32));
+    cols->internaldate = xrealloc(cols->internaldate, alloc * sizeof(time_t));
+    cols->sentdate = xrealloc(cols->sentdate, alloc * sizeof(time_t));
+    cols->size = xrealloc(cols->size, alloc * sizeof(uint32_t));
+    cols->modseq = xrealloc(cols->modseq, alloc * sizeof(modseq_t));
+    cols->isseen = xrealloc(cols->isseen, alloc);
+    cols->isrecent = xrealloc(cols->isrecent, alloc);
+    cols->alloc = alloc;
+}
+
+static void index_columns_free(struct index_columns **colsptr)
+{
+    struct index_columns *cols = *colsptr;
+
+    if (!cols) return;
+
+    free(cols->uid);
+    free(cols->system_flags);
+    free(cols->user_flags);
+    free(cols->internaldate);
+    free(cols->sentdate);
+    free(cols->size);
+    free(cols->modseq);
+    free(cols->isseen);
+    free(cols->isrecent);
+    free(cols);
+
+    *colsptr = NULL;
+}
+
+static void index_columns_update(struct index_state *state, uint32_t msgno)
+{
+    struct index_columns *cols = state->columns;
+    struct index_map *im = &state->map[msgno-1];
+    unsigned i = msgno - 1;
+    unsigned j;
+
+    if (!cols) return;
+
+    cols->uid[i] = im->record.uid;
+    cols->system_flags[i] = im->record.system_flags;
+    for (j = 0; j < (MAX_USER_FLAGS/32); j++)
+	cols->user_flags[i*(MAX_USER_FLAGS/32) + j] = im->record.user_flags[j];
+    cols->internaldate[i] = im->record.internaldate;
+    cols->sentdate[i] = im->record.sentdate;
+    cols->size[i] = im->record.size;
+    cols->modseq[i] = im->record.modseq;
+    cols->isseen[i] = im->isseen ? 1 : 0;
+    cols->isrecent[i] = im->isrecent ? 1 : 0;
+}
+
+/* get the column snapshot, building it on first use */
+static struct index_columns *index_columns(struct index_state *state)
+{
+    uint32_t msgno;
+
+    if (!state->columns) {
+	state->columns = xzmalloc(sizeof(struct index_columns));
+	index_columns_grow(state->columns, state->mapsize);
+	for (msgno = 1; msgno <= state->exists; msgno++)
+	    index_columns_update(state, msgno);
+    }
+
+    return state->columns;
+}
+
 void index_refresh(struct index_state *state)
 {
     struct mailbox *mailbox = state->mailbox;
@@ -492,6 +576,8 @@ void index_refresh(struct index_state *state)
 	state->mapsize = (need_records | 0xff) + 1; /* round up 1-256 */
 	state->map = xrealloc(state->map,
 			      state->mapsize * sizeof(struct index_map));
+	if (state->columns)
+	    index_columns_grow(state->columns, state->mapsize);
     }
 
     seenlist = _readseen(state, &recentuid);
@@ -499,7 +585,9 @@ void index_refresh(struct index_state *state)
     /* already known records - flag updates */
     for (msgno = 1; msgno <= state->exists; msgno++) {
 	im = &state->map[msgno-1];
-	if (mailbox_read_index_record(mailbox, im->record.recno, &im->record))
+	/* no recno: gone before index_setview() found it */
+	if (im->record.recno &&
+	    mailbox_read_index_record(mailbox, im->record.recno, &im->record))
 	    continue; /* bogus read... should probably be fatal */
 
 	/* ignore expunged messages */
@@ -510,6 +598,7 @@ void index_refresh(struct index_state *state)
 	     * be one lower so the client can safely resync */
 	    if (!delayed_modseq || im->record.modseq < delayed_modseq)
 		delayed_modseq = im->record.modseq - 1;
+	    index_columns_update(state, msgno);
 	    continue;
 	}
 
@@ -529,6 +618,8 @@ void index_refresh(struct index_state *state)
 	    /* we don't need to dirty seen here, it's a refresh */
 	    numrecent++;
 	}
+
+	index_columns_update(state, msgno);
     }
 
     /* new records? */
@@ -568,6 +659,8 @@ void index_refresh(struct index_state *state)
 	/* don't auto-tell */
 	im->told_modseq = im->record.modseq;
 
+	index_columns_update(state, msgno);
+
 	msgno++;
     }
 
@@ -706,6 +799,122 @@ int index_check(struct index_state *state, int usinguid, int printuid)
     return r;
 }
 
+/*
+ * Describe what the client has been told about the mailbox
+ */
+void index_getview(struct index_state *state, struct index_view *view)
+{
+    uint32_t msgno;
+    struct index_map *im;
+
+    view->uidvalidity = state->mailbox->i.uidvalidity;
+    view->highestmodseq = state->highestmodseq;
+    view->uids = seqset_init(0, SEQ_SPARSE);
+    view->recent = seqset_init(0, SEQ_SPARSE);
+
+    for (msgno = 1; msgno <= state->oldexists; msgno++) {
+	im = &state->map[msgno-1];
+
+	seqset_add(view->uids, im->record.uid, 1);
+	if (im->isrecent)
+	    seqset_add(view->recent, im->record.uid, 1);
+
+	/* changes we haven't told about yet must come out again */
+	if (im->told_modseq < im->record.modseq &&
+	    im->told_modseq < view->highestmodseq)
+	    view->highestmodseq = im->told_modseq;
+    }
+}
+
+/*
+ * Make a freshly opened index look like 'view', so that the next
+ * check reports what changed since the client was given it.
+ */
+int index_setview(struct index_state *state, const struct index_view *view)
+{
+    struct index_map *map, *im;
+    unsigned mapsize, n, i, uid;
+    uint32_t msgno = 0, oldexists;
+    size_t range;
+    int r;
+
+    r = index_lock(state);
+    if (r) return r;
+
+    if (view->uidvalidity != state->mailbox->i.uidvalidity) {
+	index_unlock(state);
+	return IMAP_MAILBOX_NONEXISTENT;
+    }
+
+    for (n = 0, range = 0; range < view->uids->len; range++)
+	n += view->uids->set[range].high - view->uids->set[range].low + 1;
+
+    mapsize = ((n + state->exists) | 0xff) + 1;
+    map = xzmalloc(mapsize * sizeof(struct index_map));
+
+    /* the messages the client knows about, by uid */
+    i = 0;
+    for (range = 0; range < view->uids->len; range++) {
+	for (uid = view->uids->set[range].low;
+	     uid <= view->uids->set[range].high; uid++) {
+	    /* uids only go up, so these can't be anything the client
+	     * saw.  Shouldn't happen, but don't shuffle msgnos for it. */
+	    while (i < state->exists && state->map[i].record.uid < uid) {
+		syslog(LOG_ERR, "index_setview: %s uid %u out of order",
+		       state->mailbox->name, state->map[i].record.uid);
+		i++;
+	    }
+
+	    im = &map[msgno++];
+	    if (i < state->exists && state->map[i].record.uid == uid) {
+		*im = state->map[i++];
+		if (im->record.modseq > view->highestmodseq)
+		    im->told_modseq = view->highestmodseq;
+	    }
+	    else {
+		/* gone since: left for index_tellexpunge() */
+		im->record.uid = uid;
+		im->record.system_flags = FLAG_DELETED | FLAG_EXPUNGED;
+		im->record.modseq = state->highestmodseq;
+		im->told_modseq = im->record.modseq;
+	    }
+	    im->isrecent = seqset_ismember(view->recent, uid);
+	}
+    }
+    oldexists = msgno;
+
+    /* and the ones which arrived since */
+    while (i < state->exists)
+	map[msgno++] = state->map[i++];
+
+    free(state->map);
+    state->map = map;
+    state->mapsize = mapsize;
+    index_columns_free(&state->columns);
+
+    state->exists = msgno;
+    state->oldexists = oldexists;
+    state->numrecent = 0;
+    state->numunseen = 0;
+    state->firstnotseen = 0;
+    for (msgno = 1; msgno <= state->exists; msgno++) {
+	im = &state->map[msgno-1];
+	if (im->record.system_flags & FLAG_EXPUNGED)
+	    continue;
+	if (im->isrecent)
+	    state->numrecent++;
+	if (!im->isseen) {
+	    state->numunseen++;
+	    if (!state->firstnotseen)
+		state->firstnotseen = msgno;
+	}
+    }
+
+    index_unlock(state);
+
+    return 0;
+}
+
 /*
  * Perform UID FETCH (VANISHED) on a sequence.
  */
@@ -831,6 +1040,7 @@ static int _fetch_setseen(struct index_state *state, uint32_t msgno)
     state->numunseen--;
     state->seen_dirty = 1;
     im->isseen = 1;
+    index_columns_update(state, msgno);
 
     /* RFC2060 says:
      * The \Seen flag is implicitly set; if this causes
@@ -1153,6 +1363,8 @@ int index_run_annotator(struct index_state *state,
 
 	r = mailbox_rewrite_index_record(mailbox, &im->record);
 	if (r) goto out;
+
+	index_columns_update(state, msgno);
     }
 
 out:
@@ -1250,6 +1462,131 @@ int index_scan(struct index_state *state, const char *contents)
     return n;
 }
 
+/*
+ * Narrow 'match' (one byte per message, indexed by msgno-1, non-zero
+ * if the message may still match) using the criteria in searchargs
+ * that can be answered from the column snapshot alone.
+ *
+ * Each criterion is a straight pass over one column.  Returns 1 if
+ * there were no other criteria, in which case 'match' is exact and
+ * the messages need no further evaluation.
+ */
+static int index_search_columns(struct index_state *state,
+				struct searchargs *searchargs,
+				unsigned char *match)
+{
+    struct index_columns *cols = index_columns(state);
+    unsigned n = state->exists;
+    unsigned i, j;
+    struct seqset *seq;
+    struct searchsub *s;
+    unsigned char *sub1, *sub2;
+    int exact = 1, exact1, exact2;
+
+    if (searchargs->flags & SEARCH_RECENT_SET)
+	for (i = 0; i < n; i++) match[i] &= cols->isrecent[i];
+    if (searchargs->flags & SEARCH_RECENT_UNSET)
+	for (i = 0; i < n; i++) match[i] &= !cols->isrecent[i];
+    if (searchargs->flags & SEARCH_SEEN_SET)
+	for (i = 0; i < n; i++) match[i] &= cols->isseen[i];
+    if (searchargs->flags & SEARCH_SEEN_UNSET)
+	for (i = 0; i < n; i++) match[i] &= !cols->isseen[i];
+
+    if (searchargs->smaller)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->size[i] < searchargs->smaller);
+    if (searchargs->larger)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->size[i] > searchargs->larger);
+
+    if (searchargs->after)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->internaldate[i] >= searchargs->after);
+    if (searchargs->before)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->internaldate[i] < searchargs->before);
+    if (searchargs->sentafter)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->sentdate[i] >= searchargs->sentafter);
+    if (searchargs->sentbefore)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->sentdate[i] < searchargs->sentbefore);
+
+    if (searchargs->modseq)
+	for (i = 0; i < n; i++)
+	    match[i] &= (cols->modseq[i] >= searchargs->modseq);
+
+    if (searchargs->system_flags_set) {
+	bit32 set = searchargs->system_flags_set;
+	for (i = 0; i < n; i++)
+	    match[i] &= ((cols->system_flags[i] & set) == set);
+    }
+    if (searchargs->system_flags_unset) {
+	bit32 unset = searchargs->system_flags_unset;
+	for (i = 0; i < n; i++)
+	    match[i] &= !(cols->system_flags[i] & unset);
+    }
+
+    for (j = 0; j < (MAX_USER_FLAGS/32); j++) {
+	bit32 set = searchargs->user_flags_set[j];
+	bit32 unset = searchargs->user_flags_unset[j];
+	bit32 *uf = cols->user_flags + j;
+
+	if (!set && !unset) continue;
+
+	for (i = 0; i < n; i++) {
+	    bit32 flags = uf[i*(MAX_USER_FLAGS/32)];
+	    match[i] &= ((flags & set) == set) && !(flags & unset);
+	}
+    }
+
+    for (seq = searchargs->sequence; seq; seq = seq->nextseq) {
+	for (i = 0; i < n; i++) {
+	    if (match[i] && !seqset_ismember(seq, i+1))
+		match[i] = 0;
+	}
+    }
+    for (seq = searchargs->uidsequence; seq; seq = seq->nextseq) {
+	for (i = 0; i < n; i++) {
+	    if (match[i] && !seqset_ismember(seq, cols->uid[i]))
+		match[i] = 0;
+	}
+    }
+
+    /* OR and NOT.  The sub-results start from our current candidates,
+     * which saves work without changing either operator's answer for
+     * them.  A NOT can only be applied if we know exactly what it
+     * negates; an OR of two supersets is still a superset. */
+    for (s = searchargs->sublist; s; s = s->next) {
+	sub1 = xmalloc(n);
+	memcpy(sub1, match, n);
+	exact1 = index_search_columns(state, s->sub1, sub1);
+	if (!s->sub2) {
+	    if (exact1) {
+		for (i = 0; i < n; i++) match[i] &= !sub1[i];
+	    }
+	    else exact = 0;
+	}
+	else {
+	    sub2 = xmalloc(n);
+	    memcpy(sub2, match, n);
+	    exact2 = index_search_columns(state, s->sub2, sub2);
+	    for (i = 0; i < n; i++) match[i] &= (sub1[i] | sub2[i]);
+	    if (!exact1 || !exact2) exact = 0;
+	    free(sub2);
+	}
+	free(sub1);
+    }
+
+    if (searchargs->from || searchargs->to || searchargs->cc ||
+	searchargs->bcc || searchargs->subject || searchargs->messageid ||
+	searchargs->body || searchargs->text || searchargs->header_name ||
+	searchargs->annotations || searchargs->cache_atleast)
+	exact = 0;
+
+    return exact;
+}
+
 /*
  * Guts of the SEARCH command.
  * 
@@ -1265,6 +1602,8 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
     int listindex, min;
     int listcount;
     struct index_map *im;
+    unsigned char *match;
+    int exact;
 
     if (state->exists <= 0) return 0;
 
@@ -1277,6 +1616,24 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
        already looked at. */
     listcount = search_prefilter_messages(*msgno_list, state, searchargs);
 
+    /* Then drop anything the column snapshot can already rule out */
+    if (config_getswitch(IMAPOPT_SEARCH_COLUMNS)) {
+	match = xmalloc(state->exists);
+	for (msgno = 1; msgno <= state->exists; msgno++)
+	    match[msgno-1] = !(state->map[msgno-1].record.system_flags &
+			       FLAG_EXPUNGED);
+	exact = index_search_columns(state, searchargs, match);
+	for (listindex = 0; listindex < listcount; listindex++) {
+	    msgno = (*msgno_list)[listindex];
+	    if (match[msgno-1])
+		(*msgno_list)[n++] = msgno;
+	}
+	listcount = n;
+	n = 0;
+	free(match);
+    }
+    else exact = 0;
+
     if (searchargs->returnopts == SEARCH_RETURN_MAX) {
 	/* If we only want MAX, then skip forward search,
 	   and do complete reverse search */
@@ -1297,7 +1654,7 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	if (im->record.system_flags & FLAG_EXPUNGED)
 	    continue;
 
-	if (index_search_evaluate(state, searchargs, msgno, NULL)) {
+	if (exact || index_search_evaluate(state, searchargs, msgno, NULL)) {
 	    (*msgno_list)[n++] = msgno;
 	    if (highestmodseq && im->record.modseq > *highestmodseq) {
 		*highestmodseq = im->record.modseq;
@@ -1330,7 +1687,7 @@ static int _index_search(unsigned **msgno_list, struct index_state *state,
 	if (im->record.system_flags & FLAG_EXPUNGED)
 	    continue;
 
-	if (index_search_evaluate(state, searchargs, msgno, NULL)) {
+	if (exact || index_search_evaluate(state, searchargs, msgno, NULL)) {
 	    (*msgno_list)[n++] = msgno;
 	    if (highestmodseq && im->record.modseq > *highestmodseq) {
 		*highestmodseq = im->record.modseq;
@@ -1400,6 +1757,10 @@ int index_status(struct index_state *state, struct statusdata *sdata)
 
 static void index_unlock(struct index_state *state)
 {
+    /* a change to our seen db moves nobody's STATUS but our own */
+    int seen_changed = state->seen_dirty && !state->internalseen &&
+		       !state->examining;
+
     /* XXX - errors */
 
     index_writeseen(state);
@@ -1413,6 +1774,8 @@ static void index_unlock(struct index_state *state)
 	/* RECENT is zero for everyone else because we wrote a new
 	 * recentuid! */
 	sdata.recent = 0;
+	if (seen_changed && !state->mailbox->i.dirty)
+	    statuscache_update(state->mailbox->name, &sdata);
 	mailbox_unlock_index(state->mailbox, &sdata);
     }
     else
@@ -1776,7 +2139,7 @@ static int index_appendremote(struct index_state *state, uint32_t msgno,
     prot_printf(pout, ") \"%s\" ", datebuf);
 
     /* message literal */
-    index_fetchmsg(state, msg_base, msg_size, 0, im->record.size, 0, 0);
+    index_fetchmsg(state, msg_base, msg_size, -1, 0, im->record.size, 0, 0);
 
     /* close the message file */
     if (msg_base) 
@@ -1839,6 +2202,43 @@ unsigned index_finduid(struct index_state *state, unsigned uid)
     return high;
 }
 
+/*
+ * Batched index_finduid(): set bit 'msgno' in 'msgnos' for each UID
+ * in 'uids' which is in the mailbox.  UIDs which arrive in ascending
+ * order, as they do from SQUAT, are merged against the map in a single
+ * pass; a handful of UIDs or an unsorted list get a binary search each.
+ */
+void index_finduids(struct index_state *state, const unsigned *uids,
+		    unsigned nuids, bitvector_t *msgnos)
+{
+    unsigned i;
+    uint32_t msgno;
+    int sorted = 1;
+
+    for (i = 1; sorted && i < nuids; i++)
+	if (uids[i] < uids[i-1]) sorted = 0;
+
+    if (!sorted || nuids * 16 < state->exists) {
+	for (i = 0; i < nuids; i++) {
+	    msgno = index_finduid(state, uids[i]);
+	    if (msgno && index_getuid(state, msgno) == uids[i])
+		bv_set(msgnos, msgno);
+	}
+	return;
+    }
+
+    msgno = 1;
+    for (i = 0; i < nuids; i++) {
+	while (msgno <= state->exists &&
+	       state->map[msgno-1].record.uid < uids[i])
+	    msgno++;
+	if (msgno > state->exists)
+	    break;
+	if (state->map[msgno-1].record.uid == uids[i])
+	    bv_set(msgnos, msgno);
+    }
+}
+
 /* Helper function to determine domain of data */
 enum {
     DOMAIN_7BIT = 0,
@@ -1863,10 +2263,11 @@ static int data_domain(const char *p, size_t n)
  * of size 'msg_size', starting at 'offset' and containing 'size'
  * octets.  If 'octet_count' is nonzero, the data is
  * further constrained by 'start_octet' and 'octet_count' as per the
- * IMAP command PARTIAL.
+ * IMAP command PARTIAL.  If 'msg_fd' isn't -1, it's the file which
+ * 'msg_base' maps, and large literals are sent straight from it.
  */
 void index_fetchmsg(struct index_state *state, const char *msg_base,
-		    unsigned long msg_size, unsigned offset,
+		    unsigned long msg_size, int msg_fd, unsigned offset,
 		    unsigned size,     /* this is the correct size for a news message after
 					  having LF translated to CRLF */
 		    unsigned start_octet, unsigned octet_count)
@@ -1923,7 +2324,10 @@ void index_fetchmsg(struct index_state *state, const char *msg_base,
     /* Non-text literal -- tell the protstream about it */
     if (domain != DOMAIN_7BIT) prot_data_boundary(state->out);
 
-    prot_write(state->out, msg_base + offset, n);
+    if (msg_fd != -1)
+	prot_sendfile(state->out, msg_fd, msg_base, offset, n);
+    else
+	prot_write(state->out, msg_base + offset, n);
     while (n++ < size) {
 	/* File too short, resynch client.
 	 *
@@ -1942,7 +2346,8 @@ void index_fetchmsg(struct index_state *state, const char *msg_base,
  */
 static int index_fetchsection(struct index_state *state, const char *resp,
 			      const char *msg_base, unsigned long msg_size,
-			      char *section, const char *cachestr, unsigned size,
+			      int msg_fd, char *section,
+			      const char *cachestr, unsigned size,
 			      unsigned start_octet, unsigned octet_count)
 {
     const char *p;
@@ -1959,7 +2364,7 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 	    prot_printf(state->out, "%s%u", resp, size);
 	} else {
 	    prot_printf(state->out, "%s", resp);
-	    index_fetchmsg(state, msg_base, msg_size, 0, size,
+	    index_fetchmsg(state, msg_base, msg_size, msg_fd, 0, size,
 			   start_octet, octet_count);
 	}
 	return 0;
@@ -2052,16 +2457,17 @@ static int index_fetchsection(struct index_state *state, const char *resp,
 	    return 0;
 	}
 	else {
-	    /* BINARY */
+	    /* BINARY: no longer the data in the file */
 	    offset = 0;
 	    size = newsize;
 	    msg_size = newsize;
+	    msg_fd = -1;
 	}
     }
 
     /* Output body part */
     prot_printf(state->out, "%s", resp);
-    index_fetchmsg(state, msg_base, msg_size, offset, size,
+    index_fetchmsg(state, msg_base, msg_size, msg_fd, offset, size,
 		   start_octet, octet_count);
 
     if (decbuf) free(decbuf);
@@ -2484,8 +2890,10 @@ static void index_tellexpunge(struct index_state *state)
 	}
 
 	/* copy back if necessary (after first expunge) */
-	if (msgno < oldmsgno)
+	if (msgno < oldmsgno) {
 	    state->map[msgno-1] = *im;
+	    index_columns_update(state, msgno);
+	}
 
 	msgno++;
     }
@@ -2678,6 +3086,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     int fetchitems = fetchargs->fetchitems;
     const char *msg_base = NULL;
     size_t msg_size = 0;
+    int msg_fd = -1;
     struct octetinfo *oi = NULL;
     int sepchar = '(';
     int started = 0;
@@ -2698,7 +3107,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	fetchargs->cache_atleast > im->record.cache_version || 
 	fetchargs->binsections || fetchargs->sizesections ||
 	fetchargs->bodysections) {
-	if (mailbox_map_message(mailbox, im->record.uid, &msg_base, &msg_size)) {
+	if (mailbox_map_message_fd(mailbox, im->record.uid, &msg_fd,
+				   &msg_base, &msg_size)) {
 	    prot_printf(state->out, "* OK ");
 	    prot_printf(state->out, error_message(IMAP_NO_MSGGONE), msgno);
 	    prot_printf(state->out, "\r\n");
@@ -2773,7 +3183,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_HEADER) {
 	prot_printf(state->out, "%cRFC822.HEADER ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(state, msg_base, msg_size, 0,
+	index_fetchmsg(state, msg_base, msg_size, msg_fd, 0,
 		       im->record.header_size,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
@@ -2795,7 +3205,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_TEXT) {
 	prot_printf(state->out, "%cRFC822.TEXT ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(state, msg_base, msg_size,
+	index_fetchmsg(state, msg_base, msg_size, msg_fd,
 		       im->record.header_size, im->record.size - im->record.header_size,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
@@ -2805,7 +3215,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     if (fetchitems & FETCH_RFC822) {
 	prot_printf(state->out, "%cRFC822 ", sepchar);
 	sepchar = ' ';
-	index_fetchmsg(state, msg_base, msg_size, 0, im->record.size,
+	index_fetchmsg(state, msg_base, msg_size, msg_fd, 0, im->record.size,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
 		         fetchargs->start_octet : 0,
 		       (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2861,7 +3271,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
 	if (!mailbox_cacherecord(mailbox, &im->record)) {
 	    r = index_fetchsection(state, respbuf,
-				   msg_base, msg_size,
+				   msg_base, msg_size, msg_fd,
 				   section->name, cacheitem_base(&im->record, CACHE_SECTION),
 				   im->record.size,
 				   (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2883,7 +3293,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 	if (!mailbox_cacherecord(mailbox, &im->record)) {
 	    oi = &section->octetinfo;
 	    r = index_fetchsection(state, respbuf,
-				   msg_base, msg_size,
+				   msg_base, msg_size, msg_fd,
 				   section->name, cacheitem_base(&im->record, CACHE_SECTION),
 				   im->record.size,
 				   (fetchitems & FETCH_IS_PARTIAL) ?
@@ -2904,7 +3314,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
 
         if (!mailbox_cacherecord(mailbox, &im->record)) {
 	    r = index_fetchsection(state, respbuf,
-				   msg_base, msg_size,
+				   msg_base, msg_size, msg_fd,
 				   section->name, cacheitem_base(&im->record, CACHE_SECTION),
 				   im->record.size,
 				   fetchargs->start_octet, fetchargs->octet_count);
@@ -2917,6 +3327,8 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     }
     if (msg_base) 
 	mailbox_unmap_message(mailbox, im->record.uid, &msg_base, &msg_size);
+    if (msg_fd != -1)
+	close(msg_fd);
 
     return r;
 }
@@ -3219,6 +3631,8 @@ static int index_storeflag(struct index_state *state, uint32_t msgno,
     r = mailbox_rewrite_index_record(mailbox, &im->record);
     if (r) return r;
 
+    index_columns_update(state, msgno);
+
     /* if it's silent and unchanged, update the seen value */
     if (storeargs->silent && im->told_modseq == oldmodseq)
 	im->told_modseq = im->record.modseq;
@@ -3254,6 +3668,8 @@ static int index_store_annotation(struct index_state *state,
     r = mailbox_rewrite_index_record(mailbox, &im->record);
     if (r) goto out;
 
+    index_columns_update(state, msgno);
+
     /* if it's silent and unchanged, update the seen value */
     if (storeargs->silent && im->told_modseq == oldmodseq)
 	im->told_modseq = im->record.modseq;
@@ -3524,12 +3940,8 @@ static int index_search_evaluate(struct index_state *state,
 	if (mailbox_cacherecord(mailbox, &im->record))
 	    goto zero;
 
-	for (l = searchargs->body; l; l = l->next) {
-	    if (!index_searchmsg(l->s, l->p, msgfile, 1,
-				 cacheitem_base(&im->record, CACHE_SECTION))) goto zero;
-	}
-	for (l = searchargs->text; l; l = l->next) {
-	    if (!index_searchmsg(l->s, l->p, msgfile, 0,
+	if (searchargs->body || searchargs->text) {
+	    if (!index_searchmsg(searchargs, msgfile,
 				 cacheitem_base(&im->record, CACHE_SECTION))) goto zero;
 	}
     }
@@ -3555,13 +3967,14 @@ zero:
 }
 
 /*
- * Search part of a message for a substring.
+ * Search the parts of a message for all of the BODY and TEXT strings
+ * in 'searchargs' at once, decoding each part only once.  BODY strings
+ * don't look at the top-level message header.  Returns nonzero iff
+ * every string was found.
  * Keep this in sync with index_getsearchtextmsg!
  */
-static int index_searchmsg(char *substr,
-			   comp_pat *pat,
+static int index_searchmsg(struct searchargs *searchargs,
 			   struct mapfile *msgfile,
-			   int skipheader,
 			   const char *cachestr)
 {
     int partsleft = 1;
@@ -3569,31 +3982,56 @@ static int index_searchmsg(char *substr,
     unsigned long start;
     int len, charset, encoding;
     char *p;
+    struct strlist *l;
+    const char **pats;
+    unsigned char *found;
+    int nbody = 0, npat = 0;
+    int skipheader = 1;
+    int r = 0;
     
     /* Won't find anything in a truncated file */
     if (msgfile->size == 0) return 0;
 
+    for (l = searchargs->body; l; l = l->next) nbody++;
+    npat = nbody;
+    for (l = searchargs->text; l; l = l->next) npat++;
+
+    /* compile all the strings together the first time through */
+    if (!searchargs->bodytext_pat) {
+	int i = 0;
+
+	pats = xmalloc(npat * sizeof(char *));
+	for (l = searchargs->body; l; l = l->next) pats[i++] = l->s;
+	for (l = searchargs->text; l; l = l->next) pats[i++] = l->s;
+	searchargs->bodytext_pat = charset_compilemultipat(pats, npat);
+	free(pats);
+    }
+
+    found = xzmalloc(npat);
+
     while (partsleft--) {
 	subparts = CACHE_ITEM_BIT32(cachestr);
 	cachestr += 4;
 	if (subparts) {
 	    partsleft += subparts-1;
 
-	    if (skipheader) {
-		skipheader = 0; /* Only skip top-level message header */
-	    }
-	    else {
-		len = CACHE_ITEM_BIT32(cachestr + CACHE_ITEM_SIZE_SKIP);
-		if (len > 0) {
-		    p = index_readheader(msgfile->base, msgfile->size,
-					 CACHE_ITEM_BIT32(cachestr),
-					 len);
-		    if (p) {
-			if (charset_search_mimeheader(substr, pat, p, charset_flags))
-			    return 1;
-		    }
+	    /* Only TEXT strings look at the top-level message header */
+	    len = CACHE_ITEM_BIT32(cachestr + CACHE_ITEM_SIZE_SKIP);
+	    if (len > 0 && !(skipheader && npat == nbody)) {
+		p = index_readheader(msgfile->base, msgfile->size,
+				     CACHE_ITEM_BIT32(cachestr),
+				     len);
+		if (p) {
+		    /* hide the BODY strings from the top-level header;
+		     * nothing has been searched before it */
+		    if (skipheader) memset(found, 1, nbody);
+		    r = charset_search_mimeheader_multi(searchargs->bodytext_pat,
+							found, p, charset_flags);
+		    if (skipheader) memset(found, 0, nbody);
+		    if (r && !(skipheader && nbody)) goto done;
 		}
 	    }
+	    skipheader = 0; /* Only skip top-level message header */
 	    cachestr += 5*4;
 
 	    while (--subparts) {
@@ -3604,16 +4042,25 @@ static int index_searchmsg(char *substr,
 
 		if (start < msgfile->size && len > 0 &&
 		    charset >= 0 && charset < 0xffff) {
-		    if (charset_searchfile(substr, pat,
-					   msgfile->base + start,
-					   len, charset, encoding, charset_flags)) return 1;
+		    if (charset_searchfile_multi(searchargs->bodytext_pat, found,
+						 msgfile->base + start,
+						 len, charset, encoding,
+						 charset_flags)) {
+			r = 1;
+			goto done;
+		    }
 		}
 		cachestr += 5*4;
 	    }
 	}
     }
 
-    return 0;
+    r = 0;
+
+done:
+    free(found);
+
+    return r;
 }
     
 /*
@@ -61,6 +61,7 @@
 #include <ctype.h>
 
 #include "annotate.h" /* for strlist functionality */
+#include "bitvector.h"
 #include "message_guid.h"
 #include "sequence.h"
 #include "strarray.h"
@@ -90,6 +91,17 @@ struct index_init {
     struct seqset *vanishedlist;
 };
 
+/* What a client has been told about a mailbox: which message each
+ * sequence number is, which of them are \Recent, and the modseq up
+ * to which it has seen flag changes.  Enough to pick the session up
+ * again in another process. */
+struct index_view {
+    unsigned long uidvalidity;
+    modseq_t highestmodseq;
+    struct seqset *uids;
+    struct seqset *recent;
+};
+
 struct index_map {
     struct index_record record;
     modseq_t told_modseq;
@@ -97,6 +109,24 @@ struct index_map {
     int isrecent:1;
 };
 
+/* Column-wise copy of the index_map fields that SEARCH tests most,
+ * indexed by msgno-1.  Built on the first search of a mailbox and
+ * then kept in step with state->map, so searches over flags, dates,
+ * sizes and modseqs can scan a few dense arrays instead of the whole
+ * map. */
+struct index_columns {
+    unsigned alloc;
+    uint32_t *uid;
+    bit32 *system_flags;
+    bit32 *user_flags;		/* MAX_USER_FLAGS/32 words per message */
+    time_t *internaldate;
+    time_t *sentdate;
+    uint32_t *size;
+    modseq_t *modseq;
+    unsigned char *isseen;
+    unsigned char *isrecent;
+};
+
 struct index_state {
     struct mailbox *mailbox;
     unsigned num_records;
@@ -107,6 +137,7 @@ struct index_state {
     modseq_t delayed_modseq;
     struct index_map *map;
     unsigned mapsize;
+    struct index_columns *columns;
     int internalseen;
     int skipped_expunge;
     int seen_dirty;
@@ -231,11 +262,16 @@ extern void index_select(struct index_state *state, struct index_init *init);
 extern int index_status(struct index_state *state, struct statusdata *sdata);
 extern void index_close(struct index_state **stateptr);
 extern unsigned index_finduid(struct index_state *state, unsigned uid);
+extern void index_finduids(struct index_state *state, const unsigned *uids,
+			   unsigned nuids, bitvector_t *msgnos);
 extern void index_tellchanges(struct index_state *state, int canexpunge,
 			      int printuid, int printmodseq);
 extern unsigned index_getuid(struct index_state *state, uint32_t msgno);
 extern modseq_t index_highestmodseq(struct index_state *state);
 extern int index_check(struct index_state *state, int usinguid, int printuid);
+extern void index_getview(struct index_state *state, struct index_view *view);
+extern int index_setview(struct index_state *state,
+			 const struct index_view *view);
 extern int index_urlfetch(struct index_state *state, uint32_t msgno,
 			  unsigned params, const char *section,
 			  unsigned long start_octet, unsigned long octet_count,
@@ -265,6 +301,13 @@ extern void index_getsearchtext(struct index_state *state,
                                 index_search_text_receiver_t receiver,
                                 void* rock);
 
+/* squatter keys each SQUAT document by the message UID and the part
+   type character which starts the document's name */
+#define SEARCHINDEX_DOC_KEY(uid, part_char) \
+	(((long long)(uid) << 8) | (unsigned char)(part_char))
+#define SEARCHINDEX_DOC_KEY_UID(key) ((unsigned)((key) >> 8))
+#define SEARCHINDEX_DOC_KEY_PART(key) ((int)((key) & 0xff))
+
 extern int index_getuidsequence(struct index_state *state,
 				struct searchargs *searchargs,
 				unsigned **uid_list);
@@ -0,0 +1,392 @@
+/* lmtp_batch.c -- batch lmtpd appends by mailbox
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "acl.h"
+#include "append.h"
+#include "assert.h"
+#include "duplicate.h"
+#include "global.h"
+#include "imap_err.h"
+#include "lmtp_batch.h"
+#include "mailbox.h"
+#include "xmalloc.h"
+
+/*
+ * Recipients of one message that land in the same mailbox are appended
+ * under a single lock: the first delivery opens an append session and
+ * leaves it pending, later deliveries to the same mailbox by the same
+ * user add to it, and the session is committed when delivery moves on
+ * to another mailbox or the message is done.  Logging and duplicate
+ * marks happen at commit time.  If the commit fails, every recipient
+ * with a message in the session gets the error as its LMTP status.  If
+ * one recipient's append fails, which aborts the session, the messages
+ * of those before it are appended again in a new one, so that only that
+ * recipient sees the error.
+ */
+struct batch_rcpt {
+    int rcpt;			/* recipient number in the transaction */
+    int dup;			/* duplicate of a pending message */
+    char *id;			/* for the duplicate mark */
+    char *date;
+    strarray_t *flags;		/* to append the message again */
+    char *user;			/* user to notify, if any */
+    const char *notifyheader;
+};
+
+static struct {
+    struct appendstate as;
+    char *mailboxname;		/* NULL if no session is pending */
+    char *authuser;
+    struct auth_state *authstate;
+    struct stagemsg *stage;
+    struct body **body;
+    int nolink;
+    int dupelim;
+    int nummsg;			/* entries that appended a message */
+    int count;
+    int alloc;
+    struct batch_rcpt *rcpts;
+} batch;
+
+static int batch_nrcpts = 0;
+static int *batch_failed = NULL; /* per-recipient commit errors */
+static batch_delivered_t *batch_delivered = NULL;
+static void *batch_rock = NULL;
+
+static void batch_add(int rcpt, int dup, const char *id, const char *date,
+		      const strarray_t *flags,
+		      const char *user, const char *notifyheader)
+{
+    struct batch_rcpt *br;
+
+    if (batch.count == batch.alloc) {
+	batch.alloc += 16;
+	batch.rcpts = xrealloc(batch.rcpts,
+			       batch.alloc * sizeof(struct batch_rcpt));
+    }
+    br = &batch.rcpts[batch.count++];
+    br->rcpt = rcpt;
+    br->dup = dup;
+    br->id = xstrdupnull(id);
+    br->date = xstrdupnull(date);
+    br->flags = flags ? strarray_dup(flags) : NULL;
+    br->user = xstrdupnull(user);
+    br->notifyheader = notifyheader;
+    if (!dup) batch.nummsg++;
+}
+
+/* is a copy of message 'id' already pending? */
+static int batch_pending(const char *id)
+{
+    int i;
+
+    for (i = 0; i < batch.count; i++) {
+	struct batch_rcpt *br = &batch.rcpts[i];
+
+	if (!br->dup && br->id && !strcmp(br->id, id))
+	    return 1;
+    }
+
+    return 0;
+}
+
+static void batch_fail(int r)
+{
+    int i;
+
+    for (i = 0; i < batch.count; i++) {
+	int rcpt = batch.rcpts[i].rcpt;
+
+	if (rcpt >= 0 && rcpt < batch_nrcpts)
+	    batch_failed[rcpt] = r;
+    }
+}
+
+static void batch_reset(void)
+{
+    int i;
+
+    for (i = 0; i < batch.count; i++) {
+	struct batch_rcpt *br = &batch.rcpts[i];
+
+	free(br->id);
+	free(br->date);
+	if (br->flags) strarray_free(br->flags);
+	free(br->user);
+    }
+    batch.count = 0;
+    batch.nummsg = 0;
+    free(batch.mailboxname);
+    batch.mailboxname = NULL;
+    free(batch.authuser);
+    batch.authuser = NULL;
+}
+
+/* the session was aborted: append the pending messages again in a new
+ * one.  They were checked the first time, so the ACL and quota aren't */
+static int batch_redo(void)
+{
+    int i, r;
+
+    r = append_setup(&batch.as, batch.mailboxname,
+		     batch.authuser, batch.authstate, 0, NULL, NULL, 0);
+
+    for (i = 0; !r && i < batch.count; i++) {
+	struct batch_rcpt *br = &batch.rcpts[i];
+
+	if (br->dup) continue;
+
+	batch.as.auth_state = batch.authstate;
+	r = append_fromstage(&batch.as, batch.body, batch.stage, 0,
+			     br->flags, batch.nolink, /*annotations*/NULL);
+	batch.as.auth_state = NULL;
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: delivering again to %d recipients in %s: %s",
+	       batch.count, batch.mailboxname, error_message(r));
+	append_abort(&batch.as);
+    }
+
+    return r;
+}
+
+void lmtp_batch_start(int nrcpts, batch_delivered_t *delivered, void *rock)
+{
+    assert(!batch.mailboxname);
+
+    batch_nrcpts = nrcpts;
+    batch_failed = xzmalloc(sizeof(int) * nrcpts);
+    batch_delivered = delivered;
+    batch_rock = rock;
+}
+
+int lmtp_batch_append(const struct batch_msg *msg, int rcpt,
+		      const char *mailboxname, const char *authuser,
+		      struct auth_state *authstate, int acloverride,
+		      const quota_t qdiffs[QUOTA_NUMRESOURCES],
+		      const strarray_t *flags,
+		      const char *id, const char *date,
+		      const char *user, const char *notifyheader)
+{
+    duplicate_key_t dkey = DUPLICATE_INITIALIZER;
+    struct message_content *content = msg->content;
+    int r = 0;
+
+    /* only add to the pending session if it's the same mailbox
+       appended to as the same user */
+    if (batch.mailboxname &&
+	(strcmp(batch.mailboxname, mailboxname) ||
+	 strcmp(batch.as.userid, authuser ? authuser : ""))) {
+	lmtp_batch_commit();
+    }
+
+    if (!batch.mailboxname) {
+	r = append_setup(&batch.as, mailboxname,
+			 authuser, authstate, acloverride ? 0 : ACL_POST,
+			 qdiffs, NULL, 0);
+	if (r) return r;
+
+	batch.mailboxname = xstrdup(mailboxname);
+	batch.authuser = xstrdupnull(authuser);
+	batch.authstate = authstate;
+	batch.stage = msg->stage;
+	batch.body = &content->body;
+	batch.nolink = msg->nolink;
+	batch.dupelim = msg->dupelim;
+    }
+    else {
+	/* redo the checks append_setup() made for the first recipient */
+	quota_t qpending[QUOTA_NUMRESOURCES];
+	int myrights = cyrus_acl_myrights(authstate, batch.as.mailbox->acl);
+	int i;
+
+	if (!acloverride && !(myrights & ACL_POST)) {
+	    return (myrights & ACL_LOOKUP) ?
+		IMAP_PERMISSION_DENIED : IMAP_MAILBOX_NONEXISTENT;
+	}
+
+	/* the quota isn't updated until commit, so count what's pending */
+	for (i = 0; i < QUOTA_NUMRESOURCES; i++) {
+	    qpending[i] = qdiffs[i];
+	    if (qpending[i] > 0) qpending[i] *= batch.nummsg + 1;
+	}
+	r = mailbox_quota_check(batch.as.mailbox, qpending);
+	if (r) return r;
+    }
+
+    /* check for duplicate message */
+    dkey.id = id;
+    dkey.to = mailboxname;
+    if (config_getenum(IMAPOPT_DUPLICATE_MAILBOX_MODE) ==
+	    IMAP_ENUM_DUPLICATE_MAILBOX_MODE_UNIQUEID)
+	dkey.to = batch.as.mailbox->uniqueid;
+    dkey.date = date;
+    if (id && msg->dupelim &&
+	!(batch.as.mailbox->i.options & OPT_IMAP_DUPDELIVER)) {
+	if (batch_pending(id)) {
+	    duplicate_log(&dkey, "delivery");
+	    /* still fails with the session if the earlier copy does */
+	    batch_add(rcpt, 1, id, date, NULL, NULL, NULL);
+	    return 0;
+	}
+	if (duplicate_check(&dkey)) {
+	    duplicate_log(&dkey, "delivery");
+	    goto done;
+	}
+    }
+
+    if (!content->body) {
+	/* parse the message body if we haven't already,
+	   and keep the file mmap'ed */
+	r = message_parse_file(msg->f, &content->base, &content->len,
+			       &content->body);
+    }
+
+    if (!r) {
+	batch.as.auth_state = authstate;
+	r = append_fromstage(&batch.as, &content->body, msg->stage, 0,
+			     flags, msg->nolink, /*annotations*/NULL);
+	batch.as.auth_state = NULL;
+
+	if (r && batch.count) {
+	    /* that took the whole session with it, so put back the
+	       messages already pending, or fail them too */
+	    int r2;
+
+	    append_abort(&batch.as);
+	    r2 = batch_redo();
+	    if (r2) {
+		batch_fail(r2);
+		batch_reset();
+	    }
+	    return r;
+	}
+    }
+
+    if (!r) batch_add(rcpt, 0, id, date, flags, user, notifyheader);
+
+ done:
+    if (!batch.count) {
+	/* nothing in the session after all */
+	append_abort(&batch.as);
+	batch_reset();
+    }
+
+    return r;
+}
+
+void lmtp_batch_commit(void)
+{
+    struct mailbox *mailbox = NULL;
+    duplicate_key_t dkey = DUPLICATE_INITIALIZER;
+    unsigned uid;
+    int i, r;
+
+    if (!batch.mailboxname) return;
+
+    dkey.to = batch.mailboxname;
+    if (config_getenum(IMAPOPT_DUPLICATE_MAILBOX_MODE) ==
+	    IMAP_ENUM_DUPLICATE_MAILBOX_MODE_UNIQUEID)
+	dkey.to = batch.as.mailbox->uniqueid;
+    uid = batch.as.baseuid;
+
+    /* hold the mailbox open until the duplicate marks are done */
+    r = append_commit(&batch.as, &mailbox);
+    if (r) {
+	syslog(LOG_ERR, "IOERROR: delivering to %d recipients in %s: %s",
+	       batch.count, batch.mailboxname, error_message(r));
+	batch_fail(r);
+	batch_reset();
+	return;
+    }
+
+    for (i = 0; i < batch.count; i++) {
+	struct batch_rcpt *br = &batch.rcpts[i];
+
+	if (br->dup) continue;
+
+	syslog(LOG_INFO, "Delivered: %s to mailbox: %s",
+	       br->id, batch.mailboxname);
+	if (batch.dupelim && br->id) {
+	    dkey.id = br->id;
+	    dkey.date = br->date;
+	    duplicate_mark(&dkey, time(NULL), uid);
+	}
+	uid++;
+
+	if (batch_delivered)
+	    batch_delivered(batch.mailboxname, br->user, br->notifyheader,
+			    batch_rock);
+    }
+    mailbox_close(&mailbox);
+
+    batch_reset();
+}
+
+int lmtp_batch_status(int rcpt)
+{
+    if (rcpt < 0 || rcpt >= batch_nrcpts) return 0;
+
+    return batch_failed[rcpt];
+}
+
+void lmtp_batch_end(void)
+{
+    assert(!batch.mailboxname);
+
+    free(batch_failed);
+    batch_failed = NULL;
+    batch_nrcpts = 0;
+    batch_delivered = NULL;
+    batch_rock = NULL;
+}
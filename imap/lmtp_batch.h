@@ -0,0 +1,92 @@
+/* lmtp_batch.h -- batch lmtpd appends by mailbox
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_LMTP_BATCH_H
+#define INCLUDED_LMTP_BATCH_H
+
+#include <stdio.h>
+#include "auth.h"
+#include "message.h"
+#include "quota.h"
+#include "strarray.h"
+
+/* the message being delivered, the same for each recipient */
+struct batch_msg {
+    FILE *f;
+    struct message_content *content;	/* parsed when first needed */
+    struct stagemsg *stage;
+    int nolink;			/* copy the message file, don't link it */
+    int dupelim;		/* suppress duplicate deliveries */
+};
+
+/* called for each message as it's committed */
+typedef void batch_delivered_t(const char *mailboxname, const char *user,
+			       const char *notifyheader, void *rock);
+
+/* start on a message with 'nrcpts' recipients, calling 'delivered'
+ * for each copy as it's committed */
+extern void lmtp_batch_start(int nrcpts,
+			     batch_delivered_t *delivered, void *rock);
+
+/* append the message to 'mailboxname' for recipient 'rcpt', adding to
+ * the pending session if it's for the same mailbox and 'authuser', or
+ * else committing that first.  Returns 0 if the message is pending or
+ * is a duplicate, or an IMAP error for this recipient */
+extern int lmtp_batch_append(const struct batch_msg *msg, int rcpt,
+			     const char *mailboxname, const char *authuser,
+			     struct auth_state *authstate, int acloverride,
+			     const quota_t qdiffs[QUOTA_NUMRESOURCES],
+			     const strarray_t *flags,
+			     const char *id, const char *date,
+			     const char *user, const char *notifyheader);
+
+/* commit the pending session, if any */
+extern void lmtp_batch_commit(void);
+
+/* the error, if any, that recipient 'rcpt' got after lmtp_batch_append()
+ * had returned, when its message was lost with the session */
+extern int lmtp_batch_status(int rcpt);
+
+/* done with the message; everything must have been committed */
+extern void lmtp_batch_end(void);
+
+#endif /* INCLUDED_LMTP_BATCH_H */
@@ -97,6 +97,7 @@
 #include "xstrlcat.h"
 
 #include "lmtpd.h"
+#include "lmtp_batch.h"
 #include "lmtpengine.h"
 #include "lmtpstats.h"
 #ifdef USE_SIEVE
@@ -164,7 +165,8 @@ static struct protocol_t lmtp_protocol =
   { "AUTH", 512, 0, "235", "5", "334 ", "*", NULL, 0 },
   { NULL, NULL, NULL },
   { "NOOP", NULL, "250" },
-  { "QUIT", NULL, "221" }
+  { "QUIT", NULL, "221" },
+  { NULL, NULL, NULL, 0 }
 };
 
 static struct sasl_callback mysasl_cb[] = {
@@ -494,12 +496,60 @@ static int mlookup(const char *name, struct mboxlist_entry **mbentryptr)
     return r;
 }
 
+static int batch_cur_rcpt = -1;	/* recipient being delivered */
+
+/* tell 'user' about a message committed to 'mailboxname' */
+static void deliver_notify(const char *mailboxname, const char *user,
+			   const char *notifyheader,
+			   void *rock __attribute__((unused)))
+{
+    const char *notifier = config_getstring(IMAPOPT_MAILNOTIFIER);
+    char inbox[MAX_MAILBOX_BUFFER];
+    char namebuf[MAX_MAILBOX_BUFFER];
+    char userbuf[MAX_MAILBOX_BUFFER];
+    const char *notify_mailbox = mailboxname;
+    int r2;
+
+    if (!user || !notifier) return;
+
+    /* translate user.foo to INBOX */
+    if (!(*lmtpd_namespace.mboxname_tointernal)(&lmtpd_namespace,
+						"INBOX", user, inbox)) {
+	size_t inboxlen = strlen(inbox);
+	if (strlen(mailboxname) >= inboxlen &&
+	    !strncmp(mailboxname, inbox, inboxlen) &&
+	    (!mailboxname[inboxlen] || mailboxname[inboxlen] == '.')) {
+	    strlcpy(inbox, "INBOX", sizeof(inbox)); 
+	    strlcat(inbox, mailboxname+inboxlen, sizeof(inbox));
+	    notify_mailbox = inbox;
+	}
+    }
+
+    /* translate mailboxname */
+    r2 = (*lmtpd_namespace.mboxname_toexternal)(&lmtpd_namespace,
+						notify_mailbox,
+						user, namebuf);
+    if (!r2) {
+	strlcpy(userbuf, user, sizeof(userbuf));
+	/* translate any separators in user */
+	mboxname_hiersep_toexternal(&lmtpd_namespace, userbuf,
+				    config_virtdomains ?
+				    strcspn(userbuf, "@") : 0);
+	notify(notifier, "MAIL", NULL, userbuf, namebuf, 0, NULL,
+	       notifyheader ? notifyheader : "");
+    }
+}
+
 /* places msg in mailbox mailboxname.  
  * if you wish to use single instance store, pass stage as non-NULL
  * if you want to deliver message regardless of duplicates, pass id as NULL
  * if you want to notify, pass user
  * if you want to force delivery (to force delivery to INBOX, for instance)
  * pass acloverride
+ *
+ * the append is left pending, to be committed along with any others to
+ * the same mailbox (see lmtp_batch.c), so a zero return means the
+ * message is queued for the mailbox.
  */
 int deliver_mailbox(FILE *f,
 		    struct message_content *content,
@@ -516,10 +566,7 @@ int deliver_mailbox(FILE *f,
 		    int quotaoverride,
 		    int acloverride)
 {
-    int r = 0;
-    struct appendstate as;
-    const char *notifier;
-    duplicate_key_t dkey = DUPLICATE_INITIALIZER;
+    struct batch_msg msg;
     quota_t qdiffs[QUOTA_NUMRESOURCES] = QUOTA_DIFFS_INITIALIZER;
 
     if (quotaoverride)
@@ -535,89 +582,15 @@ int deliver_mailbox(FILE *f,
     else if (config_getswitch(IMAPOPT_LMTP_STRICT_QUOTA))
 	qdiffs[QUOTA_ANNOTSTORAGE] = 0;
 
-    r = append_setup(&as, mailboxname,
-		     authuser, authstate, acloverride ? 0 : ACL_POST, 
-		     qdiffs, NULL, 0);
-    if (r) return r;
-
-    /* check for duplicate message */
-    dkey.id = id;
-    dkey.to = mailboxname;
-    if (config_getenum(IMAPOPT_DUPLICATE_MAILBOX_MODE) ==
-	    IMAP_ENUM_DUPLICATE_MAILBOX_MODE_UNIQUEID)
-	dkey.to = as.mailbox->uniqueid;
-    dkey.date = date;
-    if (id && dupelim && !(as.mailbox->i.options & OPT_IMAP_DUPDELIVER) &&
-	duplicate_check(&dkey)) {
-	duplicate_log(&dkey, "delivery");
-	append_abort(&as);
-	return 0;
-    }
-
-    if (!r && !content->body) {
-	/* parse the message body if we haven't already,
-	   and keep the file mmap'ed */
-	r = message_parse_file(f, &content->base, &content->len, &content->body);
-    }
-
-    if (!r) {
-	r = append_fromstage(&as, &content->body, stage, 0,
-			     flags, !singleinstance,
-			     /*annotations*/NULL);
-
-	if (r) {
-	    append_abort(&as);
-	} else {
-	    struct mailbox *mailbox = NULL;
-	    /* hold the mailbox open until the duplicate mark is done */
-	    r = append_commit(&as, &mailbox);
-	    if (!r) {
-		syslog(LOG_INFO, "Delivered: %s to mailbox: %s",
-		       id, mailboxname);
-		if (dupelim && id) {
-		    duplicate_mark(&dkey, time(NULL), as.baseuid);
-		}
-		mailbox_close(&mailbox);
-	    }
-	}
-    }
-
-    if (!r && user && (notifier = config_getstring(IMAPOPT_MAILNOTIFIER))) {
-	char inbox[MAX_MAILBOX_BUFFER];
-	char namebuf[MAX_MAILBOX_BUFFER];
-	char userbuf[MAX_MAILBOX_BUFFER];
-	const char *notify_mailbox = mailboxname;
-	int r2;
-
-	/* translate user.foo to INBOX */
-	if (!(*lmtpd_namespace.mboxname_tointernal)(&lmtpd_namespace,
-						    "INBOX", user, inbox)) {
-	    size_t inboxlen = strlen(inbox);
-	    if (strlen(mailboxname) >= inboxlen &&
-		!strncmp(mailboxname, inbox, inboxlen) &&
-		(!mailboxname[inboxlen] || mailboxname[inboxlen] == '.')) {
-		strlcpy(inbox, "INBOX", sizeof(inbox)); 
-		strlcat(inbox, mailboxname+inboxlen, sizeof(inbox));
-		notify_mailbox = inbox;
-	    }
-	}
+    msg.f = f;
+    msg.content = content;
+    msg.stage = stage;
+    msg.nolink = !singleinstance;
+    msg.dupelim = dupelim;
 
-	/* translate mailboxname */
-	r2 = (*lmtpd_namespace.mboxname_toexternal)(&lmtpd_namespace,
-						    notify_mailbox,
-						    user, namebuf);
-	if (!r2) {
-	    strlcpy(userbuf, user, sizeof(userbuf));
-	    /* translate any separators in user */
-	    mboxname_hiersep_toexternal(&lmtpd_namespace, userbuf,
-					config_virtdomains ?
-					strcspn(userbuf, "@") : 0);
-	    notify(notifier, "MAIL", NULL, userbuf, namebuf, 0, NULL,
-		   notifyheader ? notifyheader : "");
-	}
-    }
-
-    return r;
+    return lmtp_batch_append(&msg, batch_cur_rcpt, mailboxname,
+			     authuser, authstate, acloverride, qdiffs,
+			     flags, id, date, user, notifyheader);
 }
 
 enum rcpt_status {
@@ -776,10 +749,36 @@ int deliver_local(deliver_data_t *mydata, const strarray_t *flags,
     return ret;
 }
 
+struct deliver_target {
+    int rcpt;
+    char namebuf[MAX_MAILBOX_BUFFER];
+    struct mboxlist_entry *mbentry;
+    int r;
+};
+
+/* order by partition and then mailbox, keeping the LMTP order otherwise */
+static int target_compare(const void *a, const void *b)
+{
+    const struct deliver_target *ta = (const struct deliver_target *) a;
+    const struct deliver_target *tb = (const struct deliver_target *) b;
+    const char *pa = (!ta->r && ta->mbentry->partition) ?
+	ta->mbentry->partition : "";
+    const char *pb = (!tb->r && tb->mbentry->partition) ?
+	tb->mbentry->partition : "";
+    int cmp;
+
+    cmp = strcmp(pa, pb);
+    if (!cmp) cmp = strcmp(ta->namebuf, tb->namebuf);
+    if (!cmp) cmp = ta->rcpt - tb->rcpt;
+
+    return cmp;
+}
+
 int deliver(message_data_t *msgdata, char *authuser,
 	    struct auth_state *authstate)
 {
-    int n, nrcpts;
+    int i, n, nrcpts;
+    struct deliver_target *targets;
     struct dest *dlist = NULL;
     enum rcpt_status *status;
     struct message_content content = { NULL, 0, NULL };
@@ -804,39 +803,57 @@ int deliver(message_data_t *msgdata, char *authuser,
     mydata.authuser = authuser;
     mydata.authstate = authstate;
     
-    /* loop through each recipient, attempting delivery for each */
+    /* look up each recipient's mailbox */
+    targets = xzmalloc(sizeof(struct deliver_target) * nrcpts);
     for (n = 0; n < nrcpts; n++) {
-	char namebuf[MAX_MAILBOX_BUFFER] = "";
-	char userbuf[MAX_MAILBOX_BUFFER];
-	const char *rcpt, *user, *domain, *mailbox;
-	struct mboxlist_entry *mbentry = NULL;
-	int r = 0;
+	struct deliver_target *t = &targets[n];
+	const char *user, *domain, *mailbox;
 
-	rcpt = msg_getrcptall(msgdata, n);
+	t->rcpt = n;
 	msg_getrcpt(msgdata, n, &user, &domain, &mailbox);
 
-	namebuf[0] = '\0';
-	userbuf[0] = '\0';
-
-	if (domain) snprintf(namebuf, sizeof(namebuf), "%s!", domain);
+	if (domain) snprintf(t->namebuf, sizeof(t->namebuf), "%s!", domain);
 
 	/* case 1: shared mailbox request */
 	if (!user) {
-	    strlcat(namebuf, mailbox, sizeof(namebuf));
+	    strlcat(t->namebuf, mailbox, sizeof(t->namebuf));
 	}
 	/* case 2: ordinary user */
 	else {
-	    strlcat(namebuf, "user.", sizeof(namebuf));
-	    strlcat(namebuf, user, sizeof(namebuf));
-
-	    strlcpy(userbuf, user, sizeof(userbuf));
+	    strlcat(t->namebuf, "user.", sizeof(t->namebuf));
+	    strlcat(t->namebuf, user, sizeof(t->namebuf));
 	}
+
+	t->r = mlookup(t->namebuf, &t->mbentry);
+    }
+
+    /* deliver in mailbox order, so that recipients sharing a mailbox
+       are appended under one lock */
+    qsort(targets, nrcpts, sizeof(struct deliver_target), target_compare);
+    lmtp_batch_start(nrcpts, &deliver_notify, NULL);
+
+    /* loop through each recipient, attempting delivery for each */
+    for (i = 0; i < nrcpts; i++) {
+	char userbuf[MAX_MAILBOX_BUFFER];
+	const char *rcpt, *user, *domain, *mailbox;
+	struct mboxlist_entry *mbentry = targets[i].mbentry;
+	int r = targets[i].r;
+
+	n = targets[i].rcpt;
+	rcpt = msg_getrcptall(msgdata, n);
+	msg_getrcpt(msgdata, n, &user, &domain, &mailbox);
+
+	/* don't hold a mailbox locked over other recipients' deliveries */
+	if (i && strcmp(targets[i].namebuf, targets[i-1].namebuf))
+	    lmtp_batch_commit();
+
+	userbuf[0] = '\0';
+	if (user) strlcpy(userbuf, user, sizeof(userbuf));
 	if (domain) {
 	    strlcat(userbuf, "@", sizeof(userbuf));
 	    strlcat(userbuf, domain, sizeof(userbuf));
 	}
 
-	r = mlookup(namebuf, &mbentry);
 	if (!r && mbentry->server) {
 	    /* remote mailbox */
 	    proxy_adddest(&dlist, rcpt, n, mbentry->server, authuser);
@@ -845,6 +862,7 @@ int deliver(message_data_t *msgdata, char *authuser,
 	else if (!r) {
 	    /* local mailbox */
 	    mydata.cur_rcpt = n;
+	    batch_cur_rcpt = n;
 #ifdef USE_SIEVE
 	    r = run_sieve(user, domain, mailbox, sieve_interp, &mydata);
 	    /* if there was no sieve script, or an error during execution,
@@ -856,6 +874,7 @@ int deliver(message_data_t *msgdata, char *authuser,
 	    if (r) {
 		r = deliver_local(&mydata, NULL, userbuf, mailbox);
 	    }
+	    batch_cur_rcpt = -1;
 	}
 
 	telemetry_rusage( user );
@@ -863,6 +882,16 @@ int deliver(message_data_t *msgdata, char *authuser,
 
 	mboxlist_entry_free(&mbentry);
     }
+    free(targets);
+
+    /* commit the last pending mailbox, and fail any recipient whose
+       message didn't make it to disk after all */
+    lmtp_batch_commit();
+    for (n = 0; n < nrcpts; n++) {
+	int r = lmtp_batch_status(n);
+	if (r) msg_setrcpt_status(msgdata, n, r);
+    }
+    lmtp_batch_end();
 
     if (dlist) {
 	struct dest *d;
@@ -1076,7 +1105,7 @@ static int verify_user(const char *user, const char *domain, char *mailbox,
 	}
 
 	if (!r && mbentry->server) {
-	    int access = cyrus_acl_myrights(authstate, mbentry->acl);
+	    int access = mboxlist_entry_myrights(mbentry, authstate);
 
 	    if ((access & aclcheck) != aclcheck) {
 		r = (access & ACL_LOOKUP) ?
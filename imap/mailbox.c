@@ -770,6 +770,17 @@ static void mailbox_make_uniqueid(struct mailbox *mailbox)
  */
 int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 			const char **basep, size_t *lenp)
+{
+    return mailbox_map_message_fd(mailbox, uid, NULL, basep, lenp);
+}
+
+/*
+ * As mailbox_map_message(), but if 'fdp' is not NULL, leave the file
+ * open and return the descriptor there too, for callers who want to
+ * send it with prot_sendfile().  They must close it themselves.
+ */
+int mailbox_map_message_fd(struct mailbox *mailbox, unsigned long uid,
+			   int *fdp, const char **basep, size_t *lenp)
 {
     int msgfd;
     char *fname;
@@ -787,7 +798,11 @@ int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
     *basep = 0;
     *lenp = 0;
     map_refresh(msgfd, 1, basep, lenp, sbuf.st_size, fname, mailbox->name);
-    close(msgfd);
+
+    if (fdp)
+	*fdp = msgfd;
+    else
+	close(msgfd);
 
     return 0;
 }
@@ -1048,7 +1063,7 @@ void mailbox_close(struct mailbox **mailboxptr)
 	 * Also, cyr_expire can get first bite if it's been set
 	 * to run... */
 	if (mailbox->i.first_expunged < floor - (8 * 86400)) {
-	    mailbox_expunge_cleanup(mailbox, floor, NULL);
+	    mailbox_expunge_cleanup(mailbox, floor, NULL, NULL);
 	    /* XXX - handle error code? */
 	}
     }
@@ -1746,6 +1761,16 @@ restart:
 	}
     }
 
+    /* remember where we started, for the statuscache */
+    memset(&mailbox->status_change, 0, sizeof(struct statuschange));
+    mailbox->status_change.exists = mailbox->i.exists;
+    mailbox->status_change.last_uid = mailbox->i.last_uid;
+    mailbox->status_change.uidvalidity = mailbox->i.uidvalidity;
+    mailbox->status_change.recentuid = mailbox->i.recentuid;
+    mailbox->status_change.highestmodseq = mailbox->i.highestmodseq;
+    mailbox->status_change.sharedseen =
+	!!(mailbox->i.options & OPT_IMAP_SHAREDSEEN);
+
     return 0;
 }
 
@@ -1768,12 +1793,13 @@ void mailbox_unlock_index(struct mailbox *mailbox, struct statusdata *sdata)
     }
 
     if (mailbox->has_changed) {
-	if (updatenotifier) updatenotifier(mailbox->name);
+	if (updatenotifier) updatenotifier(mailbox);
 	sync_log_mailbox(mailbox->name);
 	if (config_getswitch(IMAPOPT_STATUSCACHE))
-	    statuscache_invalidate(mailbox->name, sdata);
+	    statuscache_mailbox_changed(mailbox, sdata);
 	mailbox->has_changed = 0;
     }
+    memset(&mailbox->status_change, 0, sizeof(struct statuschange));
 
     if (mailbox->index_locktype) {
 	if (lock_unlock(mailbox->index_fd))
@@ -2119,6 +2145,7 @@ static int mailbox_index_recalc(struct mailbox *mailbox)
     mailbox->i.exists = 0;
     mailbox->i.quota_mailbox_used = 0;
     mailbox->i.quota_annot_used = 0;
+    mailbox->status_change.other = 1;
 
     annotate_recalc_begin(mailbox, &ars, 1);
 
@@ -2211,6 +2238,19 @@ int mailbox_rewrite_index_record(struct mailbox *mailbox,
     mailbox_index_update_counts(mailbox, &oldrecord, 0);
     mailbox_index_update_counts(mailbox, record, 1);
 
+    /* only the \Seen state stored in the index matters for STATUS,
+     * an expunge changes unseen counts we can't see from here */
+    if (record->system_flags & FLAG_EXPUNGED) {
+	if (!(oldrecord.system_flags & FLAG_EXPUNGED))
+	    mailbox->status_change.other = 1;
+    }
+    else if ((record->system_flags & FLAG_SEEN) &&
+	     !(oldrecord.system_flags & FLAG_SEEN))
+	mailbox->status_change.seen++;
+    else if (!(record->system_flags & FLAG_SEEN) &&
+	     (oldrecord.system_flags & FLAG_SEEN))
+	mailbox->status_change.seen--;
+
     mailbox_index_record_to_buf(record, buf);
 
     offset = mailbox->i.start_offset +
@@ -2324,6 +2364,12 @@ int mailbox_append_index_record(struct mailbox *mailbox,
     /* add counts */
     mailbox_index_update_counts(mailbox, record, 1);
 
+    if (!(record->system_flags & FLAG_EXPUNGED)) {
+	mailbox->status_change.appended++;
+	if (record->system_flags & FLAG_SEEN)
+	    mailbox->status_change.appended_seen++;
+    }
+
     mailbox_index_record_to_buf(record, buf);
     
     recno = mailbox->i.num_records + 1;
@@ -2704,11 +2750,12 @@ int mailbox_expunge(struct mailbox *mailbox,
 }
 
 int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
-			    unsigned *ndeleted)
+			    unsigned *ndeleted, quota_t *nbytes)
 {
     uint32_t recno;
     int dirty = 0;
     unsigned numdeleted = 0;
+    quota_t numbytes = 0;
     struct index_record record;
     time_t first_expunged = 0;
     int r = 0;
@@ -2739,6 +2786,7 @@ int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
 	dirty = 1;
 
 	numdeleted++;
+	numbytes += record.size;
 
 	record.system_flags |= FLAG_UNLINKED;
 	record.silent = 1;
@@ -2756,6 +2804,7 @@ int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
     }
 
     if (ndeleted) *ndeleted = numdeleted;
+    if (nbytes) *nbytes = numbytes;
 
     return r;
 }
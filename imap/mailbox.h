@@ -120,6 +120,23 @@ struct statusdata {
     modseq_t highestmodseq;
 };
 
+/* what happened to a mailbox under one index lock, so that everyone's
+ * cached STATUS can be moved along rather than thrown away */
+struct statuschange {
+    /* header values when the lock was taken */
+    uint32_t exists;
+    uint32_t last_uid;
+    uint32_t uidvalidity;
+    uint32_t recentuid;
+    modseq_t highestmodseq;
+    int sharedseen;
+
+    uint32_t appended;		/* new messages */
+    uint32_t appended_seen;	/* of which already \Seen */
+    int seen;			/* \Seen flags set less cleared on others */
+    int other;			/* anything we can't account for */
+};
+
 struct index_record {
     uint32_t uid;
     time_t internaldate;
@@ -227,6 +244,7 @@ struct mailbox {
     int cache_dirty;
     int quota_dirty;
     int has_changed;
+    struct statuschange status_change;
     time_t last_updated; /* for appends*/
     quota_t quota_previously_used[QUOTA_NUMRESOURCES]; /* for quota change */
 };
@@ -402,7 +420,7 @@ typedef unsigned mailbox_decideproc_t(struct mailbox *mailbox,
 				      struct index_record *index,
 				      void *rock);
 
-typedef void mailbox_notifyproc_t(const char *mboxname);
+typedef void mailbox_notifyproc_t(struct mailbox *mailbox);
 
 extern void mailbox_set_updatenotifier(mailbox_notifyproc_t *notifyproc);
 extern mailbox_notifyproc_t *mailbox_get_updatenotifier(void);
@@ -420,6 +438,8 @@ extern char *mailbox_datapath(struct mailbox *mailbox);
 /* map individual messages in */
 extern int mailbox_map_message(struct mailbox *mailbox, unsigned long uid,
 				  const char **basep, size_t *lenp);
+extern int mailbox_map_message_fd(struct mailbox *mailbox, unsigned long uid,
+				  int *fdp, const char **basep, size_t *lenp);
 extern void mailbox_unmap_message(struct mailbox *mailbox,
 				  unsigned long uid,
 				  const char **basep, size_t *lenp);
@@ -484,7 +504,7 @@ extern int mailbox_internal_seen(struct mailbox *mailbox, const char *userid);
 extern int mailbox_lock_index(struct mailbox *mailbox, int locktype);
 
 extern int mailbox_expunge_cleanup(struct mailbox *mailbox, time_t expunge_mark,
-				   unsigned *ndeleted);
+				   unsigned *ndeleted, quota_t *nbytes);
 extern int mailbox_expunge(struct mailbox *mailbox,
 			   mailbox_decideproc_t *decideproc, void *deciderock,
 			   unsigned *nexpunged);
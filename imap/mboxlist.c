@@ -86,6 +86,7 @@
 
 #define DB config_mboxlist_db
 #define SUBDB config_subscription_db
+#define RACLDB config_reverseacls_db
 
 cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
@@ -93,6 +94,10 @@ struct db *mbdb;
 
 static int mboxlist_dbopen = 0;
 
+/* reverse ACLs: see mboxlist_racl_add() */
+static struct db *racldb;
+static int racl_dbopen = 0;
+
 static int mboxlist_opensubs(const char *userid, struct db **ret);
 static void mboxlist_closesubs(struct db *sub);
 
@@ -124,6 +129,31 @@ void mboxlist_entry_free(struct mboxlist_entry **mbentryptr)
     *mbentryptr = NULL;
 }
 
+/*
+ * The last ACL we were asked about, compiled if we were asked about it
+ * twice running.  Neighbouring mailboxes tend to share an ACL, so LIST
+ * and friends can check most of them without parsing it again.
+ */
+static char *last_acl = NULL;
+static struct cyrus_acl *last_cacl = NULL;
+
+int mboxlist_entry_myrights(struct mboxlist_entry *mbentry,
+			    struct auth_state *auth_state)
+{
+    if (!mbentry->acl) return 0;
+
+    if (last_acl && !strcmp(last_acl, mbentry->acl)) {
+	if (!last_cacl) last_cacl = cyrus_acl_compile(last_acl);
+	return cyrus_acl_rights(auth_state, last_cacl);
+    }
+
+    free(last_acl);
+    cyrus_acl_free(&last_cacl);
+    last_acl = xstrdup(mbentry->acl);
+
+    return cyrus_acl_myrights(auth_state, mbentry->acl);
+}
+
 char *mboxlist_entry_cstring(struct mboxlist_entry *mbentry)
 {
     struct buf ebuf;
@@ -354,17 +384,352 @@ int mboxlist_findstage(const char *name, char *stagedir, size_t sd_len)
     return 0;
 }
 
+/*
+ * Reverse ACLs.
+ *
+ * If reverseacls is set we keep a second database with a key of
+ * "<identifier>\0<mailbox>" (and no data) for every identifier which
+ * has lookup rights on every mailbox, so a non-admin LIST can visit
+ * just the mailboxes the user, "anyone" or one of the user's groups
+ * can see, rather than every mailbox on the server.
+ *
+ * It is not kept in the same transaction as mailboxes.db, so it may
+ * name mailboxes which don't exist or which the identifier can no
+ * longer see; LIST still checks each one against its real entry.
+ * What it must never do is miss a mailbox, so new keys are written
+ * before the mailboxes.db change is committed, and old ones removed
+ * after.
+ *
+ * Both sides hold the mailboxes.db lock while they touch this
+ * database, and always take it first, so they can't deadlock and a
+ * removal can't race with somebody else granting the same rights.
+ */
+
+/* present once the database has been built from mailboxes.db.
+ * Every real key has a NUL in it, so can't be this */
+#define RACL_BUILT_KEY "*built*"
+
+/* add the identifiers with lookup rights in 'acl' to 'ids' */
+static void racl_lookupids(const char *acl, strarray_t *ids)
+{
+    char *buf, *id, *rights, *next;
+
+    if (!acl) return;
+
+    buf = xstrdup(acl);
+    for (id = buf; *id; id = next) {
+	rights = strchr(id, '\t');
+	if (!rights) break;
+	*rights++ = '\0';
+
+	next = strchr(rights, '\t');
+	if (next) *next++ = '\0';
+	else next = rights + strlen(rights);
+
+	/* negative rights never make a mailbox visible */
+	if (*id == '-') continue;
+
+	if (cyrus_acl_strtomask(rights) & ACL_LOOKUP)
+	    strarray_add(ids, id);
+    }
+    free(buf);
+}
+
+static void racl_key(struct buf *key, const char *identifier,
+		     const char *name)
+{
+    buf_reset(key);
+    buf_appendcstr(key, identifier);
+    buf_putc(key, '\0');
+    buf_appendcstr(key, name);
+}
+
+/*
+ * Record that everyone with lookup rights in 'acl' may see 'name'.
+ */
+static int mboxlist_racl_add(const char *name, const char *acl,
+			     struct txn **tid)
+{
+    strarray_t ids = STRARRAY_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
+    int i, r = 0;
+
+    if (!racl_dbopen) return 0;
+
+    racl_lookupids(acl, &ids);
+
+    for (i = 0; !r && i < ids.count; i++) {
+	racl_key(&key, ids.data[i], name);
+	do {
+	    r = cyrusdb_store(racldb, key.s, key.len, "", 0, tid);
+	} while (r == CYRUSDB_AGAIN);
+    }
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: error adding reverse acls for %s: %s",
+	       name, cyrusdb_strerror(r));
+	r = IMAP_IOERROR;
+    }
+
+    strarray_fini(&ids);
+    buf_free(&key);
+
+    return r;
+}
+
+/*
+ * Forget the identifiers with lookup rights in 'oldacl' which don't
+ * have them in the committed entry for 'name' any more.  'tid' is the
+ * caller's mailboxes.db transaction if it's still open (and will be
+ * committed), otherwise we lock mailboxes.db ourselves, so nobody can
+ * add the same rights back between our read and our delete.  A failure
+ * only leaves keys which LIST will skip, so it's just logged.
+ */
+static void mboxlist_racl_remove(const char *name, const char *oldacl,
+				 struct txn **tid)
+{
+    strarray_t oldids = STRARRAY_INITIALIZER;
+    strarray_t newids = STRARRAY_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
+    struct mboxlist_entry *mbentry = NULL;
+    struct txn *lcl_tid = NULL;
+    int i, r;
+
+    if (!racl_dbopen) return;
+
+    if (!tid) tid = &lcl_tid;
+
+    do {
+	r = mboxlist_mylookup(name, &mbentry, tid, 1);
+    } while (r == IMAP_AGAIN);
+    if (r && r != IMAP_MAILBOX_NONEXISTENT) {
+	syslog(LOG_ERR, "DBERROR: error re-reading %s for reverse acls: %s",
+	       name, error_message(r));
+	goto done;
+    }
+
+    racl_lookupids(oldacl, &oldids);
+    if (mbentry) racl_lookupids(mbentry->acl, &newids);
+
+    for (i = 0; i < oldids.count; i++) {
+	if (strarray_find(&newids, oldids.data[i], 0) >= 0) continue;
+
+	racl_key(&key, oldids.data[i], name);
+	do {
+	    r = cyrusdb_delete(racldb, key.s, key.len, NULL, 1);
+	} while (r == CYRUSDB_AGAIN);
+
+	if (r) {
+	    syslog(LOG_ERR,
+		   "DBERROR: error removing reverse acl %s for %s: %s",
+		   oldids.data[i], name, cyrusdb_strerror(r));
+	}
+    }
+
+ done:
+    /* we only read it */
+    if (lcl_tid) cyrusdb_abort(mbdb, lcl_tid);
+    mboxlist_entry_free(&mbentry);
+    strarray_fini(&oldids);
+    strarray_fini(&newids);
+    buf_free(&key);
+}
+
+static int racl_build_cb(void *rock,
+			 const char *key, size_t keylen,
+			 const char *data, size_t datalen)
+{
+    struct txn **tid = (struct txn **) rock;
+    struct mboxlist_entry *mbentry = NULL;
+    char *name = xstrndup(key, keylen);
+    int r;
+
+    mboxlist_parse_entry(&mbentry, name, data, datalen);
+    r = mboxlist_racl_add(name, mbentry->acl, tid);
+
+    mboxlist_entry_free(&mbentry);
+    free(name);
+
+    return r;
+}
+
+static int racl_delete_cb(void *rock,
+			  const char *key, size_t keylen,
+			  const char *data __attribute__((unused)),
+			  size_t datalen __attribute__((unused)))
+{
+    struct txn **tid = (struct txn **) rock;
+
+    return cyrusdb_delete(racldb, key, keylen, tid, 1);
+}
+
+/*
+ * Build the reverse ACL database from mailboxes.db.  If 'rebuild'
+ * throw away whatever was there first, otherwise only build it if
+ * nobody has yet.
+ */
+static int mboxlist_racl_build(int rebuild)
+{
+    struct txn *mbtid = NULL;
+    struct txn *tid = NULL;
+    const char *data;
+    size_t datalen;
+    int r;
+
+    if (!racl_dbopen) return 0;
+
+    if (!rebuild &&
+	!cyrusdb_fetch(racldb, RACL_BUILT_KEY, strlen(RACL_BUILT_KEY),
+		       &data, &datalen, NULL))
+	return 0;
+
+    /* lock mailboxes.db before our own database, the same order as
+     * everyone who changes an acl; it also holds it still while we
+     * copy it.  The key can't be a mailbox, we just want the lock */
+    r = cyrusdb_fetchlock(mbdb, RACL_BUILT_KEY, strlen(RACL_BUILT_KEY),
+			  &data, &datalen, &mbtid);
+    if (r && r != CYRUSDB_NOTFOUND) goto done;
+
+    /* look again with the write lock, so only one of us builds it */
+    r = cyrusdb_fetchlock(racldb, RACL_BUILT_KEY, strlen(RACL_BUILT_KEY),
+			  &data, &datalen, &tid);
+    if (!r && !rebuild) {
+	cyrusdb_commit(racldb, tid);
+	cyrusdb_abort(mbdb, mbtid);
+	return 0;
+    }
+    if (r && r != CYRUSDB_NOTFOUND) goto done;
+
+    if (rebuild) {
+	r = cyrusdb_foreach(racldb, "", 0, NULL, racl_delete_cb, &tid, &tid);
+	if (r) goto done;
+    }
+
+    r = cyrusdb_foreach(mbdb, "", 0, NULL, racl_build_cb, &tid, &mbtid);
+    if (r) goto done;
+
+    r = cyrusdb_store(racldb, RACL_BUILT_KEY, strlen(RACL_BUILT_KEY),
+		      "", 0, &tid);
+    if (!r) r = cyrusdb_commit(racldb, tid);
+    tid = NULL;
+
+ done:
+    if (tid) cyrusdb_abort(racldb, tid);
+    if (mbtid) cyrusdb_abort(mbdb, mbtid);
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: error building reverse acls: %s",
+	       r == IMAP_IOERROR ? error_message(r) : cyrusdb_strerror(r));
+	return IMAP_IOERROR;
+    }
+
+    syslog(LOG_NOTICE, "built reverse acls");
+
+    return 0;
+}
+
+int mboxlist_racl_rebuild(void)
+{
+    return mboxlist_racl_build(1);
+}
+
+static int racl_collect_cb(void *rock,
+			   const char *key, size_t keylen,
+			   const char *data __attribute__((unused)),
+			   size_t datalen __attribute__((unused)))
+{
+    strarray_t *names = (strarray_t *) rock;
+    const char *name = memchr(key, '\0', keylen);
+
+    if (name) {
+	name++;
+	strarray_appendm(names, xstrndup(name, keylen - (name - key)));
+    }
+
+    return 0;
+}
+
+static int racl_compar(const void *a, const void *b)
+{
+    const char *na = *(const char **) a;
+    const char *nb = *(const char **) b;
+
+    return cyrusdb_compar(mbdb, na, strlen(na), nb, strlen(nb));
+}
+
+/*
+ * The mailboxes starting with 'prefix' which 'userid' may be able to
+ * see, in mailboxes.db order.  NULL if we can't tell, and have to look
+ * at them all.
+ */
+static strarray_t *mboxlist_racl_names(const char *userid,
+				       struct auth_state *auth_state,
+				       const char *prefix, size_t prefixlen)
+{
+    strarray_t *ids, *names;
+    struct buf key = BUF_INITIALIZER;
+    int i, j, r = 0;
+
+    if (!racl_dbopen || !userid) return NULL;
+
+    ids = auth_groups(auth_state);
+    if (!ids) return NULL;
+
+    strarray_add(ids, userid);
+    strarray_add(ids, "anyone");
+    if (!auth_state) strarray_add(ids, "anonymous");
+
+    names = strarray_new();
+    for (i = 0; !r && i < ids->count; i++) {
+	racl_key(&key, ids->data[i], "");
+	buf_appendmap(&key, prefix, prefixlen);
+	r = cyrusdb_foreach(racldb, key.s, key.len, NULL,
+			    racl_collect_cb, names, NULL);
+    }
+
+    strarray_free(ids);
+    buf_free(&key);
+
+    if (r) {
+	syslog(LOG_ERR, "DBERROR: error reading reverse acls for %s: %s",
+	       userid, cyrusdb_strerror(r));
+	strarray_free(names);
+	return NULL;
+    }
+
+    /* the same mailbox may be there for several identifiers */
+    qsort(names->data, names->count, sizeof(char *), racl_compar);
+    for (i = 0, j = 0; i < names->count; i++) {
+	if (j && !strcmp(names->data[j-1], names->data[i])) {
+	    free(names->data[i]);
+	    continue;
+	}
+	names->data[j++] = names->data[i];
+    }
+    names->count = j;
+
+    return names;
+}
+
 int mboxlist_update(struct mboxlist_entry *mbentry, int localonly)
 {
     int r = 0, r2 = 0;
     char *mboxent = NULL;
     struct txn *tid = NULL;
+    struct mboxlist_entry *oldmbentry = NULL;
 
-    mboxent = mboxlist_entry_cstring(mbentry);
-    r = cyrusdb_store(mbdb, mbentry->name, strlen(mbentry->name),
-		  mboxent, strlen(mboxent), &tid);
-    free(mboxent);
-    mboxent = NULL;
+    if (racl_dbopen) {
+	r = mboxlist_mylookup(mbentry->name, &oldmbentry, &tid, 1);
+	if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;
+	if (!r) r = mboxlist_racl_add(mbentry->name, mbentry->acl, NULL);
+    }
+
+    if (!r) {
+	mboxent = mboxlist_entry_cstring(mbentry);
+	r = cyrusdb_store(mbdb, mbentry->name, strlen(mbentry->name),
+			  mboxent, strlen(mboxent), &tid);
+	free(mboxent);
+	mboxent = NULL;
+    }
 
     if (!r && !localonly && config_mupdate_server) {
         mupdate_handle *mupdate_h = NULL;
@@ -402,6 +767,10 @@ int mboxlist_update(struct mboxlist_entry *mbentry, int localonly)
 	       r ? "aborting" : "commiting", cyrusdb_strerror(r2));
     }
 
+    if (!r && !r2 && oldmbentry)
+	mboxlist_racl_remove(mbentry->name, oldmbentry->acl, NULL);
+    mboxlist_entry_free(&oldmbentry);
+
     return r;
 }
 
@@ -462,7 +831,7 @@ mboxlist_mycreatemailboxcheck(const char *mboxname,
 	
 	    /* Lie about error if privacy demands */
 	    if (!isadmin && 
-		!(cyrus_acl_myrights(auth_state, mbentry->acl) & ACL_LOOKUP)) {
+		!(mboxlist_entry_myrights(mbentry, auth_state) & ACL_LOOKUP)) {
 		r = IMAP_PERMISSION_DENIED;
 	    }
 	}
@@ -514,7 +883,7 @@ mboxlist_mycreatemailboxcheck(const char *mboxname,
     if (parentlen != 0) {
 	/* check acl */
 	if (!isadmin &&
-	    !(cyrus_acl_myrights(auth_state, mbentry->acl) & ACL_CREATE)) {
+	    !(mboxlist_entry_myrights(mbentry, auth_state) & ACL_CREATE)) {
 	    free(name);
 	    mboxlist_entry_free(&mbentry);
 	    return IMAP_PERMISSION_DENIED;
@@ -678,6 +1047,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
     struct mboxlist_entry *newmbentry = NULL;
     struct dlist *item;
     const char *useptr = NULL;
+    struct txn *tid = NULL;
 
     /* Must be atleast MAX_PARTITION_LEN + 30 for partition, need
      * MAX_PARTITION_LEN + HOSTNAME_SIZE + 2 for mupdate location */
@@ -721,8 +1091,23 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
     newmbentry->partition = newpartition;
     newmbentry->uniqueid = newmailbox ? newmailbox->uniqueid : uniqueid;
     newmbentry->specialuse = useptr;
+    if (racl_dbopen) {
+	/* hold mailboxes.db while adding the reverse acls,
+	 * see mboxlist_racl_remove() */
+	r = mboxlist_mylookup(name, NULL, &tid, 1);
+	if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;
+	if (!r) r = mboxlist_racl_add(name, acl, NULL);
+	if (r) goto done;
+    }
+
     mboxent = mboxlist_entry_cstring(newmbentry);
-    r = cyrusdb_store(mbdb, name, strlen(name), mboxent, strlen(mboxent), NULL);
+    r = cyrusdb_store(mbdb, name, strlen(name), mboxent, strlen(mboxent),
+		      tid ? &tid : NULL);
+    if (tid) {
+	if (!r) r = cyrusdb_commit(mbdb, tid);
+	else cyrusdb_abort(mbdb, tid);
+	tid = NULL;
+    }
 
     if (r) {
 	syslog(LOG_ERR, "DBERROR: failed to insert to mailboxes list %s: %s", 
@@ -747,6 +1132,7 @@ int mboxlist_createmailbox_full(const char *name, int mbtype,
     }
 
 done:
+    if (tid) cyrusdb_abort(mbdb, tid);
     if (newmailbox) {
 	if (r) mailbox_delete(&newmailbox);
 	else if (mboxptr) *mboxptr = newmailbox;
@@ -793,6 +1179,7 @@ int mboxlist_createsync(const char *name, int mbtype,
 int mboxlist_insertremote(struct mboxlist_entry *mbentry,
 			  struct txn **tid)
 {
+    struct mboxlist_entry *oldmbentry = NULL;
     char *mboxent;
     int r = 0;
 
@@ -806,6 +1193,16 @@ int mboxlist_insertremote(struct mboxlist_entry *mbentry,
 	}
     }
 
+    if (racl_dbopen) {
+	r = mboxlist_mylookup(mbentry->name, &oldmbentry, tid, 1);
+	if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;
+	if (!r) r = mboxlist_racl_add(mbentry->name, mbentry->acl, NULL);
+	if (r) {
+	    mboxlist_entry_free(&oldmbentry);
+	    return r;
+	}
+    }
+
     mboxent = mboxlist_entry_cstring(mbentry);
 
     /* database put */
@@ -813,6 +1210,9 @@ int mboxlist_insertremote(struct mboxlist_entry *mbentry,
 		  mboxent, strlen(mboxent), tid);
     switch (r) {
     case CYRUSDB_OK:
+	/* our callers always commit, so don't wait for it */
+	if (oldmbentry)
+	    mboxlist_racl_remove(mbentry->name, oldmbentry->acl, tid);
 	break;
     case CYRUSDB_AGAIN:
 	abort(); /* shouldn't happen ! */
@@ -825,6 +1225,7 @@ int mboxlist_insertremote(struct mboxlist_entry *mbentry,
     }
 
     free(mboxent);
+    mboxlist_entry_free(&oldmbentry);
 
     return r;
 }
@@ -871,6 +1272,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
     r = cyrusdb_delete(mbdb, name, strlen(name), tid, 0);
     switch (r) {
     case CYRUSDB_OK: /* success */
+	mboxlist_racl_remove(name, mbentry->acl, tid);
 	break;
     case CYRUSDB_AGAIN:
 	goto retry_del;
@@ -896,6 +1298,7 @@ int mboxlist_deleteremote(const char *name, struct txn **in_tid)
 	/* Abort the transaction if it is still in progress */
 	cyrusdb_abort(mbdb, *tid);
     }
+    mboxlist_entry_free(&mbentry);
 
     return r;
 }
@@ -942,7 +1345,7 @@ mboxlist_delayed_deletemailbox(const char *name, int isadmin,
     /* check if user has Delete right (we've already excluded non-admins
      * from deleting a user mailbox) */
     if (checkacl) {
-	myrights = cyrus_acl_myrights(auth_state, mbentry->acl);
+	myrights = mboxlist_entry_myrights(mbentry, auth_state);
 	if (!(myrights & ACL_DELETEMBOX)) {
 	    /* User has admin rights over their own mailbox namespace */
 	    if (mboxname_userownsmailbox(userid, name) &&
@@ -1026,7 +1429,7 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
     /* check if user has Delete right (we've already excluded non-admins
      * from deleting a user mailbox) */
     if (checkacl) {
-	myrights = cyrus_acl_myrights(auth_state, mbentry->acl);
+	myrights = mboxlist_entry_myrights(mbentry, auth_state);
 	if(!(myrights & ACL_DELETEMBOX)) {
 	    /* User has admin rights over their own mailbox namespace */
 	    if (mboxname_userownsmailbox(userid, name) &&
@@ -1074,6 +1477,7 @@ int mboxlist_deletemailbox(const char *name, int isadmin,
 	r = IMAP_IOERROR;
 	if (!force) goto done;
     }
+    else mboxlist_racl_remove(name, mbentry->acl, NULL);
     if (r && !force) goto done;
 
     /* delete underlying mailbox */
@@ -1195,8 +1599,11 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
 	newmbentry->partition = newpartition;
 	newmbentry->acl = oldmailbox->acl;
 	mboxent = mboxlist_entry_cstring(newmbentry);
-	r = cyrusdb_store(mbdb, newname, strlen(newname), 
-		      mboxent, strlen(mboxent), &tid);
+	r = racl_dbopen ? mboxlist_mylookup(newname, NULL, &tid, 1) : 0;
+	if (!r) r = mboxlist_racl_add(newname, newmbentry->acl, NULL);
+	if (!r)
+	    r = cyrusdb_store(mbdb, newname, strlen(newname), 
+			      mboxent, strlen(mboxent), &tid);
 	mboxlist_entry_free(&newmbentry);
 	if (r) goto done;
 	goto dbdone;
@@ -1238,6 +1645,15 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
     newmbentry->acl = newmailbox->acl;
     mboxent = mboxlist_entry_cstring(newmbentry);
 
+    /* hold mailboxes.db while adding the reverse acls,
+     * see mboxlist_racl_remove() */
+    if (racl_dbopen) {
+	r = mboxlist_mylookup(newname, NULL, &tid, 1);
+	if (r == IMAP_MAILBOX_NONEXISTENT) r = 0;
+	if (!r) r = mboxlist_racl_add(newname, newmbentry->acl, NULL);
+	if (r) goto done;
+    }
+
     do {
 	/* 7b. put it into the db */
 	r = cyrusdb_store(mbdb, newname, strlen(newname), 
@@ -1275,6 +1691,9 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
 	goto done;
     }
 
+    if (!isusermbox && !partitionmove)
+	mboxlist_racl_remove(oldname, oldmailbox->acl, NULL);
+
     if (config_mupdate_server) {
 	/* commit the mailbox in MUPDATE */
 	char buf[MAX_PARTITION_LEN + HOSTNAME_SIZE + 2];
@@ -1298,6 +1717,8 @@ int mboxlist_renamemailbox(const char *oldname, const char *newname,
     }
 
  done: /* Commit or cleanup */
+    if (tid) cyrusdb_abort(mbdb, tid);
+
     if (!r && newmailbox)
 	r = mailbox_commit(newmailbox);
 
@@ -1412,6 +1833,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
     int ensure_owner_rights = 0;
     const char *mailbox_owner = NULL;
     struct mailbox *mailbox = NULL;
+    const char *oldacl = NULL;
     char *newacl = NULL;
     char *mboxent = NULL;
     struct txn *tid = NULL;
@@ -1516,7 +1938,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
 
     /* 2. Check Rights */
     if (!r && !isadmin) {
-	myrights = cyrus_acl_myrights(auth_state, mbentry->acl);
+	myrights = mboxlist_entry_myrights(mbentry, auth_state);
 	if (!(myrights & ACL_ADMIN)) {
 	    r = (myrights & ACL_LOOKUP) ?
 		IMAP_PERMISSION_DENIED : IMAP_MAILBOX_NONEXISTENT;
@@ -1581,18 +2003,22 @@ int mboxlist_setacl(const char *name, const char *identifier,
 
     if(!r) {
 	/* ok, change the database */
+	oldacl = mbentry->acl;
 	mbentry->acl = newacl;
 	mboxent = mboxlist_entry_cstring(mbentry);
 
-	do {
-	    r = cyrusdb_store(mbdb, name, strlen(name),
-			  mboxent, strlen(mboxent), &tid);
-	} while(r == CYRUSDB_AGAIN);
-    
-	if(r) {
-	    syslog(LOG_ERR, "DBERROR: error updating acl %s: %s",
-		   name, cyrusdb_strerror(r));
-	    r = IMAP_IOERROR;
+	r = mboxlist_racl_add(name, newacl, NULL);
+	if (!r) {
+	    do {
+		r = cyrusdb_store(mbdb, name, strlen(name),
+			      mboxent, strlen(mboxent), &tid);
+	    } while(r == CYRUSDB_AGAIN);
+
+	    if(r) {
+		syslog(LOG_ERR, "DBERROR: error updating acl %s: %s",
+		       name, cyrusdb_strerror(r));
+		r = IMAP_IOERROR;
+	    }
 	}
     }
 
@@ -1613,6 +2039,7 @@ int mboxlist_setacl(const char *name, const char *identifier,
 	}
 	tid = NULL;
     }
+    if (!r) mboxlist_racl_remove(name, oldacl, NULL);
 
     /* 6. Change mupdate entry  */
     if (!r && config_mupdate_server) {
@@ -1671,6 +2098,7 @@ int
 mboxlist_sync_setacls(const char *name, const char *newacl)
 {
     struct mboxlist_entry *mbentry = NULL;
+    const char *oldacl = NULL;
     int r;
     struct txn *tid = NULL;
 
@@ -1688,7 +2116,11 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
     /* 2. Set DB Entry */
     if (!r) {
 	/* ok, change the database */
+	oldacl = mbentry->acl;
 	mbentry->acl = newacl;
+	r = mboxlist_racl_add(name, newacl, NULL);
+    }
+    if (!r) {
 	char *mboxent = mboxlist_entry_cstring(mbentry);
 
 	do {
@@ -1715,6 +2147,7 @@ mboxlist_sync_setacls(const char *name, const char *newacl)
 	}
 	tid = NULL;
     }
+    if (!r) mboxlist_racl_remove(name, oldacl, NULL);
 
     /* 4. Change mupdate entry  */
     if (!r && config_mupdate_server) {
@@ -1847,6 +2280,7 @@ struct find_rock {
     int checkshared;
     struct db *db;
     int isadmin;
+    const char *userid;
     struct auth_state *auth_state;
     char *prev;
     int prevlen;
@@ -1933,7 +2367,7 @@ static int find_p(void *rockp,
 	    return 0;
 
 	/* check the acls */
-	rights = cyrus_acl_myrights(rock->auth_state, mbentry->acl);
+	rights = mboxlist_entry_myrights(mbentry, rock->auth_state);
 	mboxlist_entry_free(&mbentry);
 
 	if (!(rights & ACL_LOOKUP)) {
@@ -2056,6 +2490,42 @@ static int find_cb(void *rockp,
     return r;
 }
 
+/*
+ * Look through the mailboxes starting with 'prefix'.  If the reverse
+ * acls can tell us which of them a non-admin might be able to see, we
+ * needn't look at any of the others.
+ */
+static int find_foreach(struct find_rock *rock,
+			const char *prefix, size_t prefixlen)
+{
+    strarray_t *names = NULL;
+    const char *data;
+    size_t datalen;
+    int i, r = 0;
+
+    if (!rock->isadmin)
+	names = mboxlist_racl_names(rock->userid, rock->auth_state,
+				    prefix, prefixlen);
+    if (!names)
+	return cyrusdb_foreach(mbdb, prefix, prefixlen,
+			       &find_p, &find_cb, rock, NULL);
+
+    for (i = 0; !r && i < names->count; i++) {
+	const char *name = names->data[i];
+	size_t namelen = strlen(name);
+
+	/* the reverse acls may be out of date, so check everything */
+	if (cyrusdb_fetch(mbdb, name, namelen, &data, &datalen, NULL))
+	    continue;
+	if (find_p(rock, name, namelen, data, datalen))
+	    r = find_cb(rock, name, namelen, data, datalen);
+    }
+
+    strarray_free(names);
+
+    return r;
+}
+
 int mboxlist_allmbox(const char *prefix, foreach_cb *proc, void *rock)
 {
     int r;
@@ -2160,6 +2630,7 @@ int mboxlist_findall(struct namespace *namespace,
     else {
 	userid = NULL;
     }
+    cbrock.userid = userid;
 
     /* Check for INBOX first of all */
     if (userid) {
@@ -2245,10 +2716,7 @@ int mboxlist_findall(struct namespace *namespace,
 	/* search for all remaining mailboxes.
 	   just bother looking at the ones that have the same pattern
 	   prefix. */
-	r = cyrusdb_foreach(mbdb,
-			domainpat, domainlen + prefixlen,
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	r = find_foreach(&cbrock, domainpat, domainlen + prefixlen);
 
 	free(cbrock.prev);
 	cbrock.prev = NULL;
@@ -2316,6 +2784,7 @@ int mboxlist_findall_alt(struct namespace *namespace,
     else {
 	userid = 0;
     }
+    cbrock.userid = userid;
 
     /* Check for INBOX first of all */
     if (userid) {
@@ -2407,10 +2876,7 @@ int mboxlist_findall_alt(struct namespace *namespace,
 
 	    /* iterate through prefixes matching usermboxname */
 	    strlcpy(domainpat+domainlen, "user", sizeof(domainpat)-domainlen);
-	    cyrusdb_foreach(mbdb,
-			domainpat, strlen(domainpat),
-			&find_p, &find_cb, &cbrock,
-			NULL);
+	    find_foreach(&cbrock, domainpat, strlen(domainpat));
 
 	    glob_free(&cbrock.g);
 	    free(cbrock.prev);
@@ -2460,20 +2926,14 @@ int mboxlist_findall_alt(struct namespace *namespace,
 		}
 
 		domainpat[domainlen] = '\0';
-		cyrusdb_foreach(mbdb,
-			    domainpat, domainlen,
-			    &find_p, &find_cb, &cbrock,
-			    NULL);
+		find_foreach(&cbrock, domainpat, domainlen);
 	    }
 	    else if (pattern[len] == '.') {
 		strlcpy(domainpat+domainlen, pattern+len+1,
 			sizeof(domainpat)-domainlen);
 		cbrock.g = glob_init(domainpat, GLOB_HIERARCHY);
 
-		cyrusdb_foreach(mbdb,
-			    domainpat, domainlen+prefixlen-(len+1),
-			    &find_p, &find_cb, &cbrock,
-			NULL);
+		find_foreach(&cbrock, domainpat, domainlen+prefixlen-(len+1));
 	    }
 	    free(cbrock.prev);
 	    cbrock.prev = NULL;
@@ -2757,8 +3217,48 @@ void mboxlist_init(int myflags)
     }
 }
 
+static void mboxlist_racl_open(void)
+{
+    const char *fname = config_getstring(IMAPOPT_REVERSEACLS_DB_PATH);
+    char *tofree = NULL;
+    int r;
+
+    if (!fname) {
+	tofree = strconcat(config_dir, FNAME_REVERSEACLSDB, (char *)NULL);
+	fname = tofree;
+    }
+
+    if (!config_getswitch(IMAPOPT_REVERSEACLS)) {
+	/* nobody's keeping it up to date, so make sure it gets built
+	 * afresh if it's wanted again */
+	if (unlink(fname) && errno != ENOENT) {
+	    syslog(LOG_ERR, "IOERROR: removing %s: %m", fname);
+	}
+	free(tofree);
+	return;
+    }
+
+    r = cyrusdb_open(RACLDB, fname, CYRUSDB_CREATE, &racldb);
+    if (r) {
+	/* LIST will just have to look at everything */
+	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
+	       cyrusdb_strerror(r));
+	free(tofree);
+	return;
+    }
+    free(tofree);
+
+    racl_dbopen = 1;
+
+    if (mboxlist_racl_build(0)) {
+	cyrusdb_close(racldb);
+	racl_dbopen = 0;
+    }
+}
+
 void mboxlist_open(const char *fname)
 {
+    const char *openfname = fname;
     int ret, flags;
     char *tofree = NULL;
 
@@ -2788,12 +3288,24 @@ void mboxlist_open(const char *fname)
     free(tofree);
 
     mboxlist_dbopen = 1;
+
+    /* the reverse acls only go with the real mailboxes.db */
+    if (!openfname) mboxlist_racl_open();
 }
 
 void mboxlist_close(void)
 {
     int r;
 
+    if (racl_dbopen) {
+	r = cyrusdb_close(racldb);
+	if (r) {
+	    syslog(LOG_ERR, "DBERROR: error closing reverse acls: %s",
+		   cyrusdb_strerror(r));
+	}
+	racl_dbopen = 0;
+    }
+
     if (mboxlist_dbopen) {
 	r = cyrusdb_close(mbdb);
 	if (r) {
@@ -2807,6 +3319,10 @@ void mboxlist_close(void)
 void mboxlist_done(void)
 {
     /* DB->done() handled by cyrus_done() */
+
+    free(last_acl);
+    last_acl = NULL;
+    cyrus_acl_free(&last_cacl);
 }
 
 /*
@@ -3313,7 +3829,7 @@ int mboxlist_changesub(const char *name, const char *userid,
 	    mboxlist_closesubs(subs);
 	    return r;
 	}
-	if ((cyrus_acl_myrights(auth_state, mbentry->acl) & ACL_LOOKUP) == 0) {
+	if ((mboxlist_entry_myrights(mbentry, auth_state) & ACL_LOOKUP) == 0) {
 	    mboxlist_closesubs(subs);
 	    mboxlist_entry_free(&mbentry);
 	    return IMAP_MAILBOX_NONEXISTENT;
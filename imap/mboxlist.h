@@ -73,6 +73,9 @@ extern struct db *mbdb;
 /* master name of the mailboxes file */
 #define FNAME_MBOXLIST "/mailboxes.db"
 
+/* identifier -> mailboxes it may look up, if reverseacls is set */
+#define FNAME_REVERSEACLSDB "/reverseacls.db"
+
 #define HOSTNAME_SIZE 512
 
 /* each mailbox has the following data */
@@ -92,6 +95,11 @@ struct mboxlist_entry *mboxlist_entry_create();
 
 void mboxlist_entry_free(struct mboxlist_entry **mbentryptr);
 
+/* the rights 'auth_state' has on the mailbox.  The same ACL on a run of
+ * mailboxes is only parsed once */
+int mboxlist_entry_myrights(struct mboxlist_entry *mbentry,
+			    struct auth_state *auth_state);
+
 /* formats a cstring from a mboxlist_entry.  Caller must free
  * after use */
 char *mboxlist_entry_cstring(struct mboxlist_entry *mbentry);
@@ -223,6 +231,9 @@ void mboxlist_init(int flags);
 /* done with database stuff */
 void mboxlist_done(void);
 
+/* rebuild the reverse acls after changing mailboxes.db behind our back */
+int mboxlist_racl_rebuild(void);
+
 /* for transactions */
 int mboxlist_commit(struct txn *tid);
 int mboxlist_abort(struct txn *tid);
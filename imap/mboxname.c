@@ -57,6 +57,7 @@
 #include "exitcodes.h"
 #include "glob.h"
 #include "global.h"
+#include "hash.h"
 #include "imap_err.h"
 #include "mailbox.h"
 #include "util.h"
@@ -868,6 +869,39 @@ int mboxname_isdeletedmailbox(const char *name, time_t *timestampp)
     return 1;
 }
 
+/*
+ * Which of 'nshards' shards (internal) mailbox 'name' belongs to.
+ * domain!user.foo.bar goes with domain!user.foo, a deleted mailbox
+ * goes with the one it was deleted from, and a shared mailbox goes
+ * with its top level.
+ */
+int mboxname_shard(const char *name, int nshards)
+{
+    char key[MAX_MAILBOX_BUFFER];
+    const char *p = name;
+    const char *end;
+    char *rest = NULL;
+    int domainlen = 0;
+
+    if (nshards <= 1) return 0;
+
+    if ((end = strchr(p, '!'))) {
+	domainlen = end - name + 1;
+	p = end + 1;
+    }
+    if (!mboxname_strip_deletedprefix((char *)p, &rest) && rest)
+	p = rest;
+
+    end = p;
+    if (!strncmp(end, "user.", 5)) end += 5;
+    end += strcspn(end, ".");
+
+    snprintf(key, sizeof(key), "%.*s%.*s",
+	     domainlen, name, (int) (end - p), p);
+
+    return hash_bytes(key, strlen(key)) % nshards;
+}
+
 /*
  * Translate (internal) inboxname into corresponding userid.
  */
@@ -143,6 +143,13 @@ char *mboxname_isusermailbox(const char *name, int isinbox);
  */
 int mboxname_isdeletedmailbox(const char *name, time_t *timestampp);
 
+/*
+ * Which of 'nshards' shards (internal) mailbox 'name' belongs to, for
+ * splitting work between processes: all of a user's mailboxes, deleted
+ * or not, are in the same one.
+ */
+int mboxname_shard(const char *name, int nshards);
+
 /*
  * Split an (internal) inboxname into it's constituent parts.
  * also: userid
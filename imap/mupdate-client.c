@@ -93,7 +93,8 @@ static struct protocol_t mupdate_protocol =
   { "A01 AUTHENTICATE", USHRT_MAX, 1, "A01 OK", "A01 NO", "", "*", NULL, 0 },
   { "Z01 COMPRESS \"DEFLATE\"", NULL, "Z01 OK" },
   { "N01 NOOP", NULL, "N01 OK" },
-  { "Q01 LOGOUT", NULL, "Q01 " }
+  { "Q01 LOGOUT", NULL, "Q01 " },
+  { NULL, NULL, NULL, 0 }
 };
 
 int mupdate_connect(const char *server,
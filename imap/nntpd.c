@@ -279,7 +279,8 @@ static struct protocol_t nntp_protocol =
   { "AUTHINFO SASL", 512, 0, "28", "48", "383 ", "*", &nntp_parsesuccess, 0 },
   { NULL, NULL, NULL },
   { "DATE", NULL, "111" },
-  { "QUIT", NULL, "205" }
+  { "QUIT", NULL, "205" },
+  { NULL, NULL, NULL, 0 }
 };
 
 /* proxy mboxlist_lookup; on misses, it asks the listener for this
@@ -1749,7 +1750,7 @@ static int open_group(char *name, int has_prefix, struct backend **ret,
     if (!r) r = mlookup(name, &mbentry);
 
     if (!r && mbentry->acl) {
-	int myrights = cyrus_acl_myrights(nntp_authstate, mbentry->acl);
+	int myrights = mboxlist_entry_myrights(mbentry, nntp_authstate);
 
 	if (postable) *postable = myrights & ACL_POST;
 	if (!postable && /* allow limited 'r' for LIST ACTIVE */
@@ -1887,8 +1888,9 @@ static void build_xref(const char *msgid, struct buf *buf, int body_only)
 static void cmd_article(int part, char *msgid, unsigned long uid)
 {
     int msgno, by_msgid = (msgid != NULL);
-    char *fname;
-    FILE *msgfile;
+    const char *msg_base = NULL;
+    size_t msg_size = 0;
+    int msgfd;
 
     msgno = index_finduid(group_state, uid);
     if (!msgno || index_getuid(group_state, msgno) != uid) {
@@ -1896,10 +1898,8 @@ static void cmd_article(int part, char *msgid, unsigned long uid)
 	return;
     }
 
-    fname = mailbox_message_fname(group_state->mailbox, uid);
-
-    msgfile = fopen(fname, "r");
-    if (!msgfile) {
+    if (mailbox_map_message_fd(group_state->mailbox, uid, &msgfd,
+			       &msg_base, &msg_size)) {
 	prot_printf(nntp_out, "502 Could not read message file\r\n");
 	return;
     }
@@ -1913,44 +1913,54 @@ static void cmd_article(int part, char *msgid, unsigned long uid)
 		220 + part, by_msgid ? 0 : uid, msgid ? msgid : "<0>");
 
     if (part != ARTICLE_STAT) {
-	char buf[4096];
-	int body = 0;
-	int output = (part != ARTICLE_BODY);
-
-	while (fgets(buf, sizeof(buf), msgfile)) {
-	    if (!body && buf[0] == '\r' && buf[1] == '\n') {
-		/* blank line between header and body */
-		body = 1;
-		if (output) {
-		    /* add the Xref header */
-		    struct buf xref = BUF_INITIALIZER;
-
-		    build_xref(msgid, &xref, 0);
-		    prot_printf(nntp_out, "%s\r\n", buf_cstring(&xref));
-		    buf_free(&xref);
-		}
-		if (part == ARTICLE_HEAD) {
-		    /* we're done */
+	const char *p = msg_base;
+	const char *end = msg_base + msg_size;
+	size_t hdrlen = msg_size;
+	char last = '\n';
+
+	/* find the blank line between header and body */
+	if (msg_size >= 2 && p[0] == '\r' && p[1] == '\n') {
+	    hdrlen = 0;
+	}
+	else {
+	    while ((p = memchr(p, '\n', end - p)) && ++p < end - 1) {
+		if (p[0] == '\r' && p[1] == '\n') {
+		    hdrlen = p - msg_base;
 		    break;
 		}
-		else if (part == ARTICLE_BODY) {
-		    /* start outputing text */
-		    output = 1;
-		    continue;
-		}
 	    }
+	}
 
-	    if (output) {
-		if (buf[0] == '.') prot_putc('.', nntp_out);
-		do {
-		    prot_printf(nntp_out, "%s", buf);
-		} while (buf[strlen(buf)-1] != '\n' &&
-			 fgets(buf, sizeof(buf), msgfile));
+	if (part != ARTICLE_BODY && hdrlen) {
+	    prot_sendfile_dotstuffed(nntp_out, msgfd, msg_base, 0, hdrlen);
+	    last = msg_base[hdrlen-1];
+	}
+
+	if (hdrlen < msg_size) {
+	    size_t offset = hdrlen;
+
+	    if (part != ARTICLE_BODY) {
+		/* add the Xref header */
+		struct buf xref = BUF_INITIALIZER;
+
+		build_xref(msgid, &xref, 0);
+		prot_printf(nntp_out, "%s\r\n", buf_cstring(&xref));
+		buf_free(&xref);
+		last = '\n';
+	    }
+	    if (part == ARTICLE_BODY) {
+		/* body starts after the blank line */
+		offset += 2;
+	    }
+	    if (part != ARTICLE_HEAD && offset < msg_size) {
+		prot_sendfile_dotstuffed(nntp_out, msgfd, msg_base,
+					 offset, msg_size - offset);
+		last = msg_base[msg_size-1];
 	    }
 	}
 
 	/* Protect against messages not ending in CRLF */
-	if (buf[strlen(buf)-1] != '\n') prot_printf(nntp_out, "\r\n");
+	if (last != '\n') prot_printf(nntp_out, "\r\n");
 
 	prot_printf(nntp_out, ".\r\n");
 
@@ -1961,7 +1971,8 @@ static void cmd_article(int part, char *msgid, unsigned long uid)
 
     if (!by_msgid) free(msgid);
 
-    fclose(msgfile);
+    mailbox_unmap_message(group_state->mailbox, uid, &msg_base, &msg_size);
+    close(msgfd);
 }
 
 static void cmd_authinfo_user(char *user)
@@ -2552,7 +2563,7 @@ static int do_newsgroups(char *name, void *rock)
     r = mlookup(name, &mbentry);
 
     if (r || !mbentry->acl ||
-	!(cyrus_acl_myrights(nntp_authstate, mbentry->acl) && ACL_LOOKUP)) {
+	!(mboxlist_entry_myrights(mbentry, nntp_authstate) && ACL_LOOKUP)) {
 	mboxlist_entry_free(&mbentry);
 	return 0;
     }
@@ -3267,7 +3278,7 @@ static int deliver(message_data_t *msg)
 	r = mlookup(rcpt, &mbentry);
 	if (r) return IMAP_MAILBOX_NONEXISTENT;
 
-	if (!(mbentry->acl && (myrights = cyrus_acl_myrights(nntp_authstate, mbentry->acl)) &&
+	if (!(mbentry->acl && (myrights = mboxlist_entry_myrights(mbentry, nntp_authstate)) &&
 	      (myrights & ACL_POST))) {
 	    mboxlist_entry_free(&mbentry);
 	    return IMAP_PERMISSION_DENIED;
@@ -176,7 +176,8 @@ static struct protocol_t pop3_protocol =
   { "AUTH", 255, 0, "+OK", "-ERR", "+ ", "*", NULL, 0 },
   { NULL, NULL, NULL },
   { "NOOP", NULL, "+OK" },
-  { "QUIT", NULL, "+OK" }
+  { "QUIT", NULL, "+OK" },
+  { NULL, NULL, NULL, 0 }
 };
 
 static void bitpipe(void);
@@ -1737,7 +1738,7 @@ int openinbox(void)
     if (!r) r = mboxlist_lookup(inboxname, &mbentry, NULL);
     if (!r && (config_popuseacl = config_getswitch(IMAPOPT_POPUSEACL)) &&
 	(!mbentry->acl ||
-	 !((myrights = cyrus_acl_myrights(popd_authstate, mbentry->acl)) & ACL_READ))) {
+	 !((myrights = mboxlist_entry_myrights(mbentry, popd_authstate)) & ACL_READ))) {
 	r = (myrights & ACL_LOOKUP) ?
 	    IMAP_PERMISSION_DENIED : IMAP_MAILBOX_NONEXISTENT;
 	log_level = LOG_INFO;
@@ -1932,6 +1933,38 @@ int openinbox(void)
     return 1;
 }
 
+/* send the whole message straight from the file */
+static int blat_all(int msgno)
+{
+    const char *msg_base = NULL;
+    size_t msg_size = 0;
+    int msgfd;
+
+    if (mailbox_map_message_fd(popd_mailbox, popd_msg[msgno].uid, &msgfd,
+			       &msg_base, &msg_size)) {
+	prot_printf(popd_out, "-ERR [SYS/PERM] Could not read message file\r\n");
+	return IMAP_IOERROR;
+    }
+    prot_printf(popd_out, "+OK Message follows\r\n");
+    prot_sendfile_dotstuffed(popd_out, msgfd, msg_base, 0, msg_size);
+
+    /* Protect against messages not ending in CRLF */
+    if (msg_size && msg_base[msg_size-1] != '\n')
+	prot_printf(popd_out, "\r\n");
+
+    mailbox_unmap_message(popd_mailbox, popd_msg[msgno].uid,
+			  &msg_base, &msg_size);
+    close(msgfd);
+
+    prot_printf(popd_out, ".\r\n");
+
+    /* Reset inactivity timer in case we spend a long time
+       pushing data to the client over a slow link. */
+    prot_resettimeout(popd_in);
+
+    return 0;
+}
+
 static int blat(int msgno, int lines)
 {
     FILE *msgfile;
@@ -1939,6 +1972,8 @@ static int blat(int msgno, int lines)
     char *fname;
     int thisline = -2;
 
+    if (lines < 0) return blat_all(msgno);
+
     fname = mailbox_message_fname(popd_mailbox, popd_msg[msgno].uid);
     msgfile = fopen(fname, "r");
     if (!msgfile) {
@@ -49,7 +49,7 @@
 
 struct backend;
 
-#define MAX_CAPA 9
+#define MAX_CAPA 10
 
 enum {
     /* generic capabilities */
@@ -107,6 +107,13 @@ struct simple_cmd_t {
     const char *ok;		/* success response */
 };
 
+struct proxyauth_cmd_t {
+    const char *cmd;		/* command string, followed by the userid */
+    const char *unsol;		/* unsolicited response */
+    const char *ok;		/* success response */
+    unsigned long capa;		/* capability advertising the command */
+};
+
 struct protocol_t {
     const char *service;	/* INET service name */
     const char *sasl_service;	/* SASL service name */
@@ -117,6 +124,8 @@ struct protocol_t {
     struct simple_cmd_t compress_cmd;
     struct simple_cmd_t ping_cmd;
     struct simple_cmd_t logout_cmd;
+    struct proxyauth_cmd_t proxyauth_cmd; /* [OPTIONAL] switch the user
+					     we're proxying for */
 };
 
 #endif /* _INCLUDED_PROTOCOL_H */
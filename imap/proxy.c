@@ -59,6 +59,7 @@
 #include "mupdate-client.h"
 #include "prot.h"
 #include "proxy.h"
+#include "strarray.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
@@ -99,6 +100,20 @@ void proxy_adddest(struct dest **dlist, const char *rcpt, int rcpt_num,
     }
 }
 
+/* forget the session a backend connection was being used for */
+static void proxy_detachserver(struct backend *s)
+{
+    /* clear any references to this backend */
+    if (s->inbox && (s == *(s->inbox))) *(s->inbox) = NULL;
+    if (s->current && (s == *(s->current))) *(s->current) = NULL;
+    s->inbox = s->current = NULL;
+
+    /* remove the timeout */
+    if (s->timeout) prot_removewaitevent(s->clientin, s->timeout);
+    s->timeout = NULL;
+    s->clientin = NULL;
+}
+
 void proxy_downserver(struct backend *s)
 {
     if (!s || (s->sock == -1)) {
@@ -109,15 +124,149 @@ void proxy_downserver(struct backend *s)
     /* need to logout of server */
     backend_disconnect(s);
 
-    /* clear any references to this backend */
-    if (s->inbox && (s == *(s->inbox))) *(s->inbox) = NULL;
-    if (s->current && (s == *(s->current))) *(s->current) = NULL;
-    s->inbox = s->current = NULL;
+    proxy_detachserver(s);
+}
 
-    /* remove the timeout */
-    if (s->timeout) prot_removewaitevent(s->clientin, s->timeout);
-    s->timeout = NULL;
-    s->clientin = NULL;
+/*
+ * Connections to backends, authenticated as ourselves, which outlive
+ * the session they were made for.  The next session wanting the same
+ * backend switches the connection to its own user, rather than paying
+ * for another connect, STARTTLS, AUTHENTICATE and COMPRESS.
+ */
+#define POOL_PING_TIMEOUT 10	/* seconds */
+
+static struct backend **pool = NULL;
+static int pool_num = 0;
+static strarray_t pool_unsupported = STRARRAY_INITIALIZER;
+static struct {
+    unsigned long reused;	/* sessions given a pooled connection */
+    unsigned long connected;	/* connections made to be pooled */
+    unsigned long dead;		/* pooled connections that failed a ping */
+    unsigned long expired;	/* pooled connections kept too long */
+    unsigned long failed;	/* failed switches to a user */
+} pool_stats;
+
+static void pool_drop(struct backend *s)
+{
+    backend_disconnect(s);
+    if (s->last_result.s) free(s->last_result.s);
+    free(s);
+}
+
+static struct backend *pool_remove(int i)
+{
+    struct backend *s = pool[i];
+
+    pool_num--;
+    memmove(pool + i, pool + i + 1, (pool_num - i) * sizeof(struct backend *));
+
+    return s;
+}
+
+/* a connection to 'server', proxying for 'userid', from the pool if
+ * we can, or else made so that it can be pooled afterwards */
+static struct backend *pool_get(const char *server, struct protocol_t *prot,
+				const char *userid)
+{
+    struct backend *s = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    if (!prot->proxyauth_cmd.cmd || !userid || !*userid ||
+	config_getint(IMAPOPT_PROXY_POOL_SIZE) <= 0 ||
+	strarray_find(&pool_unsupported, server, 0) >= 0)
+	return NULL;
+
+    /* the most recently used connection to the server which still works */
+    for (i = pool_num - 1; i >= 0; i--) {
+	if (strcmp(server, pool[i]->hostname) || pool[i]->prot != prot)
+	    continue;
+
+	s = pool_remove(i);
+	if (s->pooled + IDLE_TIMEOUT < now) {
+	    pool_stats.expired++;
+	}
+	else if (backend_ping(s)) {
+	    pool_stats.dead++;
+	}
+	else break;
+
+	pool_drop(s);
+	s = NULL;
+    }
+
+    if (s) {
+	pool_stats.reused++;
+    }
+    else {
+	s = backend_connect(NULL, server, prot, "", NULL, NULL);
+	if (!s) return NULL;
+
+	if (!CAPA(s, prot->proxyauth_cmd.capa)) {
+	    syslog(LOG_NOTICE, "backend %s can't switch users: "
+		   "not pooling connections to it", server);
+	    strarray_append(&pool_unsupported, server);
+	    pool_drop(s);
+	    return NULL;
+	}
+	pool_stats.connected++;
+    }
+
+    if (backend_proxyauth(s, userid)) {
+	syslog(LOG_ERR, "backend %s refused to proxy for %s",
+	       server, userid);
+	pool_stats.failed++;
+	pool_drop(s);
+	return NULL;
+    }
+
+    return s;
+}
+
+int proxy_pool_put(struct backend *s)
+{
+    int max = config_getint(IMAPOPT_PROXY_POOL_SIZE);
+    int r;
+
+    if (max <= 0 || !s || s->sock == -1 || prot_error(s->in) ||
+	!s->prot->proxyauth_cmd.cmd || !CAPA(s, s->prot->proxyauth_cmd.capa))
+	return 0;
+
+    /* the session may have ended part way through a command (an IDLE,
+     * or a literal being sent), so only keep the connection if it
+     * answers a ping straight away, with nothing of the last command's
+     * still to come */
+    prot_settimeout(s->in, POOL_PING_TIMEOUT);
+    r = backend_ping(s);
+    prot_settimeout(s->in, 0);
+    if (r || prot_error(s->in)) return 0;
+
+    proxy_detachserver(s);
+
+    /* make room by dropping the connection unused the longest */
+    if (!pool) pool = xmalloc(max * sizeof(struct backend *));
+    if (pool_num == max) pool_drop(pool_remove(0));
+
+    s->pooled = time(NULL);
+    pool[pool_num++] = s;
+
+    return 1;
+}
+
+void proxy_pool_done(void)
+{
+    if (pool_stats.reused || pool_stats.connected) {
+	syslog(LOG_INFO, "backend pool: reused=<%lu> connected=<%lu> "
+	       "dead=<%lu> expired=<%lu> failed=<%lu> pooled=<%d>",
+	       pool_stats.reused, pool_stats.connected, pool_stats.dead,
+	       pool_stats.expired, pool_stats.failed, pool_num);
+    }
+
+    while (pool_num) pool_drop(pool_remove(pool_num - 1));
+    free(pool);
+    pool = NULL;
+    strarray_fini(&pool_unsupported);
+    memset(&pool_stats, 0, sizeof(pool_stats));
 }
 
 static struct prot_waitevent * 
@@ -176,7 +325,9 @@ proxy_findserver(const char *server,		/* hostname of backend */
 
     if (!ret || (ret->sock == -1)) {
 	/* need to (re)establish connection to server or create one */
-	ret = backend_connect(ret, server, prot, userid, NULL, NULL);
+	if (!ret) ret = pool_get(server, prot, userid);
+	if (!ret || (ret->sock == -1))
+	    ret = backend_connect(ret, server, prot, userid, NULL, NULL);
 	if (!ret) return NULL;
 
 	if (clientin) {
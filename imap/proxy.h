@@ -77,6 +77,13 @@ proxy_findserver(const char *server, struct protocol_t *prot,
 
 void proxy_downserver(struct backend *s);
 
+/* keep a connection, at the end of its session, for the next one, if
+ * it answers a ping (returns 1 if it was taken, else 0 and it's still
+ * the caller's) */
+int proxy_pool_put(struct backend *s);
+/* log how the pool did, and close its connections */
+void proxy_pool_done(void);
+
 int proxy_check_input(struct protgroup *protin,
 		      struct protstream *clientin,
 		      struct protstream *clientout,
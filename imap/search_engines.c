@@ -63,17 +63,14 @@
 #include "squat.h"
 
 typedef struct {
-    unsigned char	*vector;
     struct index_state	*state;
     const char		*part_types;
     int			found_validity;
+    unsigned		*uids;		/* UIDs of the matching docs */
+    unsigned		nuids;
+    unsigned		alloc;
 } SquatSearchResult;
 
-static int vector_len(struct index_state *state)
-{
-    return (state->exists >> 3) + 1;
-}
-
 /* The document name is of the form
 
    pnnn.vvv
@@ -83,20 +80,20 @@ static int vector_len(struct index_state *state)
    is the UID validity value.
 
    This function parses the document name and returns the message
-   UID only if the name has the right part type and it corresponds
-   to a real message UID.
+   UID if the name has the right part type, or 0 if not.
 */
-static int parse_doc_name(SquatSearchResult *r, const char *doc_name)
+static unsigned parse_doc_name(SquatSearchResult *r, const char *doc_name)
 {
     int ch = doc_name[0];
     const char *t = r->part_types;
-    int doc_UID, index;
+    unsigned long doc_UID;
+    char *end;
 
     if (ch == 'v' && strncmp(doc_name, "validity.", 9) == 0) {
-	if ((unsigned) atoi(doc_name + 9) == r->state->mailbox->i.uidvalidity) {
+	if (strtoul(doc_name + 9, NULL, 10) == r->state->mailbox->i.uidvalidity) {
 	    r->found_validity = 1;
 	}
-	return -1;
+	return 0;
     }
 
     /* make sure that the document part type is one of the ones we're
@@ -105,99 +102,143 @@ static int parse_doc_name(SquatSearchResult *r, const char *doc_name)
 	t++;
     }
     if (*t == 0) {
-	return -1;
+	return 0;
     }
 
-    doc_UID = atoi(++doc_name);
-    while ((*doc_name >= '0' && *doc_name <= '9') || *doc_name == '-') {
-	++doc_name;
+    doc_UID = strtoul(++doc_name, &end, 10);
+    while ((*end >= '0' && *end <= '9') || *end == '-') {
+	++end;
     }
-    if (*doc_name != 0) {
-	return -1;
+    if (*end != 0 || end == doc_name) {
+	return 0;
     }
 
-    index = index_finduid(r->state, doc_UID);
+    return doc_UID;
+}
+
+/* Documents indexed by a current squatter also carry a key made of
+   the UID and the part type, which saves us parsing the name. This
+   returns the UID if the key has the right part type, or 0 if not. */
+static unsigned parse_doc_key(SquatSearchResult *r, SquatInt64 key)
+{
+    int part = SEARCHINDEX_DOC_KEY_PART(key);
+
+    if (!part || !strchr(r->part_types, part))
+	return 0;
 
-    return index;
+    return SEARCHINDEX_DOC_KEY_UID(key);
 }
 
-static int drop_indexed_docs(void* closure, const SquatListDoc *doc)
+/* Collect the UIDs of the documents; they're turned into message
+ * numbers all at once by index_finduids() when the query is done */
+static void add_doc_uid(SquatSearchResult *r, unsigned uid)
 {
-    SquatSearchResult* r = (SquatSearchResult*)closure;
-    int doc_uid = parse_doc_name(r, doc->doc_name);
+    if (!uid)
+	return;
 
-    if (doc_uid >= 0) {
-	unsigned char* vect = r->vector;
-	vect[doc_uid >> 3] &= ~(1 << (doc_uid & 0x7));
+    if (r->nuids == r->alloc) {
+	r->alloc = (r->alloc ? r->alloc * 2 : 256);
+	r->uids = xrealloc(r->uids, r->alloc * sizeof(unsigned));
     }
+    r->uids[r->nuids++] = uid;
+}
+
+static int drop_indexed_docs(void* closure, const SquatListDoc *doc)
+{
+    SquatSearchResult *r = (SquatSearchResult*)closure;
+
+    /* the validity document has no key, so always check its name */
+    if (doc->key < 0)
+	add_doc_uid(r, parse_doc_name(r, doc->doc_name));
+    else
+	add_doc_uid(r, parse_doc_key(r, doc->key));
     return SQUAT_CALLBACK_CONTINUE;
 }
 
 static int fill_with_hits(void* closure, char const* doc)
 {
-    SquatSearchResult* r = (SquatSearchResult*)closure;
-    int doc_uid = parse_doc_name(r, doc);
+    SquatSearchResult *r = (SquatSearchResult*)closure;
 
-    if (doc_uid >= 0) {
-	unsigned char* vect = r->vector;
-	vect[doc_uid >> 3] |= 1 << (doc_uid & 0x7);
-    }
+    add_doc_uid(r, parse_doc_name(r, doc));
+    return SQUAT_CALLBACK_CONTINUE;
+}
+
+static int fill_with_key_hits(void* closure, SquatInt64 key)
+{
+    SquatSearchResult *r = (SquatSearchResult*)closure;
+
+    if (key >= 0)
+	add_doc_uid(r, parse_doc_key(r, key));
     return SQUAT_CALLBACK_CONTINUE;
 }
 
 static int search_strlist(SquatSearchIndex* index, struct index_state *state,
-			  unsigned char* output, unsigned char* tmp,
+			  bitvector_t *output, bitvector_t *tmp,
 			  struct strlist* strs, char const* part_types)
 {
     SquatSearchResult r;
-    int i;
-    int len = vector_len(state);
+    int ret = 1;
 
+    memset(&r, 0, sizeof(r));
     r.part_types = part_types;
-    r.vector = tmp;
     r.state = state;
     while (strs != NULL) {
 	char const* s = strs->s;
 
-	memset(tmp, 0, len);
-	if (squat_search_execute(index, s, strlen(s), fill_with_hits, &r)
-	    != SQUAT_OK) {
+	int res;
+
+	r.nuids = 0;
+	res = squat_search_execute_keys(index, s, strlen(s),
+					fill_with_key_hits, &r);
+	if (res != SQUAT_OK
+	    && squat_get_last_error() == SQUAT_ERR_NO_DOC_KEYS) {
+	    /* an old index: match on document names instead */
+	    res = squat_search_execute(index, s, strlen(s),
+				       fill_with_hits, &r);
+	}
+	if (res != SQUAT_OK) {
 	    if (squat_get_last_error() == SQUAT_ERR_SEARCH_STRING_TOO_SHORT)
-		return 1; /* The rest of the search is still viable */
+		break; /* The rest of the search is still viable */
 	    syslog(LOG_DEBUG, "SQUAT string list search failed on string %s "
 			      "with part types %s", s, part_types);
-	    return 0;
-	}
-	for (i = 0; i < len; i++) {
-	    output[i] &= tmp[i];
+	    ret = 0;
+	    break;
 	}
+	bv_clearall(tmp);
+	index_finduids(state, r.uids, r.nuids, tmp);
+	bv_andeq(output, tmp);
 
 	strs = strs->next;
     }
-    return 1;
+
+    free(r.uids);
+    return ret;
 }
 
-static unsigned char* search_squat_do_query(SquatSearchIndex* index,
-					    struct index_state *state,
-					    struct searchargs* args)
+/* Returns a vector with bit 'msgno' set for each message which could
+ * match, or NULL on failure */
+static bitvector_t *search_squat_do_query(SquatSearchIndex* index,
+					  struct index_state *state,
+					  struct searchargs* args)
 {
-    int vlen = vector_len(state);
-    unsigned char* vect = xmalloc(vlen);
-    unsigned char* t_vect = xmalloc(vlen);
+    bitvector_t *vect = xzmalloc(sizeof(bitvector_t));
+    bitvector_t t_vect = BITVECTOR_INITIALIZER;
     struct searchsub* sub;
     int found_something = 1;
 
-    memset(vect, 255, vlen);
-
-    if (!(search_strlist(index, state, vect, t_vect, args->to, "t")
-	&& search_strlist(index, state, vect, t_vect, args->from, "f")
-	&& search_strlist(index, state, vect, t_vect, args->cc, "c")
-	&& search_strlist(index, state, vect, t_vect, args->bcc, "b")
-	&& search_strlist(index, state, vect, t_vect, args->subject, "s")
-	&& search_strlist(index, state, vect, t_vect, args->header_name, "h")
-	&& search_strlist(index, state, vect, t_vect, args->header, "h")
-	&& search_strlist(index, state, vect, t_vect, args->body, "m")
-	&& search_strlist(index, state, vect, t_vect, args->text, "mh"))) {
+    bv_setsize(vect, state->exists + 1);
+    bv_setall(vect);
+    bv_setsize(&t_vect, state->exists + 1);
+
+    if (!(search_strlist(index, state, vect, &t_vect, args->to, "t")
+	&& search_strlist(index, state, vect, &t_vect, args->from, "f")
+	&& search_strlist(index, state, vect, &t_vect, args->cc, "c")
+	&& search_strlist(index, state, vect, &t_vect, args->bcc, "b")
+	&& search_strlist(index, state, vect, &t_vect, args->subject, "s")
+	&& search_strlist(index, state, vect, &t_vect, args->header_name, "h")
+	&& search_strlist(index, state, vect, &t_vect, args->header, "h")
+	&& search_strlist(index, state, vect, &t_vect, args->body, "m")
+	&& search_strlist(index, state, vect, &t_vect, args->text, "mh"))) {
 	found_something = 0;
 	goto cleanup;
     }
@@ -211,10 +252,9 @@ static unsigned char* search_squat_do_query(SquatSearchIndex* index,
 	    /* Note that it's OK to do nothing. We'll just be returning more
 	       false positives. */
 	} else {
-	    unsigned char* sub1_vect =
+	    bitvector_t* sub1_vect =
 		    search_squat_do_query(index, state, args->sublist->sub1);
-	    unsigned char* sub2_vect;
-	    int i;
+	    bitvector_t* sub2_vect;
 
 	    if (sub1_vect == NULL) {
 		found_something = 0;
@@ -225,15 +265,17 @@ static unsigned char* search_squat_do_query(SquatSearchIndex* index,
 
 	    if (sub2_vect == NULL) {
 		found_something = 0;
+		bv_fini(sub1_vect);
 		free(sub1_vect);
 		goto cleanup;
 	    }
 
-	    for (i = 0; i < vlen; i++) {
-		vect[i] &= sub1_vect[i] | sub2_vect[i];
-	    }
+	    bv_oreq(sub1_vect, sub2_vect);
+	    bv_andeq(vect, sub1_vect);
 
+	    bv_fini(sub1_vect);
 	    free(sub1_vect);
+	    bv_fini(sub2_vect);
 	    free(sub2_vect);
 	}
 
@@ -241,8 +283,9 @@ static unsigned char* search_squat_do_query(SquatSearchIndex* index,
     }
 
 cleanup:
-    free(t_vect);
+    bv_fini(&t_vect);
     if (!found_something) {
+	bv_fini(vect);
 	free(vect);
 	return NULL;
     }
@@ -256,7 +299,7 @@ static int search_squat(unsigned* msg_list, struct index_state *state,
     char *fname;
     int fd;
     SquatSearchIndex* index;
-    unsigned char* msg_vector;
+    bitvector_t* msg_vector;
     int result;
 
     fname = mailbox_meta_fname(state->mailbox, META_SQUAT);
@@ -273,16 +316,14 @@ static int search_squat(unsigned* msg_list, struct index_state *state,
 	    == NULL) {
 	result = -1;
     } else {
-	unsigned i;
-	unsigned vlen = vector_len(state);
-	unsigned char* unindexed_vector = xmalloc(vlen);
+	int i;
+	bitvector_t indexed_vector = BITVECTOR_INITIALIZER;
+	bitvector_t unindexed_vector = BITVECTOR_INITIALIZER;
 	SquatSearchResult r;
 
-	memset(unindexed_vector, 255, vlen);
-	r.vector = unindexed_vector;
+	memset(&r, 0, sizeof(r));
 	r.state = state;
 	r.part_types = "tfcbsmh";
-	r.found_validity = 0;
 	if (squat_search_list_docs(index, drop_indexed_docs, &r) != SQUAT_OK) {
 	    syslog(LOG_DEBUG, "SQUAT failed to get list of indexed documents");
 	    result = -1;
@@ -291,20 +332,26 @@ static int search_squat(unsigned* msg_list, struct index_state *state,
 	    result = -1;
 	} else {
 	    /* Add in any unindexed messages. They must be searched manually. */
-	    for (i = 0; i < vlen; i++) {
-		msg_vector[i] |= unindexed_vector[i];
-	    }
+	    bv_setsize(&indexed_vector, state->exists + 1);
+	    index_finduids(state, r.uids, r.nuids, &indexed_vector);
+	    bv_setsize(&unindexed_vector, state->exists + 1);
+	    bv_setall(&unindexed_vector);
+	    bv_andnoteq(&unindexed_vector, &indexed_vector);
+	    bv_oreq(msg_vector, &unindexed_vector);
 
 	    result = 0;
-	    for (i = 1; i <= state->exists; i++) {
-	        if ((msg_vector[i >> 3] & (1 << (i & 7))) != 0) {
-		    msg_list[result] = i;
-		    result++;
-		}
+	    for (i = bv_next_set(msg_vector, 1); i > 0;
+		 i = bv_next_set(msg_vector, i+1)) {
+		if ((unsigned) i > state->exists) break;
+		msg_list[result] = i;
+		result++;
 	    }
 	}
+	free(r.uids);
+	bv_fini(&indexed_vector);
+	bv_fini(&unindexed_vector);
+	bv_fini(msg_vector);
 	free(msg_vector);
-	free(unindexed_vector);
     }
     squat_search_close(index);
     close(fd);
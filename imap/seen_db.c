@@ -135,6 +135,8 @@ int seen_open(const char *user,
     /* open the seendb corresponding to user */
     fname = seen_getpath(user);
     if (flags & SEEN_CREATE) cyrus_mkdir(fname, 0755);
+    if (config_getswitch(IMAPOPT_SEENSTATE_DB_GROUPCOMMIT))
+	dbflags |= CYRUSDB_GROUPCOMMIT;
     r = cyrusdb_open(DB, fname, dbflags, &seendb->db);
     if (r) {
 	if (!(flags & SEEN_SILENT)) {
@@ -312,7 +312,7 @@ int verify_user(const char *key,
 	     * and then we could do a VRFY to the correct backend which
 	     * would also do a quotacheck.
 	     */
-	    int access = cyrus_acl_myrights(authstate, mbentry->acl);
+	    int access = mboxlist_entry_myrights(mbentry, authstate);
 
 	    if ((access & aclcheck) != aclcheck) {
 		r = (access & ACL_LOOKUP) ?
@@ -65,6 +65,9 @@ struct _SquatSearchIndex {
 					 offset table start in memory */ 
   char const* doc_ID_list;            /* where does the doc-ID-list
 					 array start in memory */
+  char const* doc_key_list;           /* where does the doc-key-list
+					 array start in memory (NULL
+					 for version 1 files) */
   char const* data_end;               /* the end of the mmaped file */
   unsigned char valid_char_bits[32];  /* which characters are valid in
 					 queries according to whoever
@@ -88,7 +91,9 @@ SquatSearchIndex* squat_search_open(int fd) {
   SquatSearchIndex* index;
   SquatDiskHeader const* header;
   SquatInt64 doc_list_offset, doc_ID_list_offset, word_list_offset;
+  SquatInt64 doc_key_list_offset;
   SquatInt64 data_len;
+  int version;
 
   squat_set_last_error(SQUAT_ERR_OK);
 
@@ -109,7 +114,7 @@ SquatSearchIndex* squat_search_open(int fd) {
     goto cleanup_index;
   }
   data_len = buf.st_size - SQUAT_SAFETY_ZONE;
-  if ((size_t)data_len < sizeof(SquatDiskHeader)) {
+  if (data_len < SQUAT_DISK_HEADER_V1_SIZE) {
     squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
     goto cleanup_index;    
   }
@@ -121,16 +126,28 @@ SquatSearchIndex* squat_search_open(int fd) {
   }
 
   header = (SquatDiskHeader const*)index->data;
+  if (memcmp(header->header_text, squat_index_file_header, 8) == 0
+      && (size_t)data_len >= sizeof(SquatDiskHeader)) {
+    version = 2;
+  } else if (memcmp(header->header_text, squat_index_file_header_v1, 8) == 0) {
+    version = 1;
+  } else {
+    squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+    goto cleanup_unmap;
+  }
+
   doc_list_offset = squat_decode_64(header->doc_list_offset);
   word_list_offset = squat_decode_64(header->word_list_offset);
   doc_ID_list_offset = squat_decode_64(header->doc_ID_list_offset);
+  doc_key_list_offset = version > 1 ?
+    squat_decode_64(header->doc_key_list_offset) : 0;
 
   /* Do some sanity checking in case the header was corrupted. We wouldn't
      want to dereference any bad pointers... */
-  if (memcmp(header->header_text, squat_index_file_header, 8) != 0
-      || doc_list_offset < 0 || doc_list_offset >= data_len
+  if (doc_list_offset < 0 || doc_list_offset >= data_len
       || word_list_offset < 0 || word_list_offset >= data_len
       || doc_ID_list_offset < 0 || doc_ID_list_offset >= data_len
+      || doc_key_list_offset < 0 || doc_key_list_offset >= data_len
       || !memconst(index->data + data_len, SQUAT_SAFETY_ZONE, 0)) {
     squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
     goto cleanup_unmap;
@@ -139,6 +156,7 @@ SquatSearchIndex* squat_search_open(int fd) {
   index->doc_list = index->data + doc_list_offset;
   index->word_list = index->data + word_list_offset;
   index->doc_ID_list = index->data + doc_ID_list_offset;
+  index->doc_key_list = version > 1 ? index->data + doc_key_list_offset : NULL;
   index->data_end = index->data + data_len;
   memcpy(index->valid_char_bits, header->valid_char_bits,
          sizeof(index->valid_char_bits));
@@ -156,6 +174,7 @@ cleanup_index:
 int squat_search_list_docs(SquatSearchIndex* index,
   SquatListDocCallback handler, void* closure) {
   char const* s = index->doc_list;
+  char const* k = index->doc_key_list;
 
   squat_set_last_error(SQUAT_ERR_OK);
 
@@ -166,6 +185,15 @@ int squat_search_list_docs(SquatSearchIndex* index,
     list_doc.doc_name = s;
     s += strlen(s) + 1;
     list_doc.size = squat_decode_I(&s);
+    list_doc.key = -1;
+    if (k != NULL) {
+      if (k + 8 > index->data_end) {
+        squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+        return SQUAT_ERR;
+      }
+      list_doc.key = squat_decode_64(k);
+      k += 8;
+    }
     r = handler(closure, &list_doc);
 
     if (r == SQUAT_CALLBACK_ABORT) {
@@ -266,220 +294,204 @@ static char const* lookup_word_docs(SquatSearchIndex* index,
   return s;
 }
 
-/* Get the pointer to the list of documents containing 'data' into
-   '*run_start', and return the number of documents in the list. */
-static int count_docs_containing_word(SquatSearchIndex* index,
-  char const* data, char const** run_start) {
-  int invalid_file = 0;
-  char const* raw_doc_list = lookup_word_docs(index, data, &invalid_file);
+/* A cursor over the list of documents containing a word. It walks
+   through the list in increasing document ID order, decoding entries
+   as it goes, so that we never have to build the whole list in
+   memory. If the list has a skip table, the cursor uses it to jump
+   over entries which can't contain the document it is looking for. */
+typedef struct {
+  char const* s;          /* The next entry to decode */
+  char const* end;        /* The end of the list */
+  char const* runs;       /* The first entry (skip offsets are
+			     relative to this) */
+  char const* skips;      /* The next skip table entry to read */
+  int skips_left;         /* The number of skip table entries left */
+  int skip_doc;           /* The document ID and offset of the last */
+  int skip_offset;        /* skip table entry read */
+  int doc;                /* The current document ID, or -1 if we ran
+			     off the end of the list */
+  int run_left;           /* The number of documents left in the
+			     current run after 'doc' */
+  int size;               /* The encoded size of the list, used to
+			     estimate how many documents it has */
+  int invalid;            /* Set if the list turned out to be corrupt */
+} SquatDocCursor;
+
+/* Advance the cursor to the next document in its list. */
+static void cursor_next(SquatDocCursor* c) {
   int i;
 
-  if (raw_doc_list == NULL) {
-    return invalid_file ? -1 : 0;
+  if (c->run_left > 0) {
+    c->doc++;
+    c->run_left--;
+    return;
   }
 
-  *run_start = raw_doc_list;
+  if (c->s >= c->end) {
+    c->doc = -1;
+    return;
+  }
 
-  i = (int)squat_decode_I(&raw_doc_list);
+  i = (int)squat_decode_I(&c->s);
   if ((i & 1) != 0) {
-    return 1; /* singleton */
-  } else {
-    int size = i >> 1;
-    char const* s = raw_doc_list;
-    int count = 0;
-    
-    if (raw_doc_list + size >= index->data_end) {
-      return -1;
-    }
-
-    while (s - raw_doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        count++;
-      } else {
-        count += i >> 1;
-        s = squat_decode_skip_I(s, 1);
-      }
-    }
+    c->doc += i >> 1;
+  } else if (i > 2) {
+    int delta = (int)squat_decode_I(&c->s);
 
-    if (raw_doc_list + size != s) {
-      return -1;
+    if (delta < 0) {
+      goto corrupt;
     }
+    c->doc += delta;
+    c->run_left = (i >> 1) - 1;
+  } else {
+    goto corrupt;
+  }
 
-    return count;
+  if (c->s > c->end) {
+    goto corrupt;
   }
+  return;
+
+corrupt:
+  c->invalid = 1;
+  c->doc = -1;
 }
 
-/* We store a set of documents in this little structure. The set
-   also maintains a 'current' document pointer. */
-typedef struct {
-  int array_len;   /* The length of the array below */
-  int* array_data; /* An array of document IDs, sorted by increasing
-		      document ID. It can also contain elements equal
-		      to -1, which means "no document".
-		   */
-  int index;       /* The index of the 'current' document within the array. */
-} SquatDocSet;
-
-/* Extract the list of documents containing the word 'data' into a
-   SquatDocSet. The list is extracted from the index file data
-   'doc_list' which refers to 'doc_count' documents.
-*/
-static int
-set_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			    SquatDocSet* set,
-			    char const* data __attribute__((unused)),
-			    int doc_count, char const* doc_list)
-{
-  int i;
+/* Set up a cursor over the list of documents at 'doc_list', and
+   position it on the first document in the list. */
+static int cursor_init(SquatSearchIndex* index, SquatDocCursor* c,
+		       char const* doc_list) {
+  int i = (int)squat_decode_I(&doc_list);
+
+  c->skips_left = 0;
+  c->skip_doc = 0;
+  c->skip_offset = 0;
+  c->run_left = 0;
+  c->invalid = 0;
 
-  set->array_len = doc_count;
-  set->array_data = (int*)xmalloc(sizeof(int)*set->array_len);
-  
-  i = (int)squat_decode_I(&doc_list);
   if ((i & 1) != 0) {
-    set->array_data[0] = i >> 1;
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    int j = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        last_doc = set->array_data[j++] = last_doc + (i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
+    /* singleton */
+    c->s = c->end = c->runs = doc_list;
+    c->doc = i >> 1;
+    c->size = 0;
+    return SQUAT_OK;
+  }
 
-        last_doc += delta;
-        set->array_data[j++] = last_doc;
-        while (--count > 0) {
-          last_doc++;
-          set->array_data[j++] = last_doc;
-        }
-      }
+  c->size = i >> 1;
+  c->end = doc_list + c->size;
+  if (c->size <= 0 || c->end >= index->data_end) {
+    return SQUAT_ERR;
+  }
+
+  if (*doc_list == 0) {
+    /* skip table; every entry is at least two bytes */
+    doc_list++;
+    c->skips_left = (int)squat_decode_I(&doc_list);
+    if (c->skips_left < 0 || c->skips_left > c->size) {
+      return SQUAT_ERR;
+    }
+    c->skips = doc_list;
+    doc_list = squat_decode_skip_I(doc_list, 2*c->skips_left);
+    if (doc_list > c->end) {
+      return SQUAT_ERR;
     }
   }
 
-  return SQUAT_OK;
+  c->s = c->runs = doc_list;
+  c->doc = 0;
+  cursor_next(c);
+
+  return c->invalid ? SQUAT_ERR : SQUAT_OK;
 }
 
-/* Advance the "current document" in the set to the first document
-   with ID > 'doc'. Remove any documents found along the way that were
-   not 'doc'.
-*/
-static void filter_doc(SquatDocSet* set, int doc) {
-  int i = set->index;
+/* Advance the cursor to the first document with ID >= 'target'. */
+static void cursor_advance_to(SquatDocCursor* c, int target) {
+  int jumped = 0;
 
-  while (i < set->array_len && set->array_data[i] < doc) {
-    /* this document is not in the currently filtered set */
-    set->array_data[i] = -1;
-    i++;
+  if (c->doc < 0 || c->doc >= target) {
+    return;
   }
 
-  /* skip over the matched document, if we matched */
-  if (i < set->array_len && set->array_data[i] == doc) {
-    i++;
+  /* Perhaps the target is inside the current run */
+  if (c->run_left > 0) {
+    if (c->doc + c->run_left >= target) {
+      c->run_left -= target - c->doc;
+      c->doc = target;
+      return;
+    }
+    c->doc += c->run_left;
+    c->run_left = 0;
   }
 
-  set->index = i;
-}
-
-/* Remove from a SquatDocSet any documents not in the list of
-   documents containing the word 'data'. The list is extracted from
-   the index file data 'doc_list'.
-*/
-static void
-filter_to_docs_containing_word(SquatSearchIndex* index __attribute__((unused)),
-			       SquatDocSet* set,
-			       char const* data __attribute__((unused)),
-			       char const* doc_list)
-{
-  int i = (int)squat_decode_I(&doc_list);
+  /* Find the last skip that still lands before the target */
+  while (c->skips_left > 0) {
+    char const* t = c->skips;
+    int doc = c->skip_doc + (int)squat_decode_I(&t);
+    int offset = c->skip_offset + (int)squat_decode_I(&t);
 
-  set->index = 0;
+    if (doc >= target) {
+      break;
+    }
+    c->skips = t;
+    c->skips_left--;
+    c->skip_doc = doc;
+    c->skip_offset = offset;
+    jumped = 1;
+  }
 
-  if ((i & 1) != 0) {
-    filter_doc(set, i >> 1); 
-  } else {
-    int size = i >> 1;
-    char const* s = doc_list;
-    int last_doc = 0;
-    
-    while (s - doc_list < size) {
-      i = (int)squat_decode_I(&s);
-      if ((i & 1) == 1) {
-        filter_doc(set, last_doc += i >> 1);
-      } else {
-        int count = i >> 1;
-        int delta = squat_decode_I(&s);
+  if (jumped) {
+    char const* s = c->runs + c->skip_offset;
 
-        last_doc += delta;
-        filter_doc(set, last_doc);
-        while (--count > 0) {
-          last_doc++;
-          filter_doc(set, last_doc);
-        }
-      }
+    if (c->skip_offset < 0 || s > c->end) {
+      c->invalid = 1;
+      c->doc = -1;
+      return;
+    }
+    if (s > c->s) {
+      c->s = s;
+      c->doc = c->skip_doc;
     }
   }
-}
 
-/* Advance the "current document" pointer to the first document in the set. */
-static void select_first_doc(SquatDocSet* set) {
-  set->index = 0;
-  while (set->index < set->array_len && set->array_data[set->index] < 0) {
-    set->index++;
+  while (c->doc >= 0 && c->doc < target) {
+    cursor_next(c);
   }
 }
 
-/* Is the "current document" pointer pointing to any real document? */
-static int has_more_docs(SquatDocSet* set) {
-  return set->index < set->array_len;
-}
-
-/* Advance the "current document" pointer to the next document in the set,
-   and return its old value */
-static int get_next_doc(SquatDocSet* set) {
-  int doc = set->array_data[set->index];
-
-  set->index++;
-  while (set->index < set->array_len && set->array_data[set->index] < 0) {
-    set->index++;
-  }
+/* Order cursors by increasing list size */
+static int compare_cursor_size(const void* v1, const void* v2) {
+  const SquatDocCursor* c1 = (const SquatDocCursor*)v1;
+  const SquatDocCursor* c2 = (const SquatDocCursor*)v2;
 
-  return doc;
+  return c1->size - c2->size;
 }
 
-static void destroy_docset(SquatDocSet* set) {
-  free(set->array_data);
-}
+/* Called once for each document ID found by search_docs. Returns
+   SQUAT_CALLBACK_CONTINUE or SQUAT_CALLBACK_ABORT, or -1 if the
+   index turned out to be corrupt. */
+typedef int (* SquatDocIDCallback)(SquatSearchIndex* index, int doc,
+                                   void* closure);
 
 /* The basic strategy here is pretty simple. We just want to find the
    documents that contain every subword of the search string. The
    index tells us which documents contain each subword so it's just a
-   matter of doing O(N) lookups into the index. We construct an
-   explicit document list for one of the subwords and then iterate
-   through that list for each other subword, throwing out any
-   documents that don't contain that subword.
-
-   The only trick is that some subwords may occur in lots of documents
-   while others only occur in a few (or no) documents. In that case we
-   would rather construct the list with the smallest possible number
-   of documents, to save memory and the cost of traversing that list
-   several times.
+   matter of doing O(N) lookups into the index and intersecting the
+   document lists we find.
+
+   We walk all the lists in step, starting from the shortest one. Its
+   next document is the candidate; every other list is advanced to
+   the candidate, and if one of them overshoots, the shortest list is
+   advanced to where it landed and we try again. Long lists use their
+   skip tables to get there, so a subword which occurs in zillions of
+   documents costs us little more than the documents we actually
+   report.
 */
-int squat_search_execute(SquatSearchIndex* index, char const* data,
-  int data_len, SquatSearchResultCallback handler, void* closure) {
+static int search_docs(SquatSearchIndex* index, char const* data,
+  int data_len, SquatDocIDCallback handler, void* closure) {
   int i;
-  int min_doc_count_word; /* The subword of 'data' that appears in
-			     fewest documents */
-  int min_doc_count;      /* The number of documents that include that
-			     subword */
-  SquatDocSet set;
-  char const** run_starts;
+  int num_words;
+  int doc;
+  SquatDocCursor* cursors;
 
   /* First, do sanity checking on the string. We wouldn't want invalid
      client searches to mysteriously return 'no documents'. */
@@ -497,106 +509,135 @@ int squat_search_execute(SquatSearchIndex* index, char const* data,
     }
   }
 
-  /* We search for every subword of the search string. We save a
-     pointer to the document list for each subword in this array
-     ... so we don't have to traverse the trie data structures more
-     than once per subword.
-  */
-  run_starts = (char const**)xmalloc(sizeof(char const*)*
-                                    (data_len - SQUAT_WORD_SIZE + 1));
+  num_words = data_len - SQUAT_WORD_SIZE + 1;
+  cursors = (SquatDocCursor*)xmalloc(sizeof(SquatDocCursor)*num_words);
   squat_set_last_error(SQUAT_ERR_OK);
 
-  /* Now, for each subword, find its list of documents and how many
-     documents are in the list. Remember the word which had minimum
-     number of documents.
-  */
-  min_doc_count = count_docs_containing_word(index, data, run_starts);
-  if (min_doc_count < 0) {
-    squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-    goto cleanup_run_starts;
-  } else if (min_doc_count == 0) {
-      /* The first word of the substring isn't in any documents, so we
-	 can just stop now. */
-    goto cleanup_run_starts_ok;
-  }
-  min_doc_count_word = 0;
-  for (i = 1; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    int doc_count = count_docs_containing_word(index, data + i,
-                                               run_starts + i);
-    if (doc_count < 0) {
-      squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_run_starts;
-    } else if (doc_count == 0) {
+  /* Now, for each subword, find its list of documents. */
+  for (i = 0; i < num_words; i++) {
+    int invalid_file = 0;
+    char const* doc_list = lookup_word_docs(index, data + i, &invalid_file);
+
+    if (doc_list == NULL) {
+      if (invalid_file) {
+        goto invalid;
+      }
       /* This word isn't in any documents, we can stop now. */
-      goto cleanup_run_starts_ok;
-    } else if (doc_count < min_doc_count) {
-      min_doc_count = doc_count;
-      min_doc_count_word = i;
+      goto done;
     }
-  }
-
-  /* Now, extract the shortest document list into an array. By
-     starting with the shortest document list we avoid pathological
-     situations where one or more of the subwords occurs in zillions
-     of documents, and we'd allocate a huge array and have to iterate
-     through it all lots of times.
-  */
-  if (set_to_docs_containing_word(index, &set, data + min_doc_count_word,
-        min_doc_count, run_starts[min_doc_count_word]) == SQUAT_ERR) {
-    goto cleanup_run_starts;
-  }
-  /* Scan through the other document lists and throw out any documents
-     that aren't in all those lists. */
-  for (i = 0; i <= data_len - SQUAT_WORD_SIZE; i++) {
-    if (i != min_doc_count_word) {
-      filter_to_docs_containing_word(index, &set, data + i, run_starts[i]);
+    if (cursor_init(index, cursors + i, doc_list) != SQUAT_OK) {
+      goto invalid;
     }
   }
 
-  /* Now we have the results. Scan through the set and report each
-     element to the callback function. */
-  select_first_doc(&set);
-  while (has_more_docs(&set)) {
-    int next_doc;
-    char const* next_doc_info;
-    char const* next_doc_data;
-    int r;
+  qsort(cursors, num_words, sizeof(SquatDocCursor), compare_cursor_size);
 
-    /* Lookup the document info so we can get the document name to report. */
-    next_doc = get_next_doc(&set);
-    next_doc_info = index->doc_ID_list + next_doc*4;
-    if (next_doc < 0 && next_doc_info >= index->data_end) {
-      squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_docset;
+  doc = cursors[0].doc;
+  while (doc >= 0) {
+    for (i = 1; i < num_words; i++) {
+      cursor_advance_to(cursors + i, doc);
+      if (cursors[i].doc != doc) {
+        break;
+      }
     }
 
-    next_doc_data = index->doc_list + squat_decode_32(next_doc_info);
-    if (next_doc_data < index->doc_list || next_doc_data >= index->data_end) {
-      squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
-      goto cleanup_docset;
-    }
+    if (i == num_words) {
+      /* every subword is in this document */
+      int r = handler(index, doc, closure);
 
-    r = handler(closure, next_doc_data);
-    if (r == SQUAT_CALLBACK_ABORT) {
+      if (r < 0) {
+        goto invalid;
+      } else if (r == SQUAT_CALLBACK_ABORT) {
+        break;
+      }
+      assert(r == SQUAT_CALLBACK_CONTINUE);
+      cursor_next(cursors);
+    } else if (cursors[i].doc < 0) {
+      /* some subword has no more documents */
       break;
+    } else {
+      cursor_advance_to(cursors, cursors[i].doc);
     }
-    assert(r == SQUAT_CALLBACK_CONTINUE);
+    doc = cursors[0].doc;
   }
 
-  destroy_docset(&set);
+  for (i = 0; i < num_words; i++) {
+    if (cursors[i].invalid) {
+      goto invalid;
+    }
+  }
 
-cleanup_run_starts_ok:
-  free(run_starts);
+done:
+  free(cursors);
   return SQUAT_OK;
 
-cleanup_docset:
-  destroy_docset(&set);
-
-cleanup_run_starts:
-  free(run_starts);
+invalid:
+  squat_set_last_error(SQUAT_ERR_INVALID_INDEX_FILE);
+  free(cursors);
   return SQUAT_ERR;
 }
 
+struct search_execute_rock {
+  SquatSearchResultCallback name_handler;
+  SquatSearchKeyCallback key_handler;
+  void* closure;
+};
+
+/* Report a document found by search_docs by name */
+static int report_doc_name(SquatSearchIndex* index, int doc, void* closure) {
+  struct search_execute_rock* rock = (struct search_execute_rock*)closure;
+  char const* doc_info = index->doc_ID_list + doc*4;
+  char const* doc_name;
+
+  /* Lookup the document info so we can get the document name to report. */
+  if (doc_info + 4 > index->data_end) {
+    return -1;
+  }
+  doc_name = index->doc_list + squat_decode_32(doc_info);
+  if (doc_name < index->doc_list || doc_name >= index->data_end) {
+    return -1;
+  }
+
+  return rock->name_handler(rock->closure, doc_name);
+}
+
+/* Report a document found by search_docs by key */
+static int report_doc_key(SquatSearchIndex* index, int doc, void* closure) {
+  struct search_execute_rock* rock = (struct search_execute_rock*)closure;
+  char const* doc_key = index->doc_key_list + doc*8;
+
+  if (doc_key + 8 > index->data_end) {
+    return -1;
+  }
+
+  return rock->key_handler(rock->closure, squat_decode_64(doc_key));
+}
+
+int squat_search_execute(SquatSearchIndex* index, char const* data,
+  int data_len, SquatSearchResultCallback handler, void* closure) {
+  struct search_execute_rock rock;
+
+  rock.name_handler = handler;
+  rock.closure = closure;
+
+  return search_docs(index, data, data_len, report_doc_name, &rock);
+}
+
+int squat_search_execute_keys(SquatSearchIndex* index, char const* data,
+  int data_len, SquatSearchKeyCallback handler, void* closure) {
+  struct search_execute_rock rock;
+
+  if (index->doc_key_list == NULL) {
+    squat_set_last_error(SQUAT_ERR_NO_DOC_KEYS);
+    return SQUAT_ERR;
+  }
+
+  rock.key_handler = handler;
+  rock.closure = closure;
+
+  return search_docs(index, data, data_len, report_doc_key, &rock);
+}
+
 int squat_search_close(SquatSearchIndex* index) {
   int r = SQUAT_OK;
 
@@ -646,7 +687,19 @@ static int squat_scan_leaf(char const* doc_list, char *name,
     int size = i >> 1;
     char const* s = doc_list;
     int last_doc = 0;
-    
+
+    if (*s == 0) {
+      /* We're visiting every document anyway, so skip the skip table */
+      int skips;
+
+      s++;
+      skips = (int)squat_decode_I(&s);
+      if (skips < 0 || skips > size) {
+        return(SQUAT_ERR);
+      }
+      s = squat_decode_skip_I(s, 2*skips);
+    }
+
     while (s - doc_list < size) {
       i = (int)squat_decode_I(&s);
       if ((i & 1) == 1) {
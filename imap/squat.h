@@ -130,7 +130,9 @@ typedef long long SquatInt64;
 typedef int       SquatInt32;
 
 /* All SQUAT index files start with this magic 8 bytes */
-extern char const squat_index_file_header[8]; /* "SQUAT 1\n" */
+extern char const squat_index_file_header[8]; /* "SQUAT 2\n" */
+/* Indexes written before document keys existed start with this */
+extern char const squat_index_file_header_v1[8]; /* "SQUAT 1\n" */
 
 /* SQUAT return values */
 #define SQUAT_OK           1
@@ -144,6 +146,7 @@ extern char const squat_index_file_header[8]; /* "SQUAT 1\n" */
 #define SQUAT_ERR_INVALID_INDEX_FILE         4
 #define SQUAT_ERR_SEARCH_STRING_TOO_SHORT    5
 #define SQUAT_ERR_SEARCH_STRING_INVALID_CHAR 6
+#define SQUAT_ERR_NO_DOC_KEYS                7   /* index predates doc keys */
 int squat_get_last_error(void);
 
 
@@ -236,6 +239,13 @@ SquatIndex* squat_index_init(int fd, SquatOptions const* options);
 */
 int         squat_index_open_document(SquatIndex* index, char const* name);
 
+/* As squat_index_open_document, but also associate a non-negative
+   64-bit key with the document. Searches can report matching
+   documents by key (see squat_search_execute_keys) without looking
+   up their names. Documents opened without a key get the key -1. */
+int         squat_index_open_document_key(SquatIndex* index, char const* name,
+               SquatInt64 key);
+
 
 /* Notify SQUAT about some more data in the current document. This
    function can be called as many times as desired until all the data
@@ -305,6 +315,8 @@ SquatSearchIndex* squat_search_open(int fd);
 typedef struct {
   char const* doc_name;  /* The UTF8 name of the document. */
   SquatInt64  size;      /* The total size of the document in bytes. */
+  SquatInt64  key;       /* The key given when the document was
+			    indexed, or -1 if there is none. */
 } SquatListDoc;
 typedef int (* SquatListDocCallback)(void* closure, SquatListDoc const* doc);
 int               squat_search_list_docs(SquatSearchIndex* index, 
@@ -321,6 +333,16 @@ typedef int (* SquatSearchResultCallback)(void* closure, char const* doc_name);
 int               squat_search_execute(SquatSearchIndex* index, char const* data,
                     int data_len, SquatSearchResultCallback handler, void* closure);
 
+/* As squat_search_execute, but report the key of each
+   possibly-matching document instead of its name. Documents are
+   reported in the order they were added to the index. Fails with
+   SQUAT_ERR_NO_DOC_KEYS if the index was written in the old format,
+   which has no keys. */
+typedef int (* SquatSearchKeyCallback)(void* closure, SquatInt64 key);
+int               squat_search_execute_keys(SquatSearchIndex* index,
+                    char const* data, int data_len,
+                    SquatSearchKeyCallback handler, void* closure);
+
 
 /* Release the SQUAT resources associated with an index. The resources
    are released whether this call succeeds or fails.
@@ -261,6 +261,12 @@ struct _SquatIndex {
 					 above buffer, measured in
 					 multiples of
 					 sizeof(SquatInt32) (i.e., 4) */
+  char* doc_key_list;                 /* A buffer where we hold the
+					 encoded array that maps from
+					 a document ID to its key. It
+					 has room for doc_ID_list_size
+					 entries of sizeof(SquatInt64)
+					 (i.e., 8) */
   int current_doc_ID;                 /* The current document
 					 ID. Document IDs are numbered
 					 starting at zero and
@@ -291,6 +297,11 @@ struct _SquatIndex {
   SquatDocChooserCallback select_doc; /* Decide whether we want doc in new */
   void *select_doc_closure;           /* Data for handler */
 
+  struct buf run_buf;                 /* Scratch space for encoding
+					 a document list */
+  struct buf skip_buf;                /* Scratch space for encoding
+					 its skip table */
+
   /* put the big structures at the end */
 
   SquatWriteBuffer index_buffers[256]; /* Buffers for the temporary
@@ -312,10 +323,10 @@ struct _SquatIndex {
 
 /* Copy existing document details verbatim from old to new index */
 static int squat_index_copy_document(SquatIndex *index, char const *name,
-				     SquatInt64 size)
+				     SquatInt64 size, SquatInt64 key)
 {
     char *buf;
-    int r = squat_index_open_document(index, name);
+    int r = squat_index_open_document_key(index, name, key);
 
     if (r != SQUAT_OK)
 	return (r);
@@ -380,7 +391,7 @@ static int copy_docIDs(void *closure, SquatListDoc const *doc)
     if (choice > 0) {
 	doc_ID_map_add(doc_ID_map, 1);
 	return (squat_index_copy_document
-		(index, doc->doc_name, doc->size));
+		(index, doc->doc_name, doc->size, doc->key));
     }
 
     /* This docID no longer exists */
@@ -486,6 +497,8 @@ SquatIndex *squat_index_init(int fd, const SquatOptions *options)
     index->doc_ID_list_size = 1000;
     index->doc_ID_list =
 	(char *)xmalloc(index->doc_ID_list_size * sizeof(SquatInt32));
+    index->doc_key_list =
+	(char *)xmalloc(index->doc_ID_list_size * sizeof(SquatInt64));
 
     /* Use a 128K write buffer for the main index file */
     if (init_write_buffer(&index->out, 128 * 1024, fd) != SQUAT_OK) {
@@ -509,6 +522,9 @@ SquatIndex *squat_index_init(int fd, const SquatOptions *options)
     index->old_index = NULL;	/* Until we are given one */
     doc_ID_map_init(&index->doc_ID_map);
 
+    buf_init(&index->run_buf);
+    buf_init(&index->skip_buf);
+
     return index;
 
 cleanup_out_buffer:
@@ -516,6 +532,7 @@ cleanup_out_buffer:
 
 cleanup_doc_ID_list:
     free(index->doc_ID_list);
+    free(index->doc_key_list);
 
 /*cleanup_tmp_path:*/
     free(index->tmp_path);
@@ -559,24 +576,35 @@ cleanup_fd:
 }
 
 int squat_index_open_document(SquatIndex *index, char const *name)
+{
+    return squat_index_open_document_key(index, name, -1);
+}
+
+int squat_index_open_document_key(SquatIndex *index, char const *name,
+				  SquatInt64 key)
 {
     int name_len;
     char *buf;
 
     squat_set_last_error(SQUAT_ERR_OK);
 
-    /* Grow the document ID array as necessary */
+    /* Grow the document ID arrays as necessary */
     if (index->current_doc_ID >= index->doc_ID_list_size) {
 	index->doc_ID_list_size *= 2;
 	index->doc_ID_list =
 	    (char *)xrealloc(index->doc_ID_list,
 			     index->doc_ID_list_size * sizeof(SquatInt32));
+	index->doc_key_list =
+	    (char *)xrealloc(index->doc_key_list,
+			     index->doc_ID_list_size * sizeof(SquatInt64));
     }
 
     /* Store the offset of the new document record into the array */
     squat_encode_32(index->doc_ID_list + index->current_doc_ID * 4,
 		    index->out.total_output_bytes -
 		    sizeof(SquatDiskHeader));
+    squat_encode_64(index->doc_key_list + index->current_doc_ID * 8,
+		    key < 0 ? -1 : key);
 
     /* Now write the new document name out to the file. Later we will
        write the document length right after this. Nobody writes to the
@@ -1208,111 +1236,116 @@ static int dump_doc_list_present_bits(SquatIndex *index,
     return SQUAT_OK;
 }
 
+/* Append the I-format encoding of 'v' to 'b'. */
+static void append_I(struct buf *b, SquatInt64 v)
+{
+    char *end;
+
+    buf_ensure(b, 10);
+    end = squat_encode_I(b->s + b->len, v);
+    buf_truncate(b, end - b->s);
+}
+
+/* Append one <index-run-list> entry, for 'count' consecutive documents
+   starting 'delta' after the previous entry's last document. */
+static void append_run_entry(struct buf *b, int count, int delta)
+{
+    if (count > 1) {
+	append_I(b, count << 1);
+	append_I(b, delta);
+    } else {
+	append_I(b, (delta << 1) | 1);
+    }
+}
+
 /* Write out the document lists for an "all documents" trie leaf. */
 static int dump_doc_list_docs(SquatIndex *index,
 			      SquatWordTableLeafDocs *docs)
 {
     int i;
     WordDocEntry **doc_list = docs->docs;
+    struct buf *runs = &index->run_buf;
+    struct buf *skips = &index->skip_buf;
 
     for (i = docs->first_valid_entry; i <= docs->last_valid_entry; i++) {
 	if (doc_list[i] != NULL) {
 	    WordDocEntry *first_doc;
 	    WordDocEntry *doc;
-	    int run_size = 0;	/* Bytes required to store the doclist for this word */
+	    int run_size;	/* Bytes required to store the doclist for this word */
 	    int last_doc_ID;
 	    int run_seq_delta = 0;
 	    int run_seq_count;
-	    int doc_count = 0;	/* number of documents containing this word */
+	    int num_entries = 0;
+	    int num_skips = 0;
+	    int skip_doc_ID = 0;
+	    int skip_offset = 0;
 	    char *buf;
 
 	    doc = first_doc = doc_list[i]->next;
 
+	    /* If there's only one document, use singleton document format */
+	    if (doc->next == doc) {
+		if ((buf = prepare_buffered_write(&index->out, 10)) == NULL) {
+		    return SQUAT_ERR;
+		}
+		buf = squat_encode_I(buf, (doc->doc_ID << 1) | 1);
+		complete_buffered_write(&index->out, buf);
+		continue;
+	    }
+
+	    /* Encode the entries, noting a skip every SQUAT_SKIP_INTERVAL
+	       entries as we go. */
+	    buf_reset(runs);
+	    buf_reset(skips);
 	    last_doc_ID = 0;
 	    run_seq_count = 0;
-	    /* First compute the run_size bytes required to store the doclist */
 	    do {
 		if (doc->doc_ID == last_doc_ID + 1 && run_seq_count > 0) {
 		    run_seq_count++;
 		} else {
 		    if (run_seq_count > 0) {
-			if (run_seq_count > 1) {
-			    run_size +=
-				squat_count_encode_I(run_seq_count << 1)
-				+ squat_count_encode_I(run_seq_delta);
-			} else {
-			    run_size +=
-				squat_count_encode_I((run_seq_delta << 1) |
-						     1);
-			}
+			append_run_entry(runs, run_seq_count, run_seq_delta);
+		    }
+		    if (num_entries > 0
+			&& num_entries % SQUAT_SKIP_INTERVAL == 0) {
+			append_I(skips, last_doc_ID - skip_doc_ID);
+			append_I(skips, runs->len - skip_offset);
+			skip_doc_ID = last_doc_ID;
+			skip_offset = runs->len;
+			num_skips++;
 		    }
+		    num_entries++;
 		    run_seq_count = 1;
 		    run_seq_delta = doc->doc_ID - last_doc_ID;
 		}
 		last_doc_ID = doc->doc_ID;
 		doc = doc->next;
-		doc_count++;
 	    } while (doc != first_doc);
-	    if (run_seq_count > 0) {
-		if (run_seq_count > 1) {
-		    run_size += squat_count_encode_I(run_seq_count << 1)
-			+ squat_count_encode_I(run_seq_delta);
-		} else {
-		    run_size +=
-			squat_count_encode_I((run_seq_delta << 1) | 1);
-		}
+	    append_run_entry(runs, run_seq_count, run_seq_delta);
+
+	    /* Short lists are cheap enough to scan without a skip table */
+	    if (num_entries < 2 * SQUAT_SKIP_INTERVAL) {
+		num_skips = 0;
 	    }
 
-	    /* reserve more than enough space in the buffer */
+	    run_size = runs->len;
+	    if (num_skips > 0) {
+		run_size += 1 + squat_count_encode_I(num_skips) + skips->len;
+	    }
+
+	    /* Store the entire document list, with its size first. */
 	    if ((buf = prepare_buffered_write(&index->out, 10 + run_size)) == NULL) {
 		return SQUAT_ERR;
 	    }
-
-	    /* If there's only one document, use singleton document format */
-	    if (doc_count == 1) {
-		buf = squat_encode_I(buf, (doc->doc_ID << 1) | 1);
-	    } else {
-		/* Store the entire document list, with its size first. */
-		buf = squat_encode_I(buf, run_size << 1);
-
-		last_doc_ID = 0;
-		run_seq_count = 0;
-		/* This logic should mirror the logic above that counts the bytes. */
-		do {
-		    if (doc->doc_ID == last_doc_ID + 1
-			&& run_seq_count > 0) {
-			run_seq_count++;
-		    } else {
-			if (run_seq_count > 0) {
-			    if (run_seq_count > 1) {
-				buf =
-				    squat_encode_I(buf,
-						   run_seq_count << 1);
-				buf = squat_encode_I(buf, run_seq_delta);
-			    } else {
-				buf =
-				    squat_encode_I(buf,
-						   (run_seq_delta << 1) |
-						   1);
-			    }
-			}
-			run_seq_count = 1;
-			run_seq_delta = doc->doc_ID - last_doc_ID;
-		    }
-		    last_doc_ID = doc->doc_ID;
-		    doc = doc->next;
-		} while (doc != first_doc);
-		if (run_seq_count > 0) {
-		    if (run_seq_count > 1) {
-			buf = squat_encode_I(buf, run_seq_count << 1);
-			buf = squat_encode_I(buf, run_seq_delta);
-		    } else {
-			buf =
-			    squat_encode_I(buf, (run_seq_delta << 1) | 1);
-		    }
-		}
+	    buf = squat_encode_I(buf, run_size << 1);
+	    if (num_skips > 0) {
+		*buf++ = 0;
+		buf = squat_encode_I(buf, num_skips);
+		memcpy(buf, skips->s, skips->len);
+		buf += skips->len;
 	    }
-
+	    memcpy(buf, runs->s, runs->len);
+	    buf += runs->len;
 	    complete_buffered_write(&index->out, buf);
 	}
     }
@@ -1524,6 +1557,7 @@ static int index_close_internal(SquatIndex *index, int OK)
     int r = SQUAT_OK;
     int doc_list_offset;
     int doc_ID_list_offset;
+    int doc_key_list_offset;
     int word_list_offset;
     char *buf;
     unsigned i;
@@ -1563,6 +1597,16 @@ static int index_close_internal(SquatIndex *index, int OK)
     memset(buf, 0, 4);
     complete_buffered_write(&index->out, buf + 4);
 
+    /* And the array that maps document IDs to their keys. */
+    doc_key_list_offset = index->out.total_output_bytes;
+    if ((buf = prepare_buffered_write(&index->out,
+				      index->current_doc_ID * 8)) == NULL) {
+	r = SQUAT_ERR;
+	goto cleanup;
+    }
+    memcpy(buf, index->doc_key_list, index->current_doc_ID * 8);
+    complete_buffered_write(&index->out, buf + index->current_doc_ID * 8);
+
     /* Now write out the trie for every initial byte that we saw. The
        offsets are collected in 'offset_buf'. */
     memset(offset_buf, 0, sizeof(offset_buf));
@@ -1662,6 +1706,7 @@ static int index_close_internal(SquatIndex *index, int OK)
     squat_encode_64(header->doc_list_offset, doc_list_offset);
     squat_encode_64(header->doc_ID_list_offset, doc_ID_list_offset);
     squat_encode_64(header->word_list_offset, word_list_offset);
+    squat_encode_64(header->doc_key_list_offset, doc_key_list_offset);
     memcpy(header->valid_char_bits, index->valid_char_bits,
 	   sizeof(header->valid_char_bits));
     complete_buffered_write(&index->out, (char *)(header + 1));
@@ -1686,6 +1731,9 @@ cleanup:
     }
     free(index->tmp_path);
     free(index->doc_ID_list);
+    free(index->doc_key_list);
+    buf_free(&index->run_buf);
+    buf_free(&index->skip_buf);
     doc_ID_map_free(&index->doc_ID_map);
     free(index);
 
@@ -48,7 +48,8 @@
 
 static int last_err = SQUAT_ERR_OK;
 
-char const squat_index_file_header[8] = "SQUAT 1\n";
+char const squat_index_file_header[8] = "SQUAT 2\n";
+char const squat_index_file_header_v1[8] = "SQUAT 1\n";
 
 void squat_set_last_error(int err)
 {
@@ -74,6 +74,12 @@
   designed to allow for efficient recovery of the name of a document
   given its ID.
 
+  Since version 2 there is also a doc-key-list structure, an array
+  indexed by the doc-ID of the 64-bit keys supplied by the client when
+  each document was indexed. A search can report the keys of the
+  matching documents straight from this array, without having to find
+  and parse their names.
+
   The rest of the file is a trie, describing the documents containing
   each words. Each trie is exactly 3 levels deep, indexed by the first
   three characters of each word. Each leaf of a trie is a list of
@@ -82,6 +88,12 @@
   lists, are stored using mildly clever encodings to reduce space
   consumption.
 
+  Long document lists carry a small skip table in front of their
+  entries, recording every SQUAT_SKIP_INTERVAL'th entry's offset and
+  the document ID preceding it. When intersecting the lists for the
+  words of a search string, a long list can then be advanced to the
+  next candidate document without decoding every entry on the way.
+
   The file contains SQUAT_SAFETY_ZONE (currently 16) zero bytes at the
   end. They are there to stop runaway decoding loops from segfaulting;
   these loops can assume the bytes are there, scan away with
@@ -103,10 +115,16 @@
 
 #define SQUAT_SAFETY_ZONE 16
 
+/* Write a skip table for document lists with at least
+   2*SQUAT_SKIP_INTERVAL entries, with one skip every
+   SQUAT_SKIP_INTERVAL entries. */
+#define SQUAT_SKIP_INTERVAL 32
+
 /* The format of a SQUAT index file. This record is stored at the
    beginning of the file. */
 typedef struct {
-  char header_text[8];       /* "SQUAT 1\n" */
+  char header_text[8];       /* "SQUAT 2\n" ("SQUAT 1\n" for old
+				files which lack the doc_key_list) */
   char doc_list_offset[8];   /* offset to a doc-list structure (see below) */
   char doc_ID_list_offset[8];/* offset to a doc-ID-list structure (see below) */
   char word_list_offset[8];  /* offset to a word-list structure (see below) */
@@ -115,8 +133,14 @@ typedef struct {
 				promises that query strings will not
 				contain characters which don't have
 				their bits set in the bitmap. */
+  char doc_key_list_offset[8];/* offset to a doc-key-list structure
+				(see below); not present in version 1
+				files, whose doc-list starts here */
 } SquatDiskHeader;
 
+/* The size of the header of a version 1 file */
+#define SQUAT_DISK_HEADER_V1_SIZE 64
+
 /* Index file format
 
    "I" means an unsigned integer decoded as N bytes as follows:
@@ -132,6 +156,8 @@ typedef struct {
 
    <doc-ID-list> = 32"doc-ID-offset"* 0 0 0 0
 
+   <doc-key-list> = 64"doc-key"*
+
    <doc-list> = <document-info>* 0
    <document-info> = S"name" I"length"
 
@@ -144,7 +170,9 @@ typedef struct {
    <word-list-trie-K> = <present-bits> <word-trie-info>*
    <word-trie-info> = <index-run>"documents"
    <index-run> = I"adjusted-single-index"
-               | I"adjusted-run-size" <index-run-list>*
+               | I"adjusted-run-size" <skip-table>? <index-run-list>*
+   <skip-table> = 0 I"skip-count" <skip>*
+   <skip> = I"skip-index-delta" I"skip-offset-delta"
    <index-run-list> = I"adjusted-single-index-delta"
                     = I"adjusted-run-length" I"first-index-delta"
 
@@ -156,6 +184,12 @@ typedef struct {
    with the bottom bit set to 1.
    The adjusted-run-length is the length of the run of consecutive indices
    shifted left one bit with the bottom bit set to 0.
+   The run size counts the skip table, if there is one. An
+   <index-run-list> never starts with a 0 byte, so a leading 0 marks a
+   skip table. Each skip gives the index of the last document before
+   some <index-run-list> and the offset of that <index-run-list> from
+   the end of the skip table, both as deltas from the previous skip
+   (or from 0).
 
    The last SQUAT_SAFETY_ZONE bytes of the index file must be 0.
    This helps protect us against corrupt index files.
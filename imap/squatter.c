@@ -67,6 +67,19 @@
   in "cyrus.squat.tmp" and then, if creation was successful, it is
   atomically renamed to "cyrus.squat". This guarantees that we don't
   interfere with anyone who has the old index open.
+
+  Mailboxes can be indexed by several worker processes at once (-j).
+  The parent hands out one mailbox name at a time down a pipe to each
+  idle worker, and the worker sends back the stats for that mailbox
+  when it's done.  A per-mailbox name lock stops two squatters from
+  indexing the same mailbox at the same time.  With a time budget (-T)
+  no new mailboxes are started once it runs out, and a run over all
+  mailboxes records where it got to so the next one can carry on.  A
+  mailbox whose worker dies before finishing it counts as not reached.
+
+  In rolling mode (-R) squatter runs in the background, normally from
+  the START section of cyrus.conf, and incrementally indexes whichever
+  mailboxes the squat_log says have had messages appended to them.
 */
 
 #include <config.h>
@@ -78,12 +91,17 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <syslog.h>
 #include <string.h>
 
 #include "annotate.h"
 #include "assert.h"
+#include "bsearch.h"
+#include "cyr_lock.h"
 #include "mboxlist.h"
 #include "global.h"
 #include "exitcodes.h"
@@ -98,6 +116,8 @@
 #include "map.h"
 #include "squat.h"
 #include "index.h"
+#include "signals.h"
+#include "sync_log.h"
 #include "util.h"
 
 /* global state */
@@ -125,6 +145,9 @@ static int verbose = 0;
 static int mailbox_count = 0;
 static int skip_unmodified = 0;
 static int incremental_mode = 0;
+static int nworkers = 0;
+static time_t deadline = 0;
+static int rolling = 0;
 static SquatStats total_stats;
 
 static void start_stats(SquatStats *stats)
@@ -151,12 +174,29 @@ static void print_stats(FILE *out, SquatStats *stats)
 static int usage(const char *name)
 {
     fprintf(stderr,
-	    "usage: %s [-C <alt_config>] [-r] [-s] [-a] [-v] [mailbox...]\n",
-	    name);
+	    "usage: %s [-C <alt_config>] [-r] [-s] [-i] [-a] [-v]"
+	    " [-j <workers>] [-T <seconds>] [mailbox...]\n"
+	    "       %s [-C <alt_config>] [-a] [-v] [-j <workers>]"
+	    " -R [-f] [-d <seconds>]\n",
+	    name, name);
  
     exit(EC_USAGE);
 }
 
+static void shut_down(int code) __attribute__((noreturn));
+static void shut_down(int code)
+{
+    seen_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+
+    cyrus_done();
+
+    exit(code);
+}
+
 static void fatal_syserror(const char *s)
 {
     perror(s);
@@ -196,6 +236,7 @@ struct uid_info {
     unsigned long len;
     unsigned long uidvalidity;
     int valid;
+    int keyless;		/* old index without document keys */
 };
 
 static void uid_info_init(struct uid_info *uid_info, unsigned long exists)
@@ -204,6 +245,7 @@ static void uid_info_init(struct uid_info *uid_info, unsigned long exists)
     uid_info->len = exists;
     uid_info->uidvalidity = 0L;
     uid_info->valid = 1;
+    uid_info->keyless = 0;
 }
 
 static void uid_info_free(struct uid_info *uid_info)
@@ -260,6 +302,12 @@ static int doc_check(void *closure, const SquatListDoc *doc)
 	return (1);
     }
 
+    /* An index from before document keys: rebuild it from scratch */
+    if (doc->key < 0) {
+	uid_info->keyless = 1;
+	return (1);
+    }
+
     uid = strtoul(doc->doc_name + 1, NULL, 10);
     if ((uid > 0) && (uid_item = find_uid_item(uid_info, uid))) {
 	uid_item->flagged = 1;
@@ -328,7 +376,9 @@ static void search_text_receiver(int uid, int part, int cmd,
 	    printf("Opening document part '%s'\n", buf);
 	}
 
-	if (squat_index_open_document(d->index, buf) != SQUAT_OK) {
+	if (squat_index_open_document_key(d->index, buf,
+					  SEARCHINDEX_DOC_KEY(uid, part_char))
+	    != SQUAT_OK) {
 	    fatal_squat_error("Writing index");
 	}
     }
@@ -450,6 +500,14 @@ static int squat_single(struct index_state *state, int incremental)
 	    goto bail;
 	}
 
+	if (uid_info.keyless) {
+	    syslog(LOG_INFO,
+		   "Old format squat index for %s, rebuilding",
+		   mailbox->name);
+	    r = IMAP_IOERROR;
+	    goto bail;
+	}
+
 	if (uid_info.uidvalidity != mailbox->i.uidvalidity) {
 	    /* Squat file refers to old mailbox: force full rebuild */
 	    r = IMAP_IOERROR;
@@ -533,12 +591,48 @@ bail:
     return (r);
 }
 
+/* Only one squatter may index a mailbox at a time.  This takes a
+   mailbox name lock on a name which can't be a real mailbox, since
+   '%' is a wildcard, so it doesn't get in the way of anything else.
+   The lock file is removed again by squat_unlock(), so a lock on a
+   file that has gone from under us doesn't count. */
+static int squat_lock(const char *name, struct mboxlock **lockp)
+{
+    char lockname[MAX_MAILBOX_BUFFER];
+    struct stat sbuf, fsbuf;
+    int r;
+
+    snprintf(lockname, sizeof(lockname), "%s.%%squat", name);
+
+    for (;;) {
+	r = mboxname_lock(lockname, lockp, LOCK_NONBLOCKING);
+	if (r) return r;
+
+	if (stat(mboxname_lockpath(lockname), &sbuf) < 0) {
+	    if (errno != ENOENT) return 0;
+	}
+	else if (fstat((*lockp)->lock_fd, &fsbuf) < 0 ||
+		 (sbuf.st_ino == fsbuf.st_ino && sbuf.st_dev == fsbuf.st_dev))
+	    return 0;
+
+	mboxname_release(lockp);
+    }
+}
+
+static void squat_unlock(struct mboxlock **lockp)
+{
+    /* while we still hold it, so nobody else can be using it */
+    unlink(mboxname_lockpath((*lockp)->name));
+    mboxname_release(lockp);
+}
+
 /* This is called once for each mailbox we're told to index. */
 static int index_me(char *name, int matchlen __attribute__((unused)),
 		    int maycreate __attribute__((unused)),
 		    void *rock) {
     struct mboxlist_entry *mbentry = NULL;
     struct index_state *state = NULL;
+    struct mboxlock *squatlock = NULL;
     int r;
     char *fname;
     struct stat sbuf;
@@ -609,6 +703,27 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
 	buf_free(&attrib);
     }
 
+    r = squat_lock(name, &squatlock);
+    if (r == IMAP_MAILBOX_LOCKED) {
+	syslog(LOG_INFO, "skipping mailbox %s: already being indexed",
+	       extname);
+	if (verbose > 0) {
+	    printf("Skipping mailbox %s, already being indexed\n", extname);
+	}
+	/* the other squatter may have started before the latest append,
+	   so come back to it */
+	if (rolling) sync_log_squat(name);
+	return 0;
+    }
+    if (r) {
+        if (verbose) {
+            printf("error locking %s: %s\n", extname, error_message(r));
+        }
+        syslog(LOG_INFO, "error locking %s: %s\n", extname, error_message(r));
+
+        return 1;
+    }
+
     r = index_open(name, NULL, &state);
     if (r) {
         if (verbose) {
@@ -616,6 +731,7 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
         }
         syslog(LOG_INFO, "error opening %s: %s\n", extname, error_message(r));
 
+	squat_unlock(&squatlock);
         return 1;
     }
 
@@ -629,6 +745,7 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
                 printf("Skipping mailbox %s\n", extname);
             }
             index_close(&state);
+	    squat_unlock(&squatlock);
             return 0;
         }
     }
@@ -644,6 +761,7 @@ static int index_me(char *name, int matchlen __attribute__((unused)),
     }
 
     index_close(&state);
+    squat_unlock(&squatlock);
     mailbox_count++;
 
     return 0;
@@ -659,13 +777,407 @@ static int addmbox(char *name,
     return 0;
 }
 
+/* ====================================================================== */
+
+/* Where a time limited run over all mailboxes stopped: the name of the
+   next mailbox to index. */
+static const char *resume_fname(void)
+{
+    static char fname[MAX_MAILBOX_PATH+1];
+
+    snprintf(fname, sizeof(fname), "%s/squatter.resume", config_dir);
+
+    return fname;
+}
+
+/* Find where in 'mboxes', which is in mailbox list order, the last
+   run stopped */
+static int resume_start(strarray_t *mboxes)
+{
+    char buf[MAX_MAILBOX_BUFFER];
+    char *p;
+    FILE *f;
+    int i = 0;
+
+    f = fopen(resume_fname(), "r");
+    if (!f) return 0;
+
+    if (fgets(buf, sizeof(buf), f)) {
+	if ((p = strchr(buf, '\n'))) *p = '\0';
+
+	/* the mailbox itself may have gone away since */
+	while (i < mboxes->count &&
+	       bsearch_compare_mbox(mboxes->data[i], buf) < 0)
+	    i++;
+
+	syslog(LOG_NOTICE, "resuming indexing at %s", buf);
+    }
+    fclose(f);
+
+    if (i == mboxes->count) i = 0;	/* start again */
+
+    return i;
+}
+
+static void resume_save(const char *name)
+{
+    char newfname[MAX_MAILBOX_PATH+1];
+    FILE *f;
+
+    snprintf(newfname, sizeof(newfname), "%s.NEW", resume_fname());
+
+    f = fopen(newfname, "w");
+    if (!f) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	return;
+    }
+    fprintf(f, "%s\n", name);
+    if (fclose(f) == EOF || rename(newfname, resume_fname()) < 0) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", resume_fname());
+	unlink(newfname);
+    }
+}
+
+static int out_of_time(void)
+{
+    return deadline && time(NULL) >= deadline;
+}
+
+/* Index mailboxes from 'start' onwards in this process.  Returns the
+   index of the first mailbox not done. */
+static int run_serial(strarray_t *mboxes, int start, int use_annot)
+{
+    int i;
+
+    for (i = start; i < mboxes->count && !out_of_time(); i++) {
+	index_me(mboxes->data[i], 0, 0, &use_annot);
+	/* Ignore errors: most will be mailboxes moving around */
+    }
+
+    return i;
+}
+
+struct worker {
+    pid_t pid;
+    FILE *to;		/* mailbox names to the worker, NULL if dead */
+    FILE *from;		/* stats back from the worker */
+    int busy;
+    int mbox;		/* which mailbox it's indexing, if busy */
+};
+
+static void worker_main(int infd, int outfd, int use_annot)
+{
+    FILE *in = fdopen(infd, "r");
+    FILE *out = fdopen(outfd, "w");
+    char name[MAX_MAILBOX_BUFFER];
+    char *p;
+    int count;
+
+    if (!in || !out) fatal_syserror("Unable to set up worker");
+
+    /* every worker has its own handles on the databases */
+    annotatemore_open();
+    mboxlist_open(NULL);
+
+    while (fgets(name, sizeof(name), in)) {
+	if ((p = strchr(name, '\n'))) *p = '\0';
+
+	start_stats(&total_stats);
+	count = mailbox_count;
+
+	index_me(name, 0, 0, &use_annot);
+
+	fprintf(out, "%lu %lu %lu %d\n",
+		total_stats.indexed_messages, total_stats.indexed_bytes,
+		total_stats.index_size, mailbox_count - count);
+	if (fflush(out) == EOF) break;
+    }
+
+    seen_done();
+    mboxlist_close();
+    mboxlist_done();
+    annotatemore_close();
+    annotatemore_done();
+
+    cyrus_done();
+
+    exit(0);
+}
+
+/* Index mailboxes from 'start' onwards with 'nworkers' worker
+   processes, adding their stats into total_stats.  Returns the index of
+   the first mailbox not handed out, and sets *lostp to the first one
+   a worker died while indexing, or -1 if none did. */
+static int run_workers(strarray_t *mboxes, int start, int use_annot,
+		       int *lostp)
+{
+    struct worker *workers = xzmalloc(nworkers * sizeof(struct worker));
+    int next = start;
+    int nbusy = 0;
+    int i, j, fd, maxfd, count;
+    int down[2], up[2];
+    fd_set rfds;
+    char line[1024];
+    SquatStats stats;
+
+    *lostp = -1;
+
+    /* a dead worker shouldn't take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the workers open their own handles on the databases */
+    mboxlist_close();
+    annotatemore_close();
+
+    for (i = 0; i < nworkers; i++) {
+	if (pipe(down) < 0 || pipe(up) < 0)
+	    fatal_syserror("Unable to create pipe");
+
+	workers[i].pid = fork();
+	if (workers[i].pid < 0)
+	    fatal_syserror("Unable to fork worker");
+
+	if (!workers[i].pid) {
+	    /* don't hold the other workers' pipes open */
+	    for (j = 0; j < i; j++) {
+		fclose(workers[j].to);
+		fclose(workers[j].from);
+	    }
+	    close(down[1]);
+	    close(up[0]);
+	    worker_main(down[0], up[1], use_annot);
+	}
+
+	close(down[0]);
+	close(up[1]);
+	workers[i].to = fdopen(down[1], "w");
+	workers[i].from = fdopen(up[0], "r");
+	if (!workers[i].to || !workers[i].from)
+	    fatal_syserror("Unable to set up worker");
+    }
+
+    for (;;) {
+	/* give every idle worker another mailbox, while there's time */
+	for (i = 0; i < nworkers; i++) {
+	    if (next >= mboxes->count || out_of_time()) break;
+	    if (workers[i].busy || !workers[i].to) continue;
+
+	    fprintf(workers[i].to, "%s\n", mboxes->data[next]);
+	    if (fflush(workers[i].to) == EOF) {
+		syslog(LOG_ERR, "squatter worker %d went away",
+		       (int) workers[i].pid);
+		fclose(workers[i].to);
+		fclose(workers[i].from);
+		workers[i].to = workers[i].from = NULL;
+		continue;
+	    }
+	    workers[i].mbox = next++;
+	    workers[i].busy = 1;
+	    nbusy++;
+	}
+
+	if (!nbusy) break;
+
+	FD_ZERO(&rfds);
+	maxfd = -1;
+	for (i = 0; i < nworkers; i++) {
+	    if (!workers[i].busy) continue;
+	    fd = fileno(workers[i].from);
+	    FD_SET(fd, &rfds);
+	    if (fd > maxfd) maxfd = fd;
+	}
+
+	if (select(maxfd + 1, &rfds, NULL, NULL, NULL) < 0) {
+	    if (errno == EINTR) continue;
+	    fatal_syserror("select");
+	}
+
+	for (i = 0; i < nworkers; i++) {
+	    if (!workers[i].busy ||
+		!FD_ISSET(fileno(workers[i].from), &rfds)) continue;
+
+	    workers[i].busy = 0;
+	    nbusy--;
+
+	    if (!fgets(line, sizeof(line), workers[i].from) ||
+		sscanf(line, "%lu %lu %lu %d", &stats.indexed_messages,
+		       &stats.indexed_bytes, &stats.index_size, &count) != 4) {
+		/* the mailbox it was working on doesn't get done */
+		syslog(LOG_ERR, "squatter worker %d died indexing %s",
+		       (int) workers[i].pid, mboxes->data[workers[i].mbox]);
+		if (*lostp < 0 || workers[i].mbox < *lostp)
+		    *lostp = workers[i].mbox;
+		/* try again next time round */
+		if (rolling) sync_log_squat(mboxes->data[workers[i].mbox]);
+		fclose(workers[i].to);
+		fclose(workers[i].from);
+		workers[i].to = workers[i].from = NULL;
+		continue;
+	    }
+
+	    total_stats.indexed_messages += stats.indexed_messages;
+	    total_stats.indexed_bytes += stats.indexed_bytes;
+	    total_stats.index_size += stats.index_size;
+	    mailbox_count += count;
+	}
+    }
+
+    if (next < mboxes->count && !out_of_time()) {
+	syslog(LOG_ERR, "all squatter workers died, %d mailboxes left to index",
+	       mboxes->count - next);
+	if (verbose > 0) {
+	    printf("All workers died, %d mailboxes left to index\n",
+		   mboxes->count - next);
+	}
+    }
+
+    /* closing the pipes tells the workers we're done */
+    for (i = 0; i < nworkers; i++) {
+	if (!workers[i].to) continue;
+	fclose(workers[i].to);
+	fclose(workers[i].from);
+    }
+    for (i = 0; i < nworkers; i++) {
+	while (waitpid(workers[i].pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    free(workers);
+
+    annotatemore_open();
+    mboxlist_open(NULL);
+
+    return next;
+}
+
+/* ====================================================================== */
+
+/* Read the mailbox names out of a squat log work file into 'mboxes',
+   once each */
+static int read_squat_log(const char *fname, strarray_t *mboxes)
+{
+    struct buf type = BUF_INITIALIZER, arg = BUF_INITIALIZER;
+    struct protstream *input;
+    int fd, c;
+
+    fd = open(fname, O_RDWR);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Failed to open %s: %m", fname);
+	return IMAP_IOERROR;
+    }
+
+    /* wait for anyone who opened it before the rename to finish */
+    if (lock_blocking(fd) < 0) {
+	syslog(LOG_ERR, "Failed to lock %s: %m", fname);
+	close(fd);
+	return IMAP_IOERROR;
+    }
+
+    input = prot_new(fd, 0);
+
+    while ((c = getword(input, &type)) != EOF) {
+	/* Ignore blank lines */
+	if (c == '\r') c = prot_getc(input);
+	if (c == '\n') continue;
+
+	if (c != ' ') {
+	    syslog(LOG_ERR, "Invalid input in %s", fname);
+	    eatline(input, c);
+	    continue;
+	}
+
+	if ((c = getastring(input, 0, &arg)) == EOF) break;
+
+	if (c == '\r') c = prot_getc(input);
+	if (c != '\n') {
+	    syslog(LOG_ERR, "Garbage at end of input line in %s", fname);
+	    eatline(input, c);
+	    continue;
+	}
+
+	if (!strcasecmp(type.s, "MAILBOX"))
+	    strarray_add(mboxes, arg.s);
+	else
+	    syslog(LOG_ERR, "Unknown action type: %s", type.s);
+    }
+
+    prot_free(input);
+    close(fd);
+    buf_free(&type);
+    buf_free(&arg);
+
+    return 0;
+}
+
+/* Index whatever turns up in the squat log, every 'min_delta' seconds
+   at most, until we're told to shut down */
+static void do_rolling(int use_annot, unsigned long min_delta)
+    __attribute__((noreturn));
+static void do_rolling(int use_annot, unsigned long min_delta)
+{
+    char *log_fname =
+	xstrdup(sync_log_fname(config_getstring(IMAPOPT_SQUAT_LOG_CHANNEL)));
+    char *work_fname = strconcat(log_fname, "-run", (char *)NULL);
+    strarray_t mboxes = STRARRAY_INITIALIZER;
+    struct stat sbuf;
+    time_t single_start;
+    int delta, lost;
+
+    syslog(LOG_NOTICE, "rolling indexing from %s", log_fname);
+
+    while (1) {
+	single_start = time(NULL);
+
+	signals_poll();
+
+	if (stat(work_fname, &sbuf) == 0) {
+	    /* a previous squatter didn't finish with it */
+	    syslog(LOG_NOTICE, "Reprocessing squat log file %s", work_fname);
+	}
+	else {
+	    if (stat(log_fname, &sbuf) < 0) {
+		signals_sleep(min_delta ? min_delta : 1);
+		continue;
+	    }
+
+	    if (rename(log_fname, work_fname) < 0) {
+		syslog(LOG_ERR, "Rename %s -> %s failed: %m",
+		       log_fname, work_fname);
+		signals_sleep(min_delta ? min_delta : 1);
+		continue;
+	    }
+	}
+
+	if (read_squat_log(work_fname, &mboxes)) {
+	    signals_sleep(min_delta ? min_delta : 1);
+	    continue;
+	}
+
+	strarray_sort(&mboxes);
+
+	if (nworkers > 1)
+	    run_workers(&mboxes, 0, use_annot, &lost);
+	else
+	    run_serial(&mboxes, 0, use_annot);
+	strarray_truncate(&mboxes, 0);
+
+	if (unlink(work_fname) < 0)
+	    syslog(LOG_ERR, "Unlink %s failed: %m", work_fname);
+
+	delta = time(NULL) - single_start;
+	if ((unsigned) delta < min_delta)
+	    signals_sleep(min_delta - delta);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int opt;
     char *alt_config = NULL;
     int rflag = 0, use_annot = 0;
-    int i;
+    int i, start = 0, next, lost = -1;
+    int foreground = 0;
+    unsigned long min_delta = 0;
     char buf[MAX_MAILBOX_PATH + 1];
+    strarray_t mboxes = STRARRAY_INITIALIZER;
     int r;
 
     if ((geteuid()) == 0 && (become_cyrus() != 0)) {
@@ -674,7 +1186,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:rsiav")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:rsiavj:T:Rfd:")) != EOF) {
 	switch (opt) {
 	case 'C':		/* alt config file */
 	    alt_config = optarg;
@@ -700,11 +1212,53 @@ int main(int argc, char **argv)
 	    use_annot = 1;
 	    break;
 
+	case 'j':		/* number of worker processes */
+	    nworkers = atoi(optarg);
+	    if (nworkers < 1) usage("squatter");
+	    break;
+
+	case 'T':		/* time budget, in seconds */
+	    if (atoi(optarg) < 1) usage("squatter");
+	    deadline = time(NULL) + atoi(optarg);
+	    break;
+
+	case 'R':		/* rolling mode, from the squat log */
+	    rolling = 1;
+	    incremental_mode = 1;
+	    break;
+
+	case 'f':		/* rolling mode: stay in the foreground */
+	    foreground = 1;
+	    break;
+
+	case 'd':		/* rolling mode: minimum seconds per pass */
+	    min_delta = strtoul(optarg, NULL, 10);
+	    break;
+
 	default:
 	    usage("squatter");
 	}
     }
 
+    if (rolling) {
+	/* it has to keep going, and it picks its own mailboxes */
+	if (deadline || rflag || skip_unmodified || optind != argc)
+	    usage("squatter");
+
+	if (!foreground) {
+	    pid_t pid = fork();
+
+	    if (pid == -1) {
+		perror("fork");
+		exit(1);
+	    }
+
+	    if (pid != 0) { /* parent */
+		exit(0);
+	    }
+	}
+    }
+
     cyrus_init(alt_config, "squatter", 0);
 
     syslog(LOG_NOTICE, "indexing mailboxes");
@@ -722,9 +1276,13 @@ int main(int argc, char **argv)
 
     start_stats(&total_stats);
 
-    if (optind == argc) {
-	strarray_t sa = STRARRAY_INITIALIZER;
+    if (rolling) {
+	signals_set_shutdown(&shut_down);
+	signals_add_handlers(0);
+	do_rolling(use_annot, min_delta);
+    }
 
+    if (optind == argc) {
 	if (rflag) {
 	    fprintf(stderr, "please specify a mailbox to recurse from\n");
 	    exit(EC_USAGE);
@@ -732,28 +1290,49 @@ int main(int argc, char **argv)
 	assert(!rflag);
 	strlcpy(buf, "*", sizeof(buf));
 	(*squat_namespace.mboxlist_findall) (&squat_namespace, buf, 1,
-					     0, 0, addmbox, &sa);
+					     0, 0, addmbox, &mboxes);
 
-	for (i = 0 ; i < sa.count ; i++) {
-	    index_me(sa.data[i], strlen(sa.data[i]), 0, &use_annot);
-	    /* Ignore errors: most will be mailboxes moving around */
-	}
-	strarray_fini(&sa);
+	/* carry on from where the last time limited run got to */
+	if (deadline) start = resume_start(&mboxes);
     }
 
     for (i = optind; i < argc; i++) {
 	/* Translate any separators in mailboxname */
 	(*squat_namespace.mboxname_tointernal) (&squat_namespace, argv[i],
 						NULL, buf);
-	index_me(buf, 0, 0, &use_annot);
+	strarray_append(&mboxes, buf);
 	if (rflag) {
 	    strlcat(buf, ".*", sizeof(buf));
 	    (*squat_namespace.mboxlist_findall) (&squat_namespace, buf, 1,
-						 0, 0, index_me,
-						 &use_annot);
+						 0, 0, addmbox, &mboxes);
+	}
+    }
+
+    if (nworkers > 1)
+	next = run_workers(&mboxes, start, use_annot, &lost);
+    else
+	next = run_serial(&mboxes, start, use_annot);
+
+    if (next < mboxes.count && out_of_time()) {
+	syslog(LOG_NOTICE, "out of time, %d mailboxes left to index",
+	       mboxes.count - next);
+	if (verbose > 0) {
+	    printf("Out of time, %d mailboxes left to index\n",
+		   mboxes.count - next);
 	}
     }
 
+    /* the next run goes back for any a dead worker didn't finish */
+    if (lost >= 0 && lost < next) next = lost;
+
+    if (deadline && optind == argc) {
+	if (next < mboxes.count)
+	    resume_save(mboxes.data[next]);
+	else
+	    unlink(resume_fname());
+    }
+    strarray_fini(&mboxes);
+
     if (verbose > 0 && mailbox_count > 1) {
 	stop_stats(&total_stats);
 	printf("Total over all mailboxes: ");
@@ -762,13 +1341,5 @@ int main(int argc, char **argv)
 
     syslog(LOG_NOTICE, "done indexing mailboxes");
 
-    seen_done();
-    mboxlist_close();
-    mboxlist_done();
-    annotatemore_close();
-    annotatemore_done();
-
-    cyrus_done();
-
-    return 0;
+    shut_down(0);
 }
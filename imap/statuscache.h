@@ -77,6 +77,16 @@ extern int statuscache_update(const char *mboxname,
 extern int statuscache_invalidate(const char *mboxname,
 				  struct statusdata *sdata);
 
+/* invalidate (delete) one user's statuscache entry for the mailbox */
+extern int statuscache_invalidate_user(const char *mboxname,
+				       const char *userid);
+
+/* bring every user's entry for the mailbox up to date with the changes
+   made under its index lock, or invalidate them if that can't be done,
+   optionally writing the data for one user in the same transaction */
+extern int statuscache_mailbox_changed(struct mailbox *mailbox,
+				       struct statusdata *sdata);
+
 /* close the database */
 extern void statuscache_close(void);
 
@@ -81,6 +81,7 @@ static int statuscache_dbopen = 0;
 void statuscache_open(const char *fname)
 {
     int ret;
+    int dbflags = CYRUSDB_CREATE;
     char *tofree = NULL;
 
     if (!fname)
@@ -92,7 +93,10 @@ void statuscache_open(const char *fname)
 	fname = tofree;
     }
 
-    ret = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &statuscachedb);
+    if (config_getswitch(IMAPOPT_STATUSCACHE_DB_GROUPCOMMIT))
+	dbflags |= CYRUSDB_GROUPCOMMIT;
+
+    ret = cyrusdb_open(DB, fname, dbflags, &statuscachedb);
     if (ret != 0) {
 	syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
 	       cyrusdb_strerror(ret));
@@ -176,10 +180,10 @@ int status_lookup(const char *mboxname, const char *userid,
 	/* Do actual lookup of cache item. */
 	r = statuscache_lookup(mboxname, userid, statusitems, sdata);
 
-	/* Seen/recent status uses "push" invalidation events from
-	 * seen_db.c.   This avoids needing to open cyrus.header to get
-	 * the mailbox uniqueid to open the seen db and get the
-	 * unseen_mtime and recentuid.
+	/* Entries are kept current by whoever changes the mailbox or
+	 * the user's \Seen state, see statuscache_mailbox_changed().
+	 * This avoids needing to open cyrus.header to get the mailbox
+	 * uniqueid to open the seen db and get the recentuid.
 	 */
 
 	if (!r) {
@@ -253,37 +257,29 @@ int status_lookup(const char *mboxname, const char *userid,
     statuscache_fill(sdata, userid, mailbox, c_statusitems,
 		     numrecent, numunseen);
 
-    /* cache the new value while unlocking */
-    mailbox_unlock_index(mailbox, sdata);
+    /* cache the new value while we still hold the lock, so that
+     * the next change carries it forward */
+    if (config_getswitch(IMAPOPT_STATUSCACHE))
+	statuscache_update(mboxname, sdata);
+
+    mailbox_unlock_index(mailbox, NULL);
 
   done:
     mailbox_close(&mailbox);
     return r;
 }
 
-int statuscache_lookup(const char *mboxname, const char *userid,
-		       unsigned statusitems, struct statusdata *sdata)
+static int statuscache_parse(const char *data, size_t datalen,
+			     struct statusdata *sdata)
 {
-    size_t keylen, datalen;
-    int r = 0;
-    const char *data = NULL, *dend;
-    char *p, *key = statuscache_buildkey(mboxname, userid, &keylen);
+    const char *dend;
+    char *p;
     unsigned version;
 
-    /* Don't access DB if it hasn't been opened */
-    if (!statuscache_dbopen)
-	return IMAP_NO_NOSUCHMSG;
-
     memset(sdata, 0, sizeof(struct statusdata));
 
-    /* Check if there is an entry in the database */
-    do {
-	r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
-    } while (r == CYRUSDB_AGAIN);
-
-    if (r || !data || ((size_t) datalen < sizeof(unsigned))) {
+    if (!data || datalen < sizeof(unsigned))
 	return IMAP_NO_NOSUCHMSG;
-    }
 
     dend = data + datalen;
 
@@ -306,6 +302,31 @@ int statuscache_lookup(const char *mboxname, const char *userid,
 	return IMAP_NO_NOSUCHMSG;
     }
 
+    return 0;
+}
+
+int statuscache_lookup(const char *mboxname, const char *userid,
+		       unsigned statusitems, struct statusdata *sdata)
+{
+    size_t keylen, datalen;
+    int r = 0;
+    const char *data = NULL;
+    char *key = statuscache_buildkey(mboxname, userid, &keylen);
+
+    memset(sdata, 0, sizeof(struct statusdata));
+
+    /* Don't access DB if it hasn't been opened */
+    if (!statuscache_dbopen)
+	return IMAP_NO_NOSUCHMSG;
+
+    /* Check if there is an entry in the database */
+    do {
+	r = cyrusdb_fetch(statuscachedb, key, keylen, &data, &datalen, NULL);
+    } while (r == CYRUSDB_AGAIN);
+
+    if (r || statuscache_parse(data, datalen, sdata))
+	return IMAP_NO_NOSUCHMSG;
+
     if ((sdata->statusitems & statusitems) != statusitems) {
 	/* Don't have all of the requested information */
 	return IMAP_NO_NOSUCHMSG;
@@ -436,3 +457,168 @@ int statuscache_invalidate(const char *mboxname, struct statusdata *sdata)
     return 0; 
 }
 
+
+int statuscache_invalidate_user(const char *mboxname, const char *userid)
+{
+    size_t keylen;
+    char *key;
+    int r;
+    int doclose = 0;
+
+    /* if it's disabled then skip */
+    if (!config_getswitch(IMAPOPT_STATUSCACHE))
+	return 0;
+
+    /* Open DB if it hasn't been opened */
+    if (!statuscache_dbopen) {
+	statuscache_open(NULL);
+	doclose = 1;
+    }
+
+    key = statuscache_buildkey(mboxname, userid, &keylen);
+
+    r = cyrusdb_delete(statuscachedb, key, keylen, NULL, 1);
+    if (r != CYRUSDB_OK) {
+	syslog(LOG_ERR, "DBERROR: error deleting from database: %s",
+	       cyrusdb_strerror(r));
+    }
+
+    if (doclose)
+	statuscache_close();
+
+    return 0;
+}
+
+struct statuscache_changerock {
+    struct mailbox *mailbox;
+    struct txn *tid;
+};
+
+/* move one user's entry along by the changes in rock->mailbox, or
+ * delete it if it didn't describe the mailbox as we found it */
+static int change_cb(void *rockp,
+		     const char *key, size_t keylen,
+		     const char *data, size_t datalen)
+{
+    struct statuscache_changerock *rp = (struct statuscache_changerock *)rockp;
+    struct mailbox *mailbox = rp->mailbox;
+    struct statuschange *change = &mailbox->status_change;
+    struct statusdata sdata;
+    char buf[MAX_MAILBOX_BUFFER];
+    const char *userid;
+    int keep;
+    int r;
+
+    if (keylen >= sizeof(buf))
+	return 1;
+
+    /* we need to cache a copy, because the store might re-map
+     * the mmap space */
+    memcpy(buf, key, keylen);
+    buf[keylen] = '\0';
+    userid = buf + strlen(mailbox->name) + 2;
+
+    keep = !statuscache_parse(data, datalen, &sdata) &&
+	   sdata.messages == change->exists &&
+	   sdata.uidnext == change->last_uid + 1 &&
+	   sdata.uidvalidity == change->uidvalidity &&
+	   sdata.highestmodseq == change->highestmodseq;
+
+    if (keep && mailbox_internal_seen(mailbox, userid)) {
+	long unseen = (long) sdata.unseen + change->appended -
+		      change->appended_seen - change->seen;
+
+	/* our \Seen flags are the user's, and so is our recentuid */
+	if (unseen < 0)
+	    keep = 0;
+	else
+	    sdata.unseen = unseen;
+
+	if (mailbox->i.recentuid == change->recentuid)
+	    sdata.recent += change->appended;
+	else if (mailbox->i.recentuid >= mailbox->i.last_uid)
+	    sdata.recent = 0;
+	else
+	    keep = 0;
+    }
+    else if (keep) {
+	/* nothing new is in the user's seen db yet */
+	sdata.unseen += change->appended;
+	sdata.recent += change->appended;
+    }
+
+    if (!keep) {
+	r = cyrusdb_delete(statuscachedb, buf, keylen, &rp->tid, 1);
+	if (r != CYRUSDB_OK) {
+	    syslog(LOG_ERR, "DBERROR: error deleting from database: %s",
+		   cyrusdb_strerror(r));
+	}
+	return 0;
+    }
+
+    sdata.userid = userid;
+    sdata.messages = mailbox->i.exists;
+    sdata.uidnext = mailbox->i.last_uid + 1;
+    sdata.highestmodseq = mailbox->i.highestmodseq;
+
+    return statuscache_update_txn(mailbox->name, &sdata, &rp->tid);
+}
+
+int statuscache_mailbox_changed(struct mailbox *mailbox,
+				struct statusdata *sdata)
+{
+    struct statuschange *change = &mailbox->status_change;
+    char prefix[MAX_MAILBOX_BUFFER];
+    size_t keylen;
+    char *key;
+    int r;
+    int doclose = 0;
+    struct statuscache_changerock crock;
+
+    /* if it's disabled then skip */
+    if (!config_getswitch(IMAPOPT_STATUSCACHE))
+	return 0;
+
+    /* anything but appends and \Seen changes, and we start again */
+    if (change->other ||
+	mailbox->i.uidvalidity != change->uidvalidity ||
+	mailbox->i.exists != change->exists + change->appended ||
+	!!(mailbox->i.options & OPT_IMAP_SHAREDSEEN) != change->sharedseen)
+	return statuscache_invalidate(mailbox->name, sdata);
+
+    /* Open DB if it hasn't been opened */
+    if (!statuscache_dbopen) {
+	statuscache_open(NULL);
+	doclose = 1;
+    }
+
+    crock.mailbox = mailbox;
+    crock.tid = NULL;
+
+    /* our own copy, since change_cb builds keys of its own */
+    key = statuscache_buildkey(mailbox->name, "", &keylen);
+    memcpy(prefix, key, keylen);
+
+    r = cyrusdb_foreach(statuscachedb, prefix, keylen, NULL, change_cb,
+			&crock, &crock.tid);
+    if (r != CYRUSDB_OK) {
+	syslog(LOG_ERR, "DBERROR: error updating: %s (%s)",
+	       mailbox->name, cyrusdb_strerror(r));
+    }
+
+    if (!r && sdata) {
+	r = statuscache_update_txn(mailbox->name, sdata, &crock.tid);
+    }
+
+    if (r == CYRUSDB_OK) {
+	if (crock.tid) cyrusdb_commit(statuscachedb, crock.tid);
+    }
+    else {
+	if (crock.tid) cyrusdb_abort(statuscachedb, crock.tid);
+    }
+
+    if (doclose)
+	statuscache_close();
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+/* sync_bench.c -- time the sync_client list handling on a synthetic log
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Replays a made-up sync log for users with lots of folders through the
+ * same lists sync_client uses, and reports how long each phase takes:
+ *
+ *   sync_bench [users] [folders per user]
+ *
+ * Nothing is read from or sent to a replica.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "global.h"
+#include "mailbox.h"
+#include "seen.h"
+#include "sync_support.h"
+#include "util.h"
+#include "xmalloc.h"
+
+static struct timeval t1, t2;
+
+#define START() gettimeofday(&t1, NULL)
+#define STOP(what, n) do { gettimeofday(&t2, NULL); report(what, n); } while (0)
+
+static void report(const char *what, unsigned long n)
+{
+    double secs = (t2.tv_sec - t1.tv_sec) +
+		  (double) (t2.tv_usec - t1.tv_usec) / 1000000;
+
+    printf("*** %-10s %9lu %10.6f secs\n", what, n, secs);
+}
+
+/* the log lines do_daemon_work() would see for one user: every folder
+ * touched twice, and its \Seen and subscription once */
+static void genlog(struct buf *log, int user, int nfolders)
+{
+    int i, pass;
+
+    buf_printf(log, "USER user%d\n", user);
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < nfolders; i++) {
+	    buf_printf(log, "MAILBOX user.user%d.folder%05d\n", user, i);
+	    if (pass) continue;
+	    buf_printf(log, "SEEN user%d uid%d.%05d\n", user, user, i);
+	    buf_printf(log, "SUB user%d user.user%d.folder%05d\n",
+		       user, user, i);
+	}
+    }
+    buf_printf(log, "QUOTA user.user%d\n", user);
+    buf_printf(log, "META user%d\n", user);
+}
+
+/* as do_daemon_work() sorts the log into its lists */
+static void replay(char *log, struct sync_action_list *lists[])
+{
+    char *line, *next, *type, *arg1, *arg2;
+
+    for (line = log; *line; line = next) {
+	next = strchr(line, '\n');
+	*next++ = '\0';
+
+	type = line;
+	arg1 = strchr(type, ' ');
+	*arg1++ = '\0';
+	arg2 = strchr(arg1, ' ');
+	if (arg2) *arg2++ = '\0';
+
+	if (!strcmp(type, "USER"))
+	    sync_action_list_add(lists[0], NULL, arg1);
+	else if (!strcmp(type, "META"))
+	    sync_action_list_add(lists[1], NULL, arg1);
+	else if (!strcmp(type, "MAILBOX"))
+	    sync_action_list_add(lists[2], arg1, NULL);
+	else if (!strcmp(type, "QUOTA"))
+	    sync_action_list_add(lists[3], arg1, NULL);
+	else if (!strcmp(type, "SEEN"))
+	    sync_action_list_add(lists[4], arg2, arg1);
+	else if (!strcmp(type, "SUB"))
+	    sync_action_list_add(lists[5], arg2, arg1);
+    }
+}
+
+static struct sync_folder_list *genfolders(int user, int nfolders, int skew)
+{
+    struct sync_folder_list *l = sync_folder_list_create();
+    char id[64], name[MAX_MAILBOX_NAME];
+    int i;
+
+    /* the replica lists them in another order */
+    for (i = 0; i < nfolders; i++) {
+	int n = (i * skew) % nfolders;
+	snprintf(id, sizeof(id), "uid%d.%05d", user, n);
+	snprintf(name, sizeof(name), "user.user%d.folder%05d", user, n);
+	sync_folder_list_add(l, id, name, "default", "", 0, 1, 1, 1,
+			     NULL, 0, 0, 0, NULL, 0);
+    }
+
+    return l;
+}
+
+int main(int argc, char *argv[])
+{
+    int nusers = 10;
+    int nfolders = 10000;
+    struct sync_action_list *lists[6];
+    struct buf log = BUF_INITIALIZER;
+    unsigned long found;
+    int i, u;
+
+    if (argc > 1) nusers = atoi(argv[1]);
+    if (argc > 2) nfolders = atoi(argv[2]);
+    if (nusers <= 0 || nfolders <= 0) {
+	printf("%s [users] [folders per user]\n", argv[0]);
+	exit(1);
+    }
+
+    printf("%d users with %d folders\n", nusers, nfolders);
+
+    for (u = 0; u < nusers; u++)
+	genlog(&log, u, nfolders);
+    buf_cstring(&log);
+
+    /* 1: sort the log into action lists, dropping duplicates */
+    START();
+    for (i = 0; i < 6; i++)
+	lists[i] = sync_action_list_create();
+    replay(log.s, lists);
+    STOP("log", lists[2]->count);
+
+    for (u = 0; u < nusers; u++) {
+	struct sync_folder_list *master = genfolders(u, nfolders, 1);
+	struct sync_folder_list *replica = genfolders(u, nfolders, 7919);
+	struct sync_rename_list *renames = sync_rename_list_create();
+	struct sync_name_list *msubs = sync_name_list_create();
+	struct sync_name_list *rsubs = sync_name_list_create();
+	struct sync_seen_list *mseen = sync_seen_list_create();
+	struct sync_seen_list *rseen = sync_seen_list_create();
+	struct sync_quota_list *rquota = sync_quota_list_create();
+	struct sync_folder *mfolder;
+	struct sync_name *name;
+	struct sync_seen *seen;
+	char buf[MAX_MAILBOX_NAME];
+
+	printf("user%d\n", u);
+
+	/* 2: match up the folders as do_user_main() does */
+	START();
+	for (found = 0, mfolder = master->head; mfolder;
+	     mfolder = mfolder->next) {
+	    struct sync_folder *rfolder =
+		sync_folder_lookup(replica, mfolder->uniqueid);
+	    if (!rfolder) continue;
+	    rfolder->mark = 1;
+	    found++;
+	    if (strcmp(rfolder->name, mfolder->name))
+		sync_rename_list_add(renames, mfolder->uniqueid,
+				     rfolder->name, mfolder->name,
+				     mfolder->part, mfolder->uidvalidity);
+	}
+	STOP("folders", found);
+
+	/* 3: and the quota roots */
+	START();
+	for (i = 0; i < nfolders; i += 100) {
+	    snprintf(buf, sizeof(buf), "user.user%d.folder%05d", u, i);
+	    sync_quota_list_add(rquota, buf);
+	}
+	for (found = 0, mfolder = master->head; mfolder;
+	     mfolder = mfolder->next) {
+	    if (sync_quota_lookup(rquota, mfolder->name)) found++;
+	}
+	STOP("quota", found);
+
+	/* 4: the subscriptions, as do_user_sub() */
+	START();
+	for (mfolder = master->head; mfolder; mfolder = mfolder->next) {
+	    sync_name_list_add(msubs, mfolder->name);
+	    sync_name_list_add(rsubs, mfolder->name);
+	}
+	for (found = 0, name = msubs->head; name; name = name->next) {
+	    struct sync_name *rname = sync_name_lookup(rsubs, name->name);
+	    if (rname) {
+		rname->mark = 1;
+		found++;
+	    }
+	}
+	STOP("subs", found);
+
+	/* 5: and \Seen, as do_user_seen() */
+	START();
+	for (mfolder = master->head; mfolder; mfolder = mfolder->next) {
+	    sync_seen_list_add(mseen, mfolder->uniqueid, 0, 0, 0, "");
+	    sync_seen_list_add(rseen, mfolder->uniqueid, 0, 0, 0, "");
+	}
+	for (found = 0, seen = mseen->head; seen; seen = seen->next) {
+	    if (sync_seen_list_lookup(rseen, seen->uniqueid)) found++;
+	}
+	STOP("seen", found);
+
+	START();
+	sync_folder_list_free(&master);
+	sync_folder_list_free(&replica);
+	sync_rename_list_free(&renames);
+	sync_name_list_free(&msubs);
+	sync_name_list_free(&rsubs);
+	sync_seen_list_free(&mseen);
+	sync_seen_list_free(&rseen);
+	sync_quota_list_free(&rquota);
+	STOP("free", nfolders);
+    }
+
+    for (i = 0; i < 6; i++)
+	sync_action_list_free(&lists[i]);
+    buf_free(&log);
+
+    return 0;
+}
@@ -118,6 +118,7 @@ static int do_compress     = 0;
 
 #define CAPA_SYNC_CRC_ALGORITHM	    (CAPA_COMPRESS<<1)
 #define CAPA_SYNC_CRC_COVERS	    (CAPA_COMPRESS<<2)
+#define CAPA_SYNC_PIPELINING	    (CAPA_COMPRESS<<3)
 
 static struct protocol_t csync_protocol =
 { "csync", "csync",
@@ -129,12 +130,14 @@ static struct protocol_t csync_protocol =
       { "COMPRESS=DEFLATE", CAPA_COMPRESS },
       { "SYNC_CRC_ALGORITHM", CAPA_SYNC_CRC_ALGORITHM },
       { "SYNC_CRC_COVERS", CAPA_SYNC_CRC_COVERS },
+      { "PIPELINING", CAPA_SYNC_PIPELINING },
       { NULL, 0 } } },
   { "STARTTLS", "OK", "NO", 1 },
   { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
   { NULL, NULL, NULL },
   { "NOOP", NULL, "OK" },
-  { "EXIT", NULL, "OK" }
+  { "EXIT", NULL, "OK" },
+  { NULL, NULL, NULL, 0 }
 };
 
 static int do_meta(char *user);
@@ -172,6 +175,89 @@ void fatal(const char *s, int code)
 
 /* ====================================================================== */
 
+/* Routines relevant to pipelining.
+ *
+ * A server which offers PIPELINING answers each command in the order
+ * it was sent, so we needn't wait for the reply to one APPLY before
+ * sending the next.  Up to pipeline_window of them are in flight at
+ * once, each with a request id, and their replies are matched to them
+ * in order as they're read.  Anything which needs a reply straight
+ * away reads the ones in flight first. */
+
+#define SYNC_PIPELINE_MAX (256)
+
+struct sync_pending {
+    unsigned long id;
+    const char *cmd;
+    int *rp;		/* where to put a failure */
+};
+
+static struct sync_pending pipeline[SYNC_PIPELINE_MAX];
+static unsigned pipeline_window = 0;	/* 0: wait for every reply */
+static unsigned pipeline_head = 0;
+static unsigned pipeline_count = 0;
+static unsigned long pipeline_nextid = 0;
+
+/* Read the reply to the oldest command in flight */
+static void pipeline_collect(void)
+{
+    struct sync_pending *p = &pipeline[pipeline_head];
+    int r;
+
+    r = sync_parse_response(p->cmd, sync_in, NULL);
+    if (r) {
+	if (verbose_logging)
+	    syslog(LOG_INFO, "%s #%lu failed: %s",
+		   p->cmd, p->id, error_message(r));
+	if (!*p->rp) *p->rp = r;
+    }
+
+    pipeline_head = (pipeline_head + 1) % SYNC_PIPELINE_MAX;
+    pipeline_count--;
+}
+
+static void pipeline_wait(void)
+{
+    while (pipeline_count)
+	pipeline_collect();
+}
+
+/* Read the reply to the command we've just sent */
+static int read_response(const char *cmd, struct dlist **klp)
+{
+    pipeline_wait();
+
+    return sync_parse_response(cmd, sync_in, klp);
+}
+
+/* Send an APPLY.  If we're pipelining and the caller has given us
+ * somewhere to record a failure, don't wait for the reply: '*rp' is
+ * set after pipeline_wait() if the command failed. */
+static int sync_apply(struct dlist *kl, const char *cmd, int *rp)
+{
+    struct sync_pending *p;
+
+    if (!pipeline_window || !rp) {
+	sync_send_apply(kl, sync_out);
+	return read_response(cmd, NULL);
+    }
+
+    if (pipeline_count >= pipeline_window)
+	pipeline_collect();
+
+    p = &pipeline[(pipeline_head + pipeline_count) % SYNC_PIPELINE_MAX];
+    p->id = pipeline_nextid++;
+    p->cmd = cmd;
+    p->rp = rp;
+    pipeline_count++;
+
+    sync_send_apply(kl, sync_out);
+
+    return 0;
+}
+
+/* ====================================================================== */
+
 /* Routines relevant to reserve operation */
 
 /* Find the messages that we will want to upload from this mailbox,
@@ -334,7 +420,7 @@ static int reserve_partition(char *partition,
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, &kin);
+    r = read_response(cmd, &kin);
     if (r) return r;
 
     r = mark_missing(kin, part_list);
@@ -376,7 +462,7 @@ static int response_parse(const char *cmd,
     struct dlist *kl;
     int r;
 
-    r = sync_parse_response(cmd, sync_in, &kin);
+    r = read_response(cmd, &kin);
 
     /* Unpleasant: translate remote access error into "please reset me" */
     if (r == IMAP_MAILBOX_NONEXISTENT)
@@ -503,7 +589,7 @@ static int user_reset(const char *userid)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, NULL);
+    r = read_response(cmd, NULL);
     if (r == IMAP_MAILBOX_NONEXISTENT)
 	r = 0;
 
@@ -525,7 +611,7 @@ static int folder_rename(const char *oldname, const char *newname,
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 static int folder_delete(char *mboxname)
@@ -538,17 +624,19 @@ static int folder_delete(char *mboxname)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, NULL);
+    r = read_response(cmd, NULL);
     if (r == IMAP_MAILBOX_NONEXISTENT)
 	r = 0;
 
     return r;
 }
 
-static int set_sub(const char *userid, const char *mboxname, int add)
+static int set_sub(const char *userid, const char *mboxname, int add,
+		   int *rp)
 {
     const char *cmd = add ? "SUB" : "UNSUB";
     struct dlist *kl;
+    int r;
 
     if (verbose) 
         printf("%s %s %s\n", cmd, userid, mboxname);
@@ -559,43 +647,46 @@ static int set_sub(const char *userid, const char *mboxname, int add)
     kl = dlist_newkvlist(NULL, cmd);
     dlist_setatom(kl, "USERID", userid);
     dlist_setatom(kl, "MBOXNAME", mboxname);
-    sync_send_apply(kl, sync_out);
+    r = sync_apply(kl, cmd, rp);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 static int folder_setannotation(const char *mboxname, const char *entry,
-				const char *userid, const struct buf *value)
+				const char *userid, const struct buf *value,
+				int *rp)
 {
     const char *cmd = "ANNOTATION";
     struct dlist *kl;
+    int r;
 
     kl = dlist_newkvlist(NULL, cmd);
     dlist_setatom(kl, "MBOXNAME", mboxname);
     dlist_setatom(kl, "ENTRY", entry);
     dlist_setatom(kl, "USERID", userid);
     dlist_setmap(kl, "VALUE", value->s, value->len);
-    sync_send_apply(kl, sync_out);
+    r = sync_apply(kl, cmd, rp);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 static int folder_unannotation(const char *mboxname, const char *entry,
-			       const char *userid)
+			       const char *userid, int *rp)
 {
     const char *cmd = "UNANNOTATION";
     struct dlist *kl;
+    int r;
 
     kl = dlist_newkvlist(NULL, cmd);
     dlist_setatom(kl, "MBOXNAME", mboxname);
     dlist_setatom(kl, "ENTRY", entry);
     dlist_setatom(kl, "USERID", userid);
-    sync_send_apply(kl, sync_out);
+    r = sync_apply(kl, cmd, rp);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
 /* ====================================================================== */
@@ -620,7 +711,7 @@ static int sieve_upload(const char *userid, const char *filename,
     dlist_free(&kl);
     free(sieve);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 static int sieve_delete(const char *userid, const char *filename)
@@ -634,7 +725,7 @@ static int sieve_delete(const char *userid, const char *filename)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 static int sieve_activate(const char *userid, const char *filename)
@@ -648,7 +739,7 @@ static int sieve_activate(const char *userid, const char *filename)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 static int sieve_deactivate(const char *userid)
@@ -661,7 +752,7 @@ static int sieve_deactivate(const char *userid)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 /* ====================================================================== */
@@ -675,12 +766,12 @@ static int delete_quota(const char *root)
     sync_send_apply(kl, sync_out);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return read_response(cmd, NULL);
 }
 
 
 static int update_quota_work(struct quota *client,
-			     struct sync_quota *server)
+			     struct sync_quota *server, int *rp)
 {
     const char *cmd = "QUOTA";
     struct dlist *kl;
@@ -712,13 +803,13 @@ static int update_quota_work(struct quota *client,
     kl = dlist_newkvlist(NULL, cmd);
     dlist_setatom(kl, "ROOT", client->root);
     sync_encode_quota_limits(kl, client->limits);
-    sync_send_apply(kl, sync_out);
+    r = sync_apply(kl, cmd, rp);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
-static int user_sub(const char *userid, const char *mboxname)
+static int user_sub(const char *userid, const char *mboxname, int *rp)
 {
     int r;
 
@@ -726,9 +817,9 @@ static int user_sub(const char *userid, const char *mboxname)
 
     switch (r) {
     case CYRUSDB_OK:
-	return set_sub(userid, mboxname, 1);
+	return set_sub(userid, mboxname, 1, rp);
     case CYRUSDB_NOTFOUND:
-	return set_sub(userid, mboxname, 0);
+	return set_sub(userid, mboxname, 0, rp);
     default:
 	return r;
     }
@@ -807,7 +898,7 @@ static int fetch_file(struct mailbox *mailbox, unsigned long uid,
     sync_send_lookup(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, &kin);
+    r = read_response(cmd, &kin);
     if (r) return r;
 
     if (!dlist_tofile(kin->head, NULL, &guid, NULL, NULL)) {
@@ -1219,7 +1310,7 @@ static int mailbox_full_update(const char *mboxname)
     sync_send_lookup(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, &kin);
+    r = read_response(cmd, &kin);
     if (r) return r;
 
     kl = kin->head;
@@ -1342,7 +1433,7 @@ static int mailbox_full_update(const char *mboxname)
     if (kuids->head) {
 	int r2;
 	sync_send_apply(kexpunge, sync_out);
-	r2 = sync_parse_response("EXPUNGE", sync_in, NULL);
+	r2 = read_response("EXPUNGE", NULL);
 	if (r2) {
 	    syslog(LOG_ERR, "SYNCERROR: failed to expunge in cleanup %s",
 		   mboxname);
@@ -1396,7 +1487,7 @@ static int is_unchanged(struct mailbox *mailbox, struct sync_folder *remote)
 static int update_mailbox_once(struct sync_folder *local,
 			       struct sync_folder *remote,
 			       struct sync_reserve_list *reserve_guids,
-			       int is_repeat)
+			       int is_repeat, int *rp)
 {
     struct sync_msgid_list *part_list;
     struct mailbox *mailbox = NULL;
@@ -1461,8 +1552,10 @@ static int update_mailbox_once(struct sync_folder *local,
 	 * but don't close it, because we need to guarantee that message 
 	 * files don't get deleted until we're finished with them... */
 	mailbox_unlock_index(mailbox, NULL);
-	sync_send_apply(kupload, sync_out);
-	r = sync_parse_response("MESSAGE", sync_in, NULL);
+	/* the replica applies much of a MAILBOX before it finds a
+	 * message missing, so wait for the upload to be sure it isn't;
+	 * other folders' MAILBOXes can still be in flight meanwhile */
+	r = sync_apply(kupload, "MESSAGE", NULL);
 	if (r) goto done; /* abort earlier */
     }
 
@@ -1470,8 +1563,7 @@ static int update_mailbox_once(struct sync_folder *local,
     mailbox_close(&mailbox);
 
     /* update the mailbox */
-    sync_send_apply(kl, sync_out);
-    r = sync_parse_response("MAILBOX", sync_in, NULL);
+    r = sync_apply(kl, "MAILBOX", rp);
 
 done:
     annotate_putdb(&user_annot_db);
@@ -1485,34 +1577,45 @@ done:
     return r;
 }
 
-static int update_mailbox(struct sync_folder *local,
-			  struct sync_folder *remote,
-			  struct sync_reserve_list *reserve_guids)
+/* Recover, if we can, from update_mailbox_once() failing with 'r' */
+static int update_mailbox_retry(struct sync_folder *local,
+				struct sync_folder *remote,
+				struct sync_reserve_list *reserve_guids,
+				int r)
 {
-    int r = update_mailbox_once(local, remote, reserve_guids, 0);
-
     if (r == IMAP_AGAIN) {
 	r = mailbox_full_update(local->name);
-	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1);
+	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1, NULL);
     }
     else if (r == IMAP_SYNC_CHECKSUM) {
 	syslog(LOG_ERR, "CRC failure on sync for %s, trying full update",
 	       local->name);
 	r = mailbox_full_update(local->name);
-	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1);
+	if (!r) r = update_mailbox_once(local, remote, reserve_guids, 1, NULL);
     }
 
     return r;
 }
 
+static int update_mailbox(struct sync_folder *local,
+			  struct sync_folder *remote,
+			  struct sync_reserve_list *reserve_guids,
+			  int *rp)
+{
+    int r = update_mailbox_once(local, remote, reserve_guids, 0, rp);
+
+    return update_mailbox_retry(local, remote, reserve_guids, r);
+}
+
 /* ====================================================================== */
 
 
 static int update_seen_work(const char *user, const char *uniqueid,
-			    struct seendata *sd)
+			    struct seendata *sd, int *rp)
 {
     const char *cmd = "SEEN";
     struct dlist *kl;
+    int r;
 
     /* Update seen list */
     kl = dlist_newkvlist(NULL, cmd);
@@ -1522,13 +1625,13 @@ static int update_seen_work(const char *user, const char *uniqueid,
     dlist_setnum32(kl, "LASTUID", sd->lastuid);
     dlist_setdate(kl, "LASTCHANGE", sd->lastchange);
     dlist_setatom(kl, "SEENUIDS", sd->seenuids);
-    sync_send_apply(kl, sync_out);
+    r = sync_apply(kl, cmd, rp);
     dlist_free(&kl);
 
-    return sync_parse_response(cmd, sync_in, NULL);
+    return r;
 }
 
-static int do_seen(char *user, char *uniqueid)
+static int do_seen(char *user, char *uniqueid, int *rp)
 {
     int r = 0;
     struct seen *seendb = NULL;
@@ -1546,7 +1649,7 @@ static int do_seen(char *user, char *uniqueid)
 
     r = seen_read(seendb, uniqueid, &sd);
 
-    if (!r) r = update_seen_work(user, uniqueid, &sd);
+    if (!r) r = update_seen_work(user, uniqueid, &sd, rp);
 
     seen_close(&seendb);
     seen_freedata(&sd);
@@ -1556,7 +1659,7 @@ static int do_seen(char *user, char *uniqueid)
 
 /* ====================================================================== */
 
-static int do_quota(const char *root)
+static int do_quota(const char *root, int *rp)
 {
     int r = 0;
     struct quota q;
@@ -1568,7 +1671,7 @@ static int do_quota(const char *root)
         syslog(LOG_INFO, "SETQUOTA: %s", root);
 
     q.root = root;
-    r = update_quota_work(&q, NULL);
+    r = update_quota_work(&q, NULL, rp);
 
     return r;
 }
@@ -1622,7 +1725,7 @@ static int do_getannotation(const char *mboxname,
     sync_send_lookup(kl, sync_out);
     dlist_free(&kl);
 
-    r = sync_parse_response(cmd, sync_in, &kin);
+    r = read_response(cmd, &kin);
     if (r) return r;
 
     r = parse_annotation(kin, replica_annot);
@@ -1631,7 +1734,7 @@ static int do_getannotation(const char *mboxname,
     return r;
 }
 
-static int do_annotation(const char *mboxname)
+static int do_annotation(const char *mboxname, int *rp)
 {
     int r;
     struct sync_annot_list *replica_annot = sync_annot_list_create();
@@ -1657,7 +1760,7 @@ static int do_annotation(const char *mboxname)
 
 	if (n > 0) {
 	    /* remove replica annotation */
-	    r = folder_unannotation(mboxname, ra->entry, ra->userid);
+	    r = folder_unannotation(mboxname, ra->entry, ra->userid, rp);
 	    if (r) goto bail;
 	    ra = ra->next;
 	    continue;
@@ -1674,7 +1777,8 @@ static int do_annotation(const char *mboxname)
 	}
 
 	/* add the current client annotation */
-	r = folder_setannotation(mboxname, ma->entry, ma->userid, &ma->value);
+	r = folder_setannotation(mboxname, ma->entry, ma->userid, &ma->value,
+				 rp);
 	if (r) goto bail;
 
 	ma = ma->next;
@@ -1696,6 +1800,8 @@ int do_folders(struct sync_name_list *mboxname_list,
     struct sync_rename_list *rename_folders;
     struct sync_reserve_list *reserve_guids;
     struct sync_folder *mfolder, *rfolder;
+    int *results = NULL;
+    int i;
 
     master_folders = sync_folder_list_create();
     rename_folders = sync_rename_list_create();
@@ -1773,12 +1879,30 @@ int do_folders(struct sync_name_list *mboxname_list,
 	}
     }
 
-    for (mfolder = master_folders->head; mfolder; mfolder = mfolder->next) {
+    results = xzmalloc((master_folders->count + 1) * sizeof(int));
+
+    for (mfolder = master_folders->head, i = 0; mfolder;
+	 mfolder = mfolder->next, i++) {
 	/* NOTE: rfolder->name may now be wrong, but we're guaranteed that
 	 * it was successfully renamed above, so just use mfolder->name for
 	 * all commands */
 	rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
-	r = update_mailbox(mfolder, rfolder, reserve_guids);
+	r = update_mailbox(mfolder, rfolder, reserve_guids, &results[i]);
+	if (r) {
+	    syslog(LOG_ERR, "do_folders(): update failed: %s '%s'", 
+		   mfolder->name, error_message(r));
+	    goto bail;
+	}
+    }
+
+    /* and the updates we didn't wait for */
+    pipeline_wait();
+
+    for (mfolder = master_folders->head, i = 0; mfolder;
+	 mfolder = mfolder->next, i++) {
+	if (!results[i]) continue;
+	rfolder = sync_folder_lookup(replica_folders, mfolder->uniqueid);
+	r = update_mailbox_retry(mfolder, rfolder, reserve_guids, results[i]);
 	if (r) {
 	    syslog(LOG_ERR, "do_folders(): update failed: %s '%s'", 
 		   mfolder->name, error_message(r));
@@ -1787,6 +1911,8 @@ int do_folders(struct sync_name_list *mboxname_list,
     }
 
  bail:
+    pipeline_wait();
+    free(results);
     sync_folder_list_free(&master_folders);
     sync_rename_list_free(&rename_folders);
     sync_reserve_list_free(&reserve_guids);
@@ -1877,7 +2003,7 @@ static int do_user_quota(struct sync_name_list *master_quotaroots,
 	q.root = mitem->name;
 	if (rquota)
 	    rquota->done = 1;
-	r = update_quota_work(&q, rquota);
+	r = update_quota_work(&q, rquota, NULL);
 	if (r) return r;
     }
 
@@ -1943,6 +2069,7 @@ int do_user_sub(const char *userid, struct sync_name_list *replica_subs)
     struct sync_name_list *master_subs = sync_name_list_create();
     struct sync_name *msubs, *rsubs;
     int r = 0;
+    int pr = 0;
 
     /* Includes subsiduary nodes automatically */
     r = mboxlist_allsubs(userid, addmbox_sub, master_subs);
@@ -1956,7 +2083,7 @@ int do_user_sub(const char *userid, struct sync_name_list *replica_subs)
 	    rsubs->mark = 1;
 	    continue;
 	}
-	r = set_sub(userid, msubs->name, 1);
+	r = set_sub(userid, msubs->name, 1, &pr);
 	if (r) goto bail;
     }
 
@@ -1964,11 +2091,13 @@ int do_user_sub(const char *userid, struct sync_name_list *replica_subs)
     for (rsubs = replica_subs->head; rsubs; rsubs = rsubs->next) {
 	if (rsubs->mark)
 	    continue;
-	r = set_sub(userid, rsubs->name, 0);
+	r = set_sub(userid, rsubs->name, 0, &pr);
 	if (r) goto bail;
     }
 
  bail:
+    pipeline_wait();
+    if (!r) r = pr;
     sync_name_list_free(&master_subs);
     return r;
 }
@@ -1989,6 +2118,7 @@ static int do_user_seen(const char *user, struct sync_seen_list *replica_seen)
     struct sync_seen *mseen, *rseen;
     struct seen *seendb = NULL;
     struct sync_seen_list *list;
+    int pr = 0;
 
     /* silently ignore errors */
     r = seen_open(user, SEEN_SILENT, &seendb);
@@ -2006,8 +2136,9 @@ static int do_user_seen(const char *user, struct sync_seen_list *replica_seen)
 	    if (seen_compare(&rseen->sd, &mseen->sd))
 		continue; /* nothing changed */
 	}
-	r = update_seen_work(user, mseen->uniqueid, &mseen->sd);
+	r = update_seen_work(user, mseen->uniqueid, &mseen->sd, &pr);
     }
+    pipeline_wait();
 
     /* XXX - delete seen on the replica for records that don't exist? */
 
@@ -2268,6 +2399,8 @@ static int do_sync(const char *filename)
     int fd = -1;
     int doclose = 0;
     struct protstream *input;
+    int *results = NULL;
+    int i;
     int r = 0;
 
     if ((filename == NULL) || !strcmp(filename, "-"))
@@ -2385,12 +2518,19 @@ static int do_sync(const char *filename)
 	remove_meta(action->user, sub_list);
     }
 
-    /* And then run tasks. */
-    for (action = quota_list->head; action; action = action->next) {
+    /* And then run tasks.  Each list's updates are pipelined, so we
+     * see which failed once they've all been sent */
+    results = xzmalloc((quota_list->count + 1) * sizeof(int));
+    for (action = quota_list->head, i = 0; action; action = action->next, i++) {
 	if (!action->active)
 	    continue;
+	if ((r = do_quota(action->name, &results[i])))
+	    results[i] = r;
+    }
+    pipeline_wait();
 
-	if (do_quota(action->name)) {
+    for (action = quota_list->head, i = 0; action; action = action->next, i++) {
+	if (results[i]) {
 	    /* XXX - bogus handling, should be user */
 	    sync_action_list_add(mailbox_list, action->name, NULL);
 	    if (verbose) {
@@ -2404,14 +2544,22 @@ static int do_sync(const char *filename)
 	}
     }
 
-    for (action = annot_list->head; action; action = action->next) {
+    free(results);
+
+    results = xzmalloc((annot_list->count + 1) * sizeof(int));
+    for (action = annot_list->head, i = 0; action; action = action->next, i++) {
 	if (!action->active)
 	    continue;
+	if ((r = do_annotation(action->name, &results[i])))
+	    results[i] = r;
+    }
+    pipeline_wait();
 
+    for (action = annot_list->head, i = 0; action; action = action->next, i++) {
 	/* NOTE: ANNOTATION "" is a special case - it's a server
 	 * annotation, hence the check for a character at the
 	 * start of the name */
-	if (do_annotation(action->name) && *action->name) {
+	if (results[i] && *action->name) {
 	    /* XXX - bogus handling, should be ... er, something */
 	    sync_action_list_add(mailbox_list, action->name, NULL);
 	    if (verbose) {
@@ -2425,11 +2573,19 @@ static int do_sync(const char *filename)
 	}
     }
 
-    for (action = seen_list->head; action; action = action->next) {
+    free(results);
+
+    results = xzmalloc((seen_list->count + 1) * sizeof(int));
+    for (action = seen_list->head, i = 0; action; action = action->next, i++) {
 	if (!action->active)
 	    continue;
+	if ((r = do_seen(action->user, action->name, &results[i])))
+	    results[i] = r;
+    }
+    pipeline_wait();
 
-        if (do_seen(action->user, action->name)) {
+    for (action = seen_list->head, i = 0; action; action = action->next, i++) {
+        if (results[i]) {
 	    char *userid = mboxname_isusermailbox(action->name, 1);
 	    if (userid && !strcmp(userid, action->user)) {
 		sync_action_list_add(user_list, NULL, action->user);
@@ -2455,11 +2611,19 @@ static int do_sync(const char *filename)
 	}
     }
 
-    for (action = sub_list->head; action; action = action->next) {
+    free(results);
+
+    results = xzmalloc((sub_list->count + 1) * sizeof(int));
+    for (action = sub_list->head, i = 0; action; action = action->next, i++) {
 	if (!action->active)
 	    continue;
+	if ((r = user_sub(action->user, action->name, &results[i])))
+	    results[i] = r;
+    }
+    pipeline_wait();
 
-        if (user_sub(action->user, action->name)) {
+    for (action = sub_list->head, i = 0; action; action = action->next, i++) {
+        if (results[i]) {
             sync_action_list_add(meta_list, NULL, action->user);
             if (verbose) {
                 printf("  Promoting: SUB %s %s -> META %s\n",
@@ -2472,6 +2636,10 @@ static int do_sync(const char *filename)
         }
     }
 
+    free(results);
+    results = NULL;
+    r = 0;
+
     for (action = mailbox_list->head; action; action = action->next) {
 	if (!action->active)
 	    continue;
@@ -2517,6 +2685,7 @@ static int do_sync(const char *filename)
 
   cleanup:
     if (doclose) close(fd);
+    free(results);
 
     if (r) {
 	if (verbose)
@@ -2635,7 +2804,7 @@ int do_daemon_work(const char *sync_log_file, const char *sync_shutdown_file,
 	prot_printf(sync_out, "RESTART\r\n"); 
 	prot_flush(sync_out);
 
-	r = sync_parse_response("RESTART", sync_in, NULL);
+	r = read_response("RESTART", NULL);
 
 	if (r) {
 	    syslog(LOG_ERR, "sync_client RESTART failed: %s",
@@ -2664,6 +2833,8 @@ static int get_intconfig(const char *channel, const char *val)
     if (response == -1) {
 	if (!strcmp(val, "sync_repeat_interval"))
 	    response = config_getint(IMAPOPT_SYNC_REPEAT_INTERVAL);
+	else if (!strcmp(val, "sync_pipeline_window"))
+	    response = config_getint(IMAPOPT_SYNC_PIPELINE_WINDOW);
     }
 
     return response;
@@ -2848,7 +3019,7 @@ negfailed:
 	    sync_send_set(kl, sync_out);
 	    dlist_free(&kl);
 
-	    r = sync_parse_response("SET", sync_in, NULL);
+	    r = read_response("SET", NULL);
 	    if (r) goto negfailed;
 	}
 
@@ -2859,6 +3030,16 @@ negfailed:
     /* Force use of LITERAL+ so we don't need two way communications */
     prot_setisclient(sync_in, 1);
     prot_setisclient(sync_out, 1);
+
+    /* Don't wait for each APPLY's reply, if the server lets us */
+    pipeline_head = pipeline_count = 0;
+    pipeline_window = 0;
+    if (CAPA(sync_backend, CAPA_SYNC_PIPELINING)) {
+	int window = get_intconfig(channel, "sync_pipeline_window");
+
+	if (window > SYNC_PIPELINE_MAX) window = SYNC_PIPELINE_MAX;
+	if (window > 1) pipeline_window = window;
+    }
 }
 
 static void replica_disconnect(void)
@@ -2891,6 +3072,357 @@ void do_daemon(const char *sync_log_file, const char *sync_shutdown_file,
 
 /* ====================================================================== */
 
+/* Routines relevant to parallel rolling replication.
+ *
+ * With -j, one process reads the channel's sync log and splits it
+ * into a log per worker, each of which runs do_daemon() over its own
+ * replica connection.  All the actions for a given user go to the
+ * same worker, in the order they were logged. */
+
+#define SYNC_MAX_WORKERS (64)
+#define SYNC_LAG_INTERVAL (60)	/* seconds between lag reports */
+
+static pid_t *worker_pids = NULL;
+static int worker_count = 0;
+
+struct worker_lag {
+    time_t pending;	/* oldest action in the worker's log */
+    time_t inflight;	/* oldest action the worker has taken */
+};
+
+static char *worker_fname(const char *sync_log_file, int worker,
+			  const char *suffix)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%s-worker%d%s", sync_log_file, worker,
+	       suffix ? suffix : "");
+
+    return buf_release(&buf);
+}
+
+/* Copy the atom or quoted string at 'p' into 'arg', and return the
+ * character after it */
+static const char *sync_log_word(const char *p, const char *end,
+				 struct buf *arg)
+{
+    buf_reset(arg);
+
+    if (p < end && *p == '"') {
+	for (p++; p < end && *p != '"'; p++) {
+	    if (*p == '\\' && p + 1 < end) p++;
+	    buf_putc(arg, *p);
+	}
+	if (p < end) p++;
+    }
+    else {
+	while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+	    buf_putc(arg, *p++);
+    }
+
+    buf_cstring(arg);
+    return p;
+}
+
+/* Which worker replicates the log line between 'p' and 'end' */
+static int sync_line_shard(const char *p, const char *end, int nworkers)
+{
+    static struct buf type, arg;
+    char inboxname[MAX_MAILBOX_BUFFER];
+
+    p = sync_log_word(p, end, &type);
+    if (p >= end || *p != ' ') return 0;
+    sync_log_word(p + 1, end, &arg);
+    ucase(type.s);
+
+    /* MAILBOX, QUOTA and ANNOTATION name a mailbox, the rest a user */
+    if (!strcmp(type.s, "MAILBOX") || !strcmp(type.s, "QUOTA") ||
+	!strcmp(type.s, "ANNOTATION"))
+	return mboxname_shard(arg.s, nworkers);
+
+    if ((sync_namespace.mboxname_tointernal)(&sync_namespace, "INBOX",
+					      arg.s, inboxname))
+	return mboxname_shard(arg.s, nworkers);
+
+    return mboxname_shard(inboxname, nworkers);
+}
+
+/* Append the contents of the log 'filename' to the workers' logs */
+static int sync_distribute(const char *filename, const char *sync_log_file,
+			   int nworkers, struct worker_lag *lag)
+{
+    struct buf *out = xzmalloc(nworkers * sizeof(struct buf));
+    const char *base = NULL;
+    size_t len = 0;
+    const char *p, *eol, *end;
+    struct stat sbuf;
+    char *fname;
+    int fd, i;
+    int r = 0;
+
+    fd = open(filename, O_RDWR);
+    if (fd < 0) {
+	syslog(LOG_ERR, "Failed to open %s: %m", filename);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    /* wait for anyone who opened it before we renamed it */
+    if (lock_blocking(fd) < 0 || fstat(fd, &sbuf) < 0) {
+	syslog(LOG_ERR, "Failed to lock %s: %m", filename);
+	close(fd);
+	r = IMAP_IOERROR;
+	goto done;
+    }
+
+    map_refresh(fd, 1, &base, &len, sbuf.st_size, filename, NULL);
+
+    for (p = base, end = base + len; p < end; p = eol) {
+	eol = memchr(p, '\n', end - p);
+	eol = eol ? eol + 1 : end;
+	if (eol - p <= 1) continue;
+
+	i = sync_line_shard(p, eol, nworkers);
+	buf_appendmap(&out[i], p, eol - p);
+	if (eol[-1] != '\n') buf_putc(&out[i], '\n');
+    }
+
+    map_free(&base, &len);
+    close(fd);
+
+    for (i = 0; i < nworkers; i++) {
+	if (!out[i].len) continue;
+
+	fname = worker_fname(sync_log_file, i, NULL);
+	if (lag && stat(fname, &sbuf) < 0) {
+	    /* the worker has taken what we gave it last time */
+	    if (lag[i].pending) lag[i].inflight = lag[i].pending;
+	    lag[i].pending = time(NULL);
+	}
+	sync_log_append(fname, buf_cstring(&out[i]));
+	free(fname);
+    }
+
+done:
+    for (i = 0; i < nworkers; i++)
+	buf_free(&out[i]);
+    free(out);
+
+    return r;
+}
+
+/* Log how far behind each worker is: the age of the oldest action it
+ * hasn't finished with, and how much is waiting for it */
+static void report_lag(const char *sync_log_file, struct worker_lag *lag)
+{
+    time_t now = time(NULL);
+    unsigned long secs;
+    struct stat sbuf;
+    off_t queued;
+    char *fname;
+    int i;
+
+    for (i = 0; i < worker_count; i++) {
+	fname = worker_fname(sync_log_file, i, NULL);
+	if (stat(fname, &sbuf) == 0) {
+	    queued = sbuf.st_size;
+	}
+	else {
+	    /* the worker has taken everything we gave it */
+	    queued = 0;
+	    if (lag[i].pending) lag[i].inflight = lag[i].pending;
+	    lag[i].pending = 0;
+	}
+	free(fname);
+
+	/* and is it still working on it? */
+	if (lag[i].inflight) {
+	    struct buf work = BUF_INITIALIZER;
+
+	    buf_printf(&work, "%s-worker%d-%d", sync_log_file, i,
+		       (int) worker_pids[i]);
+	    if (stat(buf_cstring(&work), &sbuf) < 0) lag[i].inflight = 0;
+	    buf_free(&work);
+	}
+
+	if (lag[i].inflight) secs = now - lag[i].inflight;
+	else if (lag[i].pending) secs = now - lag[i].pending;
+	else secs = 0;
+
+	syslog(LOG_INFO, "sync_client worker %d: lag %lu secs, %lu bytes queued",
+	       i, secs, (unsigned long) queued);
+	if (verbose)
+	    printf("worker %d: lag %lu secs, %lu bytes queued\n",
+		   i, secs, (unsigned long) queued);
+    }
+}
+
+static void workers_wait(void)
+{
+    int i, status;
+
+    for (i = 0; i < worker_count; i++) {
+	if (worker_pids[i] <= 0) continue;
+	while (waitpid(worker_pids[i], &status, 0) < 0) {
+	    if (errno != EINTR) break;
+	}
+	worker_pids[i] = 0;
+    }
+}
+
+static void workers_shut_down(int code) __attribute__((noreturn));
+static void workers_shut_down(int code)
+{
+    int i;
+
+    in_shutdown = 1;
+
+    for (i = 0; i < worker_count; i++)
+	if (worker_pids[i] > 0) kill(worker_pids[i], SIGQUIT);
+    workers_wait();
+
+    cyrus_done();
+    exit(code);
+}
+
+/*
+ * Fork 'nworkers' rolling replication workers and feed them from
+ * 'sync_log_file'.  Returns the worker number in each child; the
+ * parent never returns.
+ */
+static int do_workers(const char *sync_log_file, const char *sync_shutdown_file,
+		      unsigned long min_delta, int nworkers)
+{
+    struct worker_lag *lag = xzmalloc(nworkers * sizeof(struct worker_lag));
+    time_t single_start, last_report;
+    char *work_file_name;
+    struct stat sbuf;
+    char *fname;
+    int delta;
+    int i, status;
+    pid_t pid;
+
+    signals_set_shutdown(&workers_shut_down);
+    signals_add_handlers(0);
+
+    work_file_name = xmalloc(strlen(sync_log_file)+20);
+    snprintf(work_file_name, strlen(sync_log_file)+20,
+             "%s-%d", sync_log_file, getpid());
+
+    /* hand on anything left for workers we no longer have */
+    for (i = nworkers; i < SYNC_MAX_WORKERS; i++) {
+	fname = worker_fname(sync_log_file, i, NULL);
+	if (stat(fname, &sbuf) == 0 &&
+	    !sync_distribute(fname, sync_log_file, nworkers, lag))
+	    unlink(fname);
+	free(fname);
+    }
+
+    worker_pids = xzmalloc(nworkers * sizeof(pid_t));
+
+    for (i = 0; i < nworkers; i++) {
+	pid = fork();
+	if (pid < 0) {
+	    syslog(LOG_ERR, "sync_client: can't fork worker %d: %m", i);
+	    workers_shut_down(EC_OSERR);
+	}
+	if (!pid) {
+	    free(worker_pids);
+	    worker_pids = NULL;
+	    worker_count = 0;
+	    free(lag);
+	    free(work_file_name);
+	    return i;
+	}
+	worker_pids[i] = pid;
+	worker_count = i + 1;
+    }
+
+    syslog(LOG_NOTICE, "rolling replication from %s with %d workers",
+	   sync_log_file, nworkers);
+
+    last_report = time(NULL);
+
+    while (1) {
+	single_start = time(NULL);
+
+	signals_poll();
+
+	/* A worker which gives up takes the rest of us with it, just as
+	 * a single sync_client would exit */
+	pid = waitpid(-1, &status, WNOHANG);
+	if (pid > 0) {
+	    for (i = 0; i < worker_count; i++) {
+		if (worker_pids[i] != pid) continue;
+		worker_pids[i] = 0;
+		syslog(LOG_ERR, "sync_client worker %d exited, shutting down",
+		       i);
+	    }
+	    workers_shut_down(EC_TEMPFAIL);
+	}
+
+	/* Check for shutdown file, and pass it on */
+        if (sync_shutdown_file && !stat(sync_shutdown_file, &sbuf)) {
+	    for (i = 0; i < worker_count; i++) {
+		fname = worker_fname(sync_log_file, i, "-shutdown");
+		close(open(fname, O_WRONLY|O_CREAT, 0640));
+		free(fname);
+	    }
+	    workers_wait();
+            unlink(sync_shutdown_file);
+	    break;
+        }
+
+	if ((single_start - last_report) >= SYNC_LAG_INTERVAL) {
+	    report_lag(sync_log_file, lag);
+	    last_report = single_start;
+	}
+
+        if (stat(work_file_name, &sbuf) == 0) {
+	    syslog(LOG_NOTICE,
+		   "Redistributing sync log file %s", work_file_name);
+	}
+	else {
+	    /* Check for sync_log file */
+	    if (stat(sync_log_file, &sbuf) < 0) {
+		if (min_delta > 0) {
+		    sleep(min_delta);
+		} else {
+		    usleep(100000);    /* 1/10th second */
+		}
+		continue;
+	    }
+
+	    /* Move sync_log to our work file */
+	    if (rename(sync_log_file, work_file_name) < 0) {
+		syslog(LOG_ERR, "Rename %s -> %s failed: %m",
+		       sync_log_file, work_file_name);
+		workers_shut_down(EC_IOERR);
+	    }
+	}
+
+	if (sync_distribute(work_file_name, sync_log_file, nworkers, lag) ||
+	    unlink(work_file_name) < 0) {
+	    syslog(LOG_ERR, "Distributing sync log file %s failed",
+		   work_file_name);
+	    workers_shut_down(EC_IOERR);
+	}
+
+        delta = time(NULL) - single_start;
+
+        if (((unsigned) delta < min_delta) && ((min_delta-delta) > 0))
+            sleep(min_delta-delta);
+    }
+
+    free(lag);
+    free(work_file_name);
+    free(worker_pids);
+    cyrus_done();
+    exit(0);
+}
+
+/* ====================================================================== */
+
 static struct sasl_callback mysasl_cb[] = {
     { SASL_CB_GETOPT, (mysasl_cb_ft *) &mysasl_config, NULL },
     { SASL_CB_CANON_USER, (mysasl_cb_ft *) &mysasl_canon_user, NULL },
@@ -2916,7 +3448,9 @@ int main(int argc, char **argv)
     int   wait     = 0;
     int   timeout  = 600;
     int   min_delta = 0;
-    const char *sync_log_file;
+    int   nworkers = 1;
+    int   worker = -1;
+    const char *sync_log_file = NULL;
     const char *channel = NULL;
     const char *sync_shutdown_file = NULL;
     char buf[512];
@@ -2932,7 +3466,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:vlS:F:f:w:t:d:n:rRumsoz")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:vlS:F:f:w:t:d:j:n:rRumsoz")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -2979,6 +3513,12 @@ int main(int argc, char **argv)
             min_delta = atoi(optarg);
             break;
 
+        case 'j': /* number of replica connections */
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > SYNC_MAX_WORKERS)
+                usage("sync_client");
+            break;
+
         case 'r':
 	    background = 1;
 	    /* fallthrough */
@@ -3059,6 +3599,28 @@ int main(int argc, char **argv)
         fatal(error_message(r), EC_CONFIG);
     }
 
+    if (mode == MODE_REPEAT && !input_filename) {
+	/* rolling replication */
+	sync_log_file = sync_log_fname(channel);
+
+	if (!sync_shutdown_file)
+	    sync_shutdown_file = get_config(channel, "sync_shutdown_file");
+
+	if (!min_delta)
+	    min_delta = get_intconfig(channel, "sync_repeat_interval");
+
+	/* the workers each open their own databases, so fork them
+	 * before we open ours */
+	if (nworkers > 1) {
+	    worker = do_workers(sync_log_file, sync_shutdown_file,
+				min_delta, nworkers);
+
+	    /* and from here on we're one of them */
+	    sync_shutdown_file = worker_fname(sync_log_file, worker, "-shutdown");
+	    sync_log_file = worker_fname(sync_log_file, worker, NULL);
+	}
+    }
+
     /* open the mboxlist, we'll need it for real work */
     mboxlist_init(0);
     mboxlist_open(NULL);
@@ -3204,14 +3766,6 @@ int main(int argc, char **argv)
 	}
 	else {
 	    /* rolling replication */
-	    sync_log_file = sync_log_fname(channel);
-
-	    if (!sync_shutdown_file)
-		sync_shutdown_file = get_config(channel, "sync_shutdown_file");
-
-	    if (!min_delta)
-		min_delta = get_intconfig(channel, "sync_repeat_interval");
-
 	    do_daemon(sync_log_file, sync_shutdown_file, channel, timeout, min_delta);
 	}
 
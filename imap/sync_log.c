@@ -130,19 +130,14 @@ char *sync_log_fname(const char *channel)
     return buf;
 }
 
-static void sync_log_base(const char *channel, const char *string)
+/* Append 'string' to the log file 'fname' under lock. Readers rename
+   the file away before processing it, so make sure that we've locked
+   the file which is still in place. */
+void sync_log_append(const char *fname, const char *string)
 {
     int fd;
     struct stat sbuffile, sbuffd;
     int retries = 0;
-    const char *fname;
-
-    /* are we being supressed? */
-    if (!sync_log_enabled) return;
-    if (channel && suppressed_channel && !strcmp(channel, suppressed_channel))
-	return;
-
-    fname = sync_log_fname(channel);
 
     while (retries++ < SYNC_LOG_RETRIES) {
 	fd = open(fname, O_WRONLY|O_APPEND|O_CREAT, 0640);
@@ -188,6 +183,16 @@ static void sync_log_base(const char *channel, const char *string)
     close(fd);
 }
 
+static void sync_log_base(const char *channel, const char *string)
+{
+    /* are we being supressed? */
+    if (!sync_log_enabled) return;
+    if (channel && suppressed_channel && !strcmp(channel, suppressed_channel))
+	return;
+
+    sync_log_append(sync_log_fname(channel), string);
+}
+
 static const char *sync_quote_name(const char *name)
 {
     static char buf[MAX_MAILBOX_BUFFER+3]; /* "x2 plus \0 */
@@ -289,6 +294,19 @@ void sync_log_channel(const char *channel, const char *fmt, ...)
     sync_log_base(channel, val);
 }
 
+/* The squatter queue is independent of replication: it's written
+   whenever squat_log is set, whatever sync_log says */
+void sync_log_squat(const char *name)
+{
+    char buf[MAX_MAILBOX_BUFFER+20];
+
+    if (!config_getswitch(IMAPOPT_SQUAT_LOG)) return;
+
+    snprintf(buf, sizeof(buf), "MAILBOX %s\n", sync_quote_name(name));
+    sync_log_append(sync_log_fname(config_getstring(IMAPOPT_SQUAT_LOG_CHANNEL)),
+		    buf);
+}
+
 void sync_log(const char *fmt, ...)
 {
     va_list ap;
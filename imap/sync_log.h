@@ -81,6 +81,7 @@ void sync_log(const char *fmt, ...);
     sync_log("SUB %s %s\n", user, name)
 
 char *sync_log_fname(const char *channel);
+void sync_log_append(const char *fname, const char *string);
 void sync_log_suppress_channel(const char *channel);
 void sync_log_channel(const char *channel, const char *fmt, ...);
 
@@ -108,4 +109,8 @@ void sync_log_channel(const char *channel, const char *fmt, ...);
 #define sync_log_subscribe_channel(channel, user, name) \
     sync_log_channel(channel, "SUB %s %s\n", user, name)
 
+/* Queue a mailbox with new messages for the rolling squatter, in the
+   log for the squat_log_channel */
+void sync_log_squat(const char *name);
+
 #endif /* INCLUDED_SYNC_LOG_H */
@@ -328,6 +328,10 @@ static void dobanner(void)
     prot_printf(sync_out, "* SYNC_CRC_COVERS %s\r\n",
 			  sync_crc_list_covers());
 
+    /* We answer commands strictly in order, so the client can send
+     * more before reading our replies */
+    prot_printf(sync_out, "* PIPELINING\r\n");
+
     prot_printf(sync_out,
 		"* OK %s Cyrus sync server %s\r\n",
 		config_servername, cyrus_version());
@@ -564,7 +568,10 @@ static void cmdloop(void)
     reserve_list = sync_reserve_list_create(SYNC_MESSAGE_LIST_HASH_SIZE);
 
     for (;;) {
-        prot_flush(sync_out);
+	/* batch up the replies to pipelined commands; we flush
+	 * when we next block on reading anyway */
+	if (!sync_in->cnt)
+	    prot_flush(sync_out);
 
 	/* Parse command name */
 	if ((c = getword(sync_in, &cmd)) == EOF)
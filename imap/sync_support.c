@@ -459,6 +459,7 @@ struct sync_folder_list *sync_folder_list_create(void)
     l->head   = NULL;
     l->tail   = NULL;
     l->count  = 0;
+    construct_hash_table(&l->byid, SYNC_LIST_HASH_SIZE, 0);
 
     return(l);
 }
@@ -506,19 +507,17 @@ struct sync_folder *sync_folder_list_add(struct sync_folder_list *l,
     result->mark     = 0;
     result->reserve  = 0;
 
+    /* lookups find the first one added */
+    if (uniqueid && !hash_lookup(uniqueid, &l->byid))
+	hash_insert(uniqueid, result, &l->byid);
+
     return(result);
 }
 
 struct sync_folder *sync_folder_lookup(struct sync_folder_list *l,
 				       const char *uniqueid)
 {
-    struct sync_folder *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->uniqueid, uniqueid))
-            return p;
-    }
-    return NULL;
+    return (struct sync_folder *) hash_lookup(uniqueid, &l->byid);
 }
 
 void sync_folder_list_free(struct sync_folder_list **lp)
@@ -540,6 +539,7 @@ void sync_folder_list_free(struct sync_folder_list **lp)
 	free(current);
 	current = next;
     }
+    free_hash_table(&l->byid, NULL);
     free(l);
     *lp = NULL;
 }
@@ -554,6 +554,7 @@ struct sync_rename_list *sync_rename_list_create(void)
     l->tail  = NULL;
     l->count = 0;
     l->done  = 0;
+    construct_hash_table(&l->byname, SYNC_LIST_HASH_SIZE, 0);
 
     return(l);
 }
@@ -581,20 +582,16 @@ struct sync_rename *sync_rename_list_add(struct sync_rename_list *l,
     result->uidvalidity = uidvalidity;
     result->done = 0;
 
+    if (!hash_lookup(oldname, &l->byname))
+	hash_insert(oldname, result, &l->byname);
+
     return result;
 }
 
 struct sync_rename *sync_rename_lookup(struct sync_rename_list *l,
 					    const char *oldname)
 {
-    struct sync_rename *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->oldname, oldname))
-            return p;
-    }
-
-    return NULL;
+    return (struct sync_rename *) hash_lookup(oldname, &l->byname);
 }
 
 void sync_rename_list_free(struct sync_rename_list **lp)
@@ -614,6 +611,7 @@ void sync_rename_list_free(struct sync_rename_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&l->byname, NULL);
     free(l);
     *lp = NULL;
 }
@@ -628,6 +626,7 @@ struct sync_quota_list *sync_quota_list_create(void)
     l->tail  = NULL;
     l->count = 0;
     l->done  = 0;
+    construct_hash_table(&l->byroot, SYNC_LIST_HASH_SIZE, 0);
 
     return(l);
 }
@@ -652,20 +651,16 @@ struct sync_quota *sync_quota_list_add(struct sync_quota_list *l,
 	result->limits[res] = QUOTA_UNLIMITED;
     result->done = 0;
 
+    if (!hash_lookup(root, &l->byroot))
+	hash_insert(root, result, &l->byroot);
+
     return result;
 }
 
 struct sync_quota *sync_quota_lookup(struct sync_quota_list *l,
 					  const char *name)
 {
-    struct sync_quota *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->root, name))
-            return p;
-    }
-
-    return NULL;
+    return (struct sync_quota *) hash_lookup(name, &l->byroot);
 }
 
 void sync_quota_list_free(struct sync_quota_list **lp)
@@ -682,6 +677,7 @@ void sync_quota_list_free(struct sync_quota_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&l->byroot, NULL);
     free(l);
     *lp = NULL;
 }
@@ -732,6 +728,7 @@ struct sync_sieve_list *sync_sieve_list_create(void)
     l->head   = NULL;
     l->tail   = NULL;
     l->count  = 0;
+    construct_hash_table(&l->byname, SYNC_LIST_HASH_SIZE, 0);
 
     return l;
 }
@@ -754,30 +751,21 @@ void sync_sieve_list_add(struct sync_sieve_list *l, const char *name,
         l->head = l->tail = item;
 
     l->count++;
+
+    if (!hash_lookup(name, &l->byname))
+	hash_insert(name, item, &l->byname);
 }
 
 struct sync_sieve *sync_sieve_lookup(struct sync_sieve_list *l, const char *name)
 {
-    struct sync_sieve *p;
-
-    for (p = l->head; p; p = p->next) {
-        if (!strcmp(p->name, name))
-            return p;
-    }
-
-    return NULL;
+    return (struct sync_sieve *) hash_lookup(name, &l->byname);
 }
 
 void sync_sieve_list_set_active(struct sync_sieve_list *l, const char *name)
 {
-    struct sync_sieve *item;
+    struct sync_sieve *item = sync_sieve_lookup(l, name);
 
-    for (item = l->head; item; item = item->next) {
-        if (!strcmp(item->name, name)) {
-            item->active = 1;
-            break;
-        }
-    }
+    if (item) item->active = 1;
 }
 
 void sync_sieve_list_free(struct sync_sieve_list **lp)
@@ -792,6 +780,7 @@ void sync_sieve_list_free(struct sync_sieve_list **lp)
 	free(current);
 	current = next;
     }
+    free_hash_table(&l->byname, NULL);
     free(l);
     *lp = NULL;
 }
@@ -1036,6 +1025,7 @@ struct sync_name_list *sync_name_list_create(void)
     l->tail = NULL;
     l->count = 0;
     l->marked = 0;
+    construct_hash_table(&l->byname, SYNC_LIST_HASH_SIZE, 0);
     return l;
 }
 
@@ -1055,19 +1045,16 @@ struct sync_name *sync_name_list_add(struct sync_name_list *l,
     item->name = xstrdup(name);
     item->mark = 0;
 
+    if (!hash_lookup(name, &l->byname))
+	hash_insert(name, item, &l->byname);
+
     return item;
 }
 
 struct sync_name *sync_name_lookup(struct sync_name_list *l,
 					const char *name)
 {
-    struct sync_name *p;
-
-    for (p = l->head; p; p = p->next)
-	if (!strcmp(p->name, name))
-	    return p;
-
-    return NULL;
+    return (struct sync_name *) hash_lookup(name, &l->byname);
 }
 
 void sync_name_list_free(struct sync_name_list **lp)
@@ -1081,6 +1068,7 @@ void sync_name_list_free(struct sync_name_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&(*lp)->byname, NULL);
     free(*lp);
     *lp = NULL;
 }
@@ -1093,6 +1081,7 @@ struct sync_seen_list *sync_seen_list_create(void)
     l->head = NULL;
     l->tail = NULL;
     l->count = 0;
+    construct_hash_table(&l->byid, SYNC_LIST_HASH_SIZE, 0);
     return l;
 }
 
@@ -1118,19 +1107,16 @@ struct sync_seen *sync_seen_list_add(struct sync_seen_list *l,
     item->sd.seenuids = xstrdup(seenuids);
     item->mark = 0;
 
+    if (!hash_lookup(uniqueid, &l->byid))
+	hash_insert(uniqueid, item, &l->byid);
+
     return item;
 }
 
 struct sync_seen *sync_seen_list_lookup(struct sync_seen_list *l,
 					const char *uniqueid)
 {
-    struct sync_seen *p;
-
-    for (p = l->head; p; p = p->next)
-	if (!strcmp(p->uniqueid, uniqueid))
-	    return p;
-
-    return NULL;
+    return (struct sync_seen *) hash_lookup(uniqueid, &l->byid);
 }
 
 void sync_seen_list_free(struct sync_seen_list **lp)
@@ -1145,6 +1131,7 @@ void sync_seen_list_free(struct sync_seen_list **lp)
 	free(current);
 	current = next;
     }
+    free_hash_table(&(*lp)->byid, NULL);
     free(*lp);
     *lp = NULL;
 }
@@ -1209,25 +1196,39 @@ struct sync_action_list *sync_action_list_create(void)
     l->head   = NULL;
     l->tail   = NULL;
     l->count  = 0;
+    construct_hash_table(&l->bykey, SYNC_LIST_HASH_SIZE, 0);
 
     return(l);
 }
 
+/* Each action list is always given the same one of name, user or both,
+ * so they make a key between them.  Neither has a tab in it. */
+static const char *sync_action_key(struct buf *key,
+				   const char *name, const char *user)
+{
+    buf_reset(key);
+    if (name) buf_appendcstr(key, name);
+    buf_putc(key, '\t');
+    if (user) buf_appendcstr(key, user);
+
+    return buf_cstring(key);
+}
+
 void sync_action_list_add(struct sync_action_list *l,
 			  const char *name, const char *user)
 {
     struct sync_action *current;
+    struct buf key = BUF_INITIALIZER;
 
     if (!name && !user) return;
 
-    for (current = l->head ; current ; current = current->next) {
-        if ((!name || (current->name && !strcmp(current->name, name))) &&
-	    (!user || (current->user && !strcmp(current->user, user)))) {
-	    current->active = 1;  /* Make sure active */
-	    return;
-	} else {
-	    /* name and/or user don't match current: no match possible */
-	}
+    sync_action_key(&key, name, user);
+
+    current = hash_lookup(key.s, &l->bykey);
+    if (current) {
+	current->active = 1;  /* Make sure active */
+	buf_free(&key);
+	return;
     }
 
     current           = xzmalloc(sizeof(struct sync_action));
@@ -1243,6 +1244,9 @@ void sync_action_list_add(struct sync_action_list *l,
 
     l->count++;
 
+    hash_insert(key.s, current, &l->bykey);
+    buf_free(&key);
+
 }
 
 void sync_action_list_free(struct sync_action_list **lp)
@@ -1260,6 +1264,7 @@ void sync_action_list_free(struct sync_action_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&l->bykey, NULL);
     free(l);
     *lp = NULL;
 }
@@ -49,12 +49,14 @@
 #define INCLUDED_SYNC_SUPPORT_H
 
 #include "dlist.h"
+#include "hash.h"
 #include "prot.h"
 #include "mailbox.h"
 
 #define SYNC_MSGID_LIST_HASH_SIZE        (65536)
 #define SYNC_MESSAGE_LIST_HASH_SIZE      (65536)
 #define SYNC_MESSAGE_LIST_MAX_OPEN_FILES (64)
+#define SYNC_LIST_HASH_SIZE              (64)	/* they grow as needed */
 
 int sync_eatlines_unsolicited(struct protstream *pin, int c);
 
@@ -159,6 +161,7 @@ struct sync_folder {
 struct sync_folder_list {
     struct sync_folder *head, *tail;
     unsigned long count;
+    hash_table byid;		/* by uniqueid */
 };
 
 struct sync_folder_list *sync_folder_list_create(void);
@@ -203,6 +206,7 @@ struct sync_rename_list {
     struct sync_rename *head, *tail;
     unsigned long count;
     unsigned long done;
+    hash_table byname;		/* by oldname */
 };
 
 struct sync_rename_list *sync_rename_list_create(void);
@@ -231,6 +235,7 @@ struct sync_quota_list {
     struct sync_quota *head, *tail;
     unsigned long count;
     unsigned long done;
+    hash_table byroot;
 };
 
 struct sync_quota_list *sync_quota_list_create(void);
@@ -258,6 +263,7 @@ struct sync_name_list {
     struct sync_name *head, *tail;
     unsigned long count;
     unsigned long marked;
+    hash_table byname;
 };
 
 struct sync_name_list *sync_name_list_create(void);
@@ -283,6 +289,7 @@ struct sync_seen {
 struct sync_seen_list {
     struct sync_seen *head, *tail;
     unsigned long count;
+    hash_table byid;		/* by uniqueid */
 };
 
 struct sync_seen_list *sync_seen_list_create(void);
@@ -313,6 +320,7 @@ struct sync_sieve_list {
     struct sync_sieve *head;
     struct sync_sieve *tail;
     unsigned long count;
+    hash_table byname;
 };
 
 struct sync_sieve_list *sync_sieve_list_create(void);
@@ -377,6 +385,7 @@ struct sync_action {
 struct sync_action_list {
     struct sync_action *head, *tail;
     unsigned long count;
+    hash_table bykey;		/* by sync_action_key() */
 };
 
 struct sync_action_list *sync_action_list_create(void);
@@ -105,6 +105,7 @@
 /* System library. */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -118,6 +119,9 @@
 #include <openssl/pem.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 /* Application-specific. */
 #include "assert.h"
@@ -130,12 +134,25 @@
 /* Session caching/reuse stuff */
 #include "global.h"
 #include "cyrusdb.h"
+#include "shmcache.h"
+#include "ticketkeys.h"
 
 #define DB (config_tlscache_db) /* sessions are binary -> MUST use DB3 */
 
 static struct db *sessdb = NULL;
 static int sess_dbopen = 0;
 
+/* or, for tls_session_cache: shared */
+static struct shmcache *sesscache = NULL;
+#define SESSCACHE_MAXDATA 2048	/* bigger sessions aren't cached */
+
+/* tls_session_tickets, as last read from the file master writes */
+static char *ticket_fname = NULL;
+static struct ticketkey ticket_keys[TICKETKEY_MAX];
+static int ticket_nkeys = 0;
+static ino_t ticket_ino = 0;
+static time_t ticket_mtime = 0;
+
 enum {
     var_imapd_tls_loglevel = 0,
     var_proxy_tls_loglevel = 0,
@@ -445,7 +462,7 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
 
     assert(sess);
 
-    if (!sess_dbopen) return 0;
+    if (!sess_dbopen && !sesscache) return 0;
 
     /* find the size of the ASN1 representation of the session */
     len = i2d_SSL_SESSION(sess, NULL);
@@ -465,7 +482,13 @@ static int new_session_cb(SSL *ssl __attribute__((unused)),
     expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
     memcpy(data, &expire, sizeof(time_t));
 
-    if (len) {
+    if (len && sesscache) {
+	/* the shared cache keeps the expire time itself */
+	ret = shmcache_store(sesscache, (const char *) sess->session_id,
+			     sess->session_id_length,
+			     (const char *) data + sizeof(time_t), len, expire);
+    }
+    else if (len) {
 	/* store the session in our database */
 	do {
 	    ret = cyrusdb_store(sessdb, (const char *) sess->session_id,
@@ -500,11 +523,15 @@ static void remove_session(unsigned char *id, int idlen)
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
     
-    if (!sess_dbopen) return;
-
-    do {
-	ret = cyrusdb_delete(sessdb, (const char *) id, idlen, NULL, 1);
-    } while (ret == CYRUSDB_AGAIN);
+    if (sesscache) {
+	ret = shmcache_delete(sesscache, (const char *) id, idlen);
+    }
+    else if (sess_dbopen) {
+	do {
+	    ret = cyrusdb_delete(sessdb, (const char *) id, idlen, NULL, 1);
+	} while (ret == CYRUSDB_AGAIN);
+    }
+    else return;
 
     /* log this transaction */
     if (var_imapd_tls_loglevel > 0) {
@@ -529,6 +556,37 @@ static void remove_session_cb(SSL_CTX *ctx __attribute__((unused)),
     remove_session(sess->session_id, sess->session_id_length);
 }
 
+/*
+ * Look up a session in the shared cache.  This takes no lock unless
+ * another process is storing into the same bucket at the time.
+ */
+static SSL_SESSION *get_shared_session(unsigned char *id, int idlen)
+{
+    struct buf data = BUF_INITIALIZER;
+    SSL_SESSION *sess = NULL;
+    int ret;
+
+    ret = shmcache_fetch(sesscache, (const char *) id, idlen,
+			 &data, time(0));
+    if (!ret) {
+	const unsigned char *asn = (const unsigned char *) data.s;
+	sess = d2i_SSL_SESSION(NULL, &asn, data.len);
+	if (!sess) syslog(LOG_ERR, "d2i_SSL_SESSION failed: %m");
+    }
+    buf_free(&data);
+
+    /* log this transaction */
+    if (var_imapd_tls_loglevel > 0) {
+	char idstr[SSL_MAX_SSL_SESSION_ID_LENGTH*2 + 1];
+
+	bin_to_hex(id, idlen, idstr, BH_UPPER);
+	syslog(LOG_DEBUG, "get TLS session: id=%s, status=%s",
+	       idstr, ret ? "not found" : "ok");
+    }
+
+    return sess;
+}
+
 /*
  * The get_session_cb() is only called on SSL/TLS servers with the
  * session id proposed by the client. The get_session_cb() is always
@@ -547,6 +605,10 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
     assert(id);
     assert(idlen <= SSL_MAX_SSL_SESSION_ID_LENGTH);
 
+    *copy = 0;
+
+    if (sesscache) return get_shared_session(id, idlen);
+
     if (!sess_dbopen) return NULL;
 
     do {
@@ -584,10 +646,65 @@ static SSL_SESSION *get_session_cb(SSL *ssl __attribute__((unused)),
 	       !data ? "not found" : expire < now ? "expired" : "ok");
     }
 
-    *copy = 0;
     return sess;
 }
 
+/*
+ * Session tickets.  The keys come from the file master replaces every
+ * tls_ticket_key_rotation minutes; we read it again whenever it has
+ * been replaced.  Tickets under the previous key are still taken, but
+ * are replaced with one under the current key.
+ */
+static void ticket_keys_refresh(void)
+{
+    struct stat sbuf;
+
+    if (stat(ticket_fname, &sbuf) == -1) {
+	ticket_nkeys = 0;
+	return;
+    }
+    if (sbuf.st_ino == ticket_ino && sbuf.st_mtime == ticket_mtime) return;
+
+    ticket_nkeys = ticketkeys_read(ticket_fname, ticket_keys);
+    if (ticket_nkeys < 0) ticket_nkeys = 0;
+    ticket_ino = sbuf.st_ino;
+    ticket_mtime = sbuf.st_mtime;
+}
+
+static int ticket_key_cb(SSL *ssl __attribute__((unused)),
+			 unsigned char key_name[16], unsigned char *iv,
+			 EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    int i;
+
+    ticket_keys_refresh();
+
+    if (enc) {
+	/* master hasn't made any keys yet: no ticket this time */
+	if (!ticket_nkeys) return 0;
+
+	if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0) return -1;
+	memcpy(key_name, ticket_keys[0].name, TICKETKEY_NAMELEN);
+	EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL,
+			   ticket_keys[0].aes, iv);
+	HMAC_Init_ex(hctx, ticket_keys[0].hmac, TICKETKEY_SECRETLEN,
+		     EVP_sha256(), NULL);
+	return 1;
+    }
+
+    for (i = 0; i < ticket_nkeys; i++) {
+	if (!memcmp(key_name, ticket_keys[i].name, TICKETKEY_NAMELEN)) break;
+    }
+    /* a ticket from before the last rotation but one */
+    if (i == ticket_nkeys) return 0;
+
+    HMAC_Init_ex(hctx, ticket_keys[i].hmac, TICKETKEY_SECRETLEN,
+		 EVP_sha256(), NULL);
+    EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, ticket_keys[i].aes, iv);
+
+    return i ? 2 : 1;
+}
+
 /*
  * Seed the random number generator.
  */
@@ -690,25 +807,50 @@ int     tls_init_serverengine(const char *ident,
 	SSL_CTX_sess_set_remove_cb(s_ctx, remove_session_cb);
 	SSL_CTX_sess_set_get_cb(s_ctx, get_session_cb);
 
-	fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
-
-	/* create the name of the db file */
-	if (!fname) {
-	    tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
-	    fname = tofree;
+	if (config_getenum(IMAPOPT_TLS_SESSION_CACHE) ==
+	    IMAP_ENUM_TLS_SESSION_CACHE_SHARED) {
+	    /* shmcache_open() logs its own errors */
+	    tofree = strconcat(config_dir, FNAME_TLSSESSIONS_SHM, (char *)NULL);
+	    shmcache_open(tofree,
+			  config_getint(IMAPOPT_TLS_SESSION_CACHE_ENTRIES),
+			  SESSCACHE_MAXDATA, &sesscache);
 	}
+	else {
+	    fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
 
-	r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sessdb);
-	if (r != 0) {
-	    syslog(LOG_ERR, "DBERROR: opening %s: %s",
-		   fname, cyrusdb_strerror(ret));
+	    /* create the name of the db file */
+	    if (!fname) {
+		tofree = strconcat(config_dir, FNAME_TLSSESSIONS, (char *)NULL);
+		fname = tofree;
+	    }
+
+	    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &sessdb);
+	    if (r != 0) {
+		syslog(LOG_ERR, "DBERROR: opening %s: %s",
+		       fname, cyrusdb_strerror(ret));
+	    }
+	    else
+		sess_dbopen = 1;
 	}
-	else
-	    sess_dbopen = 1;
 
 	free(tofree);
     }
 
+#ifdef SSL_CTX_set_tlsext_ticket_key_cb
+    if (timeout && config_getswitch(IMAPOPT_TLS_SESSION_TICKETS)) {
+	ticket_fname = strconcat(config_dir, FNAME_TICKETKEYS, (char *)NULL);
+	SSL_CTX_set_tlsext_ticket_key_cb(s_ctx, ticket_key_cb);
+    }
+    else
+#endif
+    {
+#ifdef SSL_OP_NO_TICKET
+	/* tickets under a key of OpenSSL's own making would only ever
+	   work with this one process */
+	SSL_CTX_set_options(s_ctx, SSL_OP_NO_TICKET);
+#endif
+    }
+
     cipher_list = config_getstring(IMAPOPT_TLS_CIPHER_LIST);
     if (!SSL_CTX_set_cipher_list(s_ctx, cipher_list)) {
 	syslog(LOG_ERR,"TLS server engine: cannot load cipher list '%s'",
@@ -1055,6 +1197,10 @@ int tls_shutdown_serverengine(void)
 	sessdb = NULL;
 	sess_dbopen = 0;
     }
+    if (sesscache) {
+	shmcache_close(sesscache);
+	sesscache = NULL;
+    }
 
     return 0;
 
@@ -1121,6 +1267,11 @@ int tls_prune_sessions(void)
     int ret;
     struct prunerock prock;
 
+    /* the shared cache makes room for itself */
+    if (config_getenum(IMAPOPT_TLS_SESSION_CACHE) ==
+	IMAP_ENUM_TLS_SESSION_CACHE_SHARED)
+	return 0;
+
     fname = config_getstring(IMAPOPT_TLSCACHE_DB_PATH);
 
    /* create the name of the db file */
@@ -55,6 +55,9 @@ int tls_enabled(void);
 /* name of the SSL/TLS sessions database */
 #define FNAME_TLSSESSIONS "/tls_sessions.db"
 
+/* and of the table shared between processes instead */
+#define FNAME_TLSSESSIONS_SHM "/tls_sessions.shm"
+
 #ifdef HAVE_SSL
 
 #include <openssl/ssl.h>
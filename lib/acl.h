@@ -114,6 +114,25 @@ extern char *cyrus_acl_masktostr(int acl, char *str);
  */
 extern int cyrus_acl_myrights(struct auth_state *auth_state, const char *acl);
 
+/* an ACL parsed by cyrus_acl_compile(), for checking many times over */
+struct cyrus_acl;
+
+/*  cyrus_acl_compile(acl)
+ * Parse the ACL string 'acl' (which may be NULL) into a form which
+ * cyrus_acl_rights() can check without parsing it again.  Free it with
+ * cyrus_acl_free().
+ */
+extern struct cyrus_acl *cyrus_acl_compile(const char *acl);
+extern void cyrus_acl_free(struct cyrus_acl **caclp);
+
+/*  cyrus_acl_rights(auth_state, cacl)
+ * As cyrus_acl_myrights(), for an ACL from cyrus_acl_compile().  Answers
+ * about the user's identifiers are remembered for 'auth_state', so checking
+ * the same user again is cheap.
+ */
+extern int cyrus_acl_rights(struct auth_state *auth_state,
+			    const struct cyrus_acl *cacl);
+
 /*  cyrus_acl_set(acl, identifier, mode, access, canonproc, canonrock) Modify the
  * ACL pointed to by 'acl' to modify the rights granted to
  * 'identifier' as specified by 'mode' and the set specified in the
@@ -98,6 +98,95 @@ int cyrus_acl_myrights(struct auth_state *auth_state, const char *origacl)
 
     return acl_positive & ~acl_negative;
 }
+
+struct cyrus_acl_entry {
+    const char *id;
+    int negative;
+    int rights;
+};
+
+struct cyrus_acl {
+    char *buf;			/* the identifiers point into this */
+    int count;
+    struct cyrus_acl_entry *entries;
+};
+
+/*
+ * Parse the ACL string 'acl' once, for checking with cyrus_acl_rights()
+ * as often as we like.
+ */
+struct cyrus_acl *cyrus_acl_compile(const char *acl)
+{
+    struct cyrus_acl *cacl = xzmalloc(sizeof(struct cyrus_acl));
+    char *thisid, *rights, *nextid;
+    int alloc = 0;
+
+    cacl->buf = xstrdup(acl ? acl : "");
+
+    for (thisid = cacl->buf; *thisid; thisid = nextid) {
+	struct cyrus_acl_entry *entry;
+
+	rights = strchr(thisid, '\t');
+	if (!rights) break;
+	*rights++ = '\0';
+
+	nextid = strchr(rights, '\t');
+	if (!nextid) break;
+	*nextid++ = '\0';
+
+	if (cacl->count == alloc) {
+	    alloc = alloc ? alloc * 2 : 8;
+	    cacl->entries = xrealloc(cacl->entries,
+				     alloc * sizeof(struct cyrus_acl_entry));
+	}
+	entry = &cacl->entries[cacl->count++];
+
+	entry->negative = (*thisid == '-');
+	if (entry->negative) thisid++;
+	entry->id = thisid;
+	entry->rights = cyrus_acl_strtomask(rights);
+    }
+
+    return cacl;
+}
+
+void cyrus_acl_free(struct cyrus_acl **caclp)
+{
+    struct cyrus_acl *cacl = *caclp;
+
+    if (!cacl) return;
+
+    free(cacl->buf);
+    free(cacl->entries);
+    free(cacl);
+
+    *caclp = NULL;
+}
+
+/*
+ * Calculate the set of rights the user in 'auth_state' has in the
+ * compiled ACL 'cacl'.
+ */
+int cyrus_acl_rights(struct auth_state *auth_state,
+		     const struct cyrus_acl *cacl)
+{
+    long acl_positive = 0, acl_negative = 0;
+    int i;
+
+    for (i = 0; i < cacl->count; i++) {
+	const struct cyrus_acl_entry *entry = &cacl->entries[i];
+	long *acl_ptr = entry->negative ? &acl_negative : &acl_positive;
+
+	/* nothing to learn from asking */
+	if ((*acl_ptr & entry->rights) == entry->rights) continue;
+
+	if (auth_memberof_memo(auth_state, entry->id)) {
+	    *acl_ptr |= entry->rights;
+	}
+    }
+
+    return acl_positive & ~acl_negative;
+}
 	
 /*
  * Modify the ACL pointed to by 'acl' to make the rights granted to
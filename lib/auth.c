@@ -47,6 +47,7 @@
 
 #include "auth.h"
 #include "exitcodes.h"
+#include "hash.h"
 #include "libcyr_cfg.h"
 #include "xmalloc.h"
 
@@ -106,9 +107,95 @@ struct auth_state *auth_newstate(const char *identifier)
     return auth->newstate(identifier);
 }
 
+/*
+ * Memo of auth_memberof() answers, one per auth_state, so that checking
+ * the same identifiers against the same user over and over (as LIST and
+ * STATUS on lots of mailboxes do) is a table lookup rather than another
+ * search of the user's groups.  Only auth_memberof_memo() uses it.
+ */
+
+/* past this many identifiers, just ask for the rest each time */
+#define AUTH_MEMO_MAX 16384
+
+/* what the memo holds for each identifier; hash_lookup() returns NULL
+ * for the ones it doesn't know yet */
+static char memo_no, memo_yes;
+
+struct auth_memo {
+    struct auth_state *auth_state;
+    hash_table table;
+    struct auth_memo *next;
+};
+
+static struct auth_memo *memos = NULL;
+
+static struct auth_memo *memo_find(struct auth_state *auth_state)
+{
+    struct auth_memo **prevp, *memo;
+
+    for (prevp = &memos; (memo = *prevp); prevp = &memo->next) {
+	if (memo->auth_state == auth_state) {
+	    /* keep the one in use at the front */
+	    *prevp = memo->next;
+	    break;
+	}
+    }
+
+    if (!memo) {
+	memo = xzmalloc(sizeof(struct auth_memo));
+	memo->auth_state = auth_state;
+	construct_hash_table(&memo->table, 64, 1);
+    }
+
+    memo->next = memos;
+    memos = memo;
+
+    return memo;
+}
+
+int auth_memberof_memo(struct auth_state *auth_state,
+		       const char *identifier)
+{
+    struct auth_memo *memo = memos;
+    const char *seen;
+    int member;
+
+    if (!memo || memo->auth_state != auth_state)
+	memo = memo_find(auth_state);
+
+    seen = hash_lookup(identifier, &memo->table);
+    if (seen) return seen == &memo_yes;
+
+    member = auth_memberof(auth_state, identifier);
+    if (memo->table.count < AUTH_MEMO_MAX)
+	hash_insert(identifier, member ? &memo_yes : &memo_no, &memo->table);
+
+    return member;
+}
+
 void auth_freestate(struct auth_state *auth_state)
 {
     struct auth_mech *auth = auth_fromname();
+    struct auth_memo **prevp, *memo;
+
+    /* its address may be reused for somebody else */
+    for (prevp = &memos; (memo = *prevp); prevp = &memo->next) {
+	if (memo->auth_state == auth_state) {
+	    *prevp = memo->next;
+	    free_hash_table(&memo->table, NULL);
+	    free(memo);
+	    break;
+	}
+    }
 
     if (auth_state) auth->freestate(auth_state);
 }
+
+strarray_t *auth_groups(struct auth_state *auth_state)
+{
+    struct auth_mech *auth = auth_fromname();
+
+    if (!auth->groups) return NULL;
+
+    return auth->groups(auth_state);
+}
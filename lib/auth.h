@@ -45,6 +45,8 @@
 #ifndef INCLUDED_AUTH_H
 #define INCLUDED_AUTH_H
 
+#include "strarray.h"
+
 struct auth_state;
 
 struct auth_mech {
@@ -55,6 +57,7 @@ struct auth_mech {
              const char *identifier);
     struct auth_state *(*newstate)(const char *identifier);
     void (*freestate)(struct auth_state *auth_state);
+    strarray_t *(*groups)(struct auth_state *auth_state);
 };
 
 extern struct auth_mech *auth_mechs[];
@@ -78,4 +81,14 @@ int auth_memberof(struct auth_state *auth_state,
 struct auth_state *auth_newstate(const char *identifier);
 void auth_freestate(struct auth_state *auth_state);
 
+/* auth_memberof_memo: as auth_memberof, but remembers the answer for
+ *                     next time */
+int auth_memberof_memo(struct auth_state *auth_state,
+		       const char *identifier);
+
+/* auth_groups: return the identifiers of the groups the user is a
+ *              member of, for the caller to free, or NULL if the
+ *              mechanism has no fixed list of them */
+strarray_t *auth_groups(struct auth_state *auth_state);
+
 #endif /* INCLUDED_AUTH_H */
@@ -373,4 +373,5 @@ struct auth_mech auth_krb =
     &mymemberof,
     &mynewstate,
     &myfreestate,
+    NULL,		/* groups can be wildcards, so can't be listed */
 };
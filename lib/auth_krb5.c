@@ -233,6 +233,13 @@ static void myfreestate(
 
 #endif
 
+/* a krb5 identity is only ever a member of itself */
+static strarray_t *mygroups(
+    struct auth_state *auth_state __attribute__((unused)))
+{
+    return strarray_new();
+}
+
 struct auth_mech auth_krb5 = 
 {
     "krb5",		/* name */
@@ -241,4 +248,5 @@ struct auth_mech auth_krb5 =
     &mymemberof,
     &mynewstate,
     &myfreestate,
+    &mygroups,
 };
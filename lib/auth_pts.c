@@ -520,6 +520,20 @@ static void myfreestate(struct auth_state *auth_state)
     free(auth_state);
 }
 
+static strarray_t *mygroups(struct auth_state *auth_state)
+{
+    strarray_t *sa = strarray_new();
+    int i;
+
+    /* "anonymous" is not a member of any group */
+    if (!auth_state) return sa;
+
+    for (i = 0; i < auth_state->ngroups; i++)
+	strarray_append(sa, auth_state->groups[i].id);
+
+    return sa;
+}
+
 struct auth_mech auth_pts = 
 {
     "pts",		/* name */
@@ -528,4 +542,5 @@ struct auth_mech auth_pts =
     &mymemberof,
     &mynewstate,
     &myfreestate,
+    &mygroups,
 };
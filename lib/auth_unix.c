@@ -282,6 +282,20 @@ static void myfreestate(struct auth_state *auth_state)
     free(auth_state);
 }
 
+static strarray_t *mygroups(struct auth_state *auth_state)
+{
+    strarray_t *sa = strarray_new();
+    int i;
+
+    if (!auth_state) return sa;
+
+    for (i = 0; i < auth_state->groups.count; i++)
+	strarray_appendm(sa, strconcat("group:", auth_state->groups.data[i],
+				       (char *)NULL));
+
+    return sa;
+}
+
 
 struct auth_mech auth_unix = 
 {
@@ -291,4 +305,5 @@ struct auth_mech auth_unix =
     &mymemberof,
     &mynewstate,
     &myfreestate,
+    &mygroups,
 };
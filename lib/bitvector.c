@@ -0,0 +1,279 @@
+/* bitvector.c -- a growable vector of bits
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bitvector.h"
+#include <memory.h>
+#include "xmalloc.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define bytes_for(nbits)    (((nbits) + 7) / 8)
+#define WORDBITS	    (8 * sizeof(unsigned long))
+
+/*
+ * The combinators.  'n' is always a multiple of BV_QUANTUM bytes.
+ * When the compiler is allowed AVX2 or SSE2 we do a vector register
+ * at a time, otherwise a machine word at a time; bits are never
+ * handled singly.
+ */
+static void and_blocks(unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i;
+#if defined(__AVX2__)
+    for (i = 0; i < n; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+	__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+	_mm256_storeu_si256((__m256i *)(a + i), _mm256_and_si256(x, y));
+    }
+#elif defined(__SSE2__)
+    for (i = 0; i < n; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+	__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+	_mm_storeu_si128((__m128i *)(a + i), _mm_and_si128(x, y));
+    }
+#else
+    unsigned long *wa = (unsigned long *)a;
+    const unsigned long *wb = (const unsigned long *)b;
+    for (i = 0; i < n / sizeof(unsigned long); i++)
+	wa[i] &= wb[i];
+#endif
+}
+
+static void or_blocks(unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i;
+#if defined(__AVX2__)
+    for (i = 0; i < n; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+	__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+	_mm256_storeu_si256((__m256i *)(a + i), _mm256_or_si256(x, y));
+    }
+#elif defined(__SSE2__)
+    for (i = 0; i < n; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+	__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+	_mm_storeu_si128((__m128i *)(a + i), _mm_or_si128(x, y));
+    }
+#else
+    unsigned long *wa = (unsigned long *)a;
+    const unsigned long *wb = (const unsigned long *)b;
+    for (i = 0; i < n / sizeof(unsigned long); i++)
+	wa[i] |= wb[i];
+#endif
+}
+
+static void andnot_blocks(unsigned char *a, const unsigned char *b, size_t n)
+{
+    size_t i;
+#if defined(__AVX2__)
+    for (i = 0; i < n; i += 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+	__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+	_mm256_storeu_si256((__m256i *)(a + i), _mm256_andnot_si256(y, x));
+    }
+#elif defined(__SSE2__)
+    for (i = 0; i < n; i += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+	__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+	_mm_storeu_si128((__m128i *)(a + i), _mm_andnot_si128(y, x));
+    }
+#else
+    unsigned long *wa = (unsigned long *)a;
+    const unsigned long *wb = (const unsigned long *)b;
+    for (i = 0; i < n / sizeof(unsigned long); i++)
+	wa[i] &= ~wb[i];
+#endif
+}
+
+static unsigned int popcount(unsigned long w)
+{
+#ifdef __GNUC__
+    return __builtin_popcountl(w);
+#else
+    unsigned int c = 0;
+    for ( ; w ; w &= w - 1)
+	c++;
+    return c;
+#endif
+}
+
+/* zero everything from bit 'length' to the end of the storage */
+static void clear_tail(bitvector_t *bv)
+{
+    unsigned int byte = bv->length / 8;
+
+    if (byte >= bv->alloc)
+	return;
+    if (bv->length % 8)
+	bv->bits[byte++] &= (1 << (bv->length % 8)) - 1;
+    memset(bv->bits + byte, 0, bv->alloc - byte);
+}
+
+void bv_setsize(bitvector_t *bv, unsigned int len)
+{
+    unsigned int newalloc = bytes_for(len);
+
+    newalloc = ((newalloc + BV_QUANTUM-1) / BV_QUANTUM) * BV_QUANTUM;
+    if (newalloc > bv->alloc) {
+	bv->bits = xrealloc(bv->bits, newalloc);
+	memset(bv->bits + bv->alloc, 0, newalloc - bv->alloc);
+	bv->alloc = newalloc;
+    }
+
+    bv->length = len;
+    clear_tail(bv);
+}
+
+void bv_fini(bitvector_t *bv)
+{
+    if (!bv)
+	return;
+    free(bv->bits);
+    bv->bits = NULL;
+    bv->length = 0;
+    bv->alloc = 0;
+}
+
+void bv_set(bitvector_t *bv, unsigned int i)
+{
+    if (i >= bv->length)
+	bv_setsize(bv, i+1);
+    bv->bits[i/8] |= (1 << (i%8));
+}
+
+void bv_clear(bitvector_t *bv, unsigned int i)
+{
+    if (i < bv->length)
+	bv->bits[i/8] &= ~(1 << (i%8));
+}
+
+int bv_isset(const bitvector_t *bv, unsigned int i)
+{
+    if (i >= bv->length)
+	return 0;
+    return !!(bv->bits[i/8] & (1 << (i%8)));
+}
+
+void bv_setall(bitvector_t *bv)
+{
+    if (!bv->alloc)
+	return;
+    memset(bv->bits, 0xff, bv->alloc);
+    clear_tail(bv);
+}
+
+void bv_clearall(bitvector_t *bv)
+{
+    if (bv->alloc)
+	memset(bv->bits, 0, bv->alloc);
+}
+
+void bv_andeq(bitvector_t *a, const bitvector_t *b)
+{
+    unsigned int n = (a->alloc < b->alloc ? a->alloc : b->alloc);
+
+    and_blocks(a->bits, b->bits, n);
+    if (a->alloc > n)
+	memset(a->bits + n, 0, a->alloc - n);
+}
+
+void bv_oreq(bitvector_t *a, const bitvector_t *b)
+{
+    unsigned int n;
+
+    if (b->length > a->length)
+	bv_setsize(a, b->length);
+
+    /* b is all zero past a->alloc, so no need to go further */
+    n = (a->alloc < b->alloc ? a->alloc : b->alloc);
+    or_blocks(a->bits, b->bits, n);
+}
+
+void bv_andnoteq(bitvector_t *a, const bitvector_t *b)
+{
+    unsigned int n = (a->alloc < b->alloc ? a->alloc : b->alloc);
+
+    andnot_blocks(a->bits, b->bits, n);
+}
+
+unsigned int bv_count(const bitvector_t *bv)
+{
+    const unsigned long *w = (const unsigned long *)bv->bits;
+    unsigned int i;
+    unsigned int c = 0;
+
+    for (i = 0; i < bv->alloc / sizeof(unsigned long); i++)
+	c += popcount(w[i]);
+
+    return c;
+}
+
+int bv_next_set(const bitvector_t *bv, unsigned int start)
+{
+    unsigned int i = start;
+    unsigned char byte;
+
+    while (i < bv->length) {
+	byte = bv->bits[i/8] >> (i%8);
+	if (byte) {
+	    while (!(byte & 1)) {
+		byte >>= 1;
+		i++;
+	    }
+	    return i;
+	}
+	i = (i/8 + 1) * 8;
+
+	/* skip runs of empty words; everything past length is zero */
+	if (i % WORDBITS == 0) {
+	    while (i + WORDBITS <= bv->alloc * 8 &&
+		   !((const unsigned long *)bv->bits)[i / WORDBITS])
+		i += WORDBITS;
+	}
+    }
+
+    return -1;
+}
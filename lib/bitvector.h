@@ -0,0 +1,85 @@
+/* bitvector.h -- a growable vector of bits
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_BITVECTOR_H__
+#define __CYRUS_BITVECTOR_H__
+
+#include <config.h>
+#include <sys/types.h>
+
+/*
+ * Bit i lives in bits[i/8] at (1 << (i%8)), the same layout the
+ * search code has always used for its message vectors.  Storage is
+ * kept zero beyond 'length' and rounded up to whole BV_QUANTUM byte
+ * blocks, so the combinators can work a block at a time.
+ */
+typedef struct
+{
+    unsigned int length;	/* in bits */
+    unsigned int alloc;		/* in bytes */
+    unsigned char *bits;
+} bitvector_t;
+
+#define BITVECTOR_INITIALIZER	{ 0, 0, NULL }
+#define BV_QUANTUM		32
+
+extern void bv_setsize(bitvector_t *bv, unsigned int len);
+extern void bv_fini(bitvector_t *bv);
+
+extern void bv_set(bitvector_t *bv, unsigned int i);
+extern void bv_clear(bitvector_t *bv, unsigned int i);
+extern int bv_isset(const bitvector_t *bv, unsigned int i);
+
+extern void bv_setall(bitvector_t *bv);
+extern void bv_clearall(bitvector_t *bv);
+
+/* a &= b, a |= b and a &= ~b.  Bits past the end of the shorter
+ * vector count as zero; bv_oreq() grows 'a' to the length of 'b'. */
+extern void bv_andeq(bitvector_t *a, const bitvector_t *b);
+extern void bv_oreq(bitvector_t *a, const bitvector_t *b);
+extern void bv_andnoteq(bitvector_t *a, const bitvector_t *b);
+
+extern unsigned int bv_count(const bitvector_t *bv);
+/* returns the first set bit at or after 'start', or -1 */
+extern int bv_next_set(const bitvector_t *bv, unsigned int start);
+
+#endif /* __CYRUS_BITVECTOR_H__ */
@@ -46,6 +46,9 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "assert.h"
 #include "charset.h"
@@ -71,6 +74,7 @@ struct table_state {
     int codepoint;
     int mode;
     int num_bits;
+    int ascii_ok;	/* initial table maps ASCII to itself */
 };
 
 struct canon_state {
@@ -92,13 +96,48 @@ struct search_state {
     size_t offset;
 };
 
+/*
+ * Aho-Corasick automaton over the bytes of several search-form
+ * strings.  Bytes which don't appear in any pattern share class 0,
+ * so the transition table is only nstates * nclass entries.
+ */
+struct comp_multipat_s {
+    int npat;
+    int nstates;
+    int nclass;
+    unsigned short class[256];
+    int *delta;		/* next state, indexed by state * nclass + class */
+    int *out;		/* first pattern ending at each state, or -1 */
+    int *outnext;	/* next pattern ending at the same state, or -1 */
+    int *dict;		/* nearest proper suffix state with output, or -1 */
+};
+
+struct multisearch_state {
+    struct comp_multipat_s *pat;
+    int cur;
+    unsigned char *found;
+    int nleft;
+    int havematch;
+};
+
 struct convert_rock;
 
 typedef void convertproc_t(struct convert_rock *rock, int c);
+typedef void asciiproc_t(struct convert_rock *rock,
+			 const unsigned char *s, size_t n);
 typedef void freeconvert_t(struct convert_rock *rock);
 
+/*
+ * A conversion is a chain of these.  Every stage has 'f', which takes
+ * one character at a time.  Stages may also have 'fascii', which takes
+ * a whole run of characters below 0x80 - these are the same whether
+ * they're bytes or unicode code points - and should pass on as much
+ * of it as possible as runs in turn.  Plain text is mostly ASCII, so
+ * this avoids an indirect call per stage per byte for most input.
+ */
 struct convert_rock {
     convertproc_t *f;
+    asciiproc_t *fascii;
     freeconvert_t *cleanup;
     struct convert_rock *next;
     void *state;
@@ -106,6 +145,9 @@ struct convert_rock {
 
 #define GROWSIZE 100
 
+/* how much input to feed in one go between checks on the output */
+#define CONVERT_BLOCK 4096
+
 #define XX 127
 /*
  * Table for decoding hexadecimal in quoted-printable
@@ -158,22 +200,76 @@ static inline void convert_putc(struct convert_rock *rock, int c)
     rock->f(rock, c);
 }
 
-void convert_cat(struct convert_rock *rock, const char *s)
+/* feed a run of characters which are all below 0x80 */
+static inline void convert_ascii(struct convert_rock *rock,
+				 const unsigned char *s, size_t n)
 {
-    while (*s) {
-	convert_putc(rock, (unsigned char)*s);
-	s++;
+    if (!n)
+	return;
+
+    if (rock->fascii) {
+	rock->fascii(rock, s, n);
+	return;
     }
+
+    while (n-- > 0)
+	rock->f(rock, *s++);
+}
+
+/* length of the run of bytes at 's' with the high bit clear */
+static size_t ascii_span(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    while (i + 16 <= len) {
+	int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+	i += 16;
+    }
+#else
+    unsigned long w;
+    unsigned long high = ~0UL / 0xff * 0x80;	/* 0x8080...80 */
+
+    while (i + sizeof(w) <= len) {
+	memcpy(&w, s + i, sizeof(w));
+	if (w & high)
+	    break;
+	i += sizeof(w);
+    }
+#endif
+
+    while (i < len && !(s[i] & 0x80))
+	i++;
+
+    return i;
 }
 
 void convert_catn(struct convert_rock *rock, const char *s, size_t len)
 {
-    while (len-- > 0) {
-	convert_putc(rock, (unsigned char)*s);
-	s++;
+    const unsigned char *p = (const unsigned char *)s;
+    size_t n;
+
+    while (len > 0) {
+	n = ascii_span(p, len);
+	convert_ascii(rock, p, n);
+	p += n;
+	len -= n;
+
+	/* and a byte with the high bit set */
+	if (len > 0) {
+	    convert_putc(rock, *p++);
+	    len--;
+	}
     }
 }
 
+void convert_cat(struct convert_rock *rock, const char *s)
+{
+    convert_catn(rock, s, strlen(s));
+}
+
 /* convertproc_t conversion functions */
 
 void qp2byte(struct convert_rock *rock, int c) 
@@ -522,6 +618,32 @@ void byte2search(struct convert_rock *rock, int c)
     s->offset++;
 }
 
+static void multisearch_report(struct multisearch_state *s, int state)
+{
+    int i;
+
+    for ( ; state != -1; state = s->pat->dict[state]) {
+	for (i = s->pat->out[state]; i != -1; i = s->pat->outnext[i]) {
+	    if (!s->found[i]) {
+		s->found[i] = 1;
+		s->nleft--;
+	    }
+	}
+    }
+
+    if (!s->nleft) s->havematch = 1;
+}
+
+void byte2multisearch(struct convert_rock *rock, int c)
+{
+    struct multisearch_state *s = (struct multisearch_state *)rock->state;
+    struct comp_multipat_s *pat = s->pat;
+
+    s->cur = pat->delta[s->cur * pat->nclass + pat->class[c & 0xff]];
+    if (pat->out[s->cur] != -1 || pat->dict[s->cur] != -1)
+	multisearch_report(s, s->cur);
+}
+
 void byte2buffer(struct convert_rock *rock, int c)
 {
     struct buf *buf = (struct buf *)rock->state;
@@ -529,6 +651,259 @@ void byte2buffer(struct convert_rock *rock, int c)
     buf_putc(buf, c & 0xff);
 }
 
+/* asciiproc_t run conversion functions.  Each one must leave its state
+ * exactly as the matching convertproc_t would have done. */
+
+static void qp2byte_ascii(struct convert_rock *rock,
+			  const unsigned char *s, size_t n)
+{
+    struct qp_state *st = (struct qp_state *)rock->state;
+    size_t i;
+
+    while (n > 0) {
+	/* escapes, and anything inside one, go the slow way */
+	if (st->bytesleft || *s == '=' || (st->isheader && *s == '_')) {
+	    qp2byte(rock, *s++);
+	    n--;
+	    continue;
+	}
+
+	for (i = 1; i < n; i++) {
+	    if (s[i] == '=' || (st->isheader && s[i] == '_'))
+		break;
+	}
+	convert_ascii(rock->next, s, i);
+	s += i;
+	n -= i;
+    }
+}
+
+static void b64_2byte_ascii(struct convert_rock *rock,
+			    const unsigned char *s, size_t n)
+{
+    struct b64_state *st = (struct b64_state *)rock->state;
+    char out[1024];
+    size_t outlen = 0;
+    char b;
+
+    for ( ; n > 0; s++, n--) {
+	b = CHAR64(*s);
+
+	/* could just be whitespace, ignore it */
+	if (b == XX) continue;
+
+	switch (st->bytesleft) {
+	case 0:
+	    st->codepoint = b;
+	    st->bytesleft = 3;
+	    continue;
+	case 3:
+	    out[outlen++] = ((st->codepoint << 2) | (b >> 4)) & 0xff;
+	    st->codepoint = b;
+	    st->bytesleft = 2;
+	    break;
+	case 2:
+	    out[outlen++] = ((st->codepoint << 4) | (b >> 2)) & 0xff;
+	    st->codepoint = b;
+	    st->bytesleft = 1;
+	    break;
+	case 1:
+	    out[outlen++] = ((st->codepoint << 6) | b) & 0xff;
+	    st->codepoint = 0;
+	    st->bytesleft = 0;
+	}
+
+	if (outlen == sizeof(out)) {
+	    convert_catn(rock->next, out, outlen);
+	    outlen = 0;
+	}
+    }
+
+    convert_catn(rock->next, out, outlen);
+}
+
+static void stripnl2uni_ascii(struct convert_rock *rock,
+			      const unsigned char *s, size_t n)
+{
+    size_t i;
+
+    while (n > 0) {
+	for (i = 0; i < n && s[i] != '\r' && s[i] != '\n'; i++);
+	convert_ascii(rock->next, s, i);
+	if (i < n) i++;	/* drop the newline */
+	s += i;
+	n -= i;
+    }
+}
+
+static void table2uni_ascii(struct convert_rock *rock,
+			    const unsigned char *s, size_t n)
+{
+    struct table_state *st = (struct table_state *)rock->state;
+    size_t i;
+
+    while (n > 0) {
+	/* a table which does something to ASCII, or we're part way
+	 * through a multibyte character */
+	if (!st->ascii_ok || st->curtable != st->initialtable) {
+	    table2uni(rock, *s++);
+	    n--;
+	    continue;
+	}
+
+	/* ASCII passes through unchanged, except NUL which is dropped */
+	for (i = 0; i < n && s[i]; i++);
+	convert_ascii(rock->next, s, i);
+	if (i < n) i++;
+	s += i;
+	n -= i;
+    }
+}
+
+static void utf8_2uni_ascii(struct convert_rock *rock,
+			    const unsigned char *s, size_t n)
+{
+    struct table_state *st = (struct table_state *)rock->state;
+
+    /* ASCII always passes through, and ends any partial sequence */
+    st->bytesleft = 0;
+    st->codepoint = 0;
+    convert_ascii(rock->next, s, n);
+}
+
+/*
+ * Search form of each ASCII character: 0 to drop it, a character below
+ * 0x80, or -1 if it needs the full uni2searchform() treatment.  Built
+ * from the translation tables on first use.
+ */
+static short canon_ascii[128];
+static int canon_ascii_ready;
+
+static void canon_ascii_init(void)
+{
+    unsigned char table16, table8;
+    int c, code;
+
+    table16 = chartables_translation_block16[0];
+    table8 = (table16 == 255) ? 255 : chartables_translation_block8[table16][0];
+
+    for (c = 0; c < 128; c++) {
+	if (table8 == 255) {
+	    /* untranslated characters skip the whitespace handling */
+	    canon_ascii[c] = -1;
+	    continue;
+	}
+	code = chartables_translation[table8][c];
+	canon_ascii[c] = (code >= 0 && code < 0x80) ? code : -1;
+    }
+
+    canon_ascii_ready = 1;
+}
+
+static void uni2searchform_ascii(struct convert_rock *rock,
+				 const unsigned char *s, size_t n)
+{
+    struct canon_state *st = (struct canon_state *)rock->state;
+    unsigned char out[1024];
+    size_t outlen = 0;
+    int code;
+
+    if (!canon_ascii_ready)
+	canon_ascii_init();
+
+    for ( ; n > 0; s++, n--) {
+	code = canon_ascii[*s];
+
+	if (code < 0) {
+	    /* keep the output in order */
+	    convert_ascii(rock->next, out, outlen);
+	    outlen = 0;
+	    uni2searchform(rock, *s);
+	    continue;
+	}
+
+	if (code == 0)
+	    continue;
+
+	if (code == ' ' || code == '\r' || code == '\n') {
+	    if (st->flags & CHARSET_SKIPSPACE)
+		continue;
+	    if (st->flags & CHARSET_MERGESPACE) {
+		if (st->seenspace)
+		    continue;
+		st->seenspace = 1;
+		code = ' ';
+	    }
+	}
+	else
+	    st->seenspace = 0;
+
+	out[outlen++] = code;
+	if (outlen == sizeof(out)) {
+	    convert_ascii(rock->next, out, outlen);
+	    outlen = 0;
+	}
+    }
+
+    convert_ascii(rock->next, out, outlen);
+}
+
+static void uni2utf8_ascii(struct convert_rock *rock,
+			   const unsigned char *s, size_t n)
+{
+    /* UTF-8 for ASCII is ASCII */
+    convert_ascii(rock->next, s, n);
+}
+
+static void byte2search_ascii(struct convert_rock *rock,
+			      const unsigned char *s, size_t n)
+{
+    struct search_state *st = (struct search_state *)rock->state;
+    const unsigned char *p;
+
+    while (n > 0 && !st->havematch) {
+	/* with no partial matches on the go, skip straight to the
+	 * next place one could start */
+	if (st->starts[0] == -1) {
+	    p = memchr(s, st->substr[0], n);
+	    if (!p) {
+		st->offset += n;
+		return;
+	    }
+	    st->offset += p - s;
+	    n -= p - s;
+	    s = p;
+	}
+
+	byte2search(rock, *s++);
+	n--;
+    }
+}
+
+static void byte2multisearch_ascii(struct convert_rock *rock,
+				   const unsigned char *s, size_t n)
+{
+    struct multisearch_state *st = (struct multisearch_state *)rock->state;
+    const struct comp_multipat_s *pat = st->pat;
+    int cur = st->cur;
+
+    for ( ; n > 0 && !st->havematch; s++, n--) {
+	cur = pat->delta[cur * pat->nclass + pat->class[*s]];
+	if (pat->out[cur] != -1 || pat->dict[cur] != -1)
+	    multisearch_report(st, cur);
+    }
+
+    st->cur = cur;
+}
+
+static void byte2buffer_ascii(struct convert_rock *rock,
+			      const unsigned char *s, size_t n)
+{
+    struct buf *buf = (struct buf *)rock->state;
+
+    buf_appendmap(buf, (const char *)s, n);
+}
+
 /* convert_rock manipulation routines */
 
 void table_switch(struct convert_rock *rock, int charset_num)
@@ -540,20 +915,34 @@ void table_switch(struct convert_rock *rock, int charset_num)
 
     /* it's a table based lookup */
     if (chartables_charset_table[charset_num].table) {
+	const struct charmap *map;
+	int c;
+
 	/* set up the initial table */
 	state->curtable = state->initialtable
 	    = chartables_charset_table[charset_num].table;
 	rock->f = table2uni;
+	rock->fascii = table2uni_ascii;
+
+	/* can runs of ASCII go straight through? */
+	map = state->initialtable[0];
+	state->ascii_ok = (map[0].c == 0 && map[0].next == 0);
+	for (c = 1; c < 128 && state->ascii_ok; c++) {
+	    if (map[c].c != (unsigned) c || map[c].next != 0)
+		state->ascii_ok = 0;
+	}
     }
 
     /* special case UTF-8 */
     else if (strstr(chartables_charset_table[charset_num].name, "utf-8")) {
 	rock->f = utf8_2uni;
+	rock->fascii = utf8_2uni_ascii;
     }
 
     /* special case UTF-7 */
     else if (strstr(chartables_charset_table[charset_num].name, "utf-7")) {
 	rock->f = utf7_2uni;
+	rock->fascii = NULL;
     }
 
     /* should never happen */
@@ -579,6 +968,12 @@ static inline int search_havematch(struct convert_rock *rock)
     return s->havematch;
 }
 
+static inline int multisearch_havematch(struct convert_rock *rock)
+{
+    struct multisearch_state *s = (struct multisearch_state *)rock->state;
+    return s->havematch;
+}
+
 /* conversion cleanup routines */
 
 void basic_free(struct convert_rock *rock) 
@@ -628,6 +1023,7 @@ struct convert_rock *qp_init(int isheader, struct convert_rock *next)
     s->isheader = isheader;
     rock->state = (void *)s;
     rock->f = qp2byte;
+    rock->fascii = qp2byte_ascii;
     rock->next = next;
     return rock;
 }
@@ -637,6 +1033,7 @@ struct convert_rock *b64_init(struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->state = xzmalloc(sizeof(struct b64_state));
     rock->f = b64_2byte;
+    rock->fascii = b64_2byte_ascii;
     rock->next = next;
     return rock;
 }
@@ -645,6 +1042,7 @@ struct convert_rock *stripnl_init(struct convert_rock *next)
 {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->f = stripnl2uni;
+    rock->fascii = stripnl2uni_ascii;
     rock->next = next;
     return rock;
 }
@@ -655,6 +1053,7 @@ struct convert_rock *canon_init(int flags, struct convert_rock *next)
     struct canon_state *s = xzmalloc(sizeof(struct canon_state));
     s->flags = flags;
     rock->f = uni2searchform;
+    rock->fascii = uni2searchform_ascii;
     rock->state = s;
     rock->next = next;
     return rock;
@@ -664,6 +1063,7 @@ struct convert_rock *uni_init(struct convert_rock *next)
 {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->f = uni2utf8;
+    rock->fascii = uni2utf8_ascii;
     rock->next = next;
     return rock;
 }
@@ -696,18 +1096,42 @@ struct convert_rock *search_init(const char *substr, comp_pat *pat) {
 
     /* set up the rock */
     rock->f = byte2search;
+    rock->fascii = byte2search_ascii;
     rock->cleanup = search_free;
     rock->state = (void *)s;
 
     return rock;
 }
 
+static struct convert_rock *multisearch_init(comp_multipat *pat,
+					     unsigned char *found)
+{
+    struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
+    struct multisearch_state *s = xzmalloc(sizeof(struct multisearch_state));
+    int i;
+
+    s->pat = (struct comp_multipat_s *)pat;
+    s->found = found;
+    for (i = 0; i < s->pat->npat; i++) {
+	if (!found[i]) s->nleft++;
+    }
+    /* empty patterns match straight away */
+    multisearch_report(s, 0);
+
+    rock->f = byte2multisearch;
+    rock->fascii = byte2multisearch_ascii;
+    rock->state = (void *)s;
+
+    return rock;
+}
+
 static struct convert_rock *buffer_init(void)
 {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     struct buf *buf = xzmalloc(sizeof(struct buf));
 
     rock->f = byte2buffer;
+    rock->fascii = byte2buffer_ascii;
     rock->cleanup = buffer_free;
     rock->state = (void *)buf;
 
@@ -995,6 +1419,34 @@ int charset_search_mimeheader(const char *substr, comp_pat *pat,
     return res;
 }
 
+/*
+ * As charset_search_mimeheader, but for all the strings compiled into
+ * 'pat' at once.  See charset_searchfile_multi for 'found'.
+ */
+int charset_search_mimeheader_multi(comp_multipat *pat, unsigned char *found,
+				    const char *s, int flags)
+{
+    struct convert_rock *input, *tosearch;
+    int res;
+
+    tosearch = multisearch_init(pat, found);
+    if (multisearch_havematch(tosearch)) {
+	convert_free(tosearch);
+	return 1;
+    }
+
+    input = uni_init(tosearch);
+    input = canon_init(flags, input);
+
+    mimeheader_cat(input, s);
+
+    res = multisearch_havematch(tosearch);
+
+    convert_free(input);
+
+    return res;
+}
+
 /* Compile a search pattern for later comparison.  We just count
  * how long the string is, and how many times the first character
  * occurs.  Later optimisation could reduce the max_start by
@@ -1035,6 +1487,7 @@ int charset_searchstring(const char *substr, comp_pat *pat,
     struct convert_rock *tosearch;
     struct convert_rock *input;
     int charset = charset_lookupname("utf-8");
+    size_t n;
     int res;
 
     if (!substr[0])
@@ -1049,8 +1502,11 @@ int charset_searchstring(const char *substr, comp_pat *pat,
     input = table_init(charset, input);
 
     /* feed the handler */
-    while (len-- > 0) {
-	convert_putc(input, (unsigned char)*s++);
+    while (len > 0) {
+	n = len < CONVERT_BLOCK ? len : CONVERT_BLOCK;
+	convert_catn(input, s, n);
+	s += n;
+	len -= n;
 	if (search_havematch(tosearch)) break; /* shortcut if there's a match */
     }
 
@@ -1064,30 +1520,21 @@ int charset_searchstring(const char *substr, comp_pat *pat,
 }
 
 /*
- * Search for the string 'substr' in the next 'len' bytes of 
- * 'msg_base'.  
- * 'charset' and 'encoding' specify the character set and 
- * content transfer encoding of the data, respectively.
- * Returns nonzero iff the string was found.
+ * Feed the next 'len' bytes of 'msg_base', in character set 'charset'
+ * and content transfer encoding 'encoding', through to the search
+ * target 'tosearch', stopping as soon as 'havematch' says so.  Frees
+ * the conversion path.  Returns nonzero iff there was a match.
  */
-int charset_searchfile(const char *substr, comp_pat *pat,
+static int search_file(struct convert_rock *tosearch,
+		       int (*havematch)(struct convert_rock *),
 		       const char *msg_base, size_t len,
 		       int charset, int encoding, int flags)
 {
-    struct convert_rock *input, *tosearch;
-    size_t i;
+    struct convert_rock *input;
+    size_t i, n;
     int res;
 
-    /* Initialize character set mapping */
-    if (charset < 0 || charset >= chartables_num_charsets) 
-	return 0;
-
-    /* check for trivial search */
-    if (strlen(substr) == 0)
-	return 1;
-
     /* set up the conversion path */
-    tosearch = search_init(substr, pat);
     input = uni_init(tosearch);
     input = canon_init(flags, input);
     input = table_init(charset, input);
@@ -1114,19 +1561,157 @@ int charset_searchfile(const char *substr, comp_pat *pat,
 	return 0;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-	convert_putc(input, msg_base[i]);
-	if (search_havematch(tosearch)) break;
+    /* implement the loop here so we can check on the search each block */
+    for (i = 0; i < len; i += n) {
+	n = len - i < CONVERT_BLOCK ? len - i : CONVERT_BLOCK;
+	convert_catn(input, msg_base + i, n);
+	if (havematch(tosearch)) break;
     }
 
-    res = search_havematch(tosearch); /* copy before we free it */
+    res = havematch(tosearch); /* copy before we free it */
 
     convert_free(input);
 
     return res;
 }
 
+/*
+ * Search for the string 'substr' in the next 'len' bytes of 
+ * 'msg_base'.  
+ * 'charset' and 'encoding' specify the character set and 
+ * content transfer encoding of the data, respectively.
+ * Returns nonzero iff the string was found.
+ */
+int charset_searchfile(const char *substr, comp_pat *pat,
+		       const char *msg_base, size_t len,
+		       int charset, int encoding, int flags)
+{
+    /* Initialize character set mapping */
+    if (charset < 0 || charset >= chartables_num_charsets) 
+	return 0;
+
+    /* check for trivial search */
+    if (strlen(substr) == 0)
+	return 1;
+
+    return search_file(search_init(substr, pat), search_havematch,
+		       msg_base, len, charset, encoding, flags);
+}
+
+/*
+ * Compile the 'npat' strings in 'pats', which must already be in
+ * search normal form, for searching all at once.
+ */
+comp_multipat *charset_compilemultipat(const char **pats, int npat)
+{
+    struct comp_multipat_s *pat = xzmalloc(sizeof(struct comp_multipat_s));
+    const unsigned char *p;
+    int *fail, *queue;
+    int i, c, r, s, maxstates, head, tail;
+
+    pat->npat = npat;
+
+    /* give each byte used in a pattern its own class */
+    pat->nclass = 1;
+    maxstates = 1;
+    for (i = 0; i < npat; i++) {
+	for (p = (const unsigned char *)pats[i]; *p; p++) {
+	    if (!pat->class[*p]) pat->class[*p] = pat->nclass++;
+	    maxstates++;
+	}
+    }
+
+    pat->delta = xmalloc(maxstates * pat->nclass * sizeof(int));
+    pat->out = xmalloc(maxstates * sizeof(int));
+    pat->dict = xmalloc(maxstates * sizeof(int));
+    pat->outnext = xmalloc((npat ? npat : 1) * sizeof(int));
+    for (i = 0; i < maxstates * pat->nclass; i++) pat->delta[i] = -1;
+    for (i = 0; i < maxstates; i++) pat->out[i] = pat->dict[i] = -1;
+
+    /* build the trie */
+    pat->nstates = 1;
+    for (i = 0; i < npat; i++) {
+	s = 0;
+	for (p = (const unsigned char *)pats[i]; *p; p++) {
+	    int *next = &pat->delta[s * pat->nclass + pat->class[*p]];
+	    if (*next == -1) *next = pat->nstates++;
+	    s = *next;
+	}
+	pat->outnext[i] = pat->out[s];
+	pat->out[s] = i;
+    }
+
+    /* breadth first, fill in the missing transitions from each
+     * state's longest proper suffix, and link to the nearest suffix
+     * which completes a pattern */
+    fail = xmalloc(pat->nstates * sizeof(int));
+    queue = xmalloc(pat->nstates * sizeof(int));
+    fail[0] = 0;
+    head = tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+	r = queue[head++];
+	for (c = 0; c < pat->nclass; c++) {
+	    s = pat->delta[r * pat->nclass + c];
+	    if (s == -1) {
+		pat->delta[r * pat->nclass + c] =
+		    r ? pat->delta[fail[r] * pat->nclass + c] : 0;
+		continue;
+	    }
+	    fail[s] = r ? pat->delta[fail[r] * pat->nclass + c] : 0;
+	    pat->dict[s] = pat->out[fail[s]] != -1 ? fail[s] : pat->dict[fail[s]];
+	    queue[tail++] = s;
+	}
+    }
+    free(fail);
+    free(queue);
+
+    return (comp_multipat *)pat;
+}
+
+/*
+ * Free the compiled multiple pattern 'pat'
+ */
+void charset_freemultipat(comp_multipat *pat)
+{
+    struct comp_multipat_s *p = (struct comp_multipat_s *)pat;
+
+    if (!p) return;
+
+    free(p->delta);
+    free(p->out);
+    free(p->outnext);
+    free(p->dict);
+    free(p);
+}
+
+/*
+ * Search for all the strings compiled into 'pat' in the next 'len'
+ * bytes of 'msg_base', in a single pass.  found[i] is set for each
+ * pattern i which is seen; entries already set are left alone, and
+ * the search stops early once every entry is set.  Returns nonzero
+ * iff all the patterns have been found.
+ */
+int charset_searchfile_multi(comp_multipat *pat, unsigned char *found,
+			     const char *msg_base, size_t len,
+			     int charset, int encoding, int flags)
+{
+    struct convert_rock *tosearch;
+
+    /* Initialize character set mapping */
+    if (charset < 0 || charset >= chartables_num_charsets) 
+	return 0;
+
+    tosearch = multisearch_init(pat, found);
+    if (multisearch_havematch(tosearch)) {
+	convert_free(tosearch);
+	return 1;
+    }
+
+    return search_file(tosearch, multisearch_havematch,
+		       msg_base, len, charset, encoding, flags);
+}
+
 /* This is based on charset_searchfile above. */
 int charset_extractitem(index_search_text_receiver_t receiver,
 			void *rock, int uid,
@@ -1136,7 +1721,7 @@ int charset_extractitem(index_search_text_receiver_t receiver,
 {
     struct convert_rock *input, *tobuffer;
     struct buf *out;
-    size_t i;
+    size_t i, n;
 
     /* Initialize character set mapping */
     if (charset < 0 || charset >= chartables_num_charsets) 
@@ -1172,8 +1757,9 @@ int charset_extractitem(index_search_text_receiver_t receiver,
     /* point to the buffer for easy block sending */
     out = (struct buf *)tobuffer->state;
 
-    for (i = 0; i < len; i++) {
-	convert_putc(input, msg_base[i]);
+    for (i = 0; i < len; i += n) {
+	n = len - i < CONVERT_BLOCK ? len - i : CONVERT_BLOCK;
+	convert_catn(input, msg_base + i, n);
 
 	/* process a block of output every so often */
 	if (buf_len(out) > 4096) {
@@ -56,6 +56,7 @@
 #define CHARSET_UNKNOWN_CHARSET (-1)
 
 typedef int comp_pat;
+typedef int comp_multipat;
 typedef int charset_index;
 
 /* ensure up to MAXTRANSLATION times expansion into buf */
@@ -81,6 +82,17 @@ extern char *charset_encode_mimebody(const char *msg_base, size_t len,
 extern char *charset_to_utf8(const char *msg_base, size_t len, charset_index charset, int encoding);
 extern int charset_search_mimeheader(const char *substr, comp_pat *pat, const char *s, int flags);
 
+/* search for several strings in one pass over the data */
+extern comp_multipat *charset_compilemultipat(const char **pats, int npat);
+extern void charset_freemultipat(comp_multipat *pat);
+extern int charset_searchfile_multi(comp_multipat *pat, unsigned char *found,
+				    const char *msg_base, size_t len,
+				    charset_index charset, int encoding,
+				    int flags);
+extern int charset_search_mimeheader_multi(comp_multipat *pat,
+					   unsigned char *found,
+					   const char *s, int flags);
+
 /* Definitions for charset_extractfile */
 
 /* These constants are passed into the index_search_text_receiver_t callback to
@@ -73,7 +73,8 @@ enum cyrusdb_dbflags {
 enum cyrusdb_openflags {
     CYRUSDB_CREATE   = 0x01,	/* Create the database if not existant */
     CYRUSDB_MBOXSORT = 0x02,	/* Use mailbox sort order ('.' sorts 1st) */
-    CYRUSDB_CONVERT  = 0x04	/* Convert to the named format if not already */
+    CYRUSDB_CONVERT  = 0x04,	/* Convert to the named format if not already */
+    CYRUSDB_GROUPCOMMIT = 0x08	/* Sync the end of a commit outside the lock */
 };
 
 typedef int foreach_p(void *rock,
@@ -181,6 +181,9 @@ struct dbengine {
 
     /* comparator function to use for sorting */
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    /* sync the commit record after dropping the lock */
+    int groupcommit;
 };
 
 struct db_list {
@@ -807,6 +810,7 @@ static int myopen(const char *fname, int flags, struct dbengine **ret)
     db->fd = -1;
     db->fname = xstrdup(fname);
     db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox : compare_signed;
+    db->groupcommit = (flags & CYRUSDB_GROUPCOMMIT) ? 1 : 0;
 
     db->fd = open(fname, O_RDWR, 0644);
     if (db->fd == -1 && errno == ENOENT) {
@@ -1438,6 +1442,7 @@ static int mydelete(struct dbengine *db,
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     uint32_t commitrectype = htonl(COMMIT);
+    int synclater = 0;
     int r = 0;
 
     assert(db && tid);
@@ -1474,8 +1479,14 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     lseek(tid->syncfd, tid->logend, SEEK_SET);
     retry_write(tid->syncfd, (char *) &commitrectype, 4);
 
+    if (db->groupcommit && !use_osync &&
+	tid->logend <= (2 * db->logstart + SKIPLIST_MINREWRITE)) {
+	/* recovery copes with the commit record going missing, so
+	   other writers needn't wait while it gets to disk */
+	synclater = 1;
+    }
     /* fsync if we're not using O_SYNC writes */
-    if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+    else if (!use_osync && DO_FSYNC && (fdatasync(db->fd) < 0)) {
 	syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
 	r = CYRUSDB_IOERROR;
         goto done;
@@ -1508,6 +1519,12 @@ static int mycommit(struct dbengine *db, struct txn *tid)
         if ((r = unlock(db)) < 0) {
             return r;
         }
+
+        /* still not acknowledged until it's on disk */
+        if (synclater && DO_FSYNC && (fdatasync(db->fd) < 0)) {
+	    syslog(LOG_ERR, "IOERROR: writing %s: %m", db->fname);
+	    r = CYRUSDB_IOERROR;
+        }
         
         /* must close this after releasing the lock */
         closesyncfd(db, tid);
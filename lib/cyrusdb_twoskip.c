@@ -255,6 +255,32 @@
  * more reliable than just using the inode, because inodes
  * can be reused.
  *
+ * LOCK FREE READS:
+ * Between checkpoints the file is only appended to, and the only
+ * records rewritten in place are those whose pointers are changed
+ * to point to new records past "current_size".  So a reader which
+ * takes "current_size" as the end of the file and ignores any
+ * pointer past it sees the database exactly as of the last commit -
+ * the same rule recovery uses.  A record head read while it's being
+ * rewritten fails its CRC.  If twoskip_lockfree_reads is set, reads
+ * outside a transaction skip the lock when the header says the file
+ * is clean, check the header again when they're done, and go back and
+ * read under the lock if it has changed at all (every transaction
+ * dirties it, and every commit changes "current_size" and so the
+ * header CRC) or anything else looked wrong.  A dirty file, whether
+ * a writer is busy or one has died, is read under the lock, which
+ * runs recovery if it's needed.
+ *
+ * GROUP COMMIT:
+ * Once the data and COMMIT record are synced, the clean header is
+ * the only thing left for a commit to sync, and until it's on disk
+ * a crash just means recovery throws away a transaction nobody was
+ * told had succeeded.  So a database opened with CYRUSDB_GROUPCOMMIT
+ * writes the header, drops the lock and only then syncs it, letting
+ * the next writer start straight away.  Either that writer's own
+ * dirty header sync or ours gets it to disk, and commit still
+ * doesn't return until it's there.
+ *
  * LOCATION OPTIMISATION:
  * If the generation is unchanged AND the size of the file
  * is unchanged, then all offsets stored in the skiploc are
@@ -392,6 +418,11 @@ struct dbengine {
     int txn_num;
     struct txn *current_txn;
 
+    /* reading without a lock, and has 'loc' been set by such a read? */
+    int lockfree;
+    int loc_lockfree;
+    uint32_t lockfree_crc;	/* of the header the read started with */
+
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -821,11 +852,18 @@ static int _getloc(struct dbengine *db, struct skiprecord *record,
 
     if (level) {
 	*outloc = record->nextloc[level + 1];
+	/* past the snapshot - just drop down a level */
+	if (db->lockfree && *outloc >= db->end)
+	    *outloc = 0;
 	return 0;
     }
 
     offset = _getzero(db, record);
 
+    /* someone has committed since we started reading */
+    if (db->lockfree && offset >= db->end)
+	return CYRUSDB_AGAIN;
+
     /* obviously not a delete! */
     if (!offset) {
 	*outloc = offset;
@@ -1244,6 +1282,92 @@ static int read_lock(struct dbengine *db)
     return 0;
 }
 
+/* start reading the last committed state of the database without a
+ * lock.  Fails if it can't, and the caller should take a read lock */
+static int lockfree_begin(struct dbengine *db)
+{
+    uint32_t crc;
+    int r;
+
+    r = mappedfile_refresh(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    /* the header may be being rewritten right now */
+    if (_size(db) < HEADER_SIZE) return CYRUSDB_AGAIN;
+    crc = ntohl(*((uint32_t *)(_base(db) + OFFSET_CRC32)));
+    if (crc32_map(_base(db), OFFSET_CRC32) != crc) return CYRUSDB_AGAIN;
+
+    r = read_header(db);
+    if (r) return r;
+
+    /* a writer is busy or died part way through, let the lock sort it */
+    if (!db_is_clean(db)) return CYRUSDB_AGAIN;
+
+    db->lockfree = 1;
+    db->loc_lockfree = 1;
+    db->lockfree_crc = crc;
+
+    return 0;
+}
+
+/* is what we read since lockfree_begin() still the committed state?
+ * Any transaction or checkpoint since then changes the header */
+static int lockfree_end(struct dbengine *db)
+{
+    char buf[HEADER_SIZE];
+    uint32_t crc;
+    ssize_t n;
+
+    db->lockfree = 0;
+
+    n = mappedfile_pread(db->mf, buf, HEADER_SIZE, 0);
+    if (n != HEADER_SIZE) return CYRUSDB_AGAIN;
+
+    crc = ntohl(*((uint32_t *)(buf + OFFSET_CRC32)));
+    if (crc32_map(buf, OFFSET_CRC32) != crc) return CYRUSDB_AGAIN;
+
+    /* the crc covers every field, so it moves with each commit, and
+     * with the dirty flag as soon as a transaction starts */
+    if (crc != db->lockfree_crc ||
+	ntohll(*((uint64_t *)(buf + OFFSET_GENERATION)))
+	    != db->header.generation ||
+	ntohll(*((uint64_t *)(buf + OFFSET_CURRENT_SIZE)))
+	    != db->header.current_size ||
+	(ntohl(*((uint32_t *)(buf + OFFSET_FLAGS))) & DIRTY))
+	return CYRUSDB_AGAIN;
+
+    return 0;
+}
+
+/* start a read outside of a transaction, lock free if we can */
+static int read_begin(struct dbengine *db, int lockfree)
+{
+    if (lockfree && libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_LOCKFREE_READS)
+	&& !lockfree_begin(db))
+	return 0;
+
+    return read_lock(db);
+}
+
+/* finish a read started with read_begin().  Returns CYRUSDB_AGAIN if
+ * it was lock free and 'r', the result of the read, can't be trusted */
+static int read_end(struct dbengine *db, int r)
+{
+    int r1;
+
+    if (db->lockfree) {
+	r1 = lockfree_end(db);
+	if (r1 || r == CYRUSDB_IOERROR || r == CYRUSDB_AGAIN)
+	    return CYRUSDB_AGAIN;
+	return r;
+    }
+
+    r1 = unlock(db);
+    if (r1) return r1;
+
+    return r;
+}
+
 static int newtxn(struct dbengine *db, struct txn **tidptr)
 {
     int r;
@@ -1255,6 +1379,13 @@ static int newtxn(struct dbengine *db, struct txn **tidptr)
     r = write_lock(db);
     if (r) return r;
 
+    /* a lock free read can leave back and forward locations which
+     * only made sense as of an older commit */
+    if (db->loc_lockfree) {
+	db->loc.generation = 0;
+	db->loc_lockfree = 0;
+    }
+
     /* create the transaction */
     db->txn_num++;
     db->current_txn = xmalloc(sizeof(struct txn));
@@ -1443,11 +1574,13 @@ static int myfetch(struct dbengine *db,
 	    const char **data, size_t *datalen,
 	    struct txn **tidptr, int fetchnext)
 {
+    int lockfree = 1;
     int r = 0;
 
     assert(db);
     if (datalen) assert(data);
 
+ retry:
     if (data) *data = NULL;
     if (datalen) *datalen = 0;
 
@@ -1465,8 +1598,8 @@ static int myfetch(struct dbengine *db,
 	    if (r) return r;
 	}
     } else {
-	/* grab a r lock */
-	r = read_lock(db);
+	/* grab a r lock, or don't need one */
+	r = read_begin(db, lockfree);
 	if (r) return r;
     }
 
@@ -1493,9 +1626,11 @@ static int myfetch(struct dbengine *db,
 done:
     if (!tidptr) {
 	/* release read lock */
-	int r1;
-	if ((r1 = unlock(db)) < 0) {
-	    return r1;
+	r = read_end(db, r);
+	if (r == CYRUSDB_AGAIN) {
+	    /* changed under us, read it again properly */
+	    lockfree = 0;
+	    goto retry;
 	}
     }
 
@@ -1515,6 +1650,8 @@ static int myforeach(struct dbengine *db,
     int need_unlock = 0;
     const char *val;
     size_t vallen;
+    struct buf lastkey = BUF_INITIALIZER;
+    int havelast = 0;
 
     assert(db);
     assert(cb);
@@ -1533,66 +1670,89 @@ static int myforeach(struct dbengine *db,
 	    if (r) return r;
 	}
     } else {
-	/* grab a r lock */
-	r = read_lock(db);
+	/* grab a r lock, or don't need one */
+	r = read_begin(db, 1);
 	if (r) return r;
 	need_unlock = 1;
     }
 
     r = find_loc(db, prefix, prefixlen);
-    if (r) goto done;
 
-    if (!db->loc.is_exactmatch) {
+    if (!r && !db->loc.is_exactmatch) {
 	/* advance to the first match */
 	r = advance_loc(db);
-	if (r) goto done;
     }
 
-    while (db->loc.is_exactmatch) {
-	/* does it match prefix? */
-	if (prefixlen) {
-	    if (db->loc.record.keylen < prefixlen) break;
-	    if (db->compar(_key(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
-	}
+    for (;;) {
+	while (!r && db->loc.is_exactmatch) {
+	    /* does it match prefix? */
+	    if (prefixlen) {
+		if (db->loc.record.keylen < prefixlen) break;
+		if (db->compar(_key(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
+	    }
 
-	val = _val(db, &db->loc.record);
-	vallen = db->loc.record.vallen;
+	    val = _val(db, &db->loc.record);
+	    vallen = db->loc.record.vallen;
 
-	if (!goodp || goodp(rock, db->loc.keybuf.s, db->loc.keybuf.len,
-				  val, vallen)) {
-	    if (!tidptr) {
-		/* release read lock */
-		r = unlock(db);
-		if (r) goto done;
-		need_unlock = 0;
-	    }
+	    if (!goodp || goodp(rock, db->loc.keybuf.s, db->loc.keybuf.len,
+				      val, vallen)) {
+		if (!tidptr) {
+		    /* release read lock */
+		    r = read_end(db, 0);
+		    need_unlock = 0;
+		    if (r) break;
+		}
+
+		/* make callback */
+		cb_r = cb(rock, db->loc.keybuf.s, db->loc.keybuf.len,
+				val, vallen);
+		if (cb_r) break;
 
-	    /* make callback */
-	    cb_r = cb(rock, db->loc.keybuf.s, db->loc.keybuf.len,
-			    val, vallen);
-	    if (cb_r) break;
+		if (!tidptr) {
+		    /* grab a r lock, or don't need one */
+		    r = read_begin(db, 1);
+		    if (r) break;
+		    need_unlock = 1;
+		}
+	    }
 
+	    /* remember where we got to, in case a lock free read
+	     * has to go back */
 	    if (!tidptr) {
-		/* grab a r lock */
-		r = read_lock(db);
-		if (r) goto done;
-		need_unlock = 1;
+		buf_copy(&lastkey, &db->loc.keybuf);
+		havelast = 1;
 	    }
+
+	    /* move to the next one */
+	    r = advance_loc(db);
 	}
 
-	/* move to the next one */
-	r = advance_loc(db);
-	if (r) goto done;
-    }
+	if (need_unlock) {
+	    /* release read lock */
+	    r = read_end(db, r);
+	    need_unlock = 0;
+	}
 
- done:
+	if (r != CYRUSDB_AGAIN) break;
 
-    if (need_unlock) {
-	/* release read lock */
-	int r1 = unlock(db);
-	if (r1) return r1;
+	/* the database changed while we were reading without a lock,
+	 * so carry on from the last record we were sure of, locked */
+	r = read_lock(db);
+	if (r) break;
+	need_unlock = 1;
+
+	if (havelast) {
+	    r = find_loc(db, lastkey.s, lastkey.len);
+	    if (!r) r = advance_loc(db);
+	}
+	else {
+	    r = find_loc(db, prefix, prefixlen);
+	    if (!r && !db->loc.is_exactmatch) r = advance_loc(db);
+	}
     }
 
+    buf_free(&lastkey);
+
     return r ? r : cb_r;
 }
 
@@ -1627,9 +1787,19 @@ static int skipwrite(struct dbengine *db,
     return 0;
 }
 
+/* is this commit going to leave a repack's worth of garbage? */
+static int need_checkpoint(struct dbengine *db)
+{
+    size_t diff = db->header.current_size - db->header.repack_size;
+
+    return (diff > MINREWRITE &&
+	    ((float)diff / (float)db->header.current_size) > REWRITE_RATIO);
+}
+
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord newrecord;
+    int unlocked = 0;
     int r = 0;
 
     assert(db);
@@ -1656,10 +1826,29 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     /* finally, update the header and commit again */
     db->header.current_size = db->end;
     db->header.flags &= ~DIRTY;
-    r = commit_header(db);
+    if ((db->open_flags & CYRUSDB_GROUPCOMMIT) && !need_checkpoint(db)) {
+	/* let the next writer in before we wait for the disk */
+	r = write_header(db);
+	if (r) goto done;
+	free(tid);
+	db->current_txn = NULL;
+	unlocked = 1;
+	r = mappedfile_unlock_commit(db->mf);
+	if (r) {
+	    syslog(LOG_ERR, "DBERROR: twoskip %s: header sync failed",
+		   _fname(db));
+	    r = CYRUSDB_IOERROR;
+	}
+    }
+    else {
+	r = commit_header(db);
+    }
 
  done:
-    if (r) {
+    if (unlocked) {
+	/* nothing left to abort: the transaction is already
+	 * visible to everyone else */
+    } else if (r) {
 	int r2;
 
 	/* error during commit; we must abort */
@@ -1670,9 +1859,7 @@ static int mycommit(struct dbengine *db, struct txn *tid)
 	}
     } else {
 	/* consider checkpointing */
-	size_t diff = db->header.current_size - db->header.repack_size;
-	if (diff > MINREWRITE &&
-	   ((float)diff / (float)db->header.current_size) > REWRITE_RATIO) {
+	if (need_checkpoint(db)) {
 	    int r2 = mycheckpoint(db);
 	    if (r2) {
 		syslog(LOG_NOTICE, "twoskip: failed to checkpoint %s: %m",
@@ -16,10 +16,6 @@
 /*
 ** public domain code by Jerry Coffin, with improvements by HenkJan Wolthuis.
 **
-** Tested with Visual C 1.0 and Borland C 3.1.
-** Compiles without warnings, and seems like it should be pretty
-** portable.
-**
 ** Modified for use with libcyrus by Ken Murchison.
 **  - prefixed functions with 'hash_' to avoid symbol clashing
 **  - use xmalloc() and xstrdup()
@@ -28,41 +24,161 @@
 **
 ** Further modified by Rob Siemborski.
 **  - xmalloc can never return NULL, so don't worry about it
-**  - sort the buckets for faster searching
-**  - actually, we'll just use a memory pool for this sucker
+**  - we'll just use a memory pool for the keys
 **    (atleast, in the cases where it is advantageous to do so)
+**
+** Since rewritten to use open addressing rather than chains.
+**  - one flat array of buckets, probed linearly, so a lookup touches
+**    consecutive memory rather than chasing a pointer per collision
+**  - each bucket keeps the hash of its key, so we only strcmp() keys
+**    which are likely to match, and never rehash a key when growing
+**  - the table doubles as it fills, so the size passed to
+**    construct_hash_table() is only a hint.  The old buckets are moved
+**    across a few at a time by later inserts, so no one insert pays
+**    for moving the whole table.
 */
 
-/* Initialize the hash_table to the size asked for.  Allocates space
-** for the correct number of pointers and sets them to NULL.  If it
-** can't allocate sufficient memory, signals error by setting the size
-** of the table to 0.
+/* a deleted bucket: probes carry on past it, inserts may reuse it */
+static char deleted_key[] = "";
+#define HASH_DELETED deleted_key
+
+#define BUCKET_INUSE(b) ((b)->key && (b)->key != HASH_DELETED)
+
+/* grow once live and deleted buckets fill this much of the table */
+#define HASH_LOAD(size) ((size) / 4 * 3)
+
+/* how many old buckets each insert moves into the new table.  A new
+ * table has room for at least a quarter of the old one's size in new
+ * keys before it fills, so this always empties the old one in time */
+#define HASH_DRAIN_STEP 16
+
+#define HASH_MIN_SIZE 16
+
+/* 32 bit FNV-1a.  strhash() only keeps the last 32 characters of a
+ * string, which puts mailbox names with a long common suffix in the
+ * same bucket, and that hurts open addressing much more than chains */
+unsigned hash_bytes(const char *s, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    unsigned hash = 2166136261U;
+
+    while (p < end) {
+	hash ^= *p++;
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+#define hash_string(key) hash_bytes((key), strlen(key))
+
+static size_t hash_roundup(size_t size)
+{
+    size_t n = HASH_MIN_SIZE;
+
+    while (n < size)
+	n <<= 1;
+
+    return n;
+}
+
+/* find the bucket holding 'key' in one array of buckets */
+static bucket *hash_find(bucket *buckets, size_t size,
+			 const char *key, unsigned hash)
+{
+    size_t mask = size - 1;
+    size_t i;
+
+    if (!buckets) return NULL;
+
+    for (i = hash & mask; buckets[i].key; i = (i + 1) & mask) {
+	if (buckets[i].hash == hash && buckets[i].key != HASH_DELETED &&
+	    !strcmp(buckets[i].key, key))
+	    return &buckets[i];
+    }
+
+    return NULL;
+}
+
+/* put a key which isn't in the table into the current array */
+static bucket *hash_place(hash_table *table, char *key, void *data,
+			  unsigned hash)
+{
+    size_t mask = table->size - 1;
+    size_t i;
+
+    for (i = hash & mask; BUCKET_INUSE(&table->table[i]); i = (i + 1) & mask);
+
+    if (!table->table[i].key) table->used++;
+
+    table->table[i].key = key;
+    table->table[i].data = data;
+    table->table[i].hash = hash;
+
+    return &table->table[i];
+}
+
+/* move up to 'n' buckets from the old array into the current one */
+static void hash_drain(hash_table *table, size_t n)
+{
+    while (table->old && n--) {
+	bucket *b = &table->old[table->oldpos++];
+
+	if (BUCKET_INUSE(b)) {
+	    hash_place(table, b->key, b->data, b->hash);
+	    b->key = HASH_DELETED;
+	}
+
+	if (table->oldpos == table->oldsize) {
+	    free(table->old);
+	    table->old = NULL;
+	    table->oldsize = 0;
+	    table->oldpos = 0;
+	}
+    }
+}
+
+static void hash_grow(hash_table *table)
+{
+    size_t size = table->size;
+
+    /* finish any previous move first, we only keep two arrays */
+    if (table->old)
+	hash_drain(table, table->oldsize);
+
+    /* if it's deleted buckets filling the table, just clean them out */
+    if (table->count >= size / 2)
+	size *= 2;
+
+    table->old = table->table;
+    table->oldsize = table->size;
+    table->oldpos = 0;
+
+    table->table = xzmalloc(size * sizeof(bucket));
+    table->size = size;
+    table->used = 0;
+}
+
+/* Initialize the hash_table with room for about the number of keys
+** asked for.  Inserting more just makes it grow.
 */
 
 hash_table *construct_hash_table(hash_table *table, size_t size, int use_mpool)
 {
-      assert(table);
-      assert(size);
-
-      table->size  = size;
-
-      /* Allocate the table -- different for using memory pools and not */
-      if(use_mpool) {
-	  /* Allocate an initial memory pool for 32 byte keys + the hash table
-	   * + the buckets themselves */
-	  table->pool =
-	      new_mpool(size * (32 + sizeof(bucket*) + sizeof(bucket)));
-	  table->table =
-	      (bucket **)mpool_malloc(table->pool,sizeof(bucket *) * size);
-      } else {
-	  table->pool = NULL;
-	  table->table = xmalloc(sizeof(bucket *) * size);
-      }
-       
-      /* Allocate the table and initilize it */
-      memset(table->table, 0, sizeof(bucket *) * size);
-
-      return table;
+    assert(table);
+    assert(size);
+
+    memset(table, 0, sizeof(hash_table));
+
+    table->size = hash_roundup(size + size / 3 + 1);
+    table->table = xzmalloc(table->size * sizeof(bucket));
+
+    /* Allocate an initial memory pool for 32 byte keys */
+    if (use_mpool)
+	table->pool = new_mpool(size * 32);
+
+    return table;
 }
 
 /*
@@ -73,79 +189,34 @@ hash_table *construct_hash_table(hash_table *table, size_t size, int use_mpool)
 
 void *hash_insert(const char *key, void *data, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
-      bucket *ptr, *newptr;
-      bucket **prev;
-
-      /*
-      ** NULL means this bucket hasn't been used yet.  We'll simply
-      ** allocate space for our new bucket and put our data there, with
-      ** the table pointing at it.
-      */
-      if (!((table->table)[val]))
-      {
-	  if(table->pool) {
-	      (table->table)[val] =
-		  (bucket *)mpool_malloc(table->pool, sizeof(bucket));
-	      (table->table)[val] -> key = mpool_strdup(table->pool, key);
-	  } else {
-	      (table->table)[val] = (bucket *)xmalloc(sizeof(bucket));
-	      (table->table)[val] -> key = xstrdup(key);
-	  }
-	  (table->table)[val] -> next = NULL;
-	  (table->table)[val] -> data = data;
-	  return (table->table)[val] -> data;
-      }
-
-      /*
-      ** This spot in the table is already in use.  See if the current string
-      ** has already been inserted, and if so, increment its count.
-      */
-      for (prev = &((table->table)[val]), ptr=(table->table)[val];
-	   ptr;
-	   prev=&(ptr->next),ptr=ptr->next) {
-	  int cmpresult = strcmp(key,ptr->key);
-	  if (!cmpresult) {
-	      /* Match! Replace this value and return the old */
-	      void *old_data;
-	      
-	      old_data = ptr->data;
-	      ptr -> data = data;
-	      return old_data;
-	  } else if (cmpresult < 0) {
-	      /* The new key is smaller than the current key--
-	       * insert a node and return this data */
-	      if(table->pool) {
-		  newptr = (bucket *)mpool_malloc(table->pool, sizeof(bucket));
-		  newptr->key = mpool_strdup(table->pool, key);
-	      } else {
-		  newptr = (bucket *)xmalloc(sizeof(bucket));
-		  newptr->key = xstrdup(key);
-	      }
-	      newptr->data = data;
-	      newptr->next = ptr;
-	      *prev = newptr;
-	      return data;
-	  }
-      }
-
-      /*
-      ** This key is the largest one so far.  Add it to the end
-      ** of the list (*prev should be correct)
-      */
-      if(table->pool) {
-	  newptr=(bucket *)mpool_malloc(table->pool,sizeof(bucket));
-	  newptr->key = mpool_strdup(table->pool,key);
-      } else {
-	  newptr=(bucket *)xmalloc(sizeof(bucket));
-	  newptr->key = xstrdup(key);
-      }
-      newptr->data = data;
-      newptr->next = NULL;
-      *prev = newptr;
-      return data;
-}
+    unsigned hash = hash_string(key);
+    bucket *b;
+    char *copy;
+
+    b = hash_find(table->table, table->size, key, hash);
+    if (!b) b = hash_find(table->old, table->oldsize, key, hash);
+
+    if (b) {
+	/* Match! Replace this value and return the old */
+	void *old_data = b->data;
+	b->data = data;
+	return old_data;
+    }
 
+    if (table->used + 1 > HASH_LOAD(table->size))
+	hash_grow(table);
+    hash_drain(table, HASH_DRAIN_STEP);
+
+    if (table->pool)
+	copy = mpool_strdup(table->pool, key);
+    else
+	copy = xstrdup(key);
+
+    hash_place(table, copy, data, hash);
+    table->count++;
+
+    return data;
+}
 
 /*
 ** Look up a key and return the associated data.  Returns NULL if
@@ -154,21 +225,13 @@ void *hash_insert(const char *key, void *data, hash_table *table)
 
 void *hash_lookup(const char *key, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
-      bucket *ptr;
-
-      if (!(table->table)[val])
-            return NULL;
-
-      for ( ptr = (table->table)[val];NULL != ptr; ptr = ptr->next )
-      {
-	  int cmpresult = strcmp(key, ptr->key);
-	  if (!cmpresult)
-	      return ptr->data;
-	  else if(cmpresult < 0) /* key < ptr->key -- we passed it */
-	      return NULL;
-      }
-      return NULL;
+    unsigned hash = hash_string(key);
+    bucket *b;
+
+    b = hash_find(table->table, table->size, key, hash);
+    if (!b) b = hash_find(table->old, table->oldsize, key, hash);
+
+    return b ? b->data : NULL;
 }
 
 /*
@@ -179,68 +242,22 @@ void *hash_lookup(const char *key, hash_table *table)
  * since it will leak memory until you get rid of the entire hash table */
 void *hash_del(const char *key, hash_table *table)
 {
-      unsigned val = strhash(key) % table->size;
-      void *data;
-      bucket *ptr, *last = NULL;
-
-      if (!(table->table)[val])
-            return NULL;
-
-      /*
-      ** Traverse the list, keeping track of the previous node in the list.
-      ** When we find the node to delete, we set the previous node's next
-      ** pointer to point to the node after ourself instead.  We then delete
-      ** the key from the present node, and return a pointer to the data it
-      ** contains.
-      */
-
-      for (last = NULL, ptr = (table->table)[val];
-            NULL != ptr;
-            last = ptr, ptr = ptr->next)
-      {
-	  int cmpresult = strcmp(key, ptr->key);
-	  if (!cmpresult)
-	  {
-	      if (last != NULL )
-	      {
-		  data = ptr -> data;
-		  last -> next = ptr -> next;
-		  if(!table->pool) {
-		      free(ptr->key);
-		      free(ptr);
-		  }
-		  return data;
-	      }
-	      
-	      /*
-	      ** If 'last' still equals NULL, it means that we need to
-	      ** delete the first node in the list. This simply consists
-	      ** of putting our own 'next' pointer in the array holding
-	      ** the head of the list.  We then dispose of the current
-	      ** node as above.
-	      */
-	      
-	      else
-	      {
-		  data = ptr->data;
-		  (table->table)[val] = ptr->next;
-		  if(!table->pool) {
-		      free(ptr->key);
-		      free(ptr);
-		  }
-		  return data;
-	      }
-	  } else if (cmpresult < 0) {
-	      /* its not here! */
-	      return NULL;
-	  }
-      }
-
-      /*
-      ** If we get here, it means we didn't find the item in the table.
-      ** Signal this by returning NULL.
-      */
-      return NULL;
+    unsigned hash = hash_string(key);
+    void *data;
+    bucket *b;
+
+    b = hash_find(table->table, table->size, key, hash);
+    if (!b) b = hash_find(table->old, table->oldsize, key, hash);
+    if (!b) return NULL;
+
+    /* 'key' may be the bucket's own copy, so don't look at it again */
+    data = b->data;
+    if (!table->pool) free(b->key);
+    b->key = HASH_DELETED;
+    b->data = NULL;
+    table->count--;
+
+    return data;
 }
 
 /*
@@ -251,66 +268,66 @@ void *hash_del(const char *key, hash_table *table)
 ** it.
 */
 
+static void free_buckets(hash_table *table, bucket *buckets, size_t size,
+			 void (*func)(void *))
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+	if (!BUCKET_INUSE(&buckets[i])) continue;
+	if (func)
+	    func(buckets[i].data);
+	if (!table->pool)
+	    free(buckets[i].key);
+    }
+
+    free(buckets);
+}
+
 void free_hash_table(hash_table *table, void (*func)(void *))
 {
-      unsigned i;
-      bucket *ptr, *temp;
-
-      /* If we have a function to free the data, apply it everywhere */
-      /* We also need to traverse this anyway if we aren't using a memory
-       * pool */
-      if(func || !table->pool) {
-	  for (i=0;i<table->size; i++)
-	  {
-	      ptr = (table->table)[i];
-	      while (ptr)
-	      {
-		  temp = ptr;
-		  ptr = ptr->next;
-		  if (func)
-		      func(temp->data);
-		  if(!table->pool) {
-		      free(temp->key);
-		      free(temp);
-		  }
-	      }
-	  }
-      }
-      
-      /* Free the main structures */
-      if(table->pool) {
-	  free_mpool(table->pool);
-	  table->pool = NULL;
-      } else {
-	  free(table->table);
-      }
-      table->table = NULL;
-      table->size = 0;
+    /* We only need to look at the buckets if there's data to free,
+     * or keys which aren't in the memory pool */
+    if (func || !table->pool) {
+	if (table->old)
+	    free_buckets(table, table->old, table->oldsize, func);
+	free_buckets(table, table->table, table->size, func);
+    }
+    else {
+	free(table->old);
+	free(table->table);
+    }
+
+    if (table->pool)
+	free_mpool(table->pool);
+
+    memset(table, 0, sizeof(hash_table));
 }
 
 /*
 ** Simply invokes the function given as the second parameter for each
 ** node in the table, passing it the key, the associated data and 'rock'.
+** The function may hash_del() the key it was passed, but must not
+** insert anything.
 */
 
+static void enumerate_buckets(bucket *buckets, size_t size,
+			      void (*func)(const char *, void *, void *),
+			      void *rock)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+	if (BUCKET_INUSE(&buckets[i]))
+	    func(buckets[i].key, buckets[i].data, rock);
+    }
+}
+
 void hash_enumerate(hash_table *table, void (*func)(const char *, void *, void *),
 		    void *rock)
 {
-      unsigned i;
-      bucket *temp, *temp_next;
-
-      for (i=0;i<table->size; i++)
-      {
-            if ((table->table)[i] != NULL)
-            {
-                  for (temp = (table->table)[i];
-                        NULL != temp;
-                        temp = temp_next)
-                  {
-			temp_next = temp->next;
-                        func(temp -> key, temp->data, rock);
-                  }
-            }
-      }
+    if (table->old)
+	enumerate_buckets(table->old, table->oldsize, func, rock);
+    if (table->table)
+	enumerate_buckets(table->table, table->size, func, rock);
 }
-
@@ -8,34 +8,40 @@
 #include "strhash.h"
 #include "mpool.h"
 
-#define HASH_TABLE_INITIALIZER {0, NULL, NULL}
+#define HASH_TABLE_INITIALIZER {0, 0, 0, NULL, NULL, NULL, 0, 0}
 
 /*
-** A hash table consists of an array of these buckets.  Each bucket
-** holds a copy of the key, a pointer to the data associated with the
-** key, and a pointer to the next bucket that collided with this one,
-** if there was one.
+** A hash table is an array of these buckets, and a key which hashes
+** to a bucket that's already taken goes in the next free one along.
+** Each bucket holds a copy of the key, its hash, and a pointer to the
+** data associated with the key.
 */
 
 typedef struct bucket {
     char *key;
     void *data;
-    struct bucket *next;
+    unsigned hash;
 } bucket;
 
 /*
 ** This is what you actually declare an instance of to create a table.
-** You then call 'construct_table' with the address of this structure,
-** and a guess at the size of the table.  Note that more nodes than this
-** can be inserted in the table, but performance degrades as this
-** happens.  Performance should still be quite adequate until 2 or 3
-** times as many nodes have been inserted as the table was created with.
+** You then call 'construct_hash_table' with the address of this
+** structure, and a guess at the number of keys.  The table grows as
+** needed, so the guess only saves some early resizing.
 */
 
 typedef struct hash_table {
-    size_t size;
-    bucket **table;
-    struct mpool *pool;
+    size_t size;		/* buckets in table, a power of two */
+    size_t count;		/* keys in the table */
+    size_t used;		/* buckets in table with a key, or deleted */
+    bucket *table;
+    struct mpool *pool;		/* for the keys, if asked for */
+
+    /* after growing, the previous buckets, which are moved
+     * across to the new ones a few at a time */
+    bucket *old;
+    size_t oldsize;
+    size_t oldpos;
 } hash_table;
 
 /*
@@ -94,4 +100,12 @@ void hash_enumerate(hash_table *table,void (*func)(const char *,void *,void *),
 
 void free_hash_table(hash_table *table, void (*func)(void *));
 
+/*
+** The hash the table uses for its keys, of the 'len' bytes at 's'.
+** It is good in every bit, so it can be masked or taken modulo
+** anything.
+*/
+
+unsigned hash_bytes(const char *s, size_t len);
+
 #endif /* HASH__H */
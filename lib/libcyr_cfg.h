@@ -116,6 +116,8 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Read twoskip databases without locking (OFF) */
+    CYRUSOPT_TWOSKIP_LOCKFREE_READS,
 
     CYRUSOPT_LAST
     
@@ -246,6 +246,57 @@ int mappedfile_readlock(struct mappedfile *mf)
     return 0;
 }
 
+/* Bring the map up to date with the file as it is now, reopening it
+ * if it's been replaced, but without taking a lock.  Only for callers
+ * which can detect for themselves that they read something while it
+ * was being written */
+int mappedfile_refresh(struct mappedfile *mf)
+{
+    struct stat sbuf, sbuffile;
+    int newfd;
+
+    assert(mf);
+    assert(mf->lock_status == MF_UNLOCKED);
+    assert(mf->fd != -1);
+    assert(!mf->dirty);
+
+    if (stat(mf->fname, &sbuffile) == -1) {
+	syslog(LOG_ERR, "IOERROR: stat %s: %m", mf->fname);
+	return -EIO;
+    }
+
+    if (fstat(mf->fd, &sbuf) == -1) {
+	syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+	return -EIO;
+    }
+
+    if (sbuf.st_ino != sbuffile.st_ino) {
+	newfd = open(mf->fname, O_RDWR, 0644);
+	if (newfd == -1) {
+	    syslog(LOG_ERR, "IOERROR: open %s: %m", mf->fname);
+	    return -EIO;
+	}
+
+	dup2(newfd, mf->fd);
+	close(newfd);
+
+	if (fstat(mf->fd, &sbuf) == -1) {
+	    syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+	    return -EIO;
+	}
+    }
+
+    if (mf->map_ino != sbuf.st_ino) {
+	mf->map_size = 0;
+	map_free(&mf->map_base, &mf->map_len);
+	mf->map_ino = sbuf.st_ino;
+    }
+
+    _ensure_mapped(mf, sbuf.st_size);
+
+    return 0;
+}
+
 int mappedfile_writelock(struct mappedfile *mf)
 {
     int r;
@@ -299,34 +350,101 @@ int mappedfile_unlock(struct mappedfile *mf)
     return 0;
 }
 
-int mappedfile_commit(struct mappedfile *mf)
+static int _sync(struct mappedfile *mf)
 {
-    assert(mf);
-    assert(mf->lock_status == MF_WRITELOCKED);
-    assert(mf->fd != -1);
-
-    if (!mf->dirty)
-	return 0; /* nice, nothing to do */
+    int r = 0;
 
     if (mf->was_resized) {
 	if (fsync(mf->fd) < 0) {
 	    syslog(LOG_ERR, "IOERROR: %s fsync: %m", mf->fname);
-	    return -EIO;
+	    r = -EIO;
 	}
     }
     else {
 	if (fdatasync(mf->fd) < 0) {
 	    syslog(LOG_ERR, "IOERROR: %s fdatasync: %m", mf->fname);
-	    return -EIO;
+	    r = -EIO;
 	}
     }
 
+    return r;
+}
+
+int mappedfile_commit(struct mappedfile *mf)
+{
+    assert(mf);
+    assert(mf->lock_status == MF_WRITELOCKED);
+    assert(mf->fd != -1);
+
+    if (!mf->dirty)
+	return 0; /* nice, nothing to do */
+
+    if (_sync(mf))
+	return -EIO;
+
     mf->dirty = 0;
     mf->was_resized = 0;
 
     return 0;
 }
 
+/* Release the write lock, and only then sync anything written under
+ * it.  Other writers can get on with their transactions while we wait
+ * for the disk, and the kernel can fold their syncs and ours together.
+ * Readers may see the data before it's durable, but we don't return
+ * until it is */
+int mappedfile_unlock_commit(struct mappedfile *mf)
+{
+    int r;
+    int dirty;
+
+    assert(mf);
+    assert(mf->lock_status == MF_WRITELOCKED);
+    assert(mf->fd != -1);
+
+    r = lock_unlock(mf->fd);
+    if (r < 0) {
+	syslog(LOG_ERR, "IOERROR: lock_unlock %s: %m", mf->fname);
+	return r;
+    }
+
+    mf->lock_status = MF_UNLOCKED;
+
+    /* the lock is gone, so there's no second chance at this sync:
+     * don't leave the file marked dirty whatever happens */
+    dirty = mf->dirty;
+    mf->dirty = 0;
+
+    if (dirty)
+	r = _sync(mf);
+
+    mf->was_resized = 0;
+
+    return r;
+}
+
+/* read straight from the file rather than the map, for when the map
+ * might be a copy */
+ssize_t mappedfile_pread(struct mappedfile *mf,
+			 char *base, size_t len,
+			 off_t offset)
+{
+    ssize_t n;
+
+    assert(mf);
+    assert(mf->fd != -1);
+    assert(base);
+
+    n = pread(mf->fd, base, len, offset);
+    if (n < 0) {
+	syslog(LOG_ERR, "IOERROR: %s read %llu bytes at %llX: %m",
+	       mf->fname, (long long unsigned int)len,
+	       (long long unsigned int)offset);
+    }
+
+    return n;
+}
+
 ssize_t mappedfile_pwrite(struct mappedfile *mf,
 			  const char *base, size_t len,
 			  off_t offset)
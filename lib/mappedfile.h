@@ -53,11 +53,16 @@ extern int mappedfile_open(struct mappedfile **mfp,
 			   const char *fname, int create);
 extern int mappedfile_close(struct mappedfile **mfp);
 
+extern int mappedfile_refresh(struct mappedfile *mf);
 extern int mappedfile_readlock(struct mappedfile *mf);
 extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
+extern int mappedfile_unlock_commit(struct mappedfile *mf);
+extern ssize_t mappedfile_pread(struct mappedfile *mf,
+				char *base, size_t len,
+				off_t offset);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
 				 const char *base, size_t len,
 				 off_t offset);
@@ -58,6 +58,9 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "assert.h"
 #include "exitcodes.h"
@@ -1215,6 +1218,165 @@ int prot_write(struct protstream *s, const char *buf, unsigned len)
     return 0;
 }
 
+/*
+ * Can data for 's' go straight to the descriptor without passing
+ * through the stream buffer?  Not if anything needs to see it on
+ * the way: the telemetry log, compression or a SASL security layer.
+ */
+static int prot_canbypass(struct protstream *s)
+{
+    if (s->writetobuf) return 0;
+    if (s->logfd != PROT_NO_FD) return 0;
+    if (s->saslssf != 0) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif
+    return 1;
+}
+
+/* Write 'len' bytes at 'buf' to the descriptor in big blocking writes */
+static int prot_writedirect(struct protstream *s, const char *buf, size_t len)
+{
+    int n;
+
+    while (len) {
+	n = prot_flush_writebuffer(s, buf,
+				   len > PROT_SENDFILE_CHUNK ?
+				   PROT_SENDFILE_CHUNK : len);
+	if (n == -1) {
+	    s->error = xstrdup(strerror(errno));
+	    return EOF;
+	}
+	if (n > 0) {
+	    buf += n;
+	    len -= n;
+	    s->bytes_out += n;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Write to the output stream 's' the 'len' bytes at 'offset' in the
+ * file open on 'fd'.  'base' may be NULL, or a map of the whole file
+ * if the caller has one to hand.
+ *
+ * Short writes are cheaper to copy into the buffer as usual.  Longer
+ * ones with nothing else in the way go from the file to the socket
+ * with sendfile(), without ever being copied into this process.
+ * Under TLS the data is written in large blocks straight from the
+ * map (or a buffer, if there isn't one), rather than a few KB at a
+ * time from the stream buffer.  Anything else gets the normal path.
+ */
+int prot_sendfile(struct protstream *s, int fd, const char *base,
+		  off_t offset, size_t len)
+{
+    char *buf = NULL;
+    ssize_t n;
+    int r = 0;
+
+    assert(s->write);
+    if (s->error || s->eof) return EOF;
+    if (len == 0) return 0;
+
+    if (base && (len < PROT_SENDFILE_MIN || !prot_canbypass(s)))
+	return prot_write(s, base + offset, len);
+
+    if (prot_canbypass(s)) {
+	/* everything already buffered has to go first */
+	if (prot_flush_internal(s, 1) == EOF) return EOF;
+	s->boundary = 0;
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#ifdef HAVE_SSL
+	if (!s->tls_conn)
+#endif
+	{
+	    off_t pos = offset;
+	    size_t left = len;
+
+	    while (left) {
+		cmdtime_netstart();
+		n = sendfile(s->fd, fd, &pos, left);
+		cmdtime_netend();
+		if (n == -1 && errno == EINTR && !signals_poll())
+		    continue;
+		if (n == -1 && left == len &&
+		    (errno == EINVAL || errno == ENOSYS)) {
+		    /* not a file or socket sendfile() can do */
+		    break;
+		}
+		if (n <= 0) {
+		    s->error = xstrdup(n ? strerror(errno) :
+				       "file shrank while sending");
+		    return EOF;
+		}
+		left -= n;
+		s->bytes_out += n;
+	    }
+	    if (!left) return 0;
+	}
+#endif /* HAVE_SENDFILE */
+
+	if (base) return prot_writedirect(s, base + offset, len);
+    }
+
+    /* no map, so read it ourselves a block at a time */
+    buf = xmalloc(PROT_SENDFILE_CHUNK);
+    while (len && !r) {
+	n = pread(fd, buf, len > PROT_SENDFILE_CHUNK ?
+		  PROT_SENDFILE_CHUNK : len, offset);
+	if (n == -1 && errno == EINTR && !signals_poll())
+	    continue;
+	if (n <= 0) {
+	    s->error = xstrdup(n ? strerror(errno) :
+			       "file shrank while sending");
+	    r = EOF;
+	    break;
+	}
+	if (prot_canbypass(s))
+	    r = prot_writedirect(s, buf, n);
+	else
+	    r = prot_write(s, buf, n);
+	offset += n;
+	len -= n;
+    }
+    free(buf);
+
+    return r;
+}
+
+/*
+ * As prot_sendfile(), but dot-stuffing any line starting with '.' as
+ * POP3 and NNTP require.  The data must start at the beginning of a
+ * line, and 'base' must be a map of the file so we can find the lines.
+ */
+int prot_sendfile_dotstuffed(struct protstream *s, int fd, const char *base,
+			     off_t offset, size_t len)
+{
+    const char *p = base + offset;
+    const char *end = p + len;
+    const char *nl;
+
+    while (p < end) {
+	if (*p == '.' && prot_putc('.', s) == EOF)
+	    return EOF;
+
+	/* send everything up to the next line needing a dot */
+	for (nl = p; (nl = memchr(nl, '\n', end - nl)); nl++) {
+	    if (nl + 1 < end && nl[1] == '.') break;
+	}
+	nl = nl ? nl + 1 : end;
+
+	if (prot_sendfile(s, fd, base, p - base, nl - p) == EOF)
+	    return EOF;
+	p = nl;
+    }
+
+    return 0;
+}
+
 int prot_putbuf(struct protstream *s, struct buf *buf)
 {
     return prot_write(s, buf->s, buf->len);
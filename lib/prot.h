@@ -65,6 +65,11 @@
 #define PROT_BUFSIZE 4096
 /* #define PROT_BUFSIZE 8192 */
 
+/* prot_sendfile() copies writes shorter than this through the buffer */
+#define PROT_SENDFILE_MIN (64*1024)
+/* and writes longer ones in blocks of this size when it can't sendfile */
+#define PROT_SENDFILE_CHUNK (256*1024)
+
 #define PROT_NO_FD -1
 
 struct protstream;
@@ -254,6 +259,11 @@ extern int prot_flush(struct protstream *s);
 /* These are protlayer versions of the specified functions */
 extern int prot_write(struct protstream *s, const char *buf, unsigned len);
 extern int prot_putbuf(struct protstream *s, struct buf *buf);
+extern int prot_sendfile(struct protstream *s, int fd, const char *base,
+			 off_t offset, size_t len);
+extern int prot_sendfile_dotstuffed(struct protstream *s, int fd,
+				    const char *base,
+				    off_t offset, size_t len);
 extern int prot_printf(struct protstream *, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
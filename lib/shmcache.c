@@ -0,0 +1,483 @@
+/* shmcache.c -- fixed-size cache shared between processes
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "shmcache.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+ * The file is a header, then the buckets.  Each bucket is a sequence
+ * number followed by SHMCACHE_WAYS entries, each holding a key, up to
+ * 'maxdata' bytes of data and the times it expires and was last used.
+ *
+ * A writer holds an fcntl() lock on the bucket's bytes, and makes the
+ * sequence number odd while it changes them.  A reader notes the
+ * sequence number, copies what it wants, and checks that the number
+ * is still the same and was even, trying again if not.  A writer
+ * which dies halfway leaves the number odd; the kernel drops its
+ * lock, so readers who find a bucket odd for too long take a read
+ * lock, and the next writer evens the number again.
+ */
+
+#define SHMCACHE_MAGIC		"Cyrus shmcache\n"
+#define SHMCACHE_VERSION	1
+#define SHMCACHE_WAYS		8
+#define SHMCACHE_HEADER		64
+#define SHMCACHE_BUCKETHDR	8
+#define SHMCACHE_RETRIES	3
+
+#define ROUNDUP8(n)	(((n) + 7) & ~7)
+
+struct header {
+    char magic[16];
+    bit32 version;
+    bit32 nbuckets;
+    bit32 ways;
+    bit32 maxdata;
+};
+
+struct entry {
+    bit64 expire;
+    bit64 lastused;		/* only a hint: updated without locking */
+    bit32 keylen;		/* 0 if the entry is free */
+    bit32 datalen;
+    unsigned char key[SHMCACHE_MAXKEY];
+    /* followed by the data */
+};
+
+struct shmcache {
+    char *fname;
+    int fd;
+    char *base;
+    size_t size;
+    unsigned nbuckets;
+    unsigned ways;
+    unsigned maxdata;
+    size_t entrysize;
+    size_t bucketsize;
+};
+
+#if defined(__GNUC__)
+#define HAVE_SEQLOCK
+#define memory_barrier()	__sync_synchronize()
+#endif
+
+#define BUCKET(c, b)	((c)->base + SHMCACHE_HEADER + (size_t) (b) * (c)->bucketsize)
+#define SEQ(bp)		((volatile bit32 *) (bp))
+#define ENTRY(c, bp, i)	((struct entry *) ((bp) + SHMCACHE_BUCKETHDR + \
+					   (size_t) (i) * (c)->entrysize))
+#define DATA(e)		((char *) (e) + sizeof(struct entry))
+
+static int lock_range(struct shmcache *cache, off_t start, off_t len, int type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+
+    while (fcntl(cache->fd, F_SETLKW, &fl) == -1) {
+	if (errno != EINTR) {
+	    syslog(LOG_ERR, "IOERROR: locking %s: %m", cache->fname);
+	    return SHMCACHE_IOERROR;
+	}
+    }
+    return SHMCACHE_OK;
+}
+
+static int lock_bucket(struct shmcache *cache, unsigned b, int type)
+{
+    return lock_range(cache,
+		      SHMCACHE_HEADER + (off_t) b * cache->bucketsize,
+		      cache->bucketsize, type);
+}
+
+static unsigned bucket_of(struct shmcache *cache,
+			  const char *key, size_t keylen)
+{
+    return crc32_map(key, keylen) % cache->nbuckets;
+}
+
+static size_t geometry(struct shmcache *cache)
+{
+    cache->entrysize = ROUNDUP8(sizeof(struct entry) + cache->maxdata);
+    cache->bucketsize = SHMCACHE_BUCKETHDR + cache->ways * cache->entrysize;
+
+    return SHMCACHE_HEADER + cache->nbuckets * cache->bucketsize;
+}
+
+/*
+ * Make a fresh table, every entry free, and swap it in for whatever is
+ * at 'cache->fname'.  Other processes may still have the old file
+ * mapped, so it must never be truncated under them: they carry on with
+ * it until they next open the cache.  Called holding the header lock
+ * on the old file, which stops anyone else doing the same at once.
+ */
+static int create_file(struct shmcache *cache, unsigned nentries,
+		       unsigned maxdata)
+{
+    struct header hdr;
+    char *newfname;
+    int fd;
+
+    cache->ways = SHMCACHE_WAYS;
+    cache->nbuckets = (nentries + cache->ways - 1) / cache->ways;
+    if (!cache->nbuckets) cache->nbuckets = 1;
+    cache->maxdata = ROUNDUP8(maxdata);
+    cache->size = geometry(cache);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SHMCACHE_MAGIC, sizeof(SHMCACHE_MAGIC));
+    hdr.version = SHMCACHE_VERSION;
+    hdr.nbuckets = cache->nbuckets;
+    hdr.ways = cache->ways;
+    hdr.maxdata = cache->maxdata;
+
+    newfname = strconcat(cache->fname, ".NEW", (char *)NULL);
+    unlink(newfname);
+    fd = open(newfname, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	free(newfname);
+	return SHMCACHE_IOERROR;
+    }
+
+    if (ftruncate(fd, cache->size) == -1 ||
+	pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	rename(newfname, cache->fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", cache->fname);
+	close(fd);
+	unlink(newfname);
+	free(newfname);
+	return SHMCACHE_IOERROR;
+    }
+    free(newfname);
+
+    /* dropping the old file drops our lock on it too */
+    close(cache->fd);
+    cache->fd = fd;
+
+    return SHMCACHE_OK;
+}
+
+int shmcache_open(const char *fname, unsigned nentries, unsigned maxdata,
+		  struct shmcache **cachep)
+{
+    struct shmcache *cache;
+    struct header hdr;
+    struct stat sbuf, fsbuf;
+    int r = SHMCACHE_IOERROR;
+
+    if (nentries > (1 << 24) || maxdata > (1 << 20))
+	return SHMCACHE_TOOBIG;
+
+    cache = xzmalloc(sizeof(struct shmcache));
+    cache->fname = xstrdup(fname);
+    cache->fd = -1;
+
+    for (;;) {
+	cache->fd = open(fname, O_RDWR | O_CREAT, 0600);
+	if (cache->fd == -1) {
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	    goto done;
+	}
+
+	/* the header lock is only ever taken here */
+	if (lock_range(cache, 0, SHMCACHE_HEADER, F_WRLCK)) goto done;
+
+	if (fstat(cache->fd, &sbuf) == -1) {
+	    syslog(LOG_ERR, "IOERROR: fstat %s: %m", fname);
+	    goto unlock;
+	}
+
+	/* somebody may have replaced it while we waited: use theirs */
+	if (stat(fname, &fsbuf) == 0 &&
+	    fsbuf.st_ino == sbuf.st_ino && fsbuf.st_dev == sbuf.st_dev)
+	    break;
+
+	close(cache->fd);
+	cache->fd = -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (sbuf.st_size >= SHMCACHE_HEADER &&
+	pread(cache->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	!memcmp(hdr.magic, SHMCACHE_MAGIC, sizeof(SHMCACHE_MAGIC)) &&
+	hdr.version == SHMCACHE_VERSION && hdr.nbuckets && hdr.ways) {
+	/* somebody made it already, perhaps with another size */
+	cache->nbuckets = hdr.nbuckets;
+	cache->ways = hdr.ways;
+	cache->maxdata = hdr.maxdata;
+	cache->size = geometry(cache);
+    }
+
+    if (!cache->size || (off_t) cache->size != sbuf.st_size) {
+	/* new or damaged: start afresh */
+	if (sbuf.st_size) {
+	    syslog(LOG_NOTICE, "shmcache: %s is damaged, replacing it",
+		   fname);
+	}
+	if (create_file(cache, nentries, maxdata)) goto unlock;
+    }
+
+    cache->base = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, cache->fd, 0);
+    if (cache->base == MAP_FAILED) {
+	syslog(LOG_ERR, "IOERROR: mapping %s: %m", fname);
+	cache->base = NULL;
+	goto unlock;
+    }
+
+    r = SHMCACHE_OK;
+
+ unlock:
+    lock_range(cache, 0, SHMCACHE_HEADER, F_UNLCK);
+ done:
+    if (r) shmcache_close(cache);
+    else *cachep = cache;
+
+    return r;
+}
+
+void shmcache_close(struct shmcache *cache)
+{
+    if (!cache) return;
+
+    if (cache->base) munmap(cache->base, cache->size);
+    if (cache->fd != -1) close(cache->fd);
+    free(cache->fname);
+    free(cache);
+}
+
+static struct entry *find_entry(struct shmcache *cache, char *bp,
+				const char *key, size_t keylen)
+{
+    struct entry *e;
+    unsigned i;
+
+    for (i = 0; i < cache->ways; i++) {
+	e = ENTRY(cache, bp, i);
+	if (e->keylen == keylen && !memcmp(e->key, key, keylen))
+	    return e;
+    }
+
+    return NULL;
+}
+
+/* copy out the entry for 'key'; may be reading a bucket mid-write */
+static int read_entry(struct shmcache *cache, char *bp,
+		      const char *key, size_t keylen,
+		      struct buf *data, time_t now, struct entry **ep)
+{
+    struct entry *e = find_entry(cache, bp, key, keylen);
+    bit32 datalen;
+
+    if (!e || e->expire < (bit64) now) return SHMCACHE_NOTFOUND;
+
+    datalen = e->datalen;
+    if (datalen > cache->maxdata) return SHMCACHE_NOTFOUND;
+
+    buf_setmap(data, DATA(e), datalen);
+    *ep = e;
+
+    return SHMCACHE_OK;
+}
+
+int shmcache_fetch(struct shmcache *cache, const char *key, size_t keylen,
+		   struct buf *data, time_t now)
+{
+    struct entry *e = NULL;
+    unsigned b;
+    char *bp;
+    int r;
+
+    if (!keylen || keylen > SHMCACHE_MAXKEY) return SHMCACHE_NOTFOUND;
+
+    b = bucket_of(cache, key, keylen);
+    bp = BUCKET(cache, b);
+
+#ifdef HAVE_SEQLOCK
+    {
+	bit32 seq;
+	int tries;
+
+	for (tries = 0; tries < SHMCACHE_RETRIES; tries++) {
+	    seq = *SEQ(bp);
+	    memory_barrier();
+	    if (seq & 1) continue;
+
+	    r = read_entry(cache, bp, key, keylen, data, now, &e);
+
+	    memory_barrier();
+	    if (*SEQ(bp) == seq) goto found;
+	}
+    }
+#endif
+
+    /* the bucket is busy, or its last writer died: wait our turn */
+    if (lock_bucket(cache, b, F_RDLCK)) return SHMCACHE_IOERROR;
+    r = read_entry(cache, bp, key, keylen, data, now, &e);
+    lock_bucket(cache, b, F_UNLCK);
+
+#ifdef HAVE_SEQLOCK
+ found:
+#endif
+    if (r == SHMCACHE_OK) e->lastused = now;
+    else buf_reset(data);
+
+    return r;
+}
+
+/* the entry to reuse for a new key: free, expired, else least used */
+static struct entry *victim(struct shmcache *cache, char *bp, time_t now)
+{
+    struct entry *e, *best = NULL;
+    bit64 score, bestscore = 0;
+    unsigned i;
+
+    for (i = 0; i < cache->ways; i++) {
+	e = ENTRY(cache, bp, i);
+
+	if (!e->keylen) return e;
+	score = e->expire < (bit64) now ? 0 : e->lastused + 1;
+
+	if (!best || score < bestscore) {
+	    best = e;
+	    bestscore = score;
+	}
+    }
+
+    return best;
+}
+
+static bit32 begin_write(char *bp)
+{
+    /* odd already if a writer died here: the bucket is ours now */
+    bit32 seq = *SEQ(bp) | 1;
+
+    *SEQ(bp) = seq;
+#ifdef HAVE_SEQLOCK
+    memory_barrier();
+#endif
+    return seq;
+}
+
+static void end_write(char *bp, bit32 seq)
+{
+#ifdef HAVE_SEQLOCK
+    memory_barrier();
+#endif
+    *SEQ(bp) = seq + 1;
+}
+
+int shmcache_store(struct shmcache *cache, const char *key, size_t keylen,
+		   const char *data, size_t datalen, time_t expire)
+{
+    struct entry *e;
+    time_t now = time(NULL);
+    unsigned b;
+    char *bp;
+    bit32 seq;
+
+    if (!keylen || keylen > SHMCACHE_MAXKEY || datalen > cache->maxdata)
+	return SHMCACHE_TOOBIG;
+
+    b = bucket_of(cache, key, keylen);
+    bp = BUCKET(cache, b);
+
+    if (lock_bucket(cache, b, F_WRLCK)) return SHMCACHE_IOERROR;
+
+    e = find_entry(cache, bp, key, keylen);
+    if (!e) e = victim(cache, bp, now);
+
+    seq = begin_write(bp);
+    e->keylen = keylen;
+    memcpy(e->key, key, keylen);
+    e->datalen = datalen;
+    memcpy(DATA(e), data, datalen);
+    e->expire = expire;
+    e->lastused = now;
+    end_write(bp, seq);
+
+    lock_bucket(cache, b, F_UNLCK);
+
+    return SHMCACHE_OK;
+}
+
+int shmcache_delete(struct shmcache *cache, const char *key, size_t keylen)
+{
+    struct entry *e;
+    unsigned b;
+    char *bp;
+    bit32 seq;
+
+    if (!keylen || keylen > SHMCACHE_MAXKEY) return SHMCACHE_NOTFOUND;
+
+    b = bucket_of(cache, key, keylen);
+    bp = BUCKET(cache, b);
+
+    if (lock_bucket(cache, b, F_WRLCK)) return SHMCACHE_IOERROR;
+
+    e = find_entry(cache, bp, key, keylen);
+    if (e) {
+	seq = begin_write(bp);
+	e->keylen = 0;
+	end_write(bp, seq);
+    }
+
+    lock_bucket(cache, b, F_UNLCK);
+
+    return e ? SHMCACHE_OK : SHMCACHE_NOTFOUND;
+}
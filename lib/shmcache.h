@@ -0,0 +1,93 @@
+/* shmcache.h -- fixed-size cache shared between processes
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_SHMCACHE_H__
+#define __CYRUS_SHMCACHE_H__
+
+#include <config.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "util.h"
+
+/*
+ * A hash table of short binary keys, kept in a file which every
+ * process using it maps shared.  The table never grows: each key
+ * hashes to a bucket of a few entries, and storing into a full bucket
+ * evicts the entry which was least recently used or has expired.
+ *
+ * Writers lock just the bucket they change.  Readers take no lock at
+ * all unless they catch a bucket being written.
+ *
+ * The size of a table is fixed when its file is created: opening an
+ * existing file uses the size it was made with.  A damaged file is
+ * replaced with a new one, never changed in place, so processes which
+ * still have the old one open keep working.
+ */
+struct shmcache;
+
+#define SHMCACHE_MAXKEY		64
+
+enum {
+    SHMCACHE_OK =	0,
+    SHMCACHE_NOTFOUND =	-1,
+    SHMCACHE_IOERROR =	-2,
+    SHMCACHE_TOOBIG =	-3
+};
+
+/* room for about 'nentries' entries of up to 'maxdata' bytes each */
+extern int shmcache_open(const char *fname, unsigned nentries,
+			 unsigned maxdata, struct shmcache **cachep);
+extern void shmcache_close(struct shmcache *cache);
+
+/* entries expiring before 'now' are never returned */
+extern int shmcache_fetch(struct shmcache *cache,
+			  const char *key, size_t keylen,
+			  struct buf *data, time_t now);
+extern int shmcache_store(struct shmcache *cache,
+			  const char *key, size_t keylen,
+			  const char *data, size_t datalen,
+			  time_t expire);
+extern int shmcache_delete(struct shmcache *cache,
+			   const char *key, size_t keylen);
+
+#endif /* __CYRUS_SHMCACHE_H__ */
@@ -47,6 +47,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <syslog.h>
+#include <sys/select.h>
 
 #include "signals.h"
 #include "xmalloc.h"
@@ -104,6 +105,33 @@ void signals_set_shutdown(shutdownfn *s)
     shutdown_cb = s;
 }
 
+/*
+ * Wait for 'seconds', or until one of our signals arrives, whichever
+ * comes first.  Unlike sleep() after signals_poll(), a signal which
+ * arrives just before we start waiting still cuts the wait short.
+ * The caller still has to signals_poll() afterwards.
+ */
+void signals_sleep(unsigned seconds)
+{
+    sigset_t mask, oldmask;
+    struct timespec ts;
+    int i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGQUIT);
+    for (i = 0; catch[i] != 0; i++)
+	sigaddset(&mask, catch[i]);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    if (!gotsignal) {
+	ts.tv_sec = seconds;
+	ts.tv_nsec = 0;
+	pselect(0, NULL, NULL, NULL, &ts, &oldmask);
+    }
+
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
 int signals_poll(void)
 {
     switch (gotsignal) {
@@ -0,0 +1,111 @@
+/* time ACL rights checks: aclbench [checks] [mailboxes] [userid] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../acl.h"
+#include "../auth.h"
+#include "../xmalloc.h"
+#include "../exitcodes.h"
+
+struct timeval t1, t2;
+
+#define START() gettimeofday(&t1, NULL)
+#define STOP(what, n) do { gettimeofday(&t2, NULL); report(what, n); } while (0)
+
+void fatal(const char *msg, int code)
+{
+    printf("fatal: %s\n", msg);
+    exit(code);
+}
+
+void report(const char *what, int n)
+{
+    double secs = (t2.tv_sec - t1.tv_sec) +
+		  (double) (t2.tv_usec - t1.tv_usec) / 1000000;
+
+    printf("*** %-10s %8d %10.6f %8.1f ns/op %12.0f /sec\n", what, n, secs,
+	   n ? secs * 1e9 / n : 0.0, secs ? n / secs : 0.0);
+}
+
+/* ACLs shaped like those on shared folders: an owner, a couple of
+ * groups, sometimes anyone, sometimes the user we're checking */
+char **genacls(int n, const char *userid)
+{
+    char **acls = xmalloc(n * sizeof(char *));
+    char buf[1024];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	snprintf(buf, sizeof(buf),
+		 "owner%05d\tlrswipkxtecda\t"
+		 "group:staff%02d\tlrs\t"
+		 "group:team%03d\tlrswipte\t"
+		 "%s%s"
+		 "-%s\t%s\t",
+		 i, i % 50, i % 300,
+		 (i % 3) ? "" : "anyone\tlr\t",
+		 (i % 7) ? "" : "owner00000\tlr\t",
+		 (i % 11) ? "nobody" : userid,
+		 (i % 2) ? "w" : "i");
+	acls[i] = xstrdup(buf);
+    }
+
+    return acls;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 1000000;
+    int nacls = 10000;
+    const char *userid = "cyrus";
+    struct auth_state *auth_state;
+    struct cyrus_acl **cacls;
+    char **acls;
+    int i, sum1, sum2;
+
+    if (argc > 1) n = atoi(argv[1]);
+    if (argc > 2) nacls = atoi(argv[2]);
+    if (argc > 3) userid = argv[3];
+    if (n <= 0 || nacls <= 0) {
+	printf("%s [checks] [mailboxes] [userid]\n", argv[0]);
+	exit(1);
+    }
+
+    auth_state = auth_newstate(userid);
+    if (!auth_state) fatal("bad userid", EC_USAGE);
+
+    acls = genacls(nacls, userid);
+    cacls = xmalloc(nacls * sizeof(struct cyrus_acl *));
+
+    printf("%d checks over %d ACLs for %s\n", n, nacls, userid);
+
+    START();
+    for (sum1 = 0, i = 0; i < n; i++)
+	sum1 += cyrus_acl_myrights(auth_state, acls[i % nacls]) & ACL_LOOKUP;
+    STOP("myrights", n);
+
+    START();
+    for (i = 0; i < nacls; i++)
+	cacls[i] = cyrus_acl_compile(acls[i]);
+    STOP("compile", nacls);
+
+    START();
+    for (sum2 = 0, i = 0; i < n; i++)
+	sum2 += cyrus_acl_rights(auth_state, cacls[i % nacls]) & ACL_LOOKUP;
+    STOP("rights", n);
+
+    if (sum1 != sum2) fatal("compiled rights differ", EC_SOFTWARE);
+
+    for (i = 0; i < nacls; i++) {
+	cyrus_acl_free(&cacls[i]);
+	free(acls[i]);
+    }
+    free(cacls);
+    free(acls);
+    auth_freestate(auth_state);
+
+    return 0;
+}
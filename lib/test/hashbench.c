@@ -0,0 +1,117 @@
+/* time the hash table: hashbench [keys] [sizeguess] [mpool] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../hash.h"
+#include "../xmalloc.h"
+#include "../exitcodes.h"
+
+struct timeval t1, t2;
+
+#define START() gettimeofday(&t1, NULL)
+#define STOP(what, n) do { gettimeofday(&t2, NULL); report(what, n); } while (0)
+
+void fatal(const char *msg, int code)
+{
+    printf("fatal: %s\n", msg);
+    exit(code);
+}
+
+void report(const char *what, int n)
+{
+    double secs = (t2.tv_sec - t1.tv_sec) +
+		  (double) (t2.tv_usec - t1.tv_usec) / 1000000;
+
+    printf("*** %-10s %8d %10.6f %8.1f ns/op\n", what, n, secs,
+	   n ? secs * 1e9 / n : 0.0);
+}
+
+void countem(const char *key, void *data, void *rock)
+{
+    (*(int *) rock)++;
+}
+
+/* keys shaped like the mailbox names idled and cyr_expire hash,
+ * which share long prefixes and suffixes */
+char **genkeys(int n, const char *fmt)
+{
+    char **keys = xmalloc(n * sizeof(char *));
+    char buf[256];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	snprintf(buf, sizeof(buf), fmt, i / 20, i % 20);
+	keys[i] = xstrdup(buf);
+    }
+
+    return keys;
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 200000;
+    int guess = 0;
+    int use_mpool = 0;
+    char **keys, **misses;
+    hash_table table;
+    int i, found, count;
+
+    if (argc > 1) n = atoi(argv[1]);
+    if (argc > 2) guess = atoi(argv[2]);
+    if (argc > 3) use_mpool = atoi(argv[3]);
+    if (n <= 0) {
+	printf("%s [keys] [sizeguess] [mpool]\n", argv[0]);
+	exit(1);
+    }
+    if (guess <= 0) guess = n;
+
+    keys = genkeys(n, "user.someuser%07d.Archive.2009.Folder%02d");
+    misses = genkeys(n, "user.someuser%07d.Archive.2010.Folder%02d");
+
+    printf("%d keys, size guess %d, %s\n", n, guess,
+	   use_mpool ? "mpool" : "malloc");
+
+    START();
+    construct_hash_table(&table, guess, use_mpool);
+    for (i = 0; i < n; i++)
+	hash_insert(keys[i], keys[i], &table);
+    STOP("insert", n);
+
+    START();
+    for (found = 0, i = 0; i < n; i++)
+	if (hash_lookup(keys[i], &table)) found++;
+    STOP("hit", n);
+    if (found != n) fatal("missing keys", EC_SOFTWARE);
+
+    START();
+    for (found = 0, i = 0; i < n; i++)
+	if (hash_lookup(misses[i], &table)) found++;
+    STOP("miss", n);
+    if (found) fatal("extra keys", EC_SOFTWARE);
+
+    START();
+    for (i = 0; i < n; i += 2)
+	hash_del(keys[i], &table);
+    STOP("delete", n / 2);
+
+    START();
+    count = 0;
+    hash_enumerate(&table, countem, &count);
+    STOP("enumerate", count);
+    if (count != n / 2) fatal("wrong count", EC_SOFTWARE);
+
+    /* and back in again, over the deleted buckets */
+    START();
+    for (i = 0; i < n; i += 2)
+	hash_insert(keys[i], keys[i], &table);
+    STOP("reinsert", n / 2);
+
+    START();
+    free_hash_table(&table, NULL);
+    STOP("free", n);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* ticketkeys.c -- keys for TLS session tickets
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "retry.h"
+#include "ticketkeys.h"
+
+int ticketkeys_read(const char *fname, struct ticketkey keys[TICKETKEY_MAX])
+{
+    int fd, n;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+	if (errno != ENOENT)
+	    syslog(LOG_ERR, "IOERROR: opening %s: %m", fname);
+	return -1;
+    }
+
+    n = retry_read(fd, keys, TICKETKEY_MAX * sizeof(struct ticketkey));
+    close(fd);
+
+    if (n < (int) sizeof(struct ticketkey) ||
+	n % sizeof(struct ticketkey)) {
+	syslog(LOG_ERR, "IOERROR: %s is damaged", fname);
+	return -1;
+    }
+
+    return n / sizeof(struct ticketkey);
+}
+
+int ticketkeys_rotate(const char *fname)
+{
+    struct ticketkey keys[TICKETKEY_MAX + 1];
+    char newfname[1024];
+    int fd, n, r = -1;
+
+    /* make the new key first, keeping what is there behind it */
+    fd = open("/dev/urandom", O_RDONLY, 0);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: opening /dev/urandom: %m");
+	return -1;
+    }
+    n = retry_read(fd, &keys[0], sizeof(struct ticketkey));
+    close(fd);
+    if (n != sizeof(struct ticketkey)) {
+	syslog(LOG_ERR, "IOERROR: reading /dev/urandom: %m");
+	return -1;
+    }
+
+    n = ticketkeys_read(fname, keys + 1);
+    if (n < 0) n = 0;
+    if (n > TICKETKEY_MAX - 1) n = TICKETKEY_MAX - 1;
+    n++;
+
+    /* swap the new file in, so readers never see half of it */
+    snprintf(newfname, sizeof(newfname), "%s.NEW", fname);
+    unlink(newfname);
+    fd = open(newfname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+	syslog(LOG_ERR, "IOERROR: creating %s: %m", newfname);
+	goto done;
+    }
+    if (retry_write(fd, keys, n * sizeof(struct ticketkey)) == -1 ||
+	fsync(fd) == -1) {
+	syslog(LOG_ERR, "IOERROR: writing %s: %m", newfname);
+	close(fd);
+	unlink(newfname);
+	goto done;
+    }
+    close(fd);
+
+    if (rename(newfname, fname) == -1) {
+	syslog(LOG_ERR, "IOERROR: renaming %s: %m", newfname);
+	unlink(newfname);
+	goto done;
+    }
+
+    r = 0;
+
+ done:
+    memset(keys, 0, sizeof(keys));
+    return r;
+}
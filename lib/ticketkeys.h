@@ -0,0 +1,72 @@
+/* ticketkeys.h -- keys for TLS session tickets
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_TICKETKEYS_H__
+#define __CYRUS_TICKETKEYS_H__
+
+/*
+ * Keys for stateless TLS session resumption (RFC 5077 tickets).
+ * master makes a new key every so often and keeps the one before it,
+ * so that tickets handed out just before a rotation still work; the
+ * TLS servers read the keys from the file whenever it is replaced.
+ */
+
+#define FNAME_TICKETKEYS	"/tls_ticketkeys"
+
+#define TICKETKEY_NAMELEN	16
+#define TICKETKEY_SECRETLEN	16
+#define TICKETKEY_MAX		2	/* current and previous */
+
+struct ticketkey {
+    unsigned char name[TICKETKEY_NAMELEN];
+    unsigned char hmac[TICKETKEY_SECRETLEN];
+    unsigned char aes[TICKETKEY_SECRETLEN];
+};
+
+/* newest first; returns how many keys there are, or -1 */
+extern int ticketkeys_read(const char *fname,
+			   struct ticketkey keys[TICKETKEY_MAX]);
+
+/* replace the file with a new key followed by the newest old one */
+extern int ticketkeys_rotate(const char *fname);
+
+#endif /* __CYRUS_TICKETKEYS_H__ */
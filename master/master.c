@@ -119,6 +119,7 @@
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
+#include "ticketkeys.h"
 
 enum {
     become_cyrus_early = 1,
@@ -177,11 +178,35 @@ struct centry {
 static struct centry *ctable[child_table_size];
 static struct centry *cfreelist;
 
+static int ticket_rotation = 0;		/* seconds between new ticket keys */
+static time_t ticket_mark = 0;		/* when the next one is due */
+
 static int janitor_frequency = 1;	/* Janitor sweeps per second */
 static int janitor_position;		/* Entry to begin at in next sweep */
 static struct timeval janitor_mark;	/* Last time janitor did a sweep */
 
 static void limit_fds(rlim_t);
+/*
+ * When the keys left by our last run are due to be replaced, so that
+ * restarting doesn't throw away the tickets we've already handed out.
+ */
+static time_t ticketkeys_due(void)
+{
+    struct stat sbuf;
+    time_t now = time(NULL);
+    char *fname;
+    int r;
+
+    fname = strconcat(config_dir, FNAME_TICKETKEYS, (char *)NULL);
+    r = stat(fname, &sbuf);
+    free(fname);
+
+    if (r == -1) return 0;
+    if (sbuf.st_mtime > now) return now + ticket_rotation;
+
+    return sbuf.st_mtime + ticket_rotation;
+}
+
 static void schedule_event(struct event *a);
 
 void fatal(const char *msg, int code)
@@ -581,6 +606,7 @@ static void spawn_service(const int si)
     int i;
     char path[PATH_MAX];
     static char name_env[100], name_env2[100];
+    static char spare_env[] = "CYRUS_SPARE=1";
     struct centry *c;
     struct service * const s = &Services[si];
     time_t now = time(NULL);
@@ -673,6 +699,10 @@ static void spawn_service(const int si)
 	snprintf(name_env2, sizeof(name_env2), "CYRUS_ID=%d", s->associate);
 	putenv(name_env2);
 
+	/* beyond prefork: time out even if never used */
+	if (s->maxprefork && s->ready_workers >= s->prefork)
+	    putenv(spare_env);
+
 	execv(path, s->exec);
 	syslog(LOG_ERR, "couldn't exec %s: %m", path);
 	exit(EX_OSERR);
@@ -695,6 +725,86 @@ static void spawn_service(const int si)
 
 }
 
+/*
+ * Size the pool of ready children of a service which has maxprefork.
+ *
+ * Once an interval, the connections handed to children are folded
+ * into a running average, halved each interval like the fork rate.
+ * We then want enough children ready for the connections expected
+ * over the next interval, looking further ahead while the rate is
+ * rising, so that a burst of logins finds processes which are already
+ * through service_init() rather than waiting on fork and exec.
+ * Shrinking the pool is left to the children, so that we never kill
+ * one which may be accepting: those forked while prefork were already
+ * waiting are spares, which time out and exit on their own whether or
+ * not they were used.
+ */
+static void pool_update(struct service *s, time_t now)
+{
+    /* connection rates are kept in 1/POOL_SCALE connections */
+    const int POOL_INTERVAL = 1;
+    const unsigned int POOL_SCALE = 16;
+
+    unsigned int oldrate = s->connrate, avg, rising;
+    int intervals, arrivals, busy, target;
+
+    if (!s->maxprefork || !s->exec) return;
+
+    intervals = (now - s->pool_interval_start) / POOL_INTERVAL;
+    if (intervals < 1) return;
+
+    /* nconnections is reset when the service is removed */
+    arrivals = s->nconnections - s->pool_connections;
+    if (arrivals < 0) arrivals = 0;
+    avg = arrivals * POOL_SCALE / intervals;
+
+    /* fold in one interval's worth at a time, all at once */
+    if (intervals > 30) s->connrate = avg;
+    else s->connrate = (s->connrate >> intervals) + avg - (avg >> intervals);
+
+    s->pool_interval_start += intervals * POOL_INTERVAL;
+    s->pool_connections = s->nconnections;
+
+    /* lead a rising rate by a couple of intervals */
+    rising = s->connrate > oldrate ? s->connrate - oldrate : 0;
+    target = (s->connrate + 2 * rising + POOL_SCALE - 1) / POOL_SCALE;
+
+    /* no use having more ready than maxchild leaves room for */
+    busy = s->nactive - s->ready_workers;
+    if (busy < 0) busy = 0;
+    if (target > s->max_workers - busy) target = s->max_workers - busy;
+
+    if (target > s->maxprefork) target = s->maxprefork;
+    if (target < s->prefork) target = s->prefork;
+
+    if (verbose && target != s->desired_workers) {
+	syslog(LOG_DEBUG,
+	       "service %s: %d ready, %d busy, %u.%02u connections/s: "
+	       "now keeping %d ready",
+	       SERVICENAME(s->name), s->ready_workers, busy,
+	       s->connrate / POOL_SCALE / POOL_INTERVAL,
+	       (s->connrate % POOL_SCALE) * 100 / POOL_SCALE / POOL_INTERVAL,
+	       target);
+    }
+    s->desired_workers = target;
+}
+
+/*
+ * Every TLS server reads its session ticket keys from a file we keep
+ * replacing: a new key to issue tickets under, and the one before it.
+ */
+static void rotate_ticketkeys(time_t now)
+{
+    char *fname;
+
+    fname = strconcat(config_dir, FNAME_TICKETKEYS, (char *)NULL);
+    if (!ticketkeys_rotate(fname) && verbose)
+	syslog(LOG_DEBUG, "new TLS session ticket key in %s", fname);
+    free(fname);
+
+    ticket_mark = now + ticket_rotation;
+}
+
 static void schedule_event(struct event *a)
 {
     struct event *ptr;
@@ -1408,6 +1518,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
     int ignore_err = rock ? 1 : 0;
     char *cmd = xstrdup(masterconf_getstring(e, "cmd", ""));
     int prefork = masterconf_getint(e, "prefork", 0);
+    int maxprefork = masterconf_getint(e, "maxprefork", 0);
     int babysit = masterconf_getswitch(e, "babysit", 0);
     int maxforkrate = masterconf_getint(e, "maxforkrate", 0);
     char *listen = xstrdup(masterconf_getstring(e, "listen", ""));
@@ -1419,6 +1530,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
 
     if(babysit && prefork == 0) prefork = 1;
     if(babysit && maxforkrate == 0) maxforkrate = 10; /* reasonable safety */
+    if(maxprefork && maxprefork < prefork) maxprefork = prefork;
 
     if (!strcmp(cmd,"") || !strcmp(listen,"")) {
 	char buf[256];
@@ -1471,6 +1583,7 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	memset(&Services[nservices++], 0, sizeof(struct service));
 
 	Services[i].last_interval_start = time(NULL);
+	Services[i].pool_interval_start = Services[i].last_interval_start;
     }
     else if (Services[i].listen) reconfig = 1;
 
@@ -1500,6 +1613,8 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	!strcmp(Services[i].proto, "tcp4") ||
 	!strcmp(Services[i].proto, "tcp6")) {
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = maxprefork;
 	Services[i].babysit = babysit;
 	Services[i].max_workers = atoi(max);
 	if (Services[i].max_workers < 0) {
@@ -1509,6 +1624,8 @@ static void add_service(const char *name, struct entry *e, void *rock)
 	/* udp */
 	if (prefork > 1) prefork = 1;
 	Services[i].desired_workers = prefork;
+	Services[i].prefork = prefork;
+	Services[i].maxprefork = 0;
 	Services[i].max_workers = 1;
     }
  
@@ -1520,6 +1637,8 @@ static void add_service(const char *name, struct entry *e, void *rock)
 		Services[j].maxforkrate = Services[i].maxforkrate;
 		Services[j].exec = Services[i].exec;
 		Services[j].desired_workers = Services[i].desired_workers;
+		Services[j].prefork = Services[i].prefork;
+		Services[j].maxprefork = Services[i].maxprefork;
 		Services[j].babysit = Services[i].babysit;
 		Services[j].max_workers = Services[i].max_workers;
 	    }
@@ -1811,6 +1930,12 @@ int main(int argc, char **argv)
 
     masterconf_init("master", alt_config);
 
+    if (config_getswitch(IMAPOPT_TLS_SESSION_TICKETS)) {
+	ticket_rotation = 60 * config_getint(IMAPOPT_TLS_TICKET_KEY_ROTATION);
+	if (ticket_rotation < 60) ticket_rotation = 60;
+	ticket_mark = ticketkeys_due();
+    }
+
     /* zero out the children table */
     memset(&ctable, 0, sizeof(struct centry *) * child_table_size);
 
@@ -2054,6 +2179,9 @@ int main(int argc, char **argv)
 	if (!in_shutdown)
 	    spawn_schedule(now);
 
+	if (ticket_rotation && !in_shutdown && now >= ticket_mark)
+	    rotate_ticketkeys(now);
+
 	/* reap first, that way if we need to babysit we will */
 	if (gotsigchld) {
 	    /* order matters here */
@@ -2065,6 +2193,8 @@ int main(int argc, char **argv)
 	for (i = 0; i < nservices; i++) {
 	    total_children += Services[i].nactive;
 	    if (!in_shutdown) {
+		pool_update(&Services[i], now);
+
 		if (Services[i].exec /* enabled */ &&
 		    (Services[i].nactive < Services[i].max_workers) &&
 		    (Services[i].ready_workers < Services[i].desired_workers)) {
@@ -2156,6 +2286,12 @@ int main(int argc, char **argv)
 	    tv.tv_usec = 0;
 	    tvptr = &tv;
 	}
+	if (ticket_rotation &&
+	    (!tvptr || ticket_mark - now < tv.tv_sec)) {
+	    tv.tv_sec = ticket_mark > now ? ticket_mark - now : 0;
+	    tv.tv_usec = 0;
+	    tvptr = &tv;
+	}
 
 #if defined(HAVE_UCDSNMP) || defined(HAVE_NETSNMP)
 	if (tvptr == NULL) blockp = 1;
@@ -26,6 +26,8 @@ struct service {
 
     /* limits */
     int desired_workers;	/* num child processes to have ready */
+    int prefork;		/* least desired_workers may be */
+    int maxprefork;		/* most desired_workers may be */
     int max_workers;		/* max num child processes to spawn */
     rlim_t maxfds;		/* max num file descriptors to use */
     unsigned int maxforkrate;	/* max rate to spawn children */
@@ -40,6 +42,11 @@ struct service {
     /* fork rate computation */
     time_t last_interval_start;
     unsigned int interval_forks;
+
+    /* connection rate computation, for sizing the pool */
+    time_t pool_interval_start;
+    int pool_connections;	/* nconnections at pool_interval_start */
+    unsigned int connrate;	/* connections per interval, scaled */
 };
 
 extern struct service *Services;
@@ -252,6 +252,7 @@ int main(int argc, char **argv, char **envp)
     int call_debugger = 0;
     int max_use = MAX_USE;
     int reuse_timeout = REUSE_TIMEOUT;
+    int spare;
     int soctype;
     socklen_t typelen = sizeof(soctype);
     strarray_t newargv = STRARRAY_INITIALIZER;
@@ -329,6 +330,9 @@ int main(int argc, char **argv, char **envp)
     }
     id = atoi(p);
 
+    /* a spare in a pool which master sizes by demand */
+    spare = (getenv("CYRUS_SPARE") != NULL);
+
     /* pick a random timeout between reuse_timeout -> 2*reuse_timeout
      * to avoid massive IO overload if the network connection goes away */
     srand(time(NULL) * getpid());
@@ -403,7 +407,7 @@ int main(int argc, char **argv, char **envp)
 	/* (re)set signal handlers, including SIGALRM */
 	signals_add_handlers(SIGALRM);
 
-	if (use_count > 0) {
+	if (use_count > 0 || spare) {
 	    /* we want to time out after 60 seconds, set an alarm */
 	    alarm(reuse_timeout);
 	}
@@ -124,26 +124,66 @@ static const char ** bc_makeArray(bytecode_input_t *bc, int *pos)
     return array;
 }
 
-/* Compile a regular expression for use during parsing */
-static regex_t * bc_compile_regex(const char *s, int ctag,
-				  char *errmsg, size_t errsiz)
+/* Compile a regular expression for use during parsing.
+ *
+ * The compiled regex is cached on the bytecode buffer it came from,
+ * keyed by the pattern's offset into the bytecode and the cflags, so
+ * a script that stays loaded across deliveries only pays for regcomp()
+ * once.  The returned regex belongs to the cache; don't free it. */
+static regex_t * bc_compile_regex(sieve_bytecode_t *bc_cur, const char *s,
+				  int ctag, char *errmsg, size_t errsiz)
 {
     int ret;
-    regex_t *reg = (regex_t *) xmalloc(sizeof(regex_t));
+    char key[64];
+    regex_t *reg;
 
 #ifdef HAVE_PCREPOSIX_H
     /* support UTF8 comparisons */
     ctag |= REG_UTF8;
 #endif
+
+    snprintf(key, sizeof(key), "%lu/%d",
+	     (unsigned long) (s - bc_cur->data), ctag);
+    if (bc_cur->regexes) {
+	reg = hash_lookup(key, bc_cur->regexes);
+	if (reg) return reg;
+    }
+
+    reg = (regex_t *) xmalloc(sizeof(regex_t));
     if ( (ret=regcomp(reg, s, ctag)) != 0)
     {
 	(void) regerror(ret, reg, errmsg, errsiz);
 	free(reg);
 	return NULL;
     }
+
+    if (!bc_cur->regexes) {
+	bc_cur->regexes = xzmalloc(sizeof(hash_table));
+	construct_hash_table(bc_cur->regexes, 16, 0);
+    }
+    hash_insert(key, reg, bc_cur->regexes);
+
     return reg;
 }
 
+static void bc_free_regex(void *data)
+{
+    regex_t *reg = (regex_t *) data;
+
+    regfree(reg);
+    free(reg);
+}
+
+/* Release the regexes cached on a bytecode buffer */
+void bc_free_regexes(sieve_bytecode_t *bc)
+{
+    if (!bc->regexes) return;
+
+    free_hash_table(bc->regexes, bc_free_regex);
+    free(bc->regexes);
+    bc->regexes = NULL;
+}
+
 /* Determine if addr is a system address */
 static int sysaddr(const char *addr)
 {
@@ -361,7 +401,8 @@ static int shouldRespond(void * m, sieve_interp_t *interp,
 
 /* Evaluate a bytecode test */
 static int eval_bc_test(sieve_interp_t *interp, void* m,
-			bytecode_input_t * bc, int * ip)
+			sieve_bytecode_t *bc_cur, bytecode_input_t * bc,
+			int * ip)
 {
     int res=0; 
     int i=*ip;
@@ -383,7 +424,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 
     case BC_NOT:/*2*/
 	i+=1;
-	res = eval_bc_test(interp, m, bc, &i);
+	res = eval_bc_test(interp, m, bc_cur, bc, &i);
 	if(res >= 0) res = !res; /* Only invert in non-error case */
 	break;
 
@@ -442,7 +483,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 	 * in the right place */
 	for (x=0; x<list_len && !res; x++) { 
 	    int tmp;
-	    tmp = eval_bc_test(interp, m, bc, &i);
+	    tmp = eval_bc_test(interp, m, bc_cur, bc, &i);
 	    if(tmp < 0) {
 		res = tmp;
 		break;
@@ -462,7 +503,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 	/* return 1 unless you find one that isn't true, then return 0 */
 	for (x=0; x<list_len && res; x++) {
 	    int tmp;
-	    tmp = eval_bc_test(interp, m, bc, &i);
+	    tmp = eval_bc_test(interp, m, bc_cur, bc, &i);
 	    if(tmp < 0) {
 		res = tmp;
 		break;
@@ -600,7 +641,7 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 			    currd = unwrap_string(bc, currd, &data_val, NULL);
 
 			    if (isReg) {
-				reg = bc_compile_regex(data_val, ctag,
+				reg = bc_compile_regex(bc_cur, data_val, ctag,
 						       errbuf, sizeof(errbuf));
 				if (!reg) {
 				    /* Oops */
@@ -611,7 +652,6 @@ static int eval_bc_test(sieve_interp_t *interp, void* m,
 
 				res |= comp(addr, strlen(addr),
 					    (const char *)reg, comprock);
-				free(reg);
 			    } else {
 #if VERBOSE
 				printf("%s compared to %s(from script)\n",
@@ -730,7 +770,7 @@ envelope_err:
 			currd = unwrap_string(bc, currd, &data_val, NULL);
 
 			if (isReg) {
-			    reg= bc_compile_regex(data_val, ctag, errbuf,
+			    reg= bc_compile_regex(bc_cur, data_val, ctag, errbuf,
 						  sizeof(errbuf));
 			    if (!reg)
 			    {
@@ -741,7 +781,6 @@ envelope_err:
 			    
 			    res |= comp(decoded_header, strlen(decoded_header),
 					(const char *)reg, comprock);
-			    free(reg);
 			} else {
 			    res |= comp(decoded_header, strlen(decoded_header),
 					data_val, comprock);
@@ -854,7 +893,7 @@ envelope_err:
 		    currd = unwrap_string(bc, currd, &data_val, NULL);
 
 		    if (isReg) {
-			reg = bc_compile_regex(data_val, ctag,
+			reg = bc_compile_regex(bc_cur, data_val, ctag,
 					       errbuf, sizeof(errbuf));
 			if (!reg) {
 			    /* Oops */
@@ -863,7 +902,6 @@ envelope_err:
 			}
 
 			res |= comp(content, strlen(content), (const char *)reg, comprock);
-			free(reg);
 		    } else {
 			res |= comp(content, strlen(content), data_val, comprock);
 		    }
@@ -938,13 +976,19 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
      * a) have bytecode
      * b) it is atleast long enough for the magic number, the version
      *    and one opcode */
-    if(!bc) return SIEVE_FAIL;
-    if(bc_cur->len < (BYTECODE_MAGIC_LEN + 2*sizeof(bytecode_input_t)))
-       return SIEVE_FAIL;
+    if(!bc) {
+	res = SIEVE_FAIL;
+	goto done;
+    }
+    if(bc_cur->len < (BYTECODE_MAGIC_LEN + 2*sizeof(bytecode_input_t))) {
+	res = SIEVE_FAIL;
+	goto done;
+    }
 
     if(memcmp(bc, BYTECODE_MAGIC, BYTECODE_MAGIC_LEN)) {
 	*errmsg = "Not a bytecode file";
-	return SIEVE_FAIL;
+	res = SIEVE_FAIL;
+	goto done;
     }
 
     ip = BYTECODE_MAGIC_LEN / sizeof(bytecode_input_t);
@@ -961,7 +1005,8 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 		"Incorrect Bytecode Version, please recompile (use sievec)";
 	    
 	}
-	return SIEVE_FAIL;
+	res = SIEVE_FAIL;
+	goto done;
     }
     
     if((version < BYTECODE_MIN_VERSION) || (version > BYTECODE_VERSION)) {
@@ -969,7 +1014,8 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 	    *errmsg =
 		"Incorrect Bytecode Version, please recompile (use sievec)";
 	}
-	return SIEVE_FAIL;
+	res = SIEVE_FAIL;
+	goto done;
     }
 
 #if VERBOSE
@@ -1047,11 +1093,12 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 	    int result;
 	   
 	    ip+=2;
-	    result=eval_bc_test(i, m, bc, &ip);
+	    result=eval_bc_test(i, m, bc_cur, bc, &ip);
 	    
 	    if (result<0) {
 		*errmsg = "Invalid test";
-		return SIEVE_FAIL;
+		res = SIEVE_FAIL;
+		goto done;
 	    } else if (result) {
 	    	/*skip over jump instruction*/
 		testend+=2;
@@ -1250,7 +1297,7 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 	    {	
 		char errmsg[1024]; /* Basically unused */
 		
-		reg=bc_compile_regex(pattern,
+		reg=bc_compile_regex(bc_cur, pattern,
 				     REG_EXTENDED | REG_NOSUB | REG_ICASE,
 				     errmsg, sizeof(errmsg));
 		if (!reg) {
@@ -1258,7 +1305,6 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 		} else {
 		    res = do_denotify(notify_list, comp, reg,
 				      comprock, priority);
-		    free(reg);
 		}
 	    } else {
 		res = do_denotify(notify_list, comp, pattern,
@@ -1399,7 +1445,8 @@ int sieve_eval_bc(sieve_execute_t *exe, int is_incl, sieve_interp_t *i,
 
 	default:
 	    if(errmsg) *errmsg = "Invalid sieve bytecode";
-	    return SIEVE_FAIL;
+	    res = SIEVE_FAIL;
+	    goto done;
 	}
       
 	if (res) /* we've either encountered an error or a stop */
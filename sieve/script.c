@@ -422,13 +422,89 @@ static char *sieve_errstr(int code)
 /******************************bytecode functions*****************************
  *****************************************************************************/
 
+/* Loaded bytecode is kept in a small per-process cache, most recently
+ * used first, so that a busy lmtpd doesn't have to reopen and remap a
+ * user's script (and recompile its regexes) for every delivery.  An
+ * entry is only reused while the file it came from still has the same
+ * device, inode, mtime and size; timsieved and sync_server both install
+ * new scripts by renaming over the old name, so the next lookup after
+ * an upload or activation sees a different inode and loads afresh.
+ * Entries that are still referenced by a sieve_execute_t are never
+ * evicted. */
+static sieve_bytecode_t *bc_cache = NULL;
+
+void bc_free_regexes(sieve_bytecode_t *bc);
+
+static void bc_free(sieve_bytecode_t *bc)
+{
+    bc_free_regexes(bc);
+    map_free(&(bc->data), &(bc->len));
+    close(bc->fd);
+    free(bc);
+}
+
+static int bc_matches(sieve_bytecode_t *bc, struct stat *sbuf)
+{
+    return (bc->dev == sbuf->st_dev && bc->inode == sbuf->st_ino &&
+	    bc->mtime == sbuf->st_mtime && bc->size == sbuf->st_size);
+}
+
+/* drop unreferenced entries which are stale or beyond the cache size */
+static void bc_cache_trim(void)
+{
+    sieve_bytecode_t **prevp = &bc_cache;
+    sieve_bytecode_t *bc;
+    int maxcount = config_getint(IMAPOPT_SIEVE_BYTECODECACHE);
+    int count = 0;
+
+    while ((bc = *prevp)) {
+	int keep = 1;
+
+	if (!bc->refcount) {
+	    struct stat sbuf;
+
+	    if (count >= maxcount) keep = 0;
+	    else if (fstat(bc->fd, &sbuf) == -1 || !sbuf.st_nlink ||
+		     !bc_matches(bc, &sbuf)) keep = 0;
+	}
+
+	if (keep) {
+	    count++;
+	    prevp = &bc->next;
+	}
+	else {
+	    *prevp = bc->next;
+	    bc_free(bc);
+	}
+    }
+}
+
+static sieve_bytecode_t *bc_cache_lookup(struct stat *sbuf)
+{
+    sieve_bytecode_t **prevp;
+    sieve_bytecode_t *bc;
+
+    for (prevp = &bc_cache; (bc = *prevp); prevp = &bc->next) {
+	if (bc_matches(bc, sbuf)) {
+	    /* move to the front */
+	    *prevp = bc->next;
+	    bc->next = bc_cache;
+	    bc_cache = bc;
+	    return bc;
+	}
+    }
+
+    return NULL;
+}
+
 /* Load a compiled script */
 int sieve_script_load(const char *fname, sieve_execute_t **ret) 
 {
     struct stat sbuf;
     sieve_execute_t *ex;
-    sieve_bytecode_t *bc;
+    sieve_bytecode_t *bc = NULL;
     int dofree = 0;
+    int i;
    
     if (!fname || !ret) return SIEVE_FAIL;
     
@@ -447,10 +523,16 @@ int sieve_script_load(const char *fname, sieve_execute_t **ret)
     }
 
     /* see if we already have this script loaded */
-    bc = ex->bc_list;
-    while (bc) {
-	if (sbuf.st_ino == bc->inode) break;
-	bc = bc->next;
+    for (i = 0; i < ex->bc_list.count; i++) {
+	bc = ptrarray_nth(&ex->bc_list, i);
+	if (sbuf.st_dev == bc->dev && sbuf.st_ino == bc->inode) break;
+	bc = NULL;
+    }
+
+    /* or if a previous delivery left it in the cache */
+    if (!bc && (bc = bc_cache_lookup(&sbuf))) {
+	bc->refcount++;
+	ptrarray_append(&ex->bc_list, bc);
     }
 
     if (!bc) {
@@ -473,14 +555,22 @@ int sieve_script_load(const char *fname, sieve_execute_t **ret)
 	bc = (sieve_bytecode_t *) xzmalloc(sizeof(sieve_bytecode_t));
 
 	bc->fd = fd;
+	bc->dev = sbuf.st_dev;
 	bc->inode = sbuf.st_ino;
+	bc->mtime = sbuf.st_mtime;
+	bc->size = sbuf.st_size;
+	bc->refcount = 1;
 
 	map_refresh(fd, 1, &bc->data, &bc->len, sbuf.st_size,
 		    fname, "sievescript");
 
 	/* add buffer to list */
-	bc->next = ex->bc_list;
-	ex->bc_list = bc;
+	ptrarray_append(&ex->bc_list, bc);
+
+	/* and to the cache, which may push out an older script */
+	bc->next = bc_cache;
+	bc_cache = bc;
+	bc_cache_trim();
     }
 
     ex->bc_cur = bc;
@@ -493,19 +583,17 @@ int sieve_script_load(const char *fname, sieve_execute_t **ret)
 int sieve_script_unload(sieve_execute_t **s) 
 {
     if(s && *s) {
-	sieve_bytecode_t *bc = (*s)->bc_list;
-	sieve_bytecode_t *nextbc;
-
-	/* free each bytecode buffer in the linked list */
-	while (bc) {
-	    map_free(&(bc->data), &(bc->len));
-	    close(bc->fd);
-	    nextbc = bc->next;
-	    free(bc);
-	    bc = nextbc;
+	sieve_bytecode_t *bc;
+
+	/* release each bytecode buffer; the cache decides what to unmap */
+	while ((bc = ptrarray_pop(&(*s)->bc_list))) {
+	    bc->refcount--;
 	}
+	ptrarray_fini(&(*s)->bc_list);
 	free(*s);
 	*s = NULL;
+
+	bc_cache_trim();
     } 
     /*i added this else, i'm not sure why, but this function always returned SIEVE_FAIL*/
     else
@@ -48,6 +48,8 @@
 
 #include <sys/types.h>
 
+#include "hash.h"
+#include "ptrarray.h"
 #include "sieve_interface.h"
 #include "interp.h"
 #include "tree.h"
@@ -81,18 +83,23 @@ struct sieve_script {
 typedef struct sieve_bytecode sieve_bytecode_t;
 
 struct sieve_bytecode {
+    dev_t dev;			/* identity of the script on disk, */
     ino_t inode;		/* used to prevent mmapping the same script */
+    time_t mtime;		/* and to notice when it has been replaced */
+    off_t size;
     const char *data;
     size_t len;
     int fd;
 
     int is_executing;		/* used to prevent recursive INCLUDEs */
+    int refcount;		/* number of sieve_execute_t using this */
+    hash_table *regexes;		/* compiled regex_t, by bytecode offset */
 
-    sieve_bytecode_t *next;
+    sieve_bytecode_t *next;	/* per-process cache, most recent first */
 };
 
 struct sieve_execute {
-    sieve_bytecode_t *bc_list;	/* list of loaded bytecode buffers */
+    ptrarray_t bc_list;		/* list of loaded bytecode buffers */
     sieve_bytecode_t *bc_cur;	/* currently active bytecode buffer */
 };
 
@@ -136,7 +136,8 @@ static struct protocol_t sieve_protocol =
     &sieve_parsesuccess, AUTO_CAPA_AUTH_SSF },
   { NULL, NULL, NULL },
   { NULL, NULL, NULL },
-  { "LOGOUT", NULL, "OK" }
+  { "LOGOUT", NULL, "OK" },
+  { NULL, NULL, NULL, 0 }
 };
 
 /* Returns TRUE if we are done */